@@ -9,6 +9,7 @@
 
 #include <libopenikev2/log.h>
 #include <libopenikev2/aaacontroller.h>
+#include <libopenikev2/threadcontroller.h>
 
 #include "eapsm.h"
 #include <string.h>
@@ -35,6 +36,7 @@ namespace openikev2 {
         this->aaa_server_addr = aaa_server_addr;
         this->aaa_server_port = aaa_server_port;
         this->aaa_server_secret = aaa_server_secret;
+        this->aaa_semaphore = new SemaphorePosix( 0 );
 
         // initialices buffer
         this->buffer = wpabuf_alloc(MAX_MESSAGE_SIZE);
@@ -86,10 +88,14 @@ namespace openikev2 {
     }
 
     EapSm::~EapSm() {
+        // No AAA response can be delivered after this point
+        this->cancelAAA();
+
 
         //delete this->wpa_configuration.eap_methods;
         eap_server_sm_deinit( this->sm );
         wpabuf_free(this->buffer);
+        delete this->aaa_semaphore;
     }
 
 
@@ -129,6 +135,20 @@ restep:
 
             Log::writeLockedMessage( "EapSm", "Sending AAA request...", Log::LOG_INFO, true );
             AAAController::AAA_send(*this);
+
+            // The AAA controller is asynchronous, so the response (or its absence) is waited here
+            if ( !this->aaa_semaphore->timedWait( EAPSM_AAA_TIMEOUT ) ) {
+                // A response delivered while cancelling is discarded, so it is not taken by the next wait
+                this->cancelAAA();
+                this->aaa_semaphore->timedWait( 0 );
+                this->aaa_eap_packet_received.reset( NULL );
+                Log::writeLockedMessage( "EapSm", "AAA response timed out", Log::LOG_ERRO, true );
+                return auto_ptr<EapPacket> ( NULL );
+            }
+            if ( this->aaa_eap_packet_received.get() == NULL ) {
+                Log::writeLockedMessage( "EapSm", "AAA response not received", Log::LOG_ERRO, true );
+                return auto_ptr<EapPacket> ( NULL );
+            }
             Log::writeLockedMessage( "EapSm", "AAA response received.", Log::LOG_INFO, true );
 
             ByteBuffer buffer_aaa( this->aaa_eap_packet_received->eap_type_data->size() + 5 );
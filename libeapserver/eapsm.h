@@ -18,6 +18,7 @@
 
 #include "../src/radiusmessage.h"
 #include "../src/aaasenderradius.h"
+#include "../src/semaphoreposix.h"
 
 extern "C" {
 #include "./common/defs.h"
@@ -28,6 +29,9 @@ extern "C" {
 
 }
 
+/* Maximum time waiting for the AAA response (in milliseconds). The RADIUS client gives up earlier on its own */
+#define EAPSM_AAA_TIMEOUT 60000
+
 namespace openikev2 {
     /**
      This class represents an EAP state machine from Hostapd code
@@ -45,7 +49,7 @@ namespace openikev2 {
             string     aaa_server_addr;
             string     aaa_server_secret;
             uint8_t    aaa_server_port;
-            Semaphore *aaa_semaphore;
+            SemaphorePosix *aaa_semaphore;
             auto_ptr<ByteArray> aaa_msk;
             auto_ptr<EapPacket> aaa_eap_packet_to_send;
             auto_ptr<EapPacket> aaa_eap_packet_received;
@@ -25,15 +25,8 @@ extern "C" {
 
 namespace openikev2 {
 
-    AAAControllerImplRadius::AAAControllerImplRadius(  ) {
-
-        RandomOpenSSL random;
-        this->seq_number = random.getRandomInt32( 1, 50000 );
-
+    AAAControllerImplRadius::AAAControllerImplRadius( ) {
         this->mutex_senders_map = ThreadController::getMutex();
-
-        this->socket.reset( new UdpSocket() );
-        this->socket->bind( SocketAddressPosix ( auto_ptr<IpAddress> ( new IpAddressOpenIKE( Enums::ADDR_IPV4 ) ), 0 ) );
     }
 
     AAAControllerImplRadius::~AAAControllerImplRadius() {}
@@ -45,272 +38,155 @@ namespace openikev2 {
     }
 
     void AAAControllerImplRadius::AAA_send( AAASenderRadius& eap_sender ){
-        // Creates the RADIUS ACCESS-REQUEST message
+        // Creates the RADIUS ACCESS-REQUEST message (the identifier is assigned by the RADIUS client)
         RandomOpenSSL random;
-        auto_ptr<RadiusMessage> request( new RadiusMessage( RadiusMessage::RADIUS_CODE_ACCESS_REQUEST, this->seq_number++, random.getRandomBytes( 16 ) ) );
+        auto_ptr<RadiusMessage> request( new RadiusMessage( RadiusMessage::RADIUS_CODE_ACCESS_REQUEST, 0, *random.getRandomBytes( 16 ) ) );
 
         // Creates the User-Name attrbiute
-        request->addAttribute( auto_ptr<RadiusAttribute> ( new RadiusAttribute( RadiusAttribute::RADIUS_ATTR_USER_NAME, eap_sender.aaa_username ) ) );
-
-        // Creates the Eap-Message attrbiute
-        auto_ptr<ByteBuffer> buffer( new ByteBuffer( MAX_MESSAGE_SIZE ) );
-        eap_sender.aaa_eap_packet_to_send->getBinaryRepresentation( *buffer );
-
-        while ( buffer->size() > 253 )
-            request->addAttribute( auto_ptr<RadiusAttribute> ( new RadiusAttribute( RadiusAttribute::RADIUS_ATTR_EAP_MESSAGE, buffer->readByteArray( 253 ) ) ) );
-
-        if ( buffer->size() > 0 )
-            request->addAttribute( auto_ptr<RadiusAttribute> ( new RadiusAttribute( RadiusAttribute::RADIUS_ATTR_EAP_MESSAGE, auto_ptr<ByteArray> ( buffer ) ) ) );
-
-        // Creates the State Attribute
-        RadiusAttribute* state_attribute = NULL;
-        if ( eap_sender.aaa_radius_response.get() != NULL )
-           state_attribute = eap_sender.aaa_radius_response->getAttribute( RadiusAttribute::RADIUS_ATTR_STATE );
-
-        request->addAttribute( state_attribute->clone() );
+        request->addAttribute( RadiusAttribute::RADIUS_ATTR_USER_NAME, eap_sender.aaa_username );
+
+        // Creates the Eap-Message attributes
+        ByteBuffer buffer( MAX_MESSAGE_SIZE );
+        eap_sender.aaa_eap_packet_to_send->getBinaryRepresentation( buffer );
+        request->addFragmentedAttribute( RadiusAttribute::RADIUS_ATTR_EAP_MESSAGE, buffer.getRawPointer(), buffer.size() );
+
+        // Creates the State Attribute (not present in the first request)
+        if ( eap_sender.aaa_radius_response.get() != NULL ) {
+            uint16_t state_length;
+            const uint8_t* state = eap_sender.aaa_radius_response->getAttribute( RadiusAttribute::RADIUS_ATTR_STATE, state_length );
+            if ( state != NULL )
+                request->addAttribute( RadiusAttribute::RADIUS_ATTR_STATE, state, state_length );
+        }
 
         // Sends the messate to the RADIUS server
         this->sendRadiusMessage( request , eap_sender);
     }
 
-
-
-
     void AAAControllerImplRadius::sendRadiusMessage( auto_ptr<RadiusMessage> radius_message, AAASenderRadius& eap_sender ) {
+        RadiusServerGroup& server_group = RadiusServerGroup::getGroup( eap_sender.aaa_server_addr, eap_sender.aaa_server_port, eap_sender.aaa_server_secret );
 
-        auto_ptr<IpAddress> server_ip_address ( new IpAddressOpenIKE( eap_sender.aaa_server_addr ) );
-        auto_ptr<SocketAddressPosix> server_socket_address( new SocketAddressPosix( server_ip_address, eap_sender.aaa_server_port ) );
-        auto_ptr<ByteArray> secret ( new ByteArray( eap_sender.aaa_server_secret.data(), eap_sender.aaa_server_secret.size() ) );
-
-        // Creates the Message-Authenticator Attribute
-        auto_ptr<ByteArray> checksum( new ByteArray( 16, 0 ) );
-        checksum->setSize( 16 );
-        auto_ptr<RadiusAttribute> message_authenticator( new RadiusAttribute( RadiusAttribute::RADIUS_ATTR_MESSAGE_AUTHENTICATOR, checksum ) );
-        radius_message->addAttribute( message_authenticator );
-
-        // Obtains the binary representation of the RADIUS message and updates the Checksum
-        ByteBuffer buffer( 4096 );
-        radius_message->getBinaryRepresentation( buffer );
-        PseudoRandomFunctionOpenSSL prf( Enums::PRF_HMAC_MD5 );
-        auto_ptr<ByteArray> hmac = prf.prf( *(secret.get()), buffer );
-        uint8_t* position = &buffer.getRawPointer()[ buffer.size() - hmac->size()];
-        memcpy( position, hmac->getRawPointer(), hmac->size() );
-
-        // Sends the message
-        this->socket->send( SocketAddressPosix ( auto_ptr<IpAddress> ( new IpAddressOpenIKE( Enums::ADDR_IPV4 ) ), 0 ) ,
-                            *(server_socket_address.get()),
-                            buffer
-                          );
-
-
-        eap_sender.aaa_radius_response = radius_message;
-        senders_map[ radius_message->identifier ] = &eap_sender;
-
-        // TODO: Hacer timeout
-        eap_sender.aaa_semaphore->wait();
-
+        // The sender is registered before the response can be processed, since the lock is held while sending
+        AutoLock auto_lock( *this->mutex_senders_map );
+        uint32_t transaction_id = server_group.sendRequest( radius_message, *this );
+        this->senders_map[ transaction_id ] = &eap_sender;
+        eap_sender.aaa_controller = this;
     }
 
-    auto_ptr<RadiusMessage> AAAControllerImplRadius::receiveRadiusMessage( ) {
-        // Receives the message
-        auto_ptr<SocketAddress> src( NULL ), dst( NULL );
-        auto_ptr<ByteArray> data = this->socket->receive( src, dst, 3000 );
-
-        // If some error occourred, exception
-        if ( data.get() == NULL )
-            throw Exception( "Cannot connect with RADIUS server" );
-
-        // Parses the message and returns it
-        ByteBuffer byte_buffer( *data );
-        auto_ptr<RadiusMessage> radius_message = RadiusMessage::parse( byte_buffer );
-
-        // Search the sender
-        map<uint8_t,AAASenderRadius *>::iterator it;
-        it = this->senders_map.find(radius_message->identifier);
+    void AAAControllerImplRadius::cancelRequests( AAASenderRadius & eap_sender ) {
+        AutoLock auto_lock( *this->mutex_senders_map );
 
-        if (it == senders_map.end()){
-            throw Exception( "RADIUS: Associated sender not found." );
+        map<uint32_t, AAASenderRadius*>::iterator it = this->senders_map.begin();
+        while ( it != this->senders_map.end() ) {
+            if ( it->second == &eap_sender )
+                this->senders_map.erase( it++ );
+            else
+                it++;
         }
-        AAASenderRadius* eap_sender = it->second;
-
-        // Check the message authenticator
-        RadiusAttribute* message_authenticator = radius_message->getAttribute( RadiusAttribute::RADIUS_ATTR_MESSAGE_AUTHENTICATOR );
-        if ( message_authenticator == NULL )
-            throw Exception( "RADIUS: Message-Authenticator attribute not present" );
-
-        // Obtain the HMAC value
-        auto_ptr<ByteArray> received_hmac = message_authenticator->getValue().clone();
-
-        // Change the HMAC value to 0 and the message authenticator to the access-request one
-        memset( message_authenticator->getValue().getRawPointer(), 0, 16 );
-        if (eap_sender->aaa_radius_request.get() != NULL)
-            radius_message->authenticator = eap_sender->aaa_radius_request->authenticator->clone();
-        else
-            throw Exception( "RADIUS: Received AAA message without associated request" );
-
-        // regenerate binary representation of the message
-        byte_buffer.reset();
-        radius_message->getBinaryRepresentation( byte_buffer );
-
-        auto_ptr<ByteArray> secret ( new ByteArray( eap_sender->aaa_server_secret.data(), eap_sender->aaa_server_secret.size() ) );
-
-        // Computes the HMAC
-        PseudoRandomFunctionOpenSSL prf( Enums::PRF_HMAC_MD5 );
-        auto_ptr<ByteArray> hmac = prf.prf( *(secret.get()), byte_buffer );
-
-        // Compares it with the received one
-        if ( !( *hmac == *received_hmac ) )
-            throw Exception( "RADIUS: Received invalid Message-Authenticator" );
-
-        return radius_message;
     }
 
+    void AAAControllerImplRadius::processRadiusResponse( uint32_t transaction_id, auto_ptr<RadiusMessage> request, auto_ptr<RadiusMessage> response, const ByteArray& secret ) {
+        // The lock is held until the sender is notified, so cancelRequests() never returns while it is being used
+        AutoLock auto_lock( *this->mutex_senders_map );
 
-
-    void AAAControllerImplRadius::receiveEapMessage( ) {
-
-    // Waits for the response
-        auto_ptr<RadiusMessage> response = this->receiveRadiusMessage( );
-
-
-    // Search the sender again
-        map<uint8_t,AAASenderRadius *>::iterator it;
-        it = this->senders_map.find(response->identifier);
-
-        if (it == senders_map.end()){
+        // Search the sender
+        map<uint32_t, AAASenderRadius*>::iterator it = this->senders_map.find( transaction_id );
+        if ( it == this->senders_map.end() )
             throw Exception( "RADIUS: Associated sender not found." );
-        }
         AAASenderRadius* eap_sender = it->second;
+        this->senders_map.erase( it );
 
-        auto_ptr<ByteArray> secret ( new ByteArray( eap_sender->aaa_server_secret.data(), eap_sender->aaa_server_secret.size() ) );
-
-        // process the MS-MPPE attributes (If access accept response
-        if ( response->code == RadiusMessage::RADIUS_CODE_ACCESS_ACCEPT )
-            eap_sender->aaa_msk = this->getMsk( *response, *(eap_sender->aaa_radius_request) , *secret);
+        // The sender waits for AAA_receive(), so it must be called whatever happens with the response
+        auto_ptr<EapPacket> response_eap_packet;
+        try {
+            eap_sender->aaa_radius_request = request;
+            eap_sender->aaa_radius_response.reset( NULL );
 
-
-        // Process the Eap-Message attribute
-        vector<RadiusAttribute*> eap_attributes = response->getAttributes( RadiusAttribute::RADIUS_ATTR_EAP_MESSAGE );
-        if ( eap_attributes.size() == 0 ){
-            eap_sender->aaa_radius_response.reset(NULL);
-            return;
+            // The server has not answered
+            if ( response.get() == NULL ) {
+                Log::writeLockedMessage( "AAAController", "RADIUS server did not respond", Log::LOG_ERRO, true );
+            }
+            else {
+                // process the MS-MPPE attributes (If access accept response
+                if ( response->getCode() == RadiusMessage::RADIUS_CODE_ACCESS_ACCEPT )
+                    eap_sender->aaa_msk = this->getMsk( *response, *(eap_sender->aaa_radius_request) , secret);
+
+                // Process the Eap-Message attributes
+                ByteBuffer temp( RADIUS_MAX_MESSAGE_SIZE );
+                if ( response->getFragmentedAttribute( RadiusAttribute::RADIUS_ATTR_EAP_MESSAGE, temp ) > 0 ) {
+                    response_eap_packet = EapPacket::parse( temp );
+                    eap_sender->aaa_radius_response = response;
+                }
+            }
+        }
+        catch ( exception & ex ) {
+            Log::writeLockedMessage( "AAAController", "Invalid RADIUS response: " + string( ex.what() ), Log::LOG_ERRO, true );
+            eap_sender->aaa_radius_response.reset( NULL );
+            response_eap_packet.reset( NULL );
         }
-        // Creates the Payload_EAP
-        ByteBuffer temp( eap_attributes.size() * 256 );
-        for ( vector<RadiusAttribute*>::iterator it = eap_attributes.begin(); it != eap_attributes.end(); it++ )
-            temp.writeByteArray( ( *it )->getValue() );
-
-        auto_ptr<EapPacket> request_eap_packet = EapPacket::parse( temp );
-
-        eap_sender->aaa_radius_response = response; // TODO: comprobar que pasa con la memoria machacada
-
-        eap_sender->AAA_receive( request_eap_packet );
 
+        eap_sender->AAA_receive( response_eap_packet );
     }
 
 
 
-    auto_ptr< ByteArray >  AAAControllerImplRadius::getMsk( RadiusMessage & radius_message, RadiusMessage & access_request_message, const ByteArray& secret ) {
-        // obtain the vendor specif attributes
-        vector<RadiusAttribute*> vendor_attributes = radius_message.getAttributes( RadiusAttribute::RADIUS_ATTR_VENDOR_SPECIFIC );
-
-        auto_ptr<ByteArray> recv_key_attr, send_key_attr;
-
-        // for all the vendor specific attributes
-        for ( vector<RadiusAttribute*>::iterator it = vendor_attributes.begin(); it < vendor_attributes.end(); it++ ) {
-            // read vendor_id
-            ByteBuffer attribute_value ( ( *it )->getValue() );
-            uint32_t vendor_id = attribute_value.readInt32();
-
-            // if vendor ID is not MS, continue
-            if ( vendor_id != 311 )
-                continue;
-
-            // Read all the subattributes in the attribute
-            while ( attribute_value.size() > 0 ) {
-                // read the vendor_type
-                uint8_t vendor_type = attribute_value.readInt8();
-
-                // read the vendor_length
-                uint8_t vendor_length = attribute_value.readInt8();
-
-                // read the value
-                auto_ptr<ByteArray> vendor_value = attribute_value.readByteArray( vendor_length - 2 );
-
-                // if the vendor type is MS_MPPE_SEND_KEY then
-                if ( vendor_type == RadiusAttribute::MS_MPPE_SEND_KEY )
-                    send_key_attr = vendor_value;
-
-                // else if the vendor type is MS_MPPE_RECV_KEY then
-                else if ( vendor_type == RadiusAttribute::MS_MPPE_RECV_KEY )
-                    recv_key_attr = vendor_value;
-            }
-        }
+    auto_ptr< ByteArray >  AAAControllerImplRadius::getMsk( const RadiusMessage & radius_message, const RadiusMessage & access_request_message, const ByteArray& secret ) {
+        // obtain the MS-MPPE keys from the vendor specific attributes, without copying them
+        uint16_t recv_key_length, send_key_length;
+        const uint8_t* recv_key_attr = radius_message.getVendorAttribute( 311, RadiusAttribute::MS_MPPE_RECV_KEY, recv_key_length );
+        const uint8_t* send_key_attr = radius_message.getVendorAttribute( 311, RadiusAttribute::MS_MPPE_SEND_KEY, send_key_length );
 
         // If both are availables, generate MSK
-        if ( recv_key_attr.get() != NULL && send_key_attr.get() != NULL ) {
-            auto_ptr<ByteArray> recv_key = this->decryptKey( *recv_key_attr, *access_request_message.authenticator, secret );
-            auto_ptr<ByteArray> send_key = this->decryptKey( *send_key_attr, *access_request_message.authenticator, secret );
-            auto_ptr<ByteBuffer> msk ( new ByteBuffer( recv_key->size() + send_key->size() ) );
-            msk->writeByteArray( *recv_key );
-            msk->writeByteArray( *send_key );
-            return auto_ptr<ByteArray> ( msk );
-        }
-        return auto_ptr<ByteArray> ( NULL );
-    }
+        if ( recv_key_attr == NULL || send_key_attr == NULL )
+            return auto_ptr<ByteArray> ( NULL );
 
-    auto_ptr< ByteArray > AAAControllerImplRadius::decryptKey( const ByteArray & key_attr, const ByteArray & authenticator, const ByteArray& secret ) {
-        ByteBuffer encrypted_data ( key_attr );
-        ByteBuffer temp( 1000 );
-        uint8_t b[16], c[16];
-
-        auto_ptr<ByteBuffer> decrypted_data ( new ByteBuffer( key_attr.size() ) );
-
-        // read salt key
-        auto_ptr<ByteArray> salt_key = encrypted_data.readByteArray( 2 );
+        auto_ptr<ByteBuffer> msk ( new ByteBuffer( recv_key_length + send_key_length ) );
+        this->decryptKey( recv_key_attr, recv_key_length, access_request_message.getAuthenticator(), secret, *msk );
+        this->decryptKey( send_key_attr, send_key_length, access_request_message.getAuthenticator(), secret, *msk );
+        return auto_ptr<ByteArray> ( msk );
+    }
 
-        if ( encrypted_data.size() % 16 )
+    void AAAControllerImplRadius::decryptKey( const uint8_t* key_attr, uint16_t key_attr_length, const uint8_t* authenticator, const ByteArray& secret, ByteBuffer& key ) {
+        // the first two bytes are the salt
+        if ( key_attr_length < 18 || ( key_attr_length - 2 ) % 16 )
             throw Exception( "Invalid attribute length" );
 
-        // prepare first iteration
-        temp.writeByteArray( secret );
-        temp.writeByteArray( authenticator );
-        temp.writeByteArray( *salt_key );
-
-        while ( encrypted_data.size() ) {
-            // calculate "b" value
-            MD5( ( unsigned char* ) temp.getRawPointer(), temp.size(), b );
-
-            // obtain the "c" value
-            encrypted_data.readBuffer( 16, c );
+        const uint8_t* salt = key_attr;
+        const uint8_t* encrypted_data = key_attr + 2;
+        uint16_t encrypted_length = key_attr_length - 2;
+        uint8_t decrypted_data[ 256 ], b[ 16 ];
+        MD5_CTX md5;
+
+        for ( uint16_t offset = 0; offset < encrypted_length; offset += 16 ) {
+            // calculate "b" value: MD5( secret + authenticator + salt ) the first time, and MD5( secret + previous "c" ) later
+            MD5_Init( &md5 );
+            MD5_Update( &md5, secret.getRawPointer(), secret.size() );
+            if ( offset == 0 ) {
+                MD5_Update( &md5, authenticator, 16 );
+                MD5_Update( &md5, salt, 2 );
+            }
+            else {
+                MD5_Update( &md5, &encrypted_data[ offset - 16 ], 16 );
+            }
+            MD5_Final( b, &md5 );
 
             // generate decrypted data
             for ( uint16_t i = 0; i < 16; i++ )
-                decrypted_data->writeInt8( c[i] ^ b[i] );
-
-            // calculate the next value for temp
-            temp.reset();
-            temp.writeByteArray( secret );
-            temp.writeBuffer( c, 16 );
+                decrypted_data[ offset + i ] = encrypted_data[ offset + i ] ^ b[ i ];
         }
 
-        uint8_t length = decrypted_data->readInt8();
-        return decrypted_data->readByteArray( length );
+        uint8_t length = decrypted_data[ 0 ];
+        if ( length + 1 > encrypted_length )
+            throw Exception( "Invalid key length" );
+
+        key.writeBuffer( &decrypted_data[ 1 ], length );
     }
 
 
     void AAAControllerImplRadius::run( ) {
         Log::writeLockedMessage( "AAAController", "Start: Thread ID=[" + intToString( thread_id ) + "]", Log::LOG_THRD, true );
 
-        while ( true ) {
-            try {
-                receiveEapMessage( );
-
-            }
-            catch ( exception & ex ) {
-                //Log::writeLockedMessage( "AlarmController", ex.what() , Log::LOG_ERRO, true );
-            }
-        }
+        // The responses are received and retransmissions performed by the shared RADIUS client threads
+        RadiusClient::getInstance();
     }
 
 
@@ -20,7 +20,8 @@
 #include <libopenikev2/aaacontrollerimpl.h>
 #include "threadposix.h"
 #include "radiusmessage.h"
-#include "udpsocket.h"
+#include "radiusclient.h"
+#include "radiusservergroup.h"
 #include "aaasenderradius.h"
 #include <libopenikev2/bytearray.h>
 
@@ -35,20 +36,15 @@ using namespace std;
 namespace openikev2 {
 
     /**
-        This class contains the AAAController implementation using RADIUS protocol
+        This class contains the AAAController implementation using RADIUS protocol.
+        Requests are sent asynchronously by the shared RadiusClient: AAA_send() doesn't wait, and the sender is notified with AAA_receive().
+        The server address of the sender may be a list of servers, which are balanced and health checked by a RadiusServerGroup.
         @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
     */
-    class AAAControllerImplRadius : public AAAControllerImpl, public ThreadPosix {
+    class AAAControllerImplRadius : public AAAControllerImpl, public ThreadPosix, public RadiusResponseHandler {
             /****************************** ATTRIBUTES ******************************/
         protected:
-            map<uint8_t, AAASenderRadius*> senders_map;
-
-            auto_ptr<UdpSocket> socket;
-            //auto_ptr<SocketAddress> server_socket_address;
-            //auto_ptr<ByteArray> secret;
-            uint8_t seq_number;
-            //auto_ptr<ByteArray> username;
-            uint16_t listen_port;
+            map<uint32_t, AAASenderRadius*> senders_map; /**< Senders waiting for a response, by RADIUS transaction ID */
 
             auto_ptr<Mutex> mutex_senders_map; /**< Mutex to protect acceses to the senders map */
 
@@ -72,14 +68,30 @@ namespace openikev2 {
 
 
             void sendRadiusMessage( auto_ptr<RadiusMessage> radius_message, AAASenderRadius& eap_sender );
-            auto_ptr< ByteArray > getMsk( RadiusMessage & radius_message, RadiusMessage & access_request_message, const ByteArray& secret ) ;
-            auto_ptr< ByteArray > decryptKey( const ByteArray & key_attr, const ByteArray & authenticator, const ByteArray& secret ) ;
-            auto_ptr<RadiusMessage> receiveRadiusMessage( ) ;
+            auto_ptr< ByteArray > getMsk( const RadiusMessage & radius_message, const RadiusMessage & access_request_message, const ByteArray& secret ) ;
+
+            /**
+             * Decrypts a MS-MPPE key attribute (RFC 2548 section 2.4.2)
+             * @param key_attr Attribute value (salt and encrypted key)
+             * @param key_attr_length Attribute value length
+             * @param authenticator Authenticator of the Access-Request (16 bytes)
+             * @param secret Secret shared with the server
+             * @param key ByteBuffer where the decrypted key is appended
+             * @throws Exception If the attribute is malformed
+             */
+            void decryptKey( const uint8_t* key_attr, uint16_t key_attr_length, const uint8_t* authenticator, const ByteArray& secret, ByteBuffer& key ) ;
+
+            /**
+             * Forgets the pending requests of a sender, so it is not notified anymore. If the sender is being notified,
+             * waits until it has been
+             * @param eap_sender Sender
+             */
+            void cancelRequests( AAASenderRadius& eap_sender );
 
-            void receiveEapMessage( ) ;
+            virtual void processRadiusResponse( uint32_t transaction_id, auto_ptr<RadiusMessage> request, auto_ptr<RadiusMessage> response, const ByteArray& secret );
 
             /**
-             * Performs main thread funcionality (waiting for Radius responses)
+             * Performs main thread funcionality (starting the shared RADIUS client)
              */
             virtual void run();
 
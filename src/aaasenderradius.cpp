@@ -7,9 +7,19 @@
 *   of the Apache license.  See the LICENSE file for details.             *
 ***************************************************************************/
 #include "aaasenderradius.h"
+#include "aaacontrollerimplradius.h"
 
 namespace openikev2 {
 
+    AAASenderRadius::AAASenderRadius( ) {
+        this->aaa_controller = NULL;
+    }
+
+    void AAASenderRadius::cancelAAA( ) {
+        if ( this->aaa_controller != NULL )
+            this->aaa_controller->cancelRequests( *this );
+    }
+
     AAASenderRadius::~AAASenderRadius( ) {}
 
 }
@@ -23,6 +23,7 @@
 
 
 namespace openikev2 {
+    class AAAControllerImplRadius;
 
     /**
         This abstract class represents objects that want to receive AAA responses.
@@ -33,9 +34,23 @@ namespace openikev2 {
         public:
             auto_ptr<RadiusMessage> aaa_radius_request;
             auto_ptr<RadiusMessage> aaa_radius_response;
+            AAAControllerImplRadius* aaa_controller;    /**< Controller with the pending requests of the sender (NULL if none) */
 
             /**
-             * This method is called when AAA controller receives the response.
+             * Creates a new AAASenderRadius
+             */
+            AAASenderRadius();
+
+            /**
+             * Cancels the pending requests, so AAA_receive() is not called anymore. Senders must call it before being
+             * destroyed, or when they stop waiting for the response
+             */
+            void cancelAAA();
+
+            /**
+             * This method is called by the AAA controller threads when the response is received. It must not block:
+             * senders driven by an IkeSa should resume it by pushing a command.
+             * @param eap_packet Received EAP packet. NULL if the AAA server did not answer or the response had no EAP packet
              */
             virtual void AAA_receive( auto_ptr<EapPacket> eap_packet ) = 0;
 
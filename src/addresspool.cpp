@@ -0,0 +1,266 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#include "addresspool.h"
+#include "ipaddressopenike.h"
+
+#include <libopenikev2/log.h>
+#include <libopenikev2/utils.h>
+
+#include <fstream>
+#include <stdio.h>
+#include <string.h>
+
+namespace openikev2 {
+
+    AddressPool::AddressPool( NetworkPrefix & prefix, string lease_file ) {
+        this->family = prefix.getNetworkAddress().getFamily();
+        this->network = prefix.getNetworkAddress().getBytes();
+        this->mask = prefix.getMask();
+        this->lease_file = lease_file;
+
+        // The network address (and the broadcast address in IPv4) are excluded, unless there is no room for them
+        uint16_t host_bits = this->network->size() * 8 - prefix.getPrefixLen();
+        if ( host_bits <= 1 ) {
+            this->first = 0;
+            this->pool_size = 1 << host_bits;
+        }
+        else if ( host_bits <= ADDRESS_POOL_MAX_BITS ) {
+            this->first = 1;
+            this->pool_size = ( 1 << host_bits ) - ( ( this->family == Enums::ADDR_IPV4 ) ? 2 : 1 );
+        }
+        else {
+            this->first = 1;
+            this->pool_size = ( 1 << ADDRESS_POOL_MAX_BITS ) - 1;
+        }
+        this->free_count = this->pool_size;
+
+        // The bits after the last address are marked as used, so they are never allocated
+        this->bitmap.resize( ( this->pool_size + 63 ) / 64, 0 );
+        if ( this->pool_size % 64 )
+            this->bitmap.back() = ~( ( 1ULL << ( this->pool_size % 64 ) ) - 1 );
+
+        this->summary.resize( ( this->bitmap.size() + 63 ) / 64, ~0ULL );
+        if ( this->bitmap.size() % 64 )
+            this->summary.back() = ( 1ULL << ( this->bitmap.size() % 64 ) ) - 1;
+
+        if ( !this->lease_file.empty() )
+            this->loadLeases();
+    }
+
+    AddressPool::~AddressPool() {
+    }
+
+    int64_t AddressPool::getIndex( const IpAddress & address ) const {
+        if ( address.getFamily() != this->family )
+            return -1;
+
+        auto_ptr<ByteArray> bytes = address.getBytes();
+        uint16_t size = bytes->size();
+
+        // The address must have the pool prefix, and its host part must fit in 32 bits
+        uint32_t host = 0;
+        for ( uint16_t i = 0; i < size; i++ ) {
+            uint8_t byte = ( *bytes ) [ i ];
+            uint8_t mask_byte = ( *this->mask ) [ i ];
+
+            if ( ( byte ^ ( *this->network ) [ i ] ) & mask_byte )
+                return -1;
+
+            if ( i < size - 4 ) {
+                if ( byte & ~mask_byte )
+                    return -1;
+            }
+            else
+                host = ( host << 8 ) | ( byte & ~mask_byte );
+        }
+
+        if ( host < this->first || host - this->first >= this->pool_size )
+            return -1;
+
+        return host - this->first;
+    }
+
+    auto_ptr<IpAddress> AddressPool::getAddress( uint32_t index ) const {
+        auto_ptr<ByteArray> data = this->network->clone();
+        uint16_t size = data->size();
+        uint32_t host = this->first + index;
+
+        for ( uint16_t i = 0; i < 4; i++ )
+            ( *data ) [ size - 1 - i ] |= ( host >> ( 8 * i ) ) & 0xFF;
+
+        return auto_ptr<IpAddress> ( new IpAddressOpenIKE( this->family, data ) );
+    }
+
+    bool AddressPool::isUsed( uint32_t index ) const {
+        return ( this->bitmap[ index / 64 ] >> ( index % 64 ) ) & 1;
+    }
+
+    void AddressPool::setUsed( uint32_t index ) {
+        uint32_t word = index / 64;
+        this->bitmap[ word ] |= 1ULL << ( index % 64 );
+        if ( this->bitmap[ word ] == ~0ULL )
+            this->summary[ word / 64 ] &= ~( 1ULL << ( word % 64 ) );
+        this->free_count--;
+    }
+
+    void AddressPool::setFree( uint32_t index ) {
+        uint32_t word = index / 64;
+        this->bitmap[ word ] &= ~( 1ULL << ( index % 64 ) );
+        this->summary[ word / 64 ] |= 1ULL << ( word % 64 );
+        this->free_count++;
+    }
+
+    auto_ptr<IpAddress> AddressPool::allocateAddress( const string & owner ) {
+        if ( this->free_count == 0 )
+            return auto_ptr<IpAddress> ( NULL );
+
+        // The address bound to the owner is preferred
+        if ( !owner.empty() ) {
+            map<string, uint32_t>::iterator it = this->bindings.find( owner );
+            if ( it != this->bindings.end() && !this->isUsed( it->second ) ) {
+                this->setUsed( it->second );
+                return this->getAddress( it->second );
+            }
+        }
+
+        // The first word with free addresses is found in the summary, and the first free address in that word
+        for ( uint32_t i = 0; i < this->summary.size(); i++ ) {
+            if ( this->summary[ i ] == 0 )
+                continue;
+
+            uint32_t word = i * 64 + __builtin_ctzll( this->summary[ i ] );
+            uint32_t index = word * 64 + __builtin_ctzll( ~this->bitmap[ word ] );
+
+            this->setUsed( index );
+            if ( !owner.empty() )
+                this->bind( owner, index );
+
+            return this->getAddress( index );
+        }
+
+        return auto_ptr<IpAddress> ( NULL );
+    }
+
+    bool AddressPool::allocateAddress( const IpAddress & address, const string & owner ) {
+        int64_t index = this->getIndex( address );
+        if ( index == -1 || this->isUsed( index ) )
+            return false;
+
+        this->setUsed( index );
+        if ( !owner.empty() )
+            this->bind( owner, index );
+
+        return true;
+    }
+
+    bool AddressPool::releaseAddress( const IpAddress & address ) {
+        int64_t index = this->getIndex( address );
+        if ( index == -1 )
+            return false;
+
+        if ( this->isUsed( index ) )
+            this->setFree( index );
+
+        return true;
+    }
+
+    bool AddressPool::contains( const IpAddress & address ) const {
+        return this->getIndex( address ) != -1;
+    }
+
+    uint32_t AddressPool::getFreeCount( ) const {
+        return this->free_count;
+    }
+
+    void AddressPool::bind( const string & owner, uint32_t index ) {
+        map<string, uint32_t>::iterator it = this->bindings.find( owner );
+        if ( it != this->bindings.end() && it->second == index )
+            return;
+
+        this->bindings[ owner ] = index;
+
+        if ( this->lease_file.empty() )
+            return;
+
+        // New bindings are appended. The outdated ones are removed when the file is loaded
+        FILE* file = fopen( this->lease_file.c_str(), "a" );
+        if ( file == NULL ) {
+            Log::writeLockedMessage( "AddressPool", "Cannot write the lease file <" + this->lease_file + ">", Log::LOG_WARN, true );
+            return;
+        }
+        fprintf( file, "%s %s\n", owner.c_str(), this->getAddress( index )->toString().c_str() );
+        fclose( file );
+    }
+
+    void AddressPool::loadLeases( ) {
+        ifstream infile( this->lease_file.c_str() );
+
+        if ( !infile.good() )
+            return;
+
+        // Lines of other pools sharing the file are kept as they are
+        vector<string> other_lines;
+        string line;
+        while ( getline( infile, line, '\n' ) ) {
+            char charline [ line.size() + 1 ];
+            strcpy( charline, line.c_str() );
+            const char delimiters[] = " \t";
+
+            char* owner = strtok( charline, delimiters );
+            char* address = ( owner != NULL ) ? strtok( NULL, delimiters ) : NULL;
+            if ( address == NULL )
+                continue;
+
+            int64_t index = -1;
+            try {
+                index = this->getIndex( IpAddressOpenIKE( address ) );
+            }
+            catch ( exception & ) {
+                Log::writeLockedMessage( "AddressPool", "Invalid address in the lease file: " + string( address ), Log::LOG_WARN, true );
+                continue;
+            }
+
+            if ( index == -1 )
+                other_lines.push_back( line );
+            else
+                this->bindings[ owner ] = index;
+        }
+        infile.close();
+
+        // Rewrites the file with the current bindings only
+        string temp_file = this->lease_file + ".tmp";
+        ofstream outfile( temp_file.c_str(), ios::trunc );
+        if ( !outfile.good() ) {
+            Log::writeLockedMessage( "AddressPool", "Cannot write the lease file <" + this->lease_file + ">", Log::LOG_WARN, true );
+            return;
+        }
+
+        for ( vector<string>::iterator it = other_lines.begin(); it != other_lines.end(); it++ )
+            outfile << *it << "\n";
+        for ( map<string, uint32_t>::iterator it = this->bindings.begin(); it != this->bindings.end(); it++ )
+            outfile << it->first << " " << this->getAddress( it->second )->toString() << "\n";
+        outfile.close();
+
+        rename( temp_file.c_str(), this->lease_file.c_str() );
+
+        Log::writeLockedMessage( "AddressPool", "Loaded leases: File=[" + this->lease_file + "] Bindings=[" + intToString( this->bindings.size() ) + "]", Log::LOG_INFO, true );
+    }
+
+    string AddressPool::getOwner( const ID & id ) {
+        string result = intToString( id.id_type ) + ":";
+
+        char hex[ 3 ];
+        for ( uint16_t i = 0; i < id.id_data->size(); i++ ) {
+            snprintf( hex, sizeof( hex ), "%02x", ( *id.id_data ) [ i ] );
+            result += hex;
+        }
+
+        return result;
+    }
+}
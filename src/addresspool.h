@@ -0,0 +1,142 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#ifndef ADDRESSPOOL_H
+#define ADDRESSPOOL_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <libopenikev2/networkprefix.h>
+#include <libopenikev2/ipaddress.h>
+#include <libopenikev2/bytearray.h>
+#include <libopenikev2/id.h>
+
+#include <map>
+#include <vector>
+#include <string>
+
+/* Maximum number of host bits covered by a pool (larger prefixes only use their first addresses) */
+#define ADDRESS_POOL_MAX_BITS 20
+
+using namespace std;
+
+namespace openikev2 {
+
+    /**
+        This class represents the pool of addresses of a network prefix, assigned to the peers with the CFG payload.
+        The state of each address is kept in a bitmap, with a second level bitmap indicating the words with free addresses,
+        so allocations and releases don't depend on the pool occupation, and an allocation only fails when the pool is full.
+        Optionally, each peer ID is bound to its last address, which is assigned to it again while it stays free. The bindings
+        can be stored in a lease file, so they survive restarts.
+        This class is not thread-safe: the NetworkController serializes the access to its pools.
+        @author Pedro J. Fernandez Ruiz, Alejandro Perez Mendez <pedroj@um.es, alex@um.es>
+    */
+    class AddressPool {
+            /****************************** ATTRIBUTES ******************************/
+        protected:
+            Enums::ADDR_FAMILY family;              /**< Address family */
+            auto_ptr<ByteArray> network;            /**< Network address */
+            auto_ptr<ByteArray> mask;               /**< Network mask */
+            uint32_t first;                         /**< Host part of the first address of the pool */
+            uint32_t pool_size;                     /**< Number of addresses of the pool */
+            uint32_t free_count;                    /**< Number of free addresses */
+            vector<uint64_t> bitmap;                /**< Used addresses (one bit per address) */
+            vector<uint64_t> summary;               /**< Words of the bitmap with free addresses (one bit per word) */
+            map<string, uint32_t> bindings;         /**< Last address index of each owner */
+            string lease_file;                      /**< File where the bindings are stored (empty if they are not stored) */
+
+            /****************************** METHODS ******************************/
+        protected:
+            /**
+             * Gets the pool index of an address
+             * @param address Address
+             * @return The index, or -1 if the address is not in the pool
+             */
+            virtual int64_t getIndex( const IpAddress& address ) const;
+
+            /**
+             * Gets the address of a pool index
+             * @param index Pool index
+             * @return The address
+             */
+            virtual auto_ptr<IpAddress> getAddress( uint32_t index ) const;
+
+            bool isUsed( uint32_t index ) const;
+
+            void setUsed( uint32_t index );
+
+            void setFree( uint32_t index );
+
+            /**
+             * Binds an owner to an address index, storing the binding in the lease file
+             * @param owner Owner
+             * @param index Pool index
+             */
+            virtual void bind( const string& owner, uint32_t index );
+
+            /**
+             * Reads the bindings from the lease file, and rewrites it without the outdated ones
+             */
+            virtual void loadLeases();
+
+        public:
+            /**
+             * Creates a new AddressPool with all its addresses free
+             * @param prefix Network prefix. The network and broadcast addresses are excluded
+             * @param lease_file File where the bindings are stored. If empty, the bindings are kept only in memory
+             */
+            AddressPool( NetworkPrefix& prefix, string lease_file = "" );
+
+            /**
+             * Allocates a free address. If the owner is bound to a free address, that one is allocated
+             * @param owner Owner of the address (see getOwner()). If empty, the address is not bound
+             * @return The allocated address, or NULL if the pool is full
+             */
+            virtual auto_ptr<IpAddress> allocateAddress( const string& owner );
+
+            /**
+             * Allocates a specific address
+             * @param address Requested address
+             * @param owner Owner of the address. If empty, the address is not bound
+             * @return TRUE if the address has been allocated. FALSE if it is in use or it is not in the pool
+             */
+            virtual bool allocateAddress( const IpAddress& address, const string& owner );
+
+            /**
+             * Releases an address. Its binding, if any, is kept
+             * @param address Address
+             * @return TRUE if the address is in the pool. FALSE otherwise
+             */
+            virtual bool releaseAddress( const IpAddress& address );
+
+            /**
+             * Indicates if an address is in the pool
+             * @param address Address
+             * @return TRUE if the address is in the pool. FALSE otherwise
+             */
+            virtual bool contains( const IpAddress& address ) const;
+
+            /**
+             * Gets the number of free addresses
+             * @return The number of free addresses
+             */
+            virtual uint32_t getFreeCount() const;
+
+            /**
+             * Gets the owner name of a peer ID, used to bind it to its address
+             * @param id Peer ID
+             * @return The owner name
+             */
+            static string getOwner( const ID& id );
+
+            virtual ~AddressPool();
+    };
+};
+#endif
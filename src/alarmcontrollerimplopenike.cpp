@@ -7,53 +7,204 @@
 *   of the Apache license.  See the LICENSE file for details.             *
 ***************************************************************************/
 #include "alarmcontrollerimplopenike.h"
+#include "alarmdispatcher.h"
+#include "alarmmutex.h"
 #include <libopenikev2/threadcontroller.h>
 #include <libopenikev2/autolock.h>
 #include <libopenikev2/log.h>
 
-#include <algorithm>
+#include <assert.h>
+#include <time.h>
 #include <unistd.h>
 
 namespace openikev2 {
 
-    AlarmControllerImplOpenIKE::AlarmControllerImplOpenIKE( uint32_t msec_interval ) {
+    __thread Alarm* AlarmControllerImplOpenIKE::dispatched_alarm = NULL;
+
+    AlarmControllerImplOpenIKE::AlarmControllerImplOpenIKE( uint32_t msec_interval, uint32_t wheel_size, uint16_t num_dispatchers ) {
+        assert( msec_interval > 0 && wheel_size > 0 && num_dispatchers > 0 );
         this->msec_interval = msec_interval;
+        this->timing_wheel.resize( wheel_size );
+        this->current_tick = 0;
+        this->start_time = getMonotonicTime();
         this->mutex_alarm_collection = ThreadController::getMutex();
+        this->mutex_alarm_changes = ThreadController::getMutex();
+        this->condition_expired.reset( new ConditionPosix() );
+
+        for ( uint16_t i = 0; i < num_dispatchers; i++ )
+            this->alarm_dispatchers.push_back( new AlarmDispatcher( *this, i ) );
+    }
+
+    AlarmControllerImplOpenIKE::~AlarmControllerImplOpenIKE() {
+        {
+            // the wrapped alarm mutexes must not notify this controller anymore
+            AutoLock auto_lock( *this->mutex_alarm_changes );
+            for ( map<Alarm*, AlarmEntry>::iterator it = this->alarm_collection.begin(); it != this->alarm_collection.end(); it++ )
+                it->second.alarm_mutex->registered = false;
+        }
+
+        for ( vector<AlarmDispatcher*>::iterator it = this->alarm_dispatchers.begin(); it != this->alarm_dispatchers.end(); it++ )
+            delete ( *it );
+    }
+
+    void AlarmControllerImplOpenIKE::start( ) {
+        for ( vector<AlarmDispatcher*>::iterator it = this->alarm_dispatchers.begin(); it != this->alarm_dispatchers.end(); it++ )
+            ( *it )->start();
+
+        ThreadPosix::start();
+    }
+
+    Alarm & AlarmControllerImplOpenIKE::getExpiredAlarm( ) {
+        AutoLock auto_lock( *this->condition_expired );
+
+        while ( this->expired_alarm_collection.empty() )
+            this->condition_expired->wait();
+
+        Alarm* alarm = this->expired_alarm_collection.front();
+        this->expired_alarm_collection.pop_front();
+        this->dispatching_alarms[ alarm ]++;
+        dispatched_alarm = alarm;
+
+        return *alarm;
+    }
+
+    void AlarmControllerImplOpenIKE::finishDispatch( Alarm & alarm ) {
+        AutoLock auto_lock( *this->condition_expired );
+
+        dispatched_alarm = NULL;
+        map<Alarm*, uint16_t>::iterator it = this->dispatching_alarms.find( &alarm );
+        if ( --it->second == 0 )
+            this->dispatching_alarms.erase( it );
+
+        // wakes up removeAlarm() (and the idle dispatchers, which will keep waiting if there are no expired alarms)
+        this->condition_expired->notifyAll();
+    }
+
+    uint64_t AlarmControllerImplOpenIKE::getMonotonicTime( ) {
+        struct timespec now;
+        clock_gettime( CLOCK_MONOTONIC, &now );
+        return ( uint64_t ) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    }
+
+    void AlarmControllerImplOpenIKE::scheduleAlarm( Alarm& alarm, AlarmEntry& entry, uint64_t deadline_tick ) {
+        this->unscheduleAlarm( entry );
+
+        list<Alarm*>& slot = this->timing_wheel[ deadline_tick % this->timing_wheel.size() ];
+        entry.wheel_position = slot.insert( slot.end(), &alarm );
+        entry.deadline_tick = deadline_tick;
+        entry.scheduled = true;
+    }
+
+    void AlarmControllerImplOpenIKE::unscheduleAlarm( AlarmEntry& entry ) {
+        if ( !entry.scheduled )
+            return;
+
+        this->timing_wheel[ entry.deadline_tick % this->timing_wheel.size() ].erase( entry.wheel_position );
+        entry.scheduled = false;
+    }
+
+    void AlarmControllerImplOpenIKE::notifyAlarmChange( AlarmMutex & alarm_mutex ) {
+        AlarmChange change;
+        change.alarm = &alarm_mutex.alarm;
+        change.enabled = alarm_mutex.alarm.enabled;
+        change.version = alarm_mutex.version;
+
+        // converts the time left into an absolute deadline, rounded up to the next tick
+        uint64_t msec_left = ( alarm_mutex.alarm.msec_left > 0 ) ? alarm_mutex.alarm.msec_left : 0;
+        change.deadline_tick = ( getMonotonicTime() - this->start_time + msec_left + this->msec_interval - 1 ) / this->msec_interval;
+
+        AutoLock auto_lock( *this->mutex_alarm_changes );
+        if ( alarm_mutex.registered )
+            this->alarm_changes.push_back( change );
+    }
+
+    void AlarmControllerImplOpenIKE::processAlarmChanges( ) {
+        deque<AlarmChange> changes;
+        {
+            AutoLock auto_lock( *this->mutex_alarm_changes );
+            changes.swap( this->alarm_changes );
+        }
+
+        // the changes of each alarm are queued in order, so the last one prevails
+        for ( deque<AlarmChange>::iterator it = changes.begin(); it != changes.end(); it++ ) {
+            map<Alarm*, AlarmEntry>::iterator it_entry = this->alarm_collection.find( it->alarm );
+            if ( it_entry == this->alarm_collection.end() )
+                continue;
+
+            if ( it->enabled ) {
+                uint64_t deadline_tick = ( it->deadline_tick <= this->current_tick ) ? this->current_tick + 1 : it->deadline_tick;
+                this->scheduleAlarm( *it->alarm, it_entry->second, deadline_tick );
+                it_entry->second.version = it->version;
+            }
+            else {
+                this->unscheduleAlarm( it_entry->second );
+            }
+        }
     }
 
-    AlarmControllerImplOpenIKE::~AlarmControllerImplOpenIKE() {}
+    void AlarmControllerImplOpenIKE::expireAlarms( uint64_t tick ) {
+        list<Alarm*>& slot = this->timing_wheel[ tick % this->timing_wheel.size() ];
+
+        // Extracts the expired alarms first
+        vector<Alarm*> expired_alarms;
+        for ( list<Alarm*>::iterator it = slot.begin(); it != slot.end(); ) {
+            AlarmEntry& entry = this->alarm_collection[ *it ];
+            if ( entry.deadline_tick > tick ) {
+                it++;
+                continue;
+            }
+            expired_alarms.push_back( *it );
+            entry.scheduled = false;
+            it = slot.erase( it );
+        }
+
+        for ( vector<Alarm*>::iterator it = expired_alarms.begin(); it != expired_alarms.end(); it++ ) {
+            Alarm* alarm = *it;
+            AlarmEntry& entry = this->alarm_collection[ alarm ];
+
+            {
+                // locks the alarm (the original mutex, so this is not notified as a change)
+                AutoLock auto_lock_alarm( entry.alarm_mutex->getMutex() );
+
+                // if the alarm has been disabled or rearmed meanwhile, do not notify it (the queued change will take care)
+                if ( !alarm->enabled || entry.alarm_mutex->version != entry.version )
+                    continue;
+
+                alarm->enabled = false;
+            }
+
+            // hands the alarm off to the dispatchers
+            AutoLock auto_lock( *this->condition_expired );
+            this->expired_alarm_collection.push_back( alarm );
+
+            // removeAlarm() waits on the same condition, so a single notification could miss the dispatchers
+            this->condition_expired->notifyAll();
+        }
+    }
 
     void AlarmControllerImplOpenIKE::run( ) {
-        Log::writeLockedMessage( "AlarmController", "Start: Thread ID=[" + intToString( thread_id ) + "]", Log::LOG_THRD, true );
+        Log::writeLockedMessage( "AlarmController", "Start: Thread ID=[" + intToString( thread_id ) + "] Wheel size=[" + intToString( this->timing_wheel.size() ) + "]", Log::LOG_THRD, true );
 
         while ( true ) {
             try {
-                // wait for another clock tic
-                usleep( msec_interval * 1000 );
+                // wait for another clock tic (absolute, so the processing time doesn't drift the clock)
+                uint64_t next_tick_time = this->start_time + ( this->current_tick + 1 ) * this->msec_interval;
+                uint64_t now = getMonotonicTime();
+                if ( now < next_tick_time ) {
+                    usleep( ( next_tick_time - now ) * 1000 );
+                    now = getMonotonicTime();
+                }
 
                 // locks the alarm collection
                 AutoLock auto_lock( *this->mutex_alarm_collection );
 
-                // for all the alarms in the collection
-                for ( vector<Alarm*>::iterator it = alarm_collection->begin(); it != alarm_collection->end(); it++ ) {
-                    Alarm *alarm = *it;
+                this->processAlarmChanges();
 
-                    // locks the alarm
-                    AutoLock auto_lock_alarm( *alarm->mutex );
-
-                    // if the alarm is disabled, then do not process this one
-                    if ( !alarm->enabled )
-                        continue;
-
-                    // decrement the alarm left time
-                    alarm->msec_left -= msec_interval;
-
-                    // If the alarm is enabled has reach timeout then and is enabled then notify the alarm
-                    //auto_lock.release(); this is rubbish but not sure
-                    if ( alarm->msec_left <= 0 ) {
-                        alarm->enabled = false;
-                        alarm->notifyAlarmable();
-                    }
+                // process all the elapsed ticks (more than one if this thread was delayed)
+                uint64_t target_tick = ( now - this->start_time ) / this->msec_interval;
+                while ( this->current_tick < target_tick ) {
+                    this->current_tick++;
+                    this->expireAlarms( this->current_tick );
                 }
             }
             catch ( exception & ex ) {
@@ -65,28 +216,73 @@ namespace openikev2 {
     void AlarmControllerImplOpenIKE::addAlarm( Alarm& alarm ) {
         AutoLock auto_lock( *this->mutex_alarm_collection );
 
+        // Wraps the alarm mutex, so resetting or disabling the alarm queues a change. The alarm must not be in use yet
+        AlarmMutex* alarm_mutex = dynamic_cast<AlarmMutex*> ( alarm.mutex.get() );
+        if ( alarm_mutex == NULL ) {
+            alarm_mutex = new AlarmMutex( *this, alarm, alarm.mutex );
+            alarm.mutex.reset( alarm_mutex );
+        }
+
         // Inserts the new alarm in the collection
-        this->alarm_collection->push_back( &alarm );
+        AlarmEntry& entry = this->alarm_collection[ &alarm ];
+        entry.scheduled = false;
+        entry.deadline_tick = 0;
+        entry.alarm_mutex = alarm_mutex;
+        entry.version = 0;
+
+        {
+            AutoLock auto_lock_changes( *this->mutex_alarm_changes );
+            alarm_mutex->registered = true;
+        }
+
+        // The alarm could have been reset before being registered. Releasing the mutex queues its current state
+        {
+            AutoLock auto_lock_alarm( *alarm_mutex );
+        }
 
         Alarm* alarm_ptr = &alarm;
-        Log::writeLockedMessage( "AlarmController", "Register alarm: Alarm Id=" + Printable::toHexString( &alarm_ptr , 4 ) + " Total Alarms=[" + intToString( this->alarm_collection->size() ) + "]", Log::LOG_ALRM, true );
+        Log::writeLockedMessage( "AlarmController", "Register alarm: Alarm Id=" + Printable::toHexString( &alarm_ptr , 4 ) + " Total Alarms=[" + intToString( this->alarm_collection.size() ) + "]", Log::LOG_ALRM, true );
     }
 
     void AlarmControllerImplOpenIKE::removeAlarm( Alarm& alarm ) {
-        AutoLock auto_lock( *this->mutex_alarm_collection );
+        {
+            AutoLock auto_lock( *this->mutex_alarm_collection );
+
+            // Finds the alarm in the collection
+            map<Alarm*, AlarmEntry>::iterator it = this->alarm_collection.find( &alarm );
+            if ( it == this->alarm_collection.end() ) {
+                Alarm * alarm_ptr = &alarm;
+                Log::writeLockedMessage( "AlarmController", "Alarm doesn't exist: Alarm Id=[" + Printable::toHexString( &alarm_ptr, 4 ) + "] Total Alarms=[" + intToString( this->alarm_collection.size() ) + "]", Log::LOG_WARN, true );
+                return ;
+            }
+
+            // Removes the alarm from the timing wheel and from the collection
+            this->unscheduleAlarm( it->second );
+            AlarmMutex* alarm_mutex = it->second.alarm_mutex;
+            this->alarm_collection.erase( it );
 
-        // Finds the alarm in the collection
-        vector<Alarm*>::iterator it = find ( this->alarm_collection->begin(), this->alarm_collection->end(), &alarm );
-        if ( it == this->alarm_collection->end() ) {
-            Alarm * alarm_ptr = &alarm;
-            Log::writeLockedMessage( "AlarmController", "Alarm doesn't exist: Alarm Id=[" + Printable::toHexString( &alarm_ptr, 4 ) + "] Total Alarms=[" + intToString( this->alarm_collection->size() ) + "]", Log::LOG_WARN, true );
-            return ;
+            // Discards its pending changes, and stops notifying new ones
+            {
+                AutoLock auto_lock_changes( *this->mutex_alarm_changes );
+                alarm_mutex->registered = false;
+                for ( deque<AlarmChange>::iterator it_change = this->alarm_changes.begin(); it_change != this->alarm_changes.end(); )
+                    it_change = ( it_change->alarm == &alarm ) ? this->alarm_changes.erase( it_change ) : it_change + 1;
+            }
+
+            Alarm* alarm_ptr = &alarm;
+            Log::writeLockedMessage( "AlarmController", "Remove alarm: Alarm Id=[" + Printable::toHexString( &alarm_ptr, 4 ) + "] Total Alarms=[" + intToString( alarm_collection.size() ) + "]", Log::LOG_ALRM, true );
         }
 
-        // Removes the alarm from the collection
-        this->alarm_collection->erase( it );
+        // The alarm may be owned by the caller, so it cannot be in use by any dispatcher when this method returns
+        AutoLock auto_lock( *this->condition_expired );
 
-        Alarm* alarm_ptr = &alarm;
-        Log::writeLockedMessage( "AlarmController", "Remove alarm: Alarm Id=[" + Printable::toHexString( &alarm_ptr, 4 ) + "] Total Alarms=[" + intToString( alarm_collection->size() ) + "]", Log::LOG_ALRM, true );
+        for ( deque<Alarm*>::iterator it = this->expired_alarm_collection.begin(); it != this->expired_alarm_collection.end(); )
+            it = ( *it == &alarm ) ? this->expired_alarm_collection.erase( it ) : it + 1;
+
+        // waits for the dispatchers notifying it, except the current one if it is being removed from its own notification
+        uint16_t own_dispatches = ( dispatched_alarm == &alarm ) ? 1 : 0;
+        map<Alarm*, uint16_t>::iterator it;
+        while ( ( it = this->dispatching_alarms.find( &alarm ) ) != this->dispatching_alarms.end() && it->second > own_dispatches )
+            this->condition_expired->wait();
     }
 }
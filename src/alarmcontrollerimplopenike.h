@@ -13,31 +13,132 @@
 #include "config.h"
 #endif
 
-#include <libopenikev2/autovector.h>
 #include <libopenikev2/alarmcontrollerimpl.h>
 #include "threadposix.h"
+#include "conditionposix.h"
+
+#include <map>
+#include <list>
+#include <deque>
+#include <vector>
 
 using namespace std;
 
 namespace openikev2 {
+    class AlarmDispatcher;
+    class AlarmMutex;
 
     /**
         This class contains the AlarmController implementation.
+        Armed alarms are stored in a hashed timing wheel indexed by their absolute deadline (in ticks of a monotonic clock),
+        so only the alarms that expire in a tick are locked and processed.
+        Registered alarms have their mutex wrapped by an AlarmMutex, so each reset or disable is queued as an alarm change,
+        and the clock thread only reschedules the changed alarms.
+        Expired alarms are notified by a pool of AlarmDispatchers, so the clock thread only does deadline bookkeeping.
         @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
     */
     class AlarmControllerImplOpenIKE : public AlarmControllerImpl, public ThreadPosix {
+            friend class AlarmDispatcher;
+            friend class AlarmMutex;
+
+            /****************************** STRUCTS ******************************/
+        protected:
+            /**
+             * Scheduling information of a registered Alarm
+             */
+            struct AlarmEntry {
+                bool scheduled;                             /**< Indicates if the alarm is in the timing wheel */
+                uint64_t deadline_tick;                     /**< Tick when the alarm expires */
+                list<Alarm*>::iterator wheel_position;      /**< Position in the timing wheel slot (only valid when scheduled) */
+                AlarmMutex* alarm_mutex;                    /**< Wrapped mutex of the alarm */
+                uint64_t version;                           /**< Version of the alarm change that scheduled it */
+            };
+
+            /**
+             * State of an alarm after being reset or disabled
+             */
+            struct AlarmChange {
+                Alarm* alarm;                               /**< Changed alarm */
+                bool enabled;                               /**< Indicates if the alarm is enabled */
+                uint64_t deadline_tick;                     /**< Tick when the alarm expires (only valid when enabled) */
+                uint64_t version;                           /**< Version of the change */
+            };
+
             /****************************** ATTRIBUTES ******************************/
         protected:
-            AutoVector<Alarm> alarm_collection;     /**< Alarm collection */
-            uint32_t msec_interval;                 /**< Interval between "clock tics" in milliseconds */
-            auto_ptr<Mutex> mutex_alarm_collection; /**< Mutex to protect acceses to the alarm collection */
+            map<Alarm*, AlarmEntry> alarm_collection;   /**< Alarm collection */
+            vector< list<Alarm*> > timing_wheel;        /**< Timing wheel. Each slot contains the alarms expiring in ticks congruent with its index */
+            uint64_t current_tick;                      /**< Last processed tick */
+            uint64_t start_time;                        /**< Monotonic time (in milliseconds) of tick 0 */
+            uint32_t msec_interval;                     /**< Interval between "clock tics" in milliseconds */
+            auto_ptr<Mutex> mutex_alarm_collection;     /**< Mutex to protect acceses to the alarm collection */
+            deque<AlarmChange> alarm_changes;           /**< Alarm changes waiting to be processed */
+            auto_ptr<Mutex> mutex_alarm_changes;        /**< Mutex to protect the alarm changes */
+            vector<AlarmDispatcher*> alarm_dispatchers; /**< Threads notifying the expired alarms */
+            deque<Alarm*> expired_alarm_collection;     /**< Expired alarms waiting to be notified */
+            map<Alarm*, uint16_t> dispatching_alarms;   /**< Alarms being notified, and the number of dispatchers notifying each one */
+            auto_ptr<ConditionPosix> condition_expired; /**< Condition to protect the expired and dispatching alarms, and wait for changes on them */
+            static __thread Alarm* dispatched_alarm;    /**< Alarm being notified by the current thread */
 
             /****************************** METHODS ******************************/
+        protected:
+            /**
+             * Gets the current time from a monotonic clock
+             * @return Current time in milliseconds
+             */
+            static uint64_t getMonotonicTime();
+
+            /**
+             * Schedules (or reschedules) an alarm in the timing wheel
+             * @param alarm Alarm to be scheduled
+             * @param entry Alarm entry
+             * @param deadline_tick Tick when the alarm expires
+             */
+            virtual void scheduleAlarm( Alarm& alarm, AlarmEntry& entry, uint64_t deadline_tick );
+
+            /**
+             * Removes an alarm from the timing wheel
+             * @param entry Alarm entry
+             */
+            virtual void unscheduleAlarm( AlarmEntry& entry );
+
+            /**
+             * Queues the state of a reset or disabled alarm. Used by the AlarmMutex, with the alarm locked.
+             * @param alarm_mutex Wrapped mutex of the alarm
+             */
+            virtual void notifyAlarmChange( AlarmMutex& alarm_mutex );
+
+            /**
+             * Schedules or unschedules the alarms changed since the last tick
+             */
+            virtual void processAlarmChanges();
+
+            /**
+             * Notifies the alarms expiring in the indicated tick
+             * @param tick Tick being processed
+             */
+            virtual void expireAlarms( uint64_t tick );
+
+            /**
+             * Gets the next expired alarm, waiting until there is one. Used by the AlarmDispatchers.
+             * @return Expired alarm to be notified
+             */
+            virtual Alarm& getExpiredAlarm();
+
+            /**
+             * Indicates that the notification of an expired alarm has finished. Used by the AlarmDispatchers.
+             * @param alarm Notified alarm
+             */
+            virtual void finishDispatch( Alarm& alarm );
+
         public:
             /**
              * Creates a new AlarmControllerImpl.
+             * @param msec_interval Interval between "clock tics" in milliseconds
+             * @param wheel_size Number of slots in the timing wheel
+             * @param num_dispatchers Number of threads notifying the expired alarms
              */
-            AlarmControllerImplOpenIKE( uint32_t msec_interval );
+            AlarmControllerImplOpenIKE( uint32_t msec_interval, uint32_t wheel_size = 512, uint16_t num_dispatchers = 2 );
 
             /**
              * Adds the Alarm to the Alarm collection
@@ -56,6 +157,8 @@ namespace openikev2 {
              */
             virtual void run();
 
+            virtual void start();
+
             virtual ~AlarmControllerImplOpenIKE();
     };
 
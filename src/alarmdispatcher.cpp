@@ -0,0 +1,46 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#include "alarmdispatcher.h"
+#include "alarmmutex.h"
+
+#include <libopenikev2/autolock.h>
+#include <libopenikev2/log.h>
+
+namespace openikev2 {
+    AlarmDispatcher::AlarmDispatcher( AlarmControllerImplOpenIKE& alarm_controller, uint16_t id ) :
+            alarm_controller ( alarm_controller ) {
+        this->id = id;
+    }
+
+    AlarmDispatcher::~AlarmDispatcher( ) {}
+
+    void AlarmDispatcher::run( ) {
+        Log::writeLockedMessage( "AlarmDispatcher[" + intToString ( this->id ) + "]", "Start: Thread ID=[" + intToString( thread_id ) + "]", Log::LOG_THRD, true );
+
+        // Do forever
+        while ( true ) {
+            // Get the next expired alarm
+            Alarm& alarm = this->alarm_controller.getExpiredAlarm();
+
+            try {
+                // locks the alarm (the original mutex, so this is not notified as a change)
+                AutoLock auto_lock_alarm( static_cast<AlarmMutex&> ( *alarm.mutex ).getMutex() );
+
+                // if the alarm has been reset after expiring, it is not notified
+                if ( !alarm.enabled )
+                    alarm.notifyAlarmable();
+            }
+            catch ( exception & ex ) {
+                Log::writeLockedMessage( "AlarmDispatcher[" + intToString ( this->id ) + "]", ex.what() , Log::LOG_ERRO, true );
+            }
+
+            this->alarm_controller.finishDispatch( alarm );
+        }
+    }
+}
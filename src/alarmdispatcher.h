@@ -0,0 +1,46 @@
+/***************************************************************************
+ *   Copyright (C) 2005 by                                                 *
+ *   Alejandro Perez Mendez     alex@um.es                                 *
+ *   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+ *                                                                         *
+ *   This software may be modified and distributed under the terms         *
+ *   of the Apache license.  See the LICENSE file for details.             *
+ ***************************************************************************/
+#ifndef ALARMDISPATCHER_H
+#define ALARMDISPATCHER_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "alarmcontrollerimplopenike.h"
+#include "threadposix.h"
+
+namespace openikev2 {
+
+    /**
+        This class represents an alarm dispatcher.
+        It notifies the Alarmables of the expired alarms, so slow handlers don't delay the alarm clock.
+        @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
+    */
+    class AlarmDispatcher : public ThreadPosix {
+            /****************************** ATTRIBUTES ******************************/
+        protected:
+            AlarmControllerImplOpenIKE& alarm_controller;
+            uint16_t id;
+
+            /****************************** METHODS ******************************/
+        public:
+            /**
+             * Creates a new AlarmDispatcher
+             * @param alarm_controller Alarm controller where the expired alarms are queued
+             * @param id Dispatcher identifier
+             */
+            AlarmDispatcher( AlarmControllerImplOpenIKE& alarm_controller, uint16_t id );
+
+            virtual void run();
+
+            virtual ~AlarmDispatcher();
+    };
+};
+#endif
@@ -0,0 +1,36 @@
+/***************************************************************************
+ *   Copyright (C) 2005 by                                                 *
+ *   Alejandro Perez Mendez     alex@um.es                                 *
+ *   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+ *                                                                         *
+ *   This software may be modified and distributed under the terms         *
+ *   of the Apache license.  See the LICENSE file for details.             *
+ ***************************************************************************/
+#include "alarmmutex.h"
+#include "alarmcontrollerimplopenike.h"
+
+namespace openikev2 {
+    AlarmMutex::AlarmMutex( AlarmControllerImplOpenIKE& alarm_controller, Alarm& alarm, auto_ptr<Mutex> mutex ) :
+            alarm_controller ( alarm_controller ), alarm ( alarm ) {
+        this->mutex = mutex;
+        this->version = 0;
+        this->registered = false;
+    }
+
+    Mutex& AlarmMutex::getMutex( ) {
+        return *this->mutex;
+    }
+
+    void AlarmMutex::acquire( ) {
+        this->mutex->acquire();
+    }
+
+    void AlarmMutex::release( ) {
+        // the alarm could have been reset or disabled, so the controller takes its state before anybody else changes it
+        this->version++;
+        this->alarm_controller.notifyAlarmChange( *this );
+        this->mutex->release();
+    }
+
+    AlarmMutex::~AlarmMutex( ) {}
+}
@@ -0,0 +1,65 @@
+/***************************************************************************
+ *   Copyright (C) 2005 by                                                 *
+ *   Alejandro Perez Mendez     alex@um.es                                 *
+ *   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+ *                                                                         *
+ *   This software may be modified and distributed under the terms         *
+ *   of the Apache license.  See the LICENSE file for details.             *
+ ***************************************************************************/
+#ifndef ALARMMUTEX_H
+#define ALARMMUTEX_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <libopenikev2/mutex.h>
+#include <libopenikev2/alarm.h>
+
+using namespace std;
+
+namespace openikev2 {
+    class AlarmControllerImplOpenIKE;
+
+    /**
+        This class wraps the Mutex of a registered Alarm.
+        Alarm::reset() and Alarm::disable() modify the alarm holding its mutex, so each release notifies the
+        AlarmController of the new alarm state while it is still locked. This way the alarm is rescheduled in the
+        reset and disable path, without polling the registered alarms.
+        @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
+    */
+    class AlarmMutex : public Mutex {
+            friend class AlarmControllerImplOpenIKE;
+
+            /****************************** ATTRIBUTES ******************************/
+        protected:
+            AlarmControllerImplOpenIKE& alarm_controller;   /**< Controller notified of the alarm changes */
+            Alarm& alarm;                                   /**< Wrapped alarm */
+            auto_ptr<Mutex> mutex;                          /**< Original mutex of the alarm */
+            uint64_t version;                               /**< Number of notified changes (protected by the mutex) */
+            bool registered;                                /**< Indicates if the alarm is registered (protected by the controller) */
+
+            /****************************** METHODS ******************************/
+        public:
+            /**
+             * Creates a new AlarmMutex
+             * @param alarm_controller Controller notified of the alarm changes
+             * @param alarm Wrapped alarm
+             * @param mutex Original mutex of the alarm
+             */
+            AlarmMutex( AlarmControllerImplOpenIKE& alarm_controller, Alarm& alarm, auto_ptr<Mutex> mutex );
+
+            /**
+             * Gets the original mutex of the alarm. Locking it doesn't notify the controller.
+             * @return The original mutex
+             */
+            virtual Mutex& getMutex();
+
+            virtual void acquire();
+
+            virtual void release();
+
+            virtual ~AlarmMutex();
+    };
+};
+#endif
@@ -7,6 +7,7 @@
 *   of the Apache license.  See the LICENSE file for details.             *
 ***************************************************************************/
 #include "certificatex509.h"
+#include "cryptocontrollerimplopenike.h"
 
 #include <libopenikev2/exception.h>
 #include <libopenikev2/utils.h>
@@ -224,7 +225,60 @@ namespace openikev2 {
         return false;
     }
 
+    /**
+        Task signing data with a CertificateX509 in the crypto worker pool
+    */
+    class SignTask : public CryptoTask {
+        protected:
+            const CertificateX509& certificate;
+            const ByteArray& data;
+
+        public:
+            auto_ptr<ByteArray> signature;
+
+            SignTask( const CertificateX509& certificate, const ByteArray& data ) :
+                    certificate ( certificate ), data ( data ) {}
+
+            virtual void execute() {
+                this->signature = this->certificate.computeSignature( this->data );
+            }
+    };
+
+    /**
+        Task verifying a signature with a CertificateX509 in the crypto worker pool
+    */
+    class VerifyTask : public CryptoTask {
+        protected:
+            CertificateX509& certificate;
+            const ByteArray& data;
+            const ByteArray& signature;
+
+        public:
+            bool valid;
+
+            VerifyTask( CertificateX509& certificate, const ByteArray& data, const ByteArray& signature ) :
+                    certificate ( certificate ), data ( data ), signature ( signature ) {
+                this->valid = false;
+            }
+
+            virtual void execute() {
+                this->valid = this->certificate.checkSignature( this->data, this->signature );
+            }
+    };
+
     auto_ptr<ByteArray> CertificateX509::signData( const ByteArray & data ) const {
+        SignTask task( *this, data );
+        CryptoControllerImplOpenIKE::executeCryptoTask( task );
+        return task.signature;
+    }
+
+    bool CertificateX509::verifyData( const ByteArray & data, const ByteArray & signature ) {
+        VerifyTask task( *this, data, signature );
+        CryptoControllerImplOpenIKE::executeCryptoTask( task );
+        return task.valid;
+    }
+
+    auto_ptr<ByteArray> CertificateX509::computeSignature( const ByteArray & data ) const {
         assert ( this->private_key != NULL );
 
         // creates the buffer
@@ -248,7 +302,7 @@ namespace openikev2 {
         return result;
     }
 
-    bool CertificateX509::verifyData( const ByteArray & data, const ByteArray & signature ) {
+    bool CertificateX509::checkSignature( const ByteArray & data, const ByteArray & signature ) {
         EVP_MD_CTX ctx;
 
         int16_t rv = EVP_VerifyInit( &ctx, EVP_sha1() );
@@ -116,10 +116,36 @@ namespace openikev2 {
 
             virtual bool hasPrivateKey() const;
 
+            /**
+             * Signs data with the private key, in the crypto worker pool
+             * @param data Data to be signed
+             * @return The signature
+             */
             virtual auto_ptr<ByteArray> signData( const ByteArray& data ) const;
 
+            /**
+             * Signs data with the private key, in the calling thread
+             * @param data Data to be signed
+             * @return The signature
+             */
+            virtual auto_ptr<ByteArray> computeSignature( const ByteArray& data ) const;
+
+            /**
+             * Verifies a signature with the public key, in the crypto worker pool
+             * @param data Signed data
+             * @param signature Signature
+             * @return TRUE if the signature is valid. FALSE otherwise
+             */
             virtual bool verifyData( const ByteArray& data, const ByteArray& signature );
 
+            /**
+             * Verifies a signature with the public key, in the calling thread
+             * @param data Signed data
+             * @param signature Signature
+             * @return TRUE if the signature is valid. FALSE otherwise
+             */
+            virtual bool checkSignature( const ByteArray& data, const ByteArray& signature );
+
             virtual Enums::AUTH_METHOD getAuthMethod() const;
 
             virtual auto_ptr<CertificateX509> clone() const;
@@ -10,13 +10,16 @@
 
 #include <openssl/dh.h>
 #include <openssl/hmac.h>
+#include <openssl/crypto.h>
 #include <assert.h>
+#include <string.h>
 
 namespace openikev2 {
 
     CipherOpenSSL::CipherOpenSSL( Enums::ENCR_ID encr_algo, Enums::INTEG_ID integ_algo, auto_ptr< ByteArray > encr_key, auto_ptr< ByteArray > integ_key ) {
-        // Initializes the crypto context
-        EVP_CIPHER_CTX_init( &ctx );
+        // Initializes the crypto contexts
+        EVP_CIPHER_CTX_init( &this->encr_ctx );
+        EVP_CIPHER_CTX_init( &this->decr_ctx );
 
         // store the keys
         this->encr_key = encr_key;
@@ -82,73 +85,115 @@ namespace openikev2 {
             default:
                 assert ( "integrity algorithm not supported" && 0 );
         }
+
+        // The inner and outer pads of the integrity key are computed only here
+        HMAC_CTX_init( &this->hmac_ctx );
+        if ( this->integ_evp != NULL ) {
+            uint8_t result = HMAC_Init_ex( &this->hmac_ctx, this->integ_key->getRawPointer(), this->integ_key->size(), this->integ_evp, NULL );
+            assert( result );
+        }
+
+        if ( this->encr_evp == NULL )
+            return;
+
+        // The key schedules are computed only here. Each message just sets its IV
+        uint8_t result = EVP_EncryptInit_ex( &this->encr_ctx, this->encr_evp, NULL, this->encr_key->getRawPointer(), NULL );
+        assert( result );
+        result = EVP_DecryptInit_ex( &this->decr_ctx, this->encr_evp, NULL, this->encr_key->getRawPointer(), NULL );
+        assert( result );
+
+        // Turn-off auto padding
+        EVP_CIPHER_CTX_set_padding( &this->encr_ctx, 0 );
+        EVP_CIPHER_CTX_set_padding( &this->decr_ctx, 0 );
     }
 
     CipherOpenSSL::~CipherOpenSSL() {
-        EVP_CIPHER_CTX_cleanup( &ctx );
+        EVP_CIPHER_CTX_cleanup( &this->encr_ctx );
+        EVP_CIPHER_CTX_cleanup( &this->decr_ctx );
+        HMAC_CTX_cleanup( &this->hmac_ctx );
     }
 
     auto_ptr< ByteArray > CipherOpenSSL::encrypt( ByteArray & plain_text, ByteArray & initialization_vector ) {
-        assert ( ( plain_text.size() % this->encr_block_size ) == 0 );
-
-        int outlen = 0;
-
         // the ciphertext will have the same size as plain_text
-        auto_ptr<ByteArray> ciphertext ( new ByteArray( plain_text.size() ) );
+        auto_ptr<ByteArray> ciphertext ( new ByteArray( plain_text.getRawPointer(), plain_text.size() ) );
+        this->encryptInPlace( ciphertext->getRawPointer(), ciphertext->size(), initialization_vector.getRawPointer() );
+        return ciphertext;
+    }
 
-        // Initializes crypto operation
-        uint8_t result = EVP_EncryptInit_ex( &this->ctx, this->encr_evp, NULL, this->encr_key->getRawPointer(), initialization_vector.getRawPointer() );
-        assert( result );
+    auto_ptr< ByteArray > CipherOpenSSL::decrypt( ByteArray & cipher_text, ByteArray & initialization_vector ) {
+        // the plaintext will have the same size as cipher_text
+        auto_ptr<ByteArray> plaintext ( new ByteArray( cipher_text.getRawPointer(), cipher_text.size() ) );
+        this->decryptInPlace( plaintext->getRawPointer(), plaintext->size(), initialization_vector.getRawPointer() );
+        return plaintext;
+    }
 
-        // Turn-off auto padding
-        EVP_CIPHER_CTX_set_padding( &this->ctx, 0 );
+    void CipherOpenSSL::encryptInPlace( uint8_t * data, uint32_t size, const uint8_t * initialization_vector ) {
+        assert ( ( size % this->encr_block_size ) == 0 );
 
-        // Encrypt data
-        result = EVP_EncryptUpdate( &this->ctx, ciphertext->getRawPointer(), &outlen, plain_text.getRawPointer(), plain_text.size() );
-        ciphertext->setSize( outlen );
+        // Initializes crypto operation (the key is already set)
+        int outlen = 0;
+        uint8_t result = EVP_EncryptInit_ex( &this->encr_ctx, NULL, NULL, NULL, initialization_vector );
         assert( result );
-        assert ( outlen == plain_text.size() );
 
-        // finalize encryption
-        result = EVP_EncryptFinal_ex( &ctx, ciphertext->getRawPointer() + outlen, &outlen );
+        // Encrypt data. The CBC mode allows the same input and output buffer
+        result = EVP_EncryptUpdate( &this->encr_ctx, data, &outlen, data, size );
         assert( result );
+        assert ( outlen == size );
 
-        // no need to finalize since no padding is needed
-        return ciphertext;
+        // no output is generated since no padding is needed
+        result = EVP_EncryptFinal_ex( &this->encr_ctx, data + outlen, &outlen );
+        assert( result );
+        assert ( outlen == 0 );
     }
 
+    void CipherOpenSSL::decryptInPlace( uint8_t * data, uint32_t size, const uint8_t * initialization_vector ) {
+        assert ( ( size % this->encr_block_size ) == 0 );
 
-    auto_ptr< ByteArray > CipherOpenSSL::decrypt( ByteArray & cipher_text, ByteArray & initialization_vector ) {
-        assert ( ( cipher_text.size() % this->encr_block_size ) == 0 );
+        // Initializes crypto operation (the key is already set)
+        int outlen = 0;
+        uint8_t result = EVP_DecryptInit_ex( &this->decr_ctx, NULL, NULL, NULL, initialization_vector );
+        assert( result );
 
-        // the ciphertext will have the same size as plain_text
-        auto_ptr<ByteArray> plaintext ( new ByteArray( cipher_text.size() ) );
+        // decrypt data
+        result = EVP_DecryptUpdate( &this->decr_ctx, data, &outlen, data, size );
+        assert( result );
+        assert ( outlen == size );
 
-        // Initializes crypto operation
-        int outlen;
-        uint8_t result = EVP_DecryptInit_ex( &this->ctx, this->encr_evp, NULL, this->encr_key->getRawPointer(), initialization_vector.getRawPointer() );
+        // no output is generated since no padding is needed
+        result = EVP_DecryptFinal_ex( &this->decr_ctx, data + outlen, &outlen );
         assert( result );
+        assert ( outlen == 0 );
+    }
 
-        // Turn-off auto padding
-        EVP_CIPHER_CTX_set_padding( &this->ctx, 0 );
+    auto_ptr< ByteArray > CipherOpenSSL::computeIntegrity( ByteArray & data_buffer ) {
+        auto_ptr<ByteArray> result ( new ByteArray( this->integ_hash_size ) );
+        this->computeIntegrityInPlace( data_buffer.getRawPointer(), data_buffer.size(), result->getRawPointer() );
+        result->setSize( this->integ_hash_size );
+        return result;
+    }
 
-        // decrypt data
-        result = EVP_DecryptUpdate( &this->ctx, plaintext->getRawPointer(), &outlen, cipher_text.getRawPointer(), cipher_text.size() );
-        plaintext->setSize( outlen );
+    void CipherOpenSSL::computeIntegrityInPlace( const uint8_t * data, uint32_t size, uint8_t * icv ) {
+        assert ( this->integ_evp != NULL );
+
+        // Restarts from the precomputed inner pad state (the key is already set)
+        uint8_t result = HMAC_Init_ex( &this->hmac_ctx, NULL, 0, NULL, NULL );
+        assert( result );
+        result = HMAC_Update( &this->hmac_ctx, data, size );
         assert( result );
-        assert ( outlen == cipher_text.size() );
 
-        // finalize decryption
-        result = EVP_DecryptFinal_ex( &ctx, plaintext->getRawPointer() + outlen, &outlen );
+        uint8_t digest[ EVP_MAX_MD_SIZE ];
+        uint32_t digest_size = 0;
+        result = HMAC_Final( &this->hmac_ctx, digest, &digest_size );
         assert( result );
 
-        // no need to finalize since no padding is needed
-        return plaintext;
+        // The integ hash size may be shorter than real hash result
+        memcpy( icv, digest, this->integ_hash_size );
     }
 
-
-    auto_ptr< ByteArray > CipherOpenSSL::computeIntegrity( ByteArray & data_buffer ) {
-        return this->hmac( data_buffer, *this->integ_key );
+    bool CipherOpenSSL::checkIntegrityInPlace( const uint8_t * data, uint32_t size, const uint8_t * icv ) {
+        uint8_t expected[ EVP_MAX_MD_SIZE ];
+        this->computeIntegrityInPlace( data, size, expected );
+        return CRYPTO_memcmp( expected, icv, this->integ_hash_size ) == 0;
     }
 
     auto_ptr< ByteArray > CipherOpenSSL::hmac( ByteArray & data_buffer, ByteArray & hmac_key ) {
@@ -22,6 +22,7 @@
 #include <libopenikev2/bytearray.h>
 
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
 
 using namespace std;
 
@@ -29,15 +30,21 @@ namespace openikev2 {
 
     /**
         This class implements a Cipher, using the OpenSSL library.
+        The key schedules are computed once, when the cipher is created, and each message only sets a new IV in the
+        encryption and decryption contexts.
+        The *InPlace() methods work directly on the message buffer of the caller, writing the truncated ICV in its final
+        place, so protecting a message doesn't need any memory allocation.
         @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
     */
     class CipherOpenSSL : public Cipher {
 
             /****************************** ATTRIBUTES ******************************/
         protected:
-            EVP_CIPHER_CTX ctx;             /**< OpenSSL context used in crypto operations */
+            EVP_CIPHER_CTX encr_ctx;        /**< OpenSSL context used to encrypt, with the key already set */
+            EVP_CIPHER_CTX decr_ctx;        /**< OpenSSL context used to decrypt, with the key already set */
             EVP_CIPHER *encr_evp;           /**< OpenSSL representation of the crypto algorithm */
             EVP_MD *integ_evp;              /**< OpenSSL representation of the HMAC algorithm */
+            HMAC_CTX hmac_ctx;              /**< HMAC context with the integrity key pads already computed */
         public:
             auto_ptr<ByteArray> encr_key;   /**< Key used to crypt and decrypt */
             auto_ptr<ByteArray> integ_key;  /**< Key used to compute HMAC of messages */
@@ -46,7 +53,8 @@ namespace openikev2 {
         public:
             /**
              * Creates a new CipherOpenSSL, setting the indicated parameters.
-             * @param proposal Proposal containing the ENCR and INTEG transforms
+             * @param encr_algo Encryption algorithm
+             * @param integ_algo Integrity algorithm
              * @param encr_key Encryption key
              * @param integ_key Integrity key
              */
@@ -60,6 +68,39 @@ namespace openikev2 {
 
             virtual auto_ptr<ByteArray> hmac( ByteArray& data_buffer, ByteArray& hmac_key );
 
+            /**
+             * Encrypts data in place, without allocating memory
+             * @param data Data to be encrypted. Its size must be a multiple of the block size
+             * @param size Size of the data
+             * @param initialization_vector IV (encr_block_size bytes)
+             */
+            virtual void encryptInPlace( uint8_t* data, uint32_t size, const uint8_t* initialization_vector );
+
+            /**
+             * Decrypts data in place, without allocating memory
+             * @param data Data to be decrypted. Its size must be a multiple of the block size
+             * @param size Size of the data
+             * @param initialization_vector IV (encr_block_size bytes)
+             */
+            virtual void decryptInPlace( uint8_t* data, uint32_t size, const uint8_t* initialization_vector );
+
+            /**
+             * Computes the truncated ICV of the data, writing it in the indicated place
+             * @param data Data to be authenticated
+             * @param size Size of the data
+             * @param icv Output: ICV (integ_hash_size bytes). It can be right after the data in the same buffer
+             */
+            virtual void computeIntegrityInPlace( const uint8_t* data, uint32_t size, uint8_t* icv );
+
+            /**
+             * Checks the truncated ICV of the data, in constant time
+             * @param data Authenticated data
+             * @param size Size of the data
+             * @param icv Received ICV (integ_hash_size bytes)
+             * @return TRUE if the ICV is valid. FALSE otherwise
+             */
+            virtual bool checkIntegrityInPlace( const uint8_t* data, uint32_t size, const uint8_t* icv );
+
             virtual ~CipherOpenSSL();
     };
 };
@@ -25,6 +25,10 @@ namespace openikev2 {
         pthread_cond_signal( &this->condition );
     }
 
+    void ConditionPosix::notifyAll( ) {
+        pthread_cond_broadcast( &this->condition );
+    }
+
     void ConditionPosix::acquire( ) {
         pthread_mutex_lock( &this->mutex );
     }
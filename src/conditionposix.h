@@ -43,6 +43,11 @@ namespace openikev2 {
 
             virtual void notify();
 
+            /**
+             * Wakes up all the threads waiting on the condition
+             */
+            virtual void notifyAll();
+
             virtual void acquire();
 
             virtual void release();
@@ -22,14 +22,28 @@
 #include "randomopenssl.h"
 #include "pseudorandomfunctionopenssl.h"
 #include "diffiehellmanellipticcurve.h"
+#include "diffiehellmanpool.h"
 
 namespace openikev2 {
 
   vector<pthread_mutex_t> CryptoControllerImplOpenIKE::openssl_mutex;
+  CryptoControllerImplOpenIKE* CryptoControllerImplOpenIKE::instance = NULL;
+  MutexPosix CryptoControllerImplOpenIKE::mutex_instance;
 
-  CryptoControllerImplOpenIKE::CryptoControllerImplOpenIKE() {
+  CryptoControllerImplOpenIKE::CryptoControllerImplOpenIKE( uint16_t dh_pool_size, uint16_t dh_pool_fillers, uint16_t num_crypto_workers ) {
     CryptoControllerImplOpenIKE::opensslThreadSetup();
 
+    // Creates the pool executing the public key operations
+    this->crypto_worker_pool.reset( new CryptoWorkerPool( num_crypto_workers ) );
+    {
+      AutoLock auto_lock( mutex_instance );
+      if ( instance == NULL )
+        instance = this;
+    }
+
+    // Creates the pool of pre-generated Diffie-Hellman key pairs
+    this->diffie_hellman_pool.reset( new DiffieHellmanPool( dh_pool_size, dh_pool_fillers ) );
+
     // Create cookie secret and alarm
     this->mutex_cookie_secret = ThreadController::getMutex();
     this->random = this->getRandom();
@@ -41,17 +55,39 @@ namespace openikev2 {
   CryptoControllerImplOpenIKE::~CryptoControllerImplOpenIKE() {
     if ( this->alarm_cookies_secret.get() )
       AlarmController::removeAlarm( *this->alarm_cookies_secret );
+
+    // No more tasks are queued, and the pending ones are executed before the workers are cancelled
+    {
+      AutoLock auto_lock( mutex_instance );
+      if ( instance == this )
+        instance = NULL;
+    }
+    this->crypto_worker_pool.reset();
   }
 
-  auto_ptr<DiffieHellman> CryptoControllerImplOpenIKE::getDiffieHellman( Enums::DH_ID group ) {
-    if (group < 19)
-        return auto_ptr<DiffieHellman> ( new DiffieHellmanOpenSSL( group ) );
+  void CryptoControllerImplOpenIKE::executeCryptoTask( CryptoTask & task ) {
+    // Only the queueing needs the controller. The queued tasks are executed even if it is destroyed meanwhile
+    bool queued = false;
+    {
+      AutoLock auto_lock( mutex_instance );
+      if ( instance != NULL )
+        queued = instance->getCryptoWorkerPool().queueTask( task );
+    }
 
-    #ifdef HAVE_OPENSSL_ECDH_H
-    else
-        return auto_ptr<DiffieHellman> ( new DiffieHellmanEllipticCurve( group ) );
-    #endif
+    if ( !queued ) {
+      task.execute();
+      return;
+    }
+
+    CryptoWorkerPool::waitTask( task );
+  }
 
+  CryptoWorkerPool & CryptoControllerImplOpenIKE::getCryptoWorkerPool( ) {
+    return *this->crypto_worker_pool;
+  }
+
+  auto_ptr<DiffieHellman> CryptoControllerImplOpenIKE::getDiffieHellman( Enums::DH_ID group ) {
+    return this->diffie_hellman_pool->getDiffieHellman( group );
   }
 
   auto_ptr< Cipher > CryptoControllerImplOpenIKE::getCipher( Proposal & proposal, auto_ptr< ByteArray > encr_key, auto_ptr< ByteArray > integ_key ) {
@@ -16,6 +16,9 @@
 #include <libopenikev2/cryptocontrollerimpl.h>
 #include <libopenikev2/alarmable.h>
 #include <libopenikev2/mutex.h>
+#include "diffiehellmanpool.h"
+#include "cryptoworkerpool.h"
+#include "mutexposix.h"
 
 namespace openikev2 {
 
@@ -33,8 +36,12 @@ namespace openikev2 {
             bool used_secret;                       /**< Secret uses. */
             auto_ptr<Random> random;                /**< Random object used in the secret generation */
             auto_ptr<Alarm> alarm_cookies_secret;   /**< Alarm to regenerate cookie secret periodically */
+            auto_ptr<DiffieHellmanPool> diffie_hellman_pool; /**< Pool of pre-generated Diffie-Hellman key pairs */
+            auto_ptr<CryptoWorkerPool> crypto_worker_pool;   /**< Pool executing the public key operations */
 
             static vector<pthread_mutex_t> openssl_mutex; /**< Mutex collection for openssl */
+            static CryptoControllerImplOpenIKE* instance; /**< Controller whose pool executes the crypto tasks (the first one created) */
+            static MutexPosix mutex_instance;             /**< Mutex to protect the instance and the queueing of the tasks */
             /****************************** METHODS ******************************/
         protected:
             /**
@@ -60,8 +67,25 @@ namespace openikev2 {
         public:
             /**
              * Creates a new CryptoControllerImplOpenIKE
+             * @param dh_pool_size Number of pre-generated Diffie-Hellman key pairs kept for each group (0 to disable the pool)
+             * @param dh_pool_fillers Number of threads generating the Diffie-Hellman key pairs
+             * @param num_crypto_workers Number of threads executing the public key operations (0 to execute them in the calling thread)
              */
-            CryptoControllerImplOpenIKE();
+            CryptoControllerImplOpenIKE( uint16_t dh_pool_size = 8, uint16_t dh_pool_fillers = 1, uint16_t num_crypto_workers = 4 );
+
+            /**
+             * Executes an expensive public key operation in the crypto worker pool of the controller, waiting until it finishes.
+             * If there is no controller, it is executed by the calling thread
+             * @param task Task to be executed
+             * @throws Exception If the task has thrown an exception
+             */
+            static void executeCryptoTask( CryptoTask& task );
+
+            /**
+             * Gets the pool executing the public key operations
+             * @return The crypto worker pool
+             */
+            virtual CryptoWorkerPool& getCryptoWorkerPool();
 
             virtual auto_ptr<DiffieHellman> getDiffieHellman( Enums::DH_ID group );
 
@@ -0,0 +1,32 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#include "cryptoworker.h"
+
+#include <libopenikev2/log.h>
+#include <libopenikev2/utils.h>
+
+namespace openikev2 {
+    CryptoWorker::CryptoWorker( CryptoWorkerPool& pool, uint16_t id ) :
+            pool ( pool ) {
+        this->id = id;
+    }
+
+    CryptoWorker::~CryptoWorker( ) {}
+
+    void CryptoWorker::run( ) {
+        Log::writeLockedMessage( "CryptoWorker[" + intToString ( this->id ) + "]", "Start: Thread ID=[" + intToString( thread_id ) + "]", Log::LOG_THRD, true );
+
+        // Do forever
+        while ( true ) {
+            CryptoTask& task = this->pool.getTask();
+            CryptoWorkerPool::runTask( task );
+            this->pool.finishTask( task );
+        }
+    }
+}
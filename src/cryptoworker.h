@@ -0,0 +1,45 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#ifndef CRYPTOWORKER_H
+#define CRYPTOWORKER_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "cryptoworkerpool.h"
+#include "threadposix.h"
+
+namespace openikev2 {
+
+    /**
+        This class represents a thread of a CryptoWorkerPool.
+        @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
+    */
+    class CryptoWorker : public ThreadPosix {
+            /****************************** ATTRIBUTES ******************************/
+        protected:
+            CryptoWorkerPool& pool;
+            uint16_t id;
+
+            /****************************** METHODS ******************************/
+        public:
+            /**
+             * Creates a new CryptoWorker
+             * @param pool Pool where the tasks are queued
+             * @param id Worker identifier
+             */
+            CryptoWorker( CryptoWorkerPool& pool, uint16_t id );
+
+            virtual void run();
+
+            virtual ~CryptoWorker();
+    };
+};
+#endif
@@ -0,0 +1,127 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#include "cryptoworkerpool.h"
+#include "cryptoworker.h"
+
+#include <libopenikev2/threadcontroller.h>
+#include <libopenikev2/autolock.h>
+#include <libopenikev2/exception.h>
+
+namespace openikev2 {
+
+    __thread CryptoBlockingHandler* CryptoWorkerPool::blocking_handler = NULL;
+
+    CryptoTask::CryptoTask() {
+        this->semaphore_done = ThreadController::getSemaphore( 0 );
+        this->failed = false;
+    }
+
+    CryptoTask::~CryptoTask() {
+    }
+
+    CryptoBlockingHandler::~CryptoBlockingHandler() {
+    }
+
+    CryptoWorkerPool::CryptoWorkerPool( uint16_t num_workers ) {
+        this->condition_tasks.reset( new ConditionPosix() );
+        this->running_tasks = 0;
+
+        for ( uint16_t i = 0; i < num_workers; i++ ) {
+            CryptoWorker* worker = new CryptoWorker( *this, i );
+            this->workers.push_back( worker );
+            worker->start();
+        }
+    }
+
+    CryptoWorkerPool::~CryptoWorkerPool() {
+        // The executers waiting for a task would never wake up if its worker was cancelled
+        {
+            AutoLock auto_lock( *this->condition_tasks );
+            while ( !this->tasks.empty() || this->running_tasks > 0 )
+                this->condition_tasks->wait();
+        }
+
+        for ( vector<CryptoWorker*>::iterator it = this->workers.begin(); it != this->workers.end(); it++ ) {
+            ( *it )->cancel();
+            delete ( *it );
+        }
+    }
+
+    CryptoTask & CryptoWorkerPool::getTask( ) {
+        AutoLock auto_lock( *this->condition_tasks );
+
+        while ( this->tasks.empty() )
+            this->condition_tasks->wait();
+
+        CryptoTask* task = this->tasks.front();
+        this->tasks.pop_front();
+        this->running_tasks++;
+        return *task;
+    }
+
+    void CryptoWorkerPool::finishTask( CryptoTask & task ) {
+        task.semaphore_done->post();
+
+        AutoLock auto_lock( *this->condition_tasks );
+        this->running_tasks--;
+
+        // wakes up the destructor (and the idle workers, which will keep waiting if there are no tasks)
+        this->condition_tasks->notifyAll();
+    }
+
+    void CryptoWorkerPool::runTask( CryptoTask & task ) {
+        try {
+            task.execute();
+        }
+        catch ( exception & ex ) {
+            task.failed = true;
+            task.error = ex.what();
+        }
+    }
+
+    bool CryptoWorkerPool::queueTask( CryptoTask & task ) {
+        if ( this->workers.empty() )
+            return false;
+
+        AutoLock auto_lock( *this->condition_tasks );
+        this->tasks.push_back( &task );
+        this->condition_tasks->notify();
+        return true;
+    }
+
+    void CryptoWorkerPool::waitTask( CryptoTask & task ) {
+        // Other threads can do the work of this one while it is waiting
+        CryptoBlockingHandler* handler = blocking_handler;
+        if ( handler != NULL )
+            handler->beginBlocking();
+
+        task.semaphore_done->wait();
+
+        if ( handler != NULL )
+            handler->endBlocking();
+
+        if ( task.failed )
+            throw Exception( task.error );
+    }
+
+    void CryptoWorkerPool::execute( CryptoTask & task ) {
+        if ( this->queueTask( task ) ) {
+            waitTask( task );
+            return;
+        }
+
+        runTask( task );
+        if ( task.failed )
+            throw Exception( task.error );
+    }
+
+    void CryptoWorkerPool::setBlockingHandler( CryptoBlockingHandler * handler ) {
+        blocking_handler = handler;
+    }
+}
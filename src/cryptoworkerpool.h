@@ -0,0 +1,156 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#ifndef CRYPTOWORKERPOOL_H
+#define CRYPTOWORKERPOOL_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <libopenikev2/condition.h>
+#include <libopenikev2/semaphore.h>
+#include "conditionposix.h"
+
+#include <deque>
+#include <vector>
+#include <string>
+
+using namespace std;
+
+namespace openikev2 {
+    class CryptoWorker;
+
+    /**
+        This class represents an expensive public key operation (i.e. a Diffie-Hellman shared secret or a RSA signature)
+        to be executed by a CryptoWorkerPool.
+        @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
+    */
+    class CryptoTask {
+            friend class CryptoWorkerPool;
+
+            /****************************** ATTRIBUTES ******************************/
+        protected:
+            auto_ptr<Semaphore> semaphore_done;     /**< Posted when the task has been executed */
+            bool failed;                            /**< Indicates if the execution has thrown an exception */
+            string error;                           /**< Error message of the exception */
+
+            /****************************** METHODS ******************************/
+        public:
+            /**
+             * Creates a new CryptoTask
+             */
+            CryptoTask();
+
+            /**
+             * Performs the operation. It is called from a worker thread
+             */
+            virtual void execute() = 0;
+
+            virtual ~CryptoTask();
+    };
+
+    /**
+        This interface is implemented by the threads that want to know when they are going to block waiting for a CryptoTask
+        (i.e. the IkeSaExecuters, that let other executer run meanwhile).
+        @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
+    */
+    class CryptoBlockingHandler {
+        public:
+            /**
+             * The current thread is going to wait for a CryptoTask
+             */
+            virtual void beginBlocking() = 0;
+
+            /**
+             * The CryptoTask of the current thread has been executed
+             */
+            virtual void endBlocking() = 0;
+
+            virtual ~CryptoBlockingHandler();
+    };
+
+    /**
+        This class represents a pool of threads executing the expensive public key operations.
+        The operations are taken off the IkeSaExecuters, so the number of concurrent operations is limited by the pool size
+        and the executers blocked on them can be replaced by others to keep processing the cheap requests.
+        @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
+    */
+    class CryptoWorkerPool {
+            friend class CryptoWorker;
+
+            /****************************** ATTRIBUTES ******************************/
+        protected:
+            deque<CryptoTask*> tasks;                           /**< Tasks waiting for a worker */
+            uint16_t running_tasks;                             /**< Tasks being executed by a worker */
+            auto_ptr<ConditionPosix> condition_tasks;           /**< Condition to protect the task queue and wait for new or finished tasks */
+            vector<CryptoWorker*> workers;                      /**< Worker threads */
+            static __thread CryptoBlockingHandler* blocking_handler; /**< Blocking handler of the current thread */
+
+            /****************************** METHODS ******************************/
+        protected:
+            /**
+             * Gets the next task, waiting until there is any. Called by the workers
+             * @return The next task
+             */
+            virtual CryptoTask& getTask();
+
+            /**
+             * Notifies the waiting thread that a task has been executed. Called by the workers
+             * @param task Executed task
+             */
+            virtual void finishTask( CryptoTask& task );
+
+            /**
+             * Executes a task, storing the exception it throws (if any)
+             * @param task Task to be executed
+             */
+            static void runTask( CryptoTask& task );
+
+        public:
+            /**
+             * Creates a new CryptoWorkerPool and starts its workers
+             * @param num_workers Number of worker threads. If 0, the tasks are executed by the calling thread
+             */
+            CryptoWorkerPool( uint16_t num_workers );
+
+            /**
+             * Queues a task to be executed by a worker thread
+             * @param task Task to be executed
+             * @return TRUE if the task has been queued. FALSE if the pool has no workers (the caller must execute it)
+             */
+            virtual bool queueTask( CryptoTask& task );
+
+            /**
+             * Waits until a queued task has been executed. The blocking handler of the calling thread (if any)
+             * is notified before and after the wait. It doesn't use the pool, so it can be called after the pool is destroyed.
+             * @param task Queued task
+             * @throws Exception If the task has thrown an exception
+             */
+            static void waitTask( CryptoTask& task );
+
+            /**
+             * Executes a task in a worker thread and waits until it finishes
+             * @param task Task to be executed
+             * @throws Exception If the task has thrown an exception
+             */
+            virtual void execute( CryptoTask& task );
+
+            /**
+             * Sets the blocking handler of the current thread
+             * @param handler Blocking handler (NULL to remove it)
+             */
+            static void setBlockingHandler( CryptoBlockingHandler* handler );
+
+            /**
+             * Waits until the queued and running tasks have been executed, and cancels the workers
+             */
+            virtual ~CryptoWorkerPool();
+    };
+};
+#endif
@@ -7,8 +7,8 @@
 *   of the Apache license.  See the LICENSE file for details.             *
 ***************************************************************************/
 #include "dhcpclient.h"
-#include "randomopenssl.h"
 #include "ipaddressopenike.h"
+#include "dhcpengine.h"
 
 #include <ifaddrs.h>
 #include <libopenikev2/log.h>
@@ -28,10 +28,8 @@
 
 #include <libopenikev2/networkcontroller.h>
 #include <libopenikev2/exception.h>
-#include <libopenikev2/ikesacontroller.h>
-#include <libopenikev2/alarmcontroller.h>
+#include <libopenikev2/threadcontroller.h>
 #include <libopenikev2/eventbus.h>
-#include <libopenikev2/senddeleteikesareqcommand.h>
 
 #include <libopenikev2/stringattribute.h>
 #include <libopenikev2/int32attribute.h>
@@ -86,103 +84,6 @@ namespace openikev2 {
                                4    //
                            };
 
-    int32_t DhcpClient::createRawSocket( ) {
-        int32_t fd;
-        struct sockaddr_ll sock;
-
-        memset(&sock, 0, sizeof(sockaddr_ll));
-
-        if ( ( fd = socket( PF_PACKET, SOCK_DGRAM, htons( ETH_P_IP ) ) ) < 0 )
-            throw NetworkException ( "DhcpClient: socket call failed" );
-
-        sock.sll_family = AF_PACKET;
-        sock.sll_protocol = htons( ETH_P_IP );
-        sock.sll_ifindex = this->dhcp_ifindex;
-
-        if ( bind( fd, ( struct sockaddr * ) & sock, sizeof( sock ) ) < 0 ) {
-            close( fd );
-            throw NetworkException( "DhcpClient: bind call failed" );
-        }
-
-        return fd;
-    }
-
-    uint16_t DhcpClient::checksum( void * addr, int32_t count ) {
-        /* Compute Internet Checksum for "count" bytes
-         *         beginning at location "addr".
-         */
-        register int32_t sum = 0;
-        u_int16_t *source = ( u_int16_t * ) addr;
-
-        while ( count > 1 ) {
-            /*  This is the inner loop */
-            sum += *source++;
-            count -= 2;
-        }
-
-        /*  Add left-over byte, if any */
-        if ( count > 0 ) {
-            /* Make sure that the left-over byte is added correctly both
-             * with little and big endian hosts */
-            u_int16_t tmp = 0;
-            *( unsigned char * ) ( &tmp ) = * ( unsigned char * ) source;
-            sum += tmp;
-        }
-        /*  Fold 32-bit sum to 16 bits */
-        while ( sum >> 16 )
-            sum = ( sum & 0xffff ) + ( sum >> 16 );
-
-        return ~sum;
-    }
-
-    int32_t DhcpClient::sendRawPacket( DhcpMessage & dhcp_message ) {
-        int fd;
-        int result;
-        struct sockaddr_ll dest;
-        struct UdpDhcpPacket packet;
-        memset( &dest, 0, sizeof( dest ) );
-        memset( &packet, 0, sizeof( packet ) );
-
-        if ( ( fd = socket( PF_PACKET, SOCK_DGRAM, htons( ETH_P_IP ) ) ) < 0 )
-            throw NetworkException( "DhcpClient: sending socket call failed" );
-
-        dest.sll_family = AF_PACKET;
-        dest.sll_protocol = htons( ETH_P_IP );
-        dest.sll_ifindex = this->dhcp_ifindex;
-        dest.sll_halen = 6;
-        memset( dest.sll_addr, 0xFF, 6 );   // broadcast mac address
-
-        if ( bind( fd, ( struct sockaddr * ) & dest, sizeof( struct sockaddr_ll ) ) < 0 ) {
-            close( fd );
-            throw NetworkException( "DhcpClient: sending bind call failed" );
-        }
-
-        packet.ip.protocol = IPPROTO_UDP;
-        memset( &packet.ip.saddr, 0, 4 );
-        memset( &packet.ip.daddr, 0xFF, 4 );
-        packet.udp.source = htons( CLIENT_PORT );
-        packet.udp.dest = htons( SERVER_PORT );
-        packet.udp.len = htons( sizeof( packet.udp ) + sizeof( struct DhcpMessage ) ); /* cheat on the psuedo-header */
-        packet.ip.tot_len = packet.udp.len;
-        memcpy( &( packet.data ), &dhcp_message, sizeof( struct DhcpMessage ) );
-        packet.udp.check = checksum( &packet, sizeof( struct UdpDhcpPacket ) );
-
-        packet.ip.tot_len = htons( sizeof( struct UdpDhcpPacket ) );
-        packet.ip.ihl = sizeof( packet.ip ) >> 2;
-        packet.ip.version = IPVERSION;
-        packet.ip.ttl = IPDEFTTL;
-        packet.ip.check = checksum( &( packet.ip ), sizeof( packet.ip ) );
-
-        result = sendto( fd, &packet, sizeof( struct UdpDhcpPacket ), 0, ( struct sockaddr * ) & dest, sizeof( dest ) );
-        if ( result <= 0 ) {
-            close( fd );
-            throw NetworkException( "DhcpClient: write on socket failed" );
-        }
-
-        close( fd );
-        return result;
-    }
-
     int32_t DhcpClient::endOption( uint8_t * optionptr ) {
         int i = 0;
 
@@ -320,7 +221,7 @@ namespace openikev2 {
         return rc;
     }
 
-    int32_t DhcpClient::sendDhcpDiscover( uint64_t xid, uint32_t requested ) {
+    void DhcpClient::sendDhcpDiscover( uint32_t xid, uint32_t requested ) {
         struct DhcpMessage packet;
 
         initPacket( &packet, DHCPDISCOVER );
@@ -330,7 +231,7 @@ namespace openikev2 {
 
         addRequests( &packet );
 
-        return this->sendRawPacket( packet );
+        DhcpEngine::getInstance().sendMessage( this->dhcp_ifindex, packet );
     }
 
 
@@ -388,81 +289,10 @@ namespace openikev2 {
         return NULL;
     }
 
-    int32_t DhcpClient::getRawPacket( DhcpMessage * payload, int32_t fd ) {
-        int bytes;
-        struct UdpDhcpPacket packet;
-        u_int32_t source, dest;
-        u_int16_t check;
-
-        memset( &packet, 0, sizeof( struct UdpDhcpPacket ) );
-        bytes = read( fd, &packet, sizeof( struct UdpDhcpPacket ) );
-        if ( bytes < 0 ) {
-            Log::writeLockedMessage( "DhcpClient", "couldn't read on raw listening socket -- ignoring", Log::LOG_DHCP, true );
-            usleep( 500000 ); /* possible down interface, looping condition */
-            return -1;
-        }
-
-        if ( bytes < ( int ) ( sizeof( struct iphdr ) + sizeof( struct udphdr ) ) ) {
-            Log::writeLockedMessage( "DhcpClient", "message too short, ignoring", Log::LOG_DHCP, true );
-            return -2;
-        }
-
-        if ( bytes < ntohs( packet.ip.tot_len ) ) {
-            Log::writeLockedMessage( "DhcpClient", "Truncated packet", Log::LOG_DHCP, true );
-            return -2;
-        }
-
-        /* ignore any extra garbage bytes */
-        bytes = ntohs( packet.ip.tot_len );
-
-        /* Make sure its the right packet for us, and that it passes sanity checks */
-        if ( packet.ip.protocol != IPPROTO_UDP || packet.ip.version != IPVERSION ||
-                packet.ip.ihl != sizeof( packet.ip ) >> 2 || packet.udp.dest != htons( CLIENT_PORT ) ||
-                bytes > ( int ) sizeof( struct UdpDhcpPacket ) ||
-                ntohs( packet.udp.len ) != ( short ) ( bytes - sizeof( packet.ip ) ) ) {
-
-            return -2;
-        }
-
-        /* check IP checksum */
-        check = packet.ip.check;
-        packet.ip.check = 0;
-        if ( check != checksum( &( packet.ip ), sizeof( packet.ip ) ) ) {
-            Log::writeLockedMessage( "DhcpClient", "ubad IP header checksum, ignoring", Log::LOG_DHCP, true );
-            return -1;
-        }
-
-        /* verify the UDP checksum by replacing the header with a psuedo header */
-        source = packet.ip.saddr;
-        dest = packet.ip.daddr;
-        check = packet.udp.check;
-        packet.udp.check = 0;
-        memset( &packet.ip, 0, sizeof( packet.ip ) );
-
-        packet.ip.protocol = IPPROTO_UDP;
-        packet.ip.saddr = source;
-        packet.ip.daddr = dest;
-        packet.ip.tot_len = packet.udp.len; /* cheat on the psuedo-header */
-        if ( check && check != checksum( &packet, bytes ) ) {
-            Log::writeLockedMessage( "DhcpClient", "packet with bad UDP checksum received, ignoring", Log::LOG_DHCP, true );
-            return -2;
-        }
-
-        memcpy( payload, &( packet.data ), bytes - ( sizeof( packet.ip ) + sizeof( packet.udp ) ) );
-
-        if ( ntohl( payload->cookie ) != DHCP_MAGIC ) {
-            Log::writeLockedMessage( "DhcpClient", "received bogus message (bad magic) -- ignoring", Log::LOG_DHCP, true );
-            return -2;
-        }
-
-        return bytes - ( sizeof( packet.ip ) + sizeof( packet.udp ) );
-    }
-
     /* Broadcasts a DHCP request message */
 
-    int32_t DhcpClient::sendSelecting( uint64_t xid, uint8_t *server, uint8_t* requested ) {
+    void DhcpClient::sendSelecting( uint32_t xid, uint8_t *server, uint8_t* requested ) {
         struct DhcpMessage packet;
-        struct in_addr addr;
 
         initPacket( &packet, DHCPREQUEST );
         packet.xid = xid;
@@ -475,9 +305,8 @@ namespace openikev2 {
         addSimpleOption( packet.options, DHCP_SERVER_ID, iserver );
 
         addRequests( &packet );
-        addr.s_addr = irequested;
 
-        return this->sendRawPacket( packet );
+        DhcpEngine::getInstance().sendMessage( this->dhcp_ifindex, packet );
     }
 
 
@@ -505,11 +334,13 @@ namespace openikev2 {
         client_id_buffer->writeByteArray( *ike_sa.peer_id->id_data );
         this->clientid = client_id_buffer;
 
-        RandomOpenSSL random;
-        this->xid = random.getRandomInt64( 0, 0xFFFFFFFF );
-
-        this->alarm.reset( new Alarm( *this, 1 ) );
-        AlarmController::addAlarm( *this->alarm );
+        this->xid = 0;
+        this->state = DHCP_STATE_INIT;
+        this->retries = 0;
+        this->next_timeout = 0;
+        this->renewal_time = 0;
+        this->subnet = 0;
+        this->semaphore_lease = ThreadController::getSemaphore( 0 );
 
         EventBus::getInstance().registerBusObserver( *this, BusEventIkeSa::IKE_SA_EVENT );
     }
@@ -517,218 +348,183 @@ namespace openikev2 {
 
     DhcpClient::~DhcpClient() {
         EventBus::getInstance().removeBusObserver( *this );
-        AlarmController::removeAlarm( *this->alarm );
+        if ( this->state != DHCP_STATE_INIT )
+            DhcpEngine::getInstance().removeClient( *this );
     }
 
     auto_ptr<IpAddress> DhcpClient::requestAddress(uint32_t &netmask) {
-        if ( !this->performDiscover() ) {
-	    netmask = 0;
+        DhcpEngine& dhcp_engine = DhcpEngine::getInstance();
+
+        // The DHCP exchange is performed by the engine thread
+        dhcp_engine.addClient( *this );
+        this->semaphore_lease->wait();
+
+        if ( this->state != DHCP_STATE_BOUND ) {
+            dhcp_engine.removeClient( *this );
+            this->state = DHCP_STATE_INIT;
+            netmask = 0;
             return auto_ptr<IpAddress> ( NULL );
         }
 
-        return this->performRequest(netmask);
+        netmask = this->subnet;
+        return this->last_assigned_address->clone();
     }
 
-    auto_ptr<Attribute> DhcpClient::cloneAttribute( ) const{
-        assert( 0 );
-    }
+    void DhcpClient::start( uint64_t now ) {
+        this->state = DHCP_STATE_SELECTING;
+        this->retries = this->dhcp_retries;
 
-    void DhcpClient::notifyAlarm( Alarm& alarm ) {
-        uint32_t subnet;
-
-	auto_ptr<IpAddress> rv = this->performRequest(subnet);
-
-        if ( rv.get() == NULL )
-            IkeSaController::pushCommandByIkeSaSpi( this->spi, auto_ptr<Command> ( new SendDeleteIkeSaReqCommand() ), true );
+        Log::writeLockedMessage( "DhcpClient", "Sending DHCP_DISCOVER..", Log::LOG_DHCP, true );
+        this->sendStateMessage( now );
     }
 
-    void DhcpClient::notifyBusEvent( const BusEvent & event ) {
-        if ( event.type == BusEvent::IKE_SA_EVENT ) {
-            BusEventIkeSa & busevent = ( BusEventIkeSa& ) event;
+    void DhcpClient::sendStateMessage( uint64_t now ) {
+        this->next_timeout = now + this->dhcp_timeout * 1000;
 
-            if ( busevent.ike_sa.my_spi != this->spi )
-                return ;
-
-            if ( busevent.ike_sa_event_type == BusEventIkeSa::IKE_SA_REKEYED ) {
-                this->spi = ( ( IkeSa* ) busevent.data ) ->my_spi;
-            }
-        }
+        if ( this->state == DHCP_STATE_SELECTING )
+            this->sendDhcpDiscover( this->xid, 0 );
+        else
+            this->sendSelecting( this->xid, this->dhcp_server_ip->getBytes()->getRawPointer(), this->last_assigned_address->getBytes()->getRawPointer() );
     }
 
-    string DhcpClient::toStringTab( uint8_t tabs ) const {
-        return "DHCP_CLIENT";
+    void DhcpClient::finishRequest( DHCP_STATE new_state ) {
+        this->state = new_state;
+        this->semaphore_lease->post();
     }
 
-    bool DhcpClient::performDiscover() {
-        DhcpMessage packet;
-        uint8_t *message;
-        fd_set fdset;
-        timeval timeout;
-
-        int32_t fd = this->createRawSocket( );
-
-        FD_ZERO( &fdset );
-        FD_SET( fd, &fdset );
-
-        int32_t retries = this->dhcp_retries;
-        int32_t timeout_sec = this->dhcp_timeout;
+    bool DhcpClient::processDhcpMessage( DhcpMessage& packet, uint64_t now ) {
+        uint8_t* message = this->getOption( &packet, DHCP_MESSAGE_TYPE );
+        if ( message == NULL )
+            return false;
 
-        bool step_ok = false;
+        if ( this->state == DHCP_STATE_SELECTING && *message == DHCPOFFER ) {
+            uint8_t* temp = getOption( &packet, DHCP_SERVER_ID );
+            if ( temp == NULL ) {
+                Log::writeLockedMessage( "DhcpClient", "No server ID in message", Log::LOG_DHCP, true );
+                return false;
+            }
 
-        // send DISCOVER and receive OFFER
-        Log::writeLockedMessage( "DhcpClient", "Sending DHCP_DISCOVER..", Log::LOG_DHCP, true );
-        while ( !step_ok ) {
-            timeout.tv_sec = timeout_sec;
-            timeout.tv_usec = 0;
-
-            // Sends discover
-            this->sendDhcpDiscover( xid, 0 );
-
-            while ( true ) {
-                FD_ZERO( &fdset );
-                FD_SET( fd, &fdset );
-                int32_t rv = select( FD_SETSIZE, &fdset, NULL, NULL, &timeout );
-
-                // If timeout
-                if ( rv == 0 ) {
-                    retries--;
-
-                    if ( retries < 0 ) {
-                        Log::writeLockedMessage( "DhcpClient", "Timeout in DHCP_DISCOVER. Is there any active DHCP server?", Log::LOG_DHCP, true );
-                        close( fd );
-                        return false;
-                    }
-                    Log::writeLockedMessage( "DhcpClient", "Retransmitting DHCP_DISCOVER..", Log::LOG_DHCP, true );
-                    break;
-                }
+            if ( dhcp_server_ip.get() != NULL && memcmp( temp, dhcp_server_ip->getBytes()->getRawPointer(), 4 ) != 0 ) {
+                Log::writeLockedMessage( "DhcpClient", "Received DHCPOFFER from a not desired server. Omitting", Log::LOG_DHCP, true );
+                return false;
+            }
 
-                rv = this->getRawPacket( &packet, fd );
+            this->last_assigned_address.reset( new IpAddressOpenIKE( Enums::ADDR_IPV4, auto_ptr<ByteArray> ( new ByteArray( &packet.yiaddr, 4) ) ) );
+            if ( this->dhcp_server_ip.get() == NULL )
+                this->dhcp_server_ip.reset ( new IpAddressOpenIKE( Enums::ADDR_IPV4, auto_ptr<ByteArray> ( new ByteArray( temp, 4 ) ) ) );
 
-                if ( rv < 0 || packet.xid != xid ) {
-                    continue;
-                }
-
-                message = this->getOption( &packet, DHCP_MESSAGE_TYPE );
-                if ( *message == DHCPOFFER ) {
-                    uint8_t * temp;
-                    if ( ( temp = getOption( &packet, DHCP_SERVER_ID ) ) ) {
-                        if ( dhcp_server_ip.get() != NULL && memcmp( temp, dhcp_server_ip->getBytes()->getRawPointer(), 4 ) != 0 ) {
-                            Log::writeLockedMessage( "DhcpClient", "Received DHCPOFFER from a not desired server. Omitting", Log::LOG_DHCP, true );
-                            continue;
-                        }
-
-                        this->last_assigned_address.reset( new IpAddressOpenIKE( Enums::ADDR_IPV4, auto_ptr<ByteArray> ( new ByteArray( &packet.yiaddr, 4) ) ) );
-                        if ( this->dhcp_server_ip.get() == NULL )
-                            this->dhcp_server_ip.reset ( new IpAddressOpenIKE( Enums::ADDR_IPV4, auto_ptr<ByteArray> ( new ByteArray( temp, 4 ) ) ) );
-
-                        step_ok = true;
-                        break;
-                    } else {
-                        Log::writeLockedMessage( "DhcpClient", "No server ID in message", Log::LOG_DHCP, true );
-                        continue;
-                    }
+            // send DHCP_REQUEST and wait for ACK
+            Log::writeLockedMessage( "DhcpClient", "Sending DHCP_REQUEST..", Log::LOG_DHCP, true );
+            this->state = DHCP_STATE_REQUESTING;
+            this->retries = this->dhcp_retries;
+            this->sendStateMessage( now );
+            return false;
+        }
 
+        if ( this->state != DHCP_STATE_REQUESTING && this->state != DHCP_STATE_RENEWING )
+            return false;
 
-                } else {
-                    continue;
-                }
+        if ( *message == DHCPNAK ) {
+            Log::writeLockedMessage( "DhcpClient", "Received DHCPNAK", Log::LOG_DHCP, true );
+            if ( this->state == DHCP_STATE_RENEWING ) {
+                this->state = DHCP_STATE_FAILED;
+                return true;
             }
+            this->finishRequest( DHCP_STATE_FAILED );
+            return false;
         }
 
-        close( fd );
-        return true;
-    }
-
-    auto_ptr<IpAddress> DhcpClient::performRequest(uint32_t& subnet) {
-        DhcpMessage packet;
-        uint8_t *message;
-        fd_set fdset;
-        timeval timeout;
+        if ( *message != DHCPACK )
+            return false;
 
-        int32_t fd = this->createRawSocket();
+        uint8_t* temp;
+        if ( ( temp = getOption( &packet, DHCP_LEASE_TIME ) ) ) {
+            uint32_t lease_time;
+            memcpy( &lease_time, temp, 4 );
+            lease_time = ntohl( lease_time );
 
-        FD_ZERO( &fdset );
-        FD_SET( fd, &fdset );
-
-        int32_t retries = this->dhcp_retries;
-        int32_t timeout_sec = this->dhcp_timeout;
-
-        bool step_ok = false;
-
-        retries = this->dhcp_retries;
+            if ( lease_time < 10 ) {
+                Log::writeLockedMessage( "DhcpClient", "DHCP: Lease time is too small. Omitting", Log::LOG_DHCP, true );
+                return false;
+            }
 
-        // send DHCP_REQUEST and receive ACK
-        Log::writeLockedMessage( "DhcpClient", "Sending DHCP_REQUEST..", Log::LOG_DHCP, true );
-        while ( !step_ok ) {
-            timeout.tv_sec = timeout_sec;
-            timeout.tv_usec = 0;
+            Log::writeLockedMessage( "DhcpClient", "DHCP lease will be valid for " + intToString( lease_time ) + " seconds. Renew in " + intToString( lease_time - 10 ) + " seconds", Log::LOG_DHCP, true );
+            this->renewal_time = now + ( uint64_t ) ( lease_time - 10 ) * 1000;
+        }
+        else {
+            this->renewal_time = 0;
+        }
 
-            // Sends discover
-            this->sendSelecting( xid, this->dhcp_server_ip->getBytes()->getRawPointer(), this->last_assigned_address->getBytes()->getRawPointer() );
+        if ( ( temp = getOption( &packet, DHCP_SUBNET ) ) )
+            memcpy( &this->subnet, temp, 4 );
+        else
+            this->subnet = 0;
 
-            while ( true ) {
-                FD_ZERO( &fdset );
-                FD_SET( fd, &fdset );
-                int32_t rv = select( FD_SETSIZE, &fdset, NULL, NULL, &timeout );
+        this->last_assigned_address.reset( new IpAddressOpenIKE( Enums::ADDR_IPV4, auto_ptr<ByteArray> ( new ByteArray( &packet.yiaddr, 4) ) ) );
 
-                // If timeout
-                if ( rv == 0 ) {
-                    retries--;
+        if ( this->state == DHCP_STATE_REQUESTING )
+            this->finishRequest( DHCP_STATE_BOUND );
+        else
+            this->state = DHCP_STATE_BOUND;
 
-                    if ( retries < 0 ) {
-                        Log::writeLockedMessage( "DhcpClient", "Timeout in DHCP_REQUEST", Log::LOG_DHCP, true );
-                        return auto_ptr<IpAddress> ( NULL );
-                    }
-                    Log::writeLockedMessage( "DhcpClient", "Retransmitting DHCP_REQUEST..", Log::LOG_DHCP, true );
-                    break;
-                }
+        return false;
+    }
 
-                rv = this->getRawPacket( &packet, fd );
+    bool DhcpClient::checkTimeout( uint64_t now ) {
+        if ( this->state == DHCP_STATE_BOUND ) {
+            if ( this->renewal_time == 0 || now < this->renewal_time )
+                return false;
 
-                if ( rv < 0 || packet.xid != xid ) {
-                    continue;
-                }
-
-                message = getOption( &packet, DHCP_MESSAGE_TYPE );
-                if ( *message == DHCPACK ) {
-                    auto_ptr<IpAddress> result_addr ( new IpAddressOpenIKE( Enums::ADDR_IPV4, auto_ptr<ByteArray> ( new ByteArray( & packet.yiaddr, 4) ) ) );
+            Log::writeLockedMessage( "DhcpClient", "Renewing DHCP lease..", Log::LOG_DHCP, true );
+            this->state = DHCP_STATE_RENEWING;
+            this->retries = this->dhcp_retries;
+            this->sendStateMessage( now );
+            return false;
+        }
 
-                    uint8_t* temp;
-                    if ( temp = getOption( &packet, DHCP_LEASE_TIME ) ) {
-                        uint32_t lease_time;
-                        memcpy( &lease_time, temp, 4 );
-                        lease_time = ntohl( lease_time );
+        if ( ( this->state != DHCP_STATE_SELECTING && this->state != DHCP_STATE_REQUESTING && this->state != DHCP_STATE_RENEWING ) || now < this->next_timeout )
+            return false;
 
-                        if ( lease_time < 10 ) {
-                            Log::writeLockedMessage( "DhcpClient", "DHCP: Lease time is too small. Omitting", Log::LOG_DHCP, true );
-                            continue;
-                        }
+        if ( --this->retries < 0 ) {
+            if ( this->state == DHCP_STATE_SELECTING )
+                Log::writeLockedMessage( "DhcpClient", "Timeout in DHCP_DISCOVER. Is there any active DHCP server?", Log::LOG_DHCP, true );
+            else
+                Log::writeLockedMessage( "DhcpClient", "Timeout in DHCP_REQUEST", Log::LOG_DHCP, true );
 
-                        Log::writeLockedMessage( "DhcpClient", "DHCP lease will be valid for " + intToString( lease_time ) + " seconds. Renew in " + intToString( lease_time - 10 ) + " seconds", Log::LOG_DHCP, true );
+            // A lease that cannot be renewed is lost
+            if ( this->state == DHCP_STATE_RENEWING ) {
+                this->state = DHCP_STATE_FAILED;
+                return true;
+            }
 
-                        this->alarm->setTime( ( lease_time - 10 ) * 1000 );
+            this->finishRequest( DHCP_STATE_FAILED );
+            return false;
+        }
 
-                        this->alarm->reset();
-                    }
+        Log::writeLockedMessage( "DhcpClient", ( this->state == DHCP_STATE_SELECTING ) ? "Retransmitting DHCP_DISCOVER.." : "Retransmitting DHCP_REQUEST..", Log::LOG_DHCP, true );
+        this->sendStateMessage( now );
+        return false;
+    }
 
-                    if ( temp = getOption( &packet, DHCP_SUBNET ) ) {
-                        uint32_t netmask;
-                        memcpy( &netmask, temp, 4 );
-                        subnet = netmask;
-                    }
-                    else {
-                        subnet = 0;
-                    }
+    auto_ptr<Attribute> DhcpClient::cloneAttribute( ) const{
+        assert( 0 );
+    }
 
+    void DhcpClient::notifyBusEvent( const BusEvent & event ) {
+        if ( event.type == BusEvent::IKE_SA_EVENT ) {
+            BusEventIkeSa & busevent = ( BusEventIkeSa& ) event;
 
-                    return result_addr;
-                } else {
-                    continue;
-                }
+            if ( busevent.ike_sa.my_spi != this->spi )
+                return ;
 
+            if ( busevent.ike_sa_event_type == BusEventIkeSa::IKE_SA_REKEYED ) {
+                this->spi = ( ( IkeSa* ) busevent.data ) ->my_spi;
             }
         }
+    }
 
-        return auto_ptr<IpAddress> ( NULL );
+    string DhcpClient::toStringTab( uint8_t tabs ) const {
+        return "DHCP_CLIENT";
     }
+
 }
@@ -113,7 +113,7 @@ enum {
 #include <libopenikev2/childsaconfiguration.h>
 #include <libopenikev2/attribute.h>
 #include <libopenikev2/busobserver.h>
-#include <libopenikev2/alarmable.h>
+#include <libopenikev2/semaphore.h>
 #include <libopenikev2/buseventikesa.h>
 #include <libopenikev2/id.h>
 
@@ -122,13 +122,28 @@ using namespace std;
 
 namespace openikev2 {
 
+    class DhcpEngine;
+
     /**
         This class implements a DHCP client to be used with the address configuration mechanims.
+        The client is a state machine driven by the shared DhcpEngine, which sends and receives its messages and handles its
+        retransmissions and lease renewals. The client methods invoked by the engine are called with the engine mutex locked.
         @author Pedro J. Fernandez Ruiz, Alejandro Perez Mendez <pedroj@um.es, alex@um.es>
     */
-    class DhcpClient: public Attribute, public BusObserver, public Alarmable {
+    class DhcpClient: public Attribute, public BusObserver {
+            friend class DhcpEngine;
 
-        // TODO: Escribir el cliente nosotros mismos. Ahora mismo está casi bien, usando auto punteros, pero el código es lioso
+            /****************************** ENUMS ******************************/
+        protected:
+            /** Client states (RFC 2131 section 4.4) */
+            enum DHCP_STATE {
+                DHCP_STATE_INIT,            /**< Not started */
+                DHCP_STATE_SELECTING,       /**< DHCPDISCOVER sent, waiting for DHCPOFFER */
+                DHCP_STATE_REQUESTING,      /**< DHCPREQUEST sent, waiting for DHCPACK */
+                DHCP_STATE_BOUND,           /**< Lease obtained */
+                DHCP_STATE_RENEWING,        /**< DHCPREQUEST sent to renew the lease, waiting for DHCPACK */
+                DHCP_STATE_FAILED           /**< Lease not obtained */
+            };
 
             /****************************** STRUCTS ******************************/
         protected:
@@ -164,29 +179,27 @@ namespace openikev2 {
             uint64_t spi;                                   /**< SPI value of the IKE_SA */
             auto_ptr<IpAddress> last_assigned_address;      /**< Last assigned address */
             auto_ptr<IpAddress> dhcp_server_ip;             /**< DHCP server IP */
-            auto_ptr<Alarm> alarm;                          /**< Alarm to control expires */
             uint8_t mac_addr[ 6 ];                          /**< MAC address */
             auto_ptr<ByteArray> clientid;                   /**< Optional client id to use */
             int32_t dhcp_ifindex;                           /**< Interface index */
             int32_t dhcp_retries;                           /**< DHCP max retries */
             int32_t dhcp_timeout;                           /**< DHCP timeout */
-            uint64_t xid;                                   /**< DHCP message id */
+            uint32_t xid;                                   /**< DHCP message id, assigned by the DhcpEngine */
+            DHCP_STATE state;                               /**< Current state */
+            int32_t retries;                                /**< Remaining retransmissions in the current state */
+            uint64_t next_timeout;                          /**< Monotonic time (in milliseconds) of the next retransmission */
+            uint64_t renewal_time;                          /**< Monotonic time (in milliseconds) of the lease renewal. 0 if none */
+            uint32_t subnet;                                /**< Subnet mask of the lease */
+            auto_ptr<Semaphore> semaphore_lease;            /**< Posted when the address request finishes */
 
             /****************************** METHODS ******************************/
         protected:
-            /**
-             * Creates a new RAW socket on the interface
-             * @return The socket file descriptor
-             */
-            virtual int32_t createRawSocket( );
-
             /**
              * Sends a DHCP discover throw the selected interface
              * @param xid Random number identificating the message
              * @param requested Requested address
-             * @return -1 on fail. >0 Otherwise
              */
-            virtual int32_t sendDhcpDiscover( uint64_t xid, uint32_t requested );
+            virtual void sendDhcpDiscover( uint32_t xid, uint32_t requested );
 
             /**
              * Initiates the packet
@@ -232,25 +245,6 @@ namespace openikev2 {
              */
             virtual void addRequests( DhcpMessage *packet );
 
-            /**
-             * Generates the UDP raw packet and sends it throw the indicated interface
-             * @param payload DHCP message
-             * @param source_ip Source IP + port
-             * @param dest_ip Destination IP + port
-             * @param dest_arp Destination MAC
-             * @param ifindex Interface identifier
-             * @return -1 on fail. >0 otherwise
-             */
-            virtual int32_t sendRawPacket( DhcpMessage &payload );
-
-            /**
-             * Calculates the checksum
-             * @param addr IP address
-             * @param count Count
-             * @return -1 on fail. >0 otherwise
-             */
-            virtual uint16_t checksum( void *addr, int32_t count );
-
             /**
              * Reads the MAC address of the interface
              * @param interface Interface name
@@ -259,14 +253,6 @@ namespace openikev2 {
              */
             virtual int32_t readMac( string interface, uint8_t *macaddr );
 
-            /**
-             * Get a raw packet from the network
-             * @param payload DHCP message
-             * @param fd Socket where listen
-             * @return -1 on fail. >0 otherwise
-             */
-            virtual int32_t getRawPacket( DhcpMessage *payload, int32_t fd );
-
             /**
              * Get an option from the DHCP message
              * @param packet DHCP message
@@ -280,13 +266,41 @@ namespace openikev2 {
              * @param xid Message identificator
              * @param server Server address
              * @param requested Requested address
-             * @return
              */
-            virtual int32_t sendSelecting( uint64_t xid, uint8_t *server, uint8_t* requested );
+            virtual void sendSelecting( uint32_t xid, uint8_t *server, uint8_t* requested );
 
-            virtual bool performDiscover();
+            /**
+             * Sends the message of the current state and schedules its retransmission
+             * @param now Current monotonic time (in milliseconds)
+             */
+            virtual void sendStateMessage( uint64_t now );
 
-            virtual auto_ptr<IpAddress> performRequest(uint32_t& subnet);
+            /**
+             * Finishes the address request, waking up the thread waiting in requestAddress()
+             * @param new_state DHCP_STATE_BOUND or DHCP_STATE_FAILED
+             */
+            virtual void finishRequest( DHCP_STATE new_state );
+
+            /**
+             * Starts the address request. Called by the DhcpEngine when the client is registered
+             * @param now Current monotonic time (in milliseconds)
+             */
+            virtual void start( uint64_t now );
+
+            /**
+             * Processes a DHCP message with the transaction ID of this client. Called by the DhcpEngine
+             * @param packet DHCP message
+             * @param now Current monotonic time (in milliseconds)
+             * @return TRUE if the lease has been lost and the IKE_SA must be deleted. FALSE otherwise
+             */
+            virtual bool processDhcpMessage( DhcpMessage& packet, uint64_t now );
+
+            /**
+             * Checks the retransmission and renewal deadlines. Called periodically by the DhcpEngine
+             * @param now Current monotonic time (in milliseconds)
+             * @return TRUE if the lease has been lost and the IKE_SA must be deleted. FALSE otherwise
+             */
+            virtual bool checkTimeout( uint64_t now );
 
         public:
 
@@ -298,14 +312,12 @@ namespace openikev2 {
             DhcpClient( IkeSa& ike_sa );
 
             /**
-             * Request and address via DHCP
+             * Request and address via DHCP. The DHCP exchange is performed by the DhcpEngine; the calling thread only waits for its end.
+             * If the address is obtained, the lease is renewed by the DhcpEngine while this object exists
              * @return The assigned IpAddress or NULL if something fails
              */
             virtual auto_ptr<IpAddress> requestAddress(uint32_t& netmask);
 
-
-            virtual void notifyAlarm( Alarm & alarm );
-
             virtual void notifyBusEvent( const BusEvent& event );
 
             virtual auto_ptr<Attribute> cloneAttribute() const;
@@ -0,0 +1,359 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#include "dhcpengine.h"
+#include "randomopenssl.h"
+
+#include <libopenikev2/threadcontroller.h>
+#include <libopenikev2/autolock.h>
+#include <libopenikev2/log.h>
+#include <libopenikev2/exception.h>
+#include <libopenikev2/utils.h>
+#include <libopenikev2/ikesacontroller.h>
+#include <libopenikev2/senddeleteikesareqcommand.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netpacket/packet.h>
+#include <net/ethernet.h>
+#include <linux/filter.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <string.h>
+
+/* Time between two checks of the retransmission and renewal deadlines (in milliseconds) */
+#define DHCP_TICK 100
+
+namespace openikev2 {
+    DhcpEngine* DhcpEngine::instance = NULL;
+    MutexPosix DhcpEngine::mutex_instance;
+
+    DhcpEngine::DhcpEngine() {
+        this->mutex_clients = ThreadController::getMutex();
+    }
+
+    DhcpEngine::~DhcpEngine() {
+        for ( map<int32_t, int32_t>::iterator it = this->sockets.begin(); it != this->sockets.end(); it++ )
+            close( it->second );
+    }
+
+    DhcpEngine& DhcpEngine::getInstance( ) {
+        AutoLock auto_lock( mutex_instance );
+
+        if ( instance == NULL ) {
+            instance = new DhcpEngine();
+            instance->start();
+        }
+
+        return *instance;
+    }
+
+    uint64_t DhcpEngine::getMonotonicTime( ) {
+        struct timespec now;
+        clock_gettime( CLOCK_MONOTONIC, &now );
+        return ( uint64_t ) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    }
+
+    uint16_t DhcpEngine::checksum( void * addr, int32_t count ) {
+        /* Compute Internet Checksum for "count" bytes
+         *         beginning at location "addr".
+         */
+        register int32_t sum = 0;
+        u_int16_t *source = ( u_int16_t * ) addr;
+
+        while ( count > 1 ) {
+            /*  This is the inner loop */
+            sum += *source++;
+            count -= 2;
+        }
+
+        /*  Add left-over byte, if any */
+        if ( count > 0 ) {
+            /* Make sure that the left-over byte is added correctly both
+             * with little and big endian hosts */
+            u_int16_t tmp = 0;
+            *( unsigned char * ) ( &tmp ) = * ( unsigned char * ) source;
+            sum += tmp;
+        }
+        /*  Fold 32-bit sum to 16 bits */
+        while ( sum >> 16 )
+            sum = ( sum & 0xffff ) + ( sum >> 16 );
+
+        return ~sum;
+    }
+
+    int32_t DhcpEngine::createRawSocket( int32_t ifindex ) {
+        int32_t fd;
+        struct sockaddr_ll sock;
+
+        // Only unfragmented UDP datagrams to the DHCP client port reach the socket
+        struct sock_filter filter_code[] = {
+            BPF_STMT( BPF_LD + BPF_B + BPF_ABS, 9 ),                    // IP protocol
+            BPF_JUMP( BPF_JMP + BPF_JEQ + BPF_K, IPPROTO_UDP, 0, 6 ),
+            BPF_STMT( BPF_LD + BPF_H + BPF_ABS, 6 ),                    // IP fragment offset
+            BPF_JUMP( BPF_JMP + BPF_JSET + BPF_K, 0x1fff, 4, 0 ),
+            BPF_STMT( BPF_LDX + BPF_B + BPF_MSH, 0 ),                   // IP header length
+            BPF_STMT( BPF_LD + BPF_H + BPF_IND, 2 ),                    // UDP destination port
+            BPF_JUMP( BPF_JMP + BPF_JEQ + BPF_K, CLIENT_PORT, 0, 1 ),
+            BPF_STMT( BPF_RET + BPF_K, 0xffff ),
+            BPF_STMT( BPF_RET + BPF_K, 0 ),
+        };
+        struct sock_fprog filter;
+        filter.len = sizeof( filter_code ) / sizeof( filter_code[ 0 ] );
+        filter.filter = filter_code;
+
+        memset( &sock, 0, sizeof( sockaddr_ll ) );
+
+        if ( ( fd = socket( PF_PACKET, SOCK_DGRAM, htons( ETH_P_IP ) ) ) < 0 )
+            throw NetworkException ( "DhcpEngine: socket call failed" );
+
+        if ( setsockopt( fd, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof( filter ) ) < 0 )
+            Log::writeLockedMessage( "DhcpEngine", "Cannot attach the DHCP socket filter: " + string( strerror( errno ) ), Log::LOG_WARN, true );
+
+        sock.sll_family = AF_PACKET;
+        sock.sll_protocol = htons( ETH_P_IP );
+        sock.sll_ifindex = ifindex;
+
+        if ( bind( fd, ( struct sockaddr * ) & sock, sizeof( sock ) ) < 0 ) {
+            close( fd );
+            throw NetworkException( "DhcpEngine: bind call failed" );
+        }
+
+        fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+
+        return fd;
+    }
+
+    int32_t DhcpEngine::getSocket( int32_t ifindex ) {
+        map<int32_t, int32_t>::iterator it = this->sockets.find( ifindex );
+        if ( it != this->sockets.end() )
+            return it->second;
+
+        int32_t fd = createRawSocket( ifindex );
+        this->sockets[ ifindex ] = fd;
+        return fd;
+    }
+
+    void DhcpEngine::addClient( DhcpClient & client ) {
+        RandomOpenSSL random;
+
+        AutoLock auto_lock( *this->mutex_clients );
+
+        // Each client has its own transaction ID
+        uint32_t xid;
+        do {
+            xid = random.getRandomInt64( 0, 0xFFFFFFFF );
+        }
+        while ( xid == 0 || this->clients.count( xid ) );
+
+        client.xid = xid;
+        this->clients[ xid ] = &client;
+
+        // The client enters DHCP_STATE_SELECTING and arms its retransmission timer before sending, so a failed send
+        // (i.e. the socket cannot be created) is retried, and the request fails when the retries are exhausted
+        try {
+            client.start( getMonotonicTime() );
+        }
+        catch ( exception & ex ) {
+            Log::writeLockedMessage( "DhcpEngine", ex.what(), Log::LOG_ERRO, true );
+        }
+    }
+
+    void DhcpEngine::removeClient( DhcpClient & client ) {
+        AutoLock auto_lock( *this->mutex_clients );
+
+        map<uint32_t, DhcpClient*>::iterator it = this->clients.find( client.xid );
+        if ( it != this->clients.end() && it->second == &client )
+            this->clients.erase( it );
+    }
+
+    void DhcpEngine::sendMessage( int32_t ifindex, const DhcpClient::DhcpMessage & dhcp_message ) {
+        struct sockaddr_ll dest;
+        struct DhcpClient::UdpDhcpPacket packet;
+        memset( &dest, 0, sizeof( dest ) );
+        memset( &packet, 0, sizeof( packet ) );
+
+        int32_t fd = this->getSocket( ifindex );
+
+        dest.sll_family = AF_PACKET;
+        dest.sll_protocol = htons( ETH_P_IP );
+        dest.sll_ifindex = ifindex;
+        dest.sll_halen = 6;
+        memset( dest.sll_addr, 0xFF, 6 );   // broadcast mac address
+
+        packet.ip.protocol = IPPROTO_UDP;
+        memset( &packet.ip.saddr, 0, 4 );
+        memset( &packet.ip.daddr, 0xFF, 4 );
+        packet.udp.source = htons( CLIENT_PORT );
+        packet.udp.dest = htons( SERVER_PORT );
+        packet.udp.len = htons( sizeof( packet.udp ) + sizeof( struct DhcpClient::DhcpMessage ) ); /* cheat on the psuedo-header */
+        packet.ip.tot_len = packet.udp.len;
+        memcpy( &( packet.data ), &dhcp_message, sizeof( struct DhcpClient::DhcpMessage ) );
+        packet.udp.check = checksum( &packet, sizeof( struct DhcpClient::UdpDhcpPacket ) );
+
+        packet.ip.tot_len = htons( sizeof( struct DhcpClient::UdpDhcpPacket ) );
+        packet.ip.ihl = sizeof( packet.ip ) >> 2;
+        packet.ip.version = IPVERSION;
+        packet.ip.ttl = IPDEFTTL;
+        packet.ip.check = checksum( &( packet.ip ), sizeof( packet.ip ) );
+
+        if ( sendto( fd, &packet, sizeof( struct DhcpClient::UdpDhcpPacket ), 0, ( struct sockaddr * ) & dest, sizeof( dest ) ) <= 0 )
+            throw NetworkException( "DhcpEngine: write on socket failed" );
+    }
+
+    void DhcpEngine::receiveMessages( int32_t fd ) {
+        vector<uint64_t> lost_leases;
+
+        while ( true ) {
+            struct DhcpClient::UdpDhcpPacket packet;
+            u_int32_t source, dest;
+            u_int16_t check;
+
+            memset( &packet, 0, sizeof( struct DhcpClient::UdpDhcpPacket ) );
+            int bytes = recv( fd, &packet, sizeof( struct DhcpClient::UdpDhcpPacket ), MSG_DONTWAIT );
+            if ( bytes < 0 ) {
+                if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+                    Log::writeLockedMessage( "DhcpEngine", "couldn't read on raw listening socket -- ignoring", Log::LOG_DHCP, true );
+                break;
+            }
+
+            if ( bytes < ( int ) ( sizeof( struct iphdr ) + sizeof( struct udphdr ) ) ) {
+                Log::writeLockedMessage( "DhcpEngine", "message too short, ignoring", Log::LOG_DHCP, true );
+                continue;
+            }
+
+            if ( bytes < ntohs( packet.ip.tot_len ) ) {
+                Log::writeLockedMessage( "DhcpEngine", "Truncated packet", Log::LOG_DHCP, true );
+                continue;
+            }
+
+            /* ignore any extra garbage bytes */
+            bytes = ntohs( packet.ip.tot_len );
+
+            /* Make sure its the right packet for us, and that it passes sanity checks */
+            if ( packet.ip.protocol != IPPROTO_UDP || packet.ip.version != IPVERSION ||
+                    packet.ip.ihl != sizeof( packet.ip ) >> 2 || packet.udp.dest != htons( CLIENT_PORT ) ||
+                    bytes > ( int ) sizeof( struct DhcpClient::UdpDhcpPacket ) ||
+                    ntohs( packet.udp.len ) != ( short ) ( bytes - sizeof( packet.ip ) ) ) {
+                continue;
+            }
+
+            /* check IP checksum */
+            check = packet.ip.check;
+            packet.ip.check = 0;
+            if ( check != checksum( &( packet.ip ), sizeof( packet.ip ) ) ) {
+                Log::writeLockedMessage( "DhcpEngine", "bad IP header checksum, ignoring", Log::LOG_DHCP, true );
+                continue;
+            }
+
+            /* verify the UDP checksum by replacing the header with a psuedo header */
+            source = packet.ip.saddr;
+            dest = packet.ip.daddr;
+            check = packet.udp.check;
+            packet.udp.check = 0;
+            memset( &packet.ip, 0, sizeof( packet.ip ) );
+
+            packet.ip.protocol = IPPROTO_UDP;
+            packet.ip.saddr = source;
+            packet.ip.daddr = dest;
+            packet.ip.tot_len = packet.udp.len; /* cheat on the psuedo-header */
+            if ( check && check != checksum( &packet, bytes ) ) {
+                Log::writeLockedMessage( "DhcpEngine", "packet with bad UDP checksum received, ignoring", Log::LOG_DHCP, true );
+                continue;
+            }
+
+            if ( ntohl( packet.data.cookie ) != DHCP_MAGIC ) {
+                Log::writeLockedMessage( "DhcpEngine", "received bogus message (bad magic) -- ignoring", Log::LOG_DHCP, true );
+                continue;
+            }
+
+            // Dispatches the message to its client
+            AutoLock auto_lock( *this->mutex_clients );
+            map<uint32_t, DhcpClient*>::iterator it = this->clients.find( packet.data.xid );
+            if ( it == this->clients.end() )
+                continue;
+
+            try {
+                if ( it->second->processDhcpMessage( packet.data, getMonotonicTime() ) )
+                    lost_leases.push_back( it->second->spi );
+            }
+            catch ( exception & ex ) {
+                Log::writeLockedMessage( "DhcpEngine", ex.what(), Log::LOG_ERRO, true );
+            }
+        }
+
+        deleteIkeSas( lost_leases );
+    }
+
+    void DhcpEngine::checkTimeouts( ) {
+        vector<uint64_t> lost_leases;
+        {
+            AutoLock auto_lock( *this->mutex_clients );
+            uint64_t now = getMonotonicTime();
+
+            for ( map<uint32_t, DhcpClient*>::iterator it = this->clients.begin(); it != this->clients.end(); it++ ) {
+                try {
+                    if ( it->second->checkTimeout( now ) )
+                        lost_leases.push_back( it->second->spi );
+                }
+                catch ( exception & ex ) {
+                    Log::writeLockedMessage( "DhcpEngine", ex.what(), Log::LOG_ERRO, true );
+                }
+            }
+        }
+
+        deleteIkeSas( lost_leases );
+    }
+
+    void DhcpEngine::deleteIkeSas( const vector<uint64_t>& spis ) {
+        // The commands are pushed without holding the clients mutex, since the IKE SA destruction removes its client
+        for ( vector<uint64_t>::const_iterator it = spis.begin(); it != spis.end(); it++ )
+            IkeSaController::pushCommandByIkeSaSpi( *it, auto_ptr<Command> ( new SendDeleteIkeSaReqCommand() ), true );
+    }
+
+    void DhcpEngine::run( ) {
+        Log::writeLockedMessage( "DhcpEngine", "Start: Thread ID=[" + intToString( thread_id ) + "]", Log::LOG_THRD, true );
+
+        uint64_t next_tick = getMonotonicTime() + DHCP_TICK;
+
+        while ( true ) {
+            vector<pollfd> fds;
+            {
+                AutoLock auto_lock( *this->mutex_clients );
+                for ( map<int32_t, int32_t>::iterator it = this->sockets.begin(); it != this->sockets.end(); it++ ) {
+                    pollfd fd;
+                    fd.fd = it->second;
+                    fd.events = POLLIN;
+                    fd.revents = 0;
+                    fds.push_back( fd );
+                }
+            }
+
+            uint64_t now = getMonotonicTime();
+            int32_t wait_time = ( next_tick > now ) ? next_tick - now : 0;
+
+            if ( fds.empty() )
+                usleep( wait_time * 1000 );
+            else if ( poll( &fds[ 0 ], fds.size(), wait_time ) > 0 ) {
+                for ( vector<pollfd>::iterator it = fds.begin(); it != fds.end(); it++ )
+                    if ( it->revents & POLLIN )
+                        this->receiveMessages( it->fd );
+            }
+
+            if ( getMonotonicTime() >= next_tick ) {
+                this->checkTimeouts();
+                next_tick = getMonotonicTime() + DHCP_TICK;
+            }
+        }
+    }
+}
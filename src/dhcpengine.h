@@ -0,0 +1,132 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#ifndef DHCP_ENGINE_H
+#define DHCP_ENGINE_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "threadposix.h"
+#include "mutexposix.h"
+#include "dhcpclient.h"
+
+#include <libopenikev2/mutex.h>
+
+#include <map>
+#include <vector>
+
+using namespace std;
+
+namespace openikev2 {
+
+    /**
+        This class represents the event loop shared by all the DhcpClients.
+        It owns one raw socket per interface, used both to send and to receive, and dispatches the received messages to the
+        clients by their transaction ID. Retransmissions and lease renewals of all the clients are driven by its timer, so no
+        thread is blocked waiting for a DHCP server.
+        @author Pedro J. Fernandez Ruiz, Alejandro Perez Mendez <pedroj@um.es, alex@um.es>
+    */
+    class DhcpEngine : public ThreadPosix {
+            /****************************** ATTRIBUTES ******************************/
+        protected:
+            map<int32_t, int32_t> sockets;                  /**< Raw sockets, by interface index */
+            map<uint32_t, DhcpClient*> clients;             /**< Registered clients, by transaction ID */
+            auto_ptr<Mutex> mutex_clients;                  /**< Mutex to protect the sockets and the clients */
+
+            static DhcpEngine* instance;                    /**< Daemon-wide instance, created by getInstance() */
+            static MutexPosix mutex_instance;               /**< Mutex to protect the instance creation */
+
+            /****************************** METHODS ******************************/
+        protected:
+            /**
+             * Gets the current monotonic time
+             * @return Time in milliseconds
+             */
+            static uint64_t getMonotonicTime();
+
+            /**
+             * Calculates the Internet checksum
+             * @param addr Data
+             * @param count Data size
+             * @return The checksum
+             */
+            static uint16_t checksum( void *addr, int32_t count );
+
+            /**
+             * Creates a non-blocking raw socket on the interface, that only receives DHCP replies
+             * @param ifindex Interface index
+             * @return The socket file descriptor
+             * @throws NetworkException If the socket cannot be created
+             */
+            static int32_t createRawSocket( int32_t ifindex );
+
+            /**
+             * Gets the raw socket of an interface, creating it the first time. The caller must lock the clients mutex
+             * @param ifindex Interface index
+             * @return The socket file descriptor
+             */
+            virtual int32_t getSocket( int32_t ifindex );
+
+            /**
+             * Reads all the pending messages of a socket and dispatches them to their clients
+             * @param fd Socket file descriptor
+             */
+            virtual void receiveMessages( int32_t fd );
+
+            /**
+             * Checks the retransmission and renewal deadlines of all the clients
+             */
+            virtual void checkTimeouts();
+
+            /**
+             * Requests the deletion of the IKE SAs whose leases have been lost
+             * @param spis SPIs of the IKE SAs
+             */
+            static void deleteIkeSas( const vector<uint64_t>& spis );
+
+        public:
+            /**
+             * Gets the shared DhcpEngine, creating and starting it the first time
+             * @return The shared DhcpEngine
+             */
+            static DhcpEngine& getInstance();
+
+            /**
+             * Creates a new DhcpEngine
+             */
+            DhcpEngine();
+
+            /**
+             * Registers a client with a new transaction ID and starts its address request
+             * @param client DHCP client
+             */
+            virtual void addClient( DhcpClient& client );
+
+            /**
+             * Unregisters a client. Its messages are ignored from now on
+             * @param client DHCP client
+             */
+            virtual void removeClient( DhcpClient& client );
+
+            /**
+             * Broadcasts a DHCP message through the shared socket of the interface. The caller must lock the clients mutex
+             * (i.e. it is called from the DhcpClient methods invoked by the engine)
+             * @param ifindex Interface index
+             * @param dhcp_message DHCP message
+             * @throws NetworkException If the message cannot be sent
+             */
+            virtual void sendMessage( int32_t ifindex, const DhcpClient::DhcpMessage& dhcp_message );
+
+            virtual void run();
+
+            virtual ~DhcpEngine();
+    };
+};
+#endif
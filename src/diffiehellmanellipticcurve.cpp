@@ -8,6 +8,7 @@
  ***************************************************************************/
 
 #include "diffiehellmanellipticcurve.h"
+#include "cryptocontrollerimplopenike.h"
 
 #ifdef HAVE_OPENSSL_ECDH_H
 
@@ -16,35 +17,57 @@
 #include <assert.h>
 
 #include <libopenikev2/exception.h>
+#include <libopenikev2/autolock.h>
 
 
 namespace openikev2 {
+    MutexPosix DiffieHellmanEllipticCurve::mutex_groups;
 
-    DiffieHellmanEllipticCurve::DiffieHellmanEllipticCurve( Enums::DH_ID group_id )
-        : DiffieHellman (group_id) {
-        uint16_t public_key_bytes_len;
-
-        // creates the BN context
-        this->bn_ctx = BN_CTX_new();
+    const EC_GROUP* DiffieHellmanEllipticCurve::getGroup( Enums::DH_ID group_id, uint16_t& coordinate_size ) {
+        static EC_GROUP* groups[ 3 ] = { NULL, NULL, NULL };
 
-        // creates the EC_KEY object
+        int nid;
         switch ( group_id ) {
             case 19:
-                this->ec_key = EC_KEY_new_by_curve_name( NID_X9_62_prime256v1 );
-                public_key_bytes_len = 32;
+                nid = NID_X9_62_prime256v1;
+                coordinate_size = 32;
                 break;
             case 20:
-                this->ec_key = EC_KEY_new_by_curve_name( NID_secp384r1 );
-                public_key_bytes_len = 48;
+                nid = NID_secp384r1;
+                coordinate_size = 48;
                 break;
             case 21:
-                this->ec_key = EC_KEY_new_by_curve_name( NID_secp521r1 );
-                public_key_bytes_len = 66;
+                nid = NID_secp521r1;
+                coordinate_size = 66;
                 break;
             default:
                 assert ( "Invalid EC group" && 0 );
+                return NULL;
         }
 
+        // The group and the multiples of its generator are computed only the first time
+        AutoLock auto_lock( mutex_groups );
+        EC_GROUP*& group = groups[ group_id - 19 ];
+        if ( group == NULL ) {
+            group = EC_GROUP_new_by_curve_name( nid );
+            EC_GROUP_precompute_mult( group, NULL );
+        }
+
+        return group;
+    }
+
+    DiffieHellmanEllipticCurve::DiffieHellmanEllipticCurve( Enums::DH_ID group_id )
+        : DiffieHellman (group_id) {
+        uint16_t public_key_bytes_len;
+
+        // creates the BN context
+        this->bn_ctx = BN_CTX_new();
+
+        // creates the EC_KEY object, using the shared group
+        this->ec_key = EC_KEY_new();
+        if ( !EC_KEY_set_group( this->ec_key, getGroup( group_id, public_key_bytes_len ) ) )
+            throw Exception( "Error setting EC group" );
+
         // Generates the keys
         if ( !EC_KEY_generate_key( this->ec_key ) )
             throw Exception( "Error generating EC key" );
@@ -83,7 +106,29 @@ namespace openikev2 {
         return *this->public_key;
     }
 
+    /**
+        Task computing the shared secret of a DiffieHellmanEllipticCurve in the crypto worker pool
+    */
+    class SharedSecretTaskEllipticCurve : public CryptoTask {
+        protected:
+            DiffieHellmanEllipticCurve& diffie_hellman;
+            const ByteArray& peer_public_key;
+
+        public:
+            SharedSecretTaskEllipticCurve( DiffieHellmanEllipticCurve& diffie_hellman, const ByteArray& peer_public_key ) :
+                    diffie_hellman ( diffie_hellman ), peer_public_key ( peer_public_key ) {}
+
+            virtual void execute() {
+                this->diffie_hellman.computeSharedSecret( this->peer_public_key );
+            }
+    };
+
     void DiffieHellmanEllipticCurve::generateSharedSecret( const ByteArray & peer_public_key ) {
+        SharedSecretTaskEllipticCurve task( *this, peer_public_key );
+        CryptoControllerImplOpenIKE::executeCryptoTask( task );
+    }
+
+    void DiffieHellmanEllipticCurve::computeSharedSecret( const ByteArray & peer_public_key ) {
         if ( peer_public_key.size() != this->public_key->size() )
             throw Exception( "Invalid public key size" );
 
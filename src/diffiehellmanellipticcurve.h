@@ -17,6 +17,7 @@
 
 #include <libopenikev2/diffiehellman.h>
 #include <openssl/ecdh.h>
+#include "mutexposix.h"
 
 namespace openikev2 {
     /**
@@ -31,7 +32,18 @@ namespace openikev2 {
             auto_ptr<ByteArray> shared_secret;  /**< Shared secret */
             auto_ptr<ByteArray> public_key;     /**< Public key */
 
+            static MutexPosix mutex_groups;     /**< Mutex to protect the shared EC groups */
+
             /****************************** METHODS ******************************/
+        protected:
+            /**
+             * Gets the EC group of a Diffie-Hellman group. It is created only the first time
+             * @param group_id Group id
+             * @param coordinate_size Output: size of each coordinate of the public key
+             * @return The EC group, shared by all the DiffieHellmanEllipticCurve objects
+             */
+            static const EC_GROUP* getGroup( Enums::DH_ID group_id, uint16_t& coordinate_size );
+
         public:
             /**
              * Creates a DiffieHellmanEllipticCurve object, using the indicated group id.
@@ -41,8 +53,19 @@ namespace openikev2 {
 
             virtual ByteArray& getPublicKey() const;
 
+            /**
+             * Generates the shared secret in the crypto worker pool
+             * @param peer_public_key Public key of the peer
+             */
             virtual void generateSharedSecret( const ByteArray& peer_public_key ) ;
 
+            /**
+             * Computes the shared secret in the calling thread
+             * @param peer_public_key Public key of the peer
+             * @throws Exception If the peer public key is not valid
+             */
+            virtual void computeSharedSecret( const ByteArray& peer_public_key );
+
             virtual ByteArray& getSharedSecret() const;
 
             virtual ~DiffieHellmanEllipticCurve();
@@ -0,0 +1,380 @@
+/***************************************************************************
+ *   Copyright (C) 2005 by                                                 *
+ *   Alejandro Perez Mendez     alex@um.es                                 *
+ *   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+ *                                                                         *
+ *   This software may be modified and distributed under the terms         *
+ *   of the Apache license.  See the LICENSE file for details.             *
+ ***************************************************************************/
+
+#include "diffiehellmanmontgomery.h"
+#include "cryptocontrollerimplopenike.h"
+
+#ifdef HAVE_INT128
+
+#include "randomopenssl.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include <libopenikev2/exception.h>
+
+namespace openikev2 {
+
+    typedef unsigned __int128 uint128_t;
+
+    /* Field primes, in little endian */
+    static const uint8_t PRIME_25519[ 32 ] = {
+        0xED, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x7F
+    };
+
+    static const uint8_t PRIME_448[ 56 ] = {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+    };
+
+    /**
+     * Reduces a wide product (up to 2 * MONTGOMERY_MAX_LIMBS - 1 limbs) into a field element.
+     * For 2^255 - 19, the limb i + 5 weights 19 times the limb i. For 2^448 - 2^224 - 1, the limb
+     * i + 8 weights the same as the limbs i and i + 4.
+     */
+    static void reduceWide( uint128_t* t, uint16_t length, uint16_t num_limbs, uint16_t limb_bits, uint64_t* result ) {
+        const uint64_t mask = ( 1ULL << limb_bits ) - 1;
+        bool is_25519 = ( num_limbs == 5 );
+
+        for ( int16_t k = length - 1; k >= num_limbs; k-- ) {
+            if ( is_25519 ) {
+                t[ k - 5 ] += 19 * t[ k ];
+            }
+            else {
+                t[ k - 8 ] += t[ k ];
+                t[ k - 4 ] += t[ k ];
+            }
+        }
+
+        // Two carry passes: the top carry of the first one can be large, the one of the second one is tiny
+        for ( uint16_t pass = 0; pass < 2; pass++ ) {
+            uint128_t carry = 0;
+            for ( uint16_t i = 0; i < num_limbs; i++ ) {
+                t[ i ] += carry;
+                carry = t[ i ] >> limb_bits;
+                t[ i ] &= mask;
+            }
+            if ( is_25519 ) {
+                t[ 0 ] += 19 * carry;
+            }
+            else {
+                t[ 0 ] += carry;
+                t[ 4 ] += carry;
+            }
+        }
+
+        for ( uint16_t i = 0; i < num_limbs; i++ )
+            result[ i ] = ( uint64_t ) t[ i ];
+    }
+
+    DiffieHellmanMontgomery::DiffieHellmanMontgomery( Enums::DH_ID group_id )
+            : DiffieHellman( group_id ) {
+        if ( group_id == DH_GROUP_CURVE25519 ) {
+            this->key_size = 32;
+            this->num_limbs = 5;
+            this->limb_bits = 51;
+            this->a24 = 121665;
+            this->prime = PRIME_25519;
+        }
+        else if ( group_id == DH_GROUP_CURVE448 ) {
+            this->key_size = 56;
+            this->num_limbs = 8;
+            this->limb_bits = 56;
+            this->a24 = 39081;
+            this->prime = PRIME_448;
+        }
+        else {
+            assert( "Invalid Montgomery curve group" && 0 );
+        }
+
+        // Generates and clamps the private scalar
+        RandomOpenSSL random;
+        auto_ptr<ByteArray> random_bytes = random.getRandomBytes( this->key_size );
+        memcpy( this->private_key, random_bytes->getRawPointer(), this->key_size );
+
+        if ( this->key_size == 32 ) {
+            this->private_key[ 0 ] &= 248;
+            this->private_key[ 31 ] &= 127;
+            this->private_key[ 31 ] |= 64;
+        }
+        else {
+            this->private_key[ 0 ] &= 252;
+            this->private_key[ 55 ] |= 128;
+        }
+
+        // The public key is the scalar multiplication of the base point (u = 9 or u = 5)
+        uint8_t base_point[ MONTGOMERY_MAX_KEY_SIZE ];
+        memset( base_point, 0, sizeof( base_point ) );
+        base_point[ 0 ] = ( this->key_size == 32 ) ? 9 : 5;
+
+        uint8_t public_key[ MONTGOMERY_MAX_KEY_SIZE ];
+        this->scalarMult( base_point, public_key );
+        this->public_key.reset( new ByteArray( public_key, this->key_size ) );
+    }
+
+    void DiffieHellmanMontgomery::carry( FieldElement & a ) const {
+        const uint64_t mask = ( 1ULL << this->limb_bits ) - 1;
+
+        for ( uint16_t i = 0; i < this->num_limbs - 1; i++ ) {
+            a.limb[ i + 1 ] += a.limb[ i ] >> this->limb_bits;
+            a.limb[ i ] &= mask;
+        }
+
+        uint64_t top = a.limb[ this->num_limbs - 1 ] >> this->limb_bits;
+        a.limb[ this->num_limbs - 1 ] &= mask;
+
+        if ( this->num_limbs == 5 ) {
+            a.limb[ 0 ] += 19 * top;
+        }
+        else {
+            a.limb[ 0 ] += top;
+            a.limb[ 4 ] += top;
+        }
+    }
+
+    void DiffieHellmanMontgomery::add( FieldElement & result, const FieldElement & a, const FieldElement & b ) const {
+        for ( uint16_t i = 0; i < this->num_limbs; i++ )
+            result.limb[ i ] = a.limb[ i ] + b.limb[ i ];
+        this->carry( result );
+    }
+
+    void DiffieHellmanMontgomery::sub( FieldElement & result, const FieldElement & a, const FieldElement & b ) const {
+        // Computes a + 2p - b, so the limbs never underflow
+        const uint64_t two_mask = ( 1ULL << ( this->limb_bits + 1 ) ) - 2;
+
+        for ( uint16_t i = 0; i < this->num_limbs; i++ )
+            result.limb[ i ] = a.limb[ i ] + two_mask - b.limb[ i ];
+
+        if ( this->num_limbs == 5 )
+            result.limb[ 0 ] -= 36;
+        else
+            result.limb[ 4 ] -= 2;
+
+        this->carry( result );
+    }
+
+    void DiffieHellmanMontgomery::mul( FieldElement & result, const FieldElement & a, const FieldElement & b ) const {
+        uint128_t t[ 2 * MONTGOMERY_MAX_LIMBS - 1 ];
+        uint16_t length = 2 * this->num_limbs - 1;
+        memset( t, 0, sizeof( t ) );
+
+        for ( uint16_t i = 0; i < this->num_limbs; i++ )
+            for ( uint16_t j = 0; j < this->num_limbs; j++ )
+                t[ i + j ] += ( uint128_t ) a.limb[ i ] * b.limb[ j ];
+
+        reduceWide( t, length, this->num_limbs, this->limb_bits, result.limb );
+    }
+
+    void DiffieHellmanMontgomery::mulSmall( FieldElement & result, const FieldElement & a, uint32_t b ) const {
+        uint128_t t[ MONTGOMERY_MAX_LIMBS ];
+
+        for ( uint16_t i = 0; i < this->num_limbs; i++ )
+            t[ i ] = ( uint128_t ) a.limb[ i ] * b;
+
+        reduceWide( t, this->num_limbs, this->num_limbs, this->limb_bits, result.limb );
+    }
+
+    void DiffieHellmanMontgomery::invert( FieldElement & result, const FieldElement & a ) const {
+        // The exponent p - 2 only differs from p in the lowest byte
+        uint8_t exponent[ MONTGOMERY_MAX_KEY_SIZE ];
+        memcpy( exponent, this->prime, this->key_size );
+        exponent[ 0 ] -= 2;
+
+        FieldElement accumulator;
+        memset( &accumulator, 0, sizeof( accumulator ) );
+        accumulator.limb[ 0 ] = 1;
+
+        // The exponent is public, so the square and multiply sequence doesn't leak anything
+        for ( int16_t bit = this->key_size * 8 - 1; bit >= 0; bit-- ) {
+            this->mul( accumulator, accumulator, accumulator );
+            if ( ( exponent[ bit / 8 ] >> ( bit % 8 ) ) & 1 )
+                this->mul( accumulator, accumulator, a );
+        }
+
+        result = accumulator;
+    }
+
+    void DiffieHellmanMontgomery::conditionalSwap( uint64_t swap, FieldElement & a, FieldElement & b ) const {
+        uint64_t mask = 0 - swap;
+
+        for ( uint16_t i = 0; i < this->num_limbs; i++ ) {
+            uint64_t difference = mask & ( a.limb[ i ] ^ b.limb[ i ] );
+            a.limb[ i ] ^= difference;
+            b.limb[ i ] ^= difference;
+        }
+    }
+
+    void DiffieHellmanMontgomery::decode( FieldElement & result, const uint8_t * bytes ) const {
+        const uint64_t mask = ( 1ULL << this->limb_bits ) - 1;
+        memset( &result, 0, sizeof( result ) );
+
+        uint128_t accumulator = 0;
+        uint16_t accumulator_bits = 0;
+        uint16_t limb = 0;
+
+        for ( uint16_t i = 0; i < this->key_size; i++ ) {
+            uint8_t byte = bytes[ i ];
+
+            // The most significant bit of an X25519 u-coordinate is ignored (RFC 7748, section 5)
+            if ( this->key_size == 32 && i == 31 )
+                byte &= 0x7F;
+
+            accumulator |= ( uint128_t ) byte << accumulator_bits;
+            accumulator_bits += 8;
+
+            while ( accumulator_bits >= this->limb_bits && limb < this->num_limbs ) {
+                result.limb[ limb++ ] = ( uint64_t ) accumulator & mask;
+                accumulator >>= this->limb_bits;
+                accumulator_bits -= this->limb_bits;
+            }
+        }
+
+        if ( limb < this->num_limbs )
+            result.limb[ limb ] = ( uint64_t ) accumulator;
+    }
+
+    void DiffieHellmanMontgomery::encode( uint8_t * bytes, FieldElement a ) const {
+        const uint64_t mask = ( 1ULL << this->limb_bits ) - 1;
+
+        // After two carries every limb is below 2^limb_bits, so the value is lower than 2p
+        this->carry( a );
+        this->carry( a );
+
+        // Subtracts p if the value is not lower than it, in constant time
+        FieldElement p, reduced;
+        this->decode( p, this->prime );
+
+        uint64_t borrow = 0;
+        for ( uint16_t i = 0; i < this->num_limbs; i++ ) {
+            uint64_t difference = a.limb[ i ] - p.limb[ i ] - borrow;
+            borrow = difference >> 63;
+            reduced.limb[ i ] = difference & mask;
+        }
+        this->conditionalSwap( 1 - borrow, a, reduced );
+
+        uint128_t accumulator = 0;
+        uint16_t accumulator_bits = 0;
+        uint16_t limb = 0;
+
+        for ( uint16_t i = 0; i < this->key_size; i++ ) {
+            while ( accumulator_bits < 8 && limb < this->num_limbs ) {
+                accumulator |= ( uint128_t ) a.limb[ limb++ ] << accumulator_bits;
+                accumulator_bits += this->limb_bits;
+            }
+            bytes[ i ] = ( uint8_t ) accumulator;
+            accumulator >>= 8;
+            accumulator_bits -= 8;
+        }
+    }
+
+    void DiffieHellmanMontgomery::scalarMult( const uint8_t * u_coordinate, uint8_t * result ) const {
+        FieldElement x1, x2, z2, x3, z3;
+        FieldElement a, aa, b, bb, e, c, d, da, cb, temp;
+
+        this->decode( x1, u_coordinate );
+        memset( &x2, 0, sizeof( x2 ) );
+        memset( &z2, 0, sizeof( z2 ) );
+        x2.limb[ 0 ] = 1;
+        x3 = x1;
+        z3 = x2;
+
+        // Montgomery ladder (RFC 7748, section 5). The sequence of operations doesn't depend on the scalar
+        uint64_t swap = 0;
+        uint16_t scalar_bits = ( this->key_size == 32 ) ? 255 : 448;
+        for ( int16_t t = scalar_bits - 1; t >= 0; t-- ) {
+            uint64_t k_t = ( this->private_key[ t / 8 ] >> ( t % 8 ) ) & 1;
+            swap ^= k_t;
+            this->conditionalSwap( swap, x2, x3 );
+            this->conditionalSwap( swap, z2, z3 );
+            swap = k_t;
+
+            this->add( a, x2, z2 );
+            this->mul( aa, a, a );
+            this->sub( b, x2, z2 );
+            this->mul( bb, b, b );
+            this->sub( e, aa, bb );
+            this->add( c, x3, z3 );
+            this->sub( d, x3, z3 );
+            this->mul( da, d, a );
+            this->mul( cb, c, b );
+
+            this->add( temp, da, cb );
+            this->mul( x3, temp, temp );
+            this->sub( temp, da, cb );
+            this->mul( temp, temp, temp );
+            this->mul( z3, x1, temp );
+            this->mul( x2, aa, bb );
+            this->mulSmall( temp, e, this->a24 );
+            this->add( temp, aa, temp );
+            this->mul( z2, e, temp );
+        }
+        this->conditionalSwap( swap, x2, x3 );
+        this->conditionalSwap( swap, z2, z3 );
+
+        this->invert( z2, z2 );
+        this->mul( x2, x2, z2 );
+        this->encode( result, x2 );
+    }
+
+    ByteArray & DiffieHellmanMontgomery::getPublicKey() const {
+        return *this->public_key;
+    }
+
+    /**
+        Task computing the shared secret of a DiffieHellmanMontgomery in the crypto worker pool
+    */
+    class SharedSecretTaskMontgomery : public CryptoTask {
+        protected:
+            DiffieHellmanMontgomery& diffie_hellman;
+            const ByteArray& peer_public_key;
+
+        public:
+            SharedSecretTaskMontgomery( DiffieHellmanMontgomery& diffie_hellman, const ByteArray& peer_public_key ) :
+                    diffie_hellman ( diffie_hellman ), peer_public_key ( peer_public_key ) {}
+
+            virtual void execute() {
+                this->diffie_hellman.computeSharedSecret( this->peer_public_key );
+            }
+    };
+
+    void DiffieHellmanMontgomery::generateSharedSecret( const ByteArray & peer_public_key ) {
+        SharedSecretTaskMontgomery task( *this, peer_public_key );
+        CryptoControllerImplOpenIKE::executeCryptoTask( task );
+    }
+
+    void DiffieHellmanMontgomery::computeSharedSecret( const ByteArray & peer_public_key ) {
+        if ( peer_public_key.size() != this->key_size )
+            throw Exception( "Invalid public key size" );
+
+        uint8_t shared_secret[ MONTGOMERY_MAX_KEY_SIZE ];
+        this->scalarMult( peer_public_key.getRawPointer(), shared_secret );
+
+        // A zero shared secret means the peer sent a low order point (RFC 7748, section 6)
+        uint8_t zero_check = 0;
+        for ( uint16_t i = 0; i < this->key_size; i++ )
+            zero_check |= shared_secret[ i ];
+        if ( zero_check == 0 )
+            throw Exception( "Invalid peer public key: zero shared secret" );
+
+        this->shared_secret.reset( new ByteArray( shared_secret, this->key_size ) );
+    }
+
+    ByteArray & DiffieHellmanMontgomery::getSharedSecret() const {
+        return *this->shared_secret;
+    }
+
+    DiffieHellmanMontgomery::~DiffieHellmanMontgomery() {
+        memset( this->private_key, 0, sizeof( this->private_key ) );
+    }
+}
+
+#endif
@@ -0,0 +1,138 @@
+/***************************************************************************
+ *   Copyright (C) 2005 by                                                 *
+ *   Alejandro Perez Mendez     alex@um.es                                 *
+ *   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+ *                                                                         *
+ *   This software may be modified and distributed under the terms         *
+ *   of the Apache license.  See the LICENSE file for details.             *
+ ***************************************************************************/
+#ifndef OPENIKEV2DIFFIEHELLMANMONTGOMERY_H
+#define OPENIKEV2DIFFIEHELLMANMONTGOMERY_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* Diffie-Hellman group numbers of the Montgomery curves (RFC 8031) */
+#define DH_GROUP_CURVE25519 31
+#define DH_GROUP_CURVE448 32
+
+#ifdef HAVE_INT128
+
+#include <libopenikev2/diffiehellman.h>
+
+/* Maximum size of the keys (X448) */
+#define MONTGOMERY_MAX_KEY_SIZE 56
+
+/* Maximum number of limbs of a field element (X448) */
+#define MONTGOMERY_MAX_LIMBS 8
+
+namespace openikev2 {
+    /**
+      This class implements the DiffieHellman abstract class for the X25519 and X448 functions (RFC 7748, RFC 8031).
+      The public values have a fixed size, and the scalar multiplication is a constant time Montgomery ladder with
+      the field elements split in 51 bit (X25519) or 56 bit (X448) limbs.
+     @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
+    */
+    class DiffieHellmanMontgomery : public DiffieHellman {
+            /****************************** STRUCTS ******************************/
+        protected:
+            /** Field element, in little endian limbs */
+            struct FieldElement {
+                uint64_t limb[ MONTGOMERY_MAX_LIMBS ];
+            };
+
+            /****************************** ATTRIBUTES ******************************/
+        protected:
+            uint16_t key_size;                          /**< Size of the keys and the shared secret */
+            uint16_t num_limbs;                         /**< Number of limbs of a field element */
+            uint16_t limb_bits;                         /**< Bits of each limb */
+            uint32_t a24;                               /**< Curve constant (A - 2) / 4 */
+            const uint8_t* prime;                       /**< Field prime (little endian) */
+            uint8_t private_key[ MONTGOMERY_MAX_KEY_SIZE ]; /**< Clamped private scalar */
+            auto_ptr<ByteArray> shared_secret;          /**< Shared secret */
+            auto_ptr<ByteArray> public_key;             /**< Public key */
+
+            /****************************** METHODS ******************************/
+        protected:
+            /**
+             * Propagates the carries of the limbs, reducing the top carry modulo the prime
+             * @param a Field element
+             */
+            void carry( FieldElement& a ) const;
+
+            void add( FieldElement& result, const FieldElement& a, const FieldElement& b ) const;
+
+            void sub( FieldElement& result, const FieldElement& a, const FieldElement& b ) const;
+
+            void mul( FieldElement& result, const FieldElement& a, const FieldElement& b ) const;
+
+            void mulSmall( FieldElement& result, const FieldElement& a, uint32_t b ) const;
+
+            /**
+             * Computes the inverse of a field element (a^(p-2))
+             * @param result Inverse
+             * @param a Field element
+             */
+            void invert( FieldElement& result, const FieldElement& a ) const;
+
+            /**
+             * Swaps two field elements if swap is 1, in constant time
+             * @param swap 0 or 1
+             * @param a Field element
+             * @param b Field element
+             */
+            void conditionalSwap( uint64_t swap, FieldElement& a, FieldElement& b ) const;
+
+            /**
+             * Reads a field element from its little endian representation
+             * @param result Field element
+             * @param bytes Little endian representation (key_size bytes)
+             */
+            void decode( FieldElement& result, const uint8_t* bytes ) const;
+
+            /**
+             * Writes the canonical little endian representation of a field element
+             * @param bytes Output buffer (key_size bytes)
+             * @param a Field element
+             */
+            void encode( uint8_t* bytes, FieldElement a ) const;
+
+            /**
+             * Computes the X25519 / X448 function with the private scalar
+             * @param u_coordinate U coordinate of the point (key_size bytes)
+             * @param result Output: U coordinate of the result (key_size bytes)
+             */
+            void scalarMult( const uint8_t* u_coordinate, uint8_t* result ) const;
+
+        public:
+            /**
+             * Creates a DiffieHellmanMontgomery object, generating a new key pair
+             * @param group_id Group id (DH_GROUP_CURVE25519 or DH_GROUP_CURVE448)
+             */
+            DiffieHellmanMontgomery( Enums::DH_ID group_id );
+
+            virtual ByteArray& getPublicKey() const;
+
+            /**
+             * Generates the shared secret in the crypto worker pool
+             * @param peer_public_key Public key of the peer
+             */
+            virtual void generateSharedSecret( const ByteArray& peer_public_key ) ;
+
+            /**
+             * Computes the shared secret in the calling thread
+             * @param peer_public_key Public key of the peer
+             * @throws Exception If the peer public key has an invalid size or the shared secret is zero
+             */
+            virtual void computeSharedSecret( const ByteArray& peer_public_key );
+
+            virtual ByteArray& getSharedSecret() const;
+
+            virtual ~DiffieHellmanMontgomery();
+    };
+}
+
+#endif
+
+#endif
@@ -7,12 +7,15 @@
 *   of the Apache license.  See the LICENSE file for details.             *
 ***************************************************************************/
 #include "diffiehellmanopenssl.h"
+#include "cryptocontrollerimplopenike.h"
 
 #include <libopenikev2/bytebuffer.h>
+#include <libopenikev2/autolock.h>
 #include <openssl/bn.h>
 #include <assert.h>
 
 namespace openikev2 {
+    MutexPosix DiffieHellmanOpenSSL::mutex_parameters;
 
     /*
      * Diffie-Hellman Groups defined for use with IKEv2
@@ -207,15 +210,27 @@ namespace openikev2 {
     };
 
 
+    DH* DiffieHellmanOpenSSL::getGroupParameters( Enums::DH_ID group_id ) {
+        static DH* group_parameters[ 19 ] = { NULL };
+
+        AutoLock auto_lock( mutex_parameters );
+        if ( group_parameters[ group_id ] == NULL ) {
+            DH* parameters = DH_new();
+            BN_hex2bn( &parameters->p, modp_groups[ group_id ] );
+            BN_hex2bn( &parameters->g, "2" );
+            group_parameters[ group_id ] = parameters;
+        }
+
+        return group_parameters[ group_id ];
+    }
+
     DiffieHellmanOpenSSL::DiffieHellmanOpenSSL( Enums::DH_ID group_id )
         : DiffieHellman(group_id)  {
         assert ( group_id <= 18 && modp_groups[ group_id ] != NULL );
-        // Create a new DH instance
-        this->dh = DH_new();
+        // Create a new DH instance with the group parameters
+        this->dh = DHparams_dup( getGroupParameters( group_id ) );
 
         // Generate DH key pair
-        BN_hex2bn( &this->dh->p, modp_groups[ group_id ] );
-        BN_hex2bn( &this->dh->g, "2" );
         DH_generate_key( this->dh );
 
         this->dh_key_size = DH_size( this->dh );
@@ -235,7 +250,29 @@ namespace openikev2 {
         return * this->public_key;
     }
 
+    /**
+        Task computing the shared secret of a DiffieHellmanOpenSSL in the crypto worker pool
+    */
+    class SharedSecretTaskOpenSSL : public CryptoTask {
+        protected:
+            DiffieHellmanOpenSSL& diffie_hellman;
+            const ByteArray& peer_public_key;
+
+        public:
+            SharedSecretTaskOpenSSL( DiffieHellmanOpenSSL& diffie_hellman, const ByteArray& peer_public_key ) :
+                    diffie_hellman ( diffie_hellman ), peer_public_key ( peer_public_key ) {}
+
+            virtual void execute() {
+                this->diffie_hellman.computeSharedSecret( this->peer_public_key );
+            }
+    };
+
     void DiffieHellmanOpenSSL::generateSharedSecret( const ByteArray& peer_public_key ) {
+        SharedSecretTaskOpenSSL task( *this, peer_public_key );
+        CryptoControllerImplOpenIKE::executeCryptoTask( task );
+    }
+
+    void DiffieHellmanOpenSSL::computeSharedSecret( const ByteArray& peer_public_key ) {
         // generates the shared secret
         this->shared_secret.reset ( new ByteArray( this->dh_key_size ) );
         BIGNUM *peer_key = BN_bin2bn( peer_public_key.getRawPointer(), peer_public_key.size(), NULL );
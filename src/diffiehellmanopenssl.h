@@ -11,6 +11,7 @@
 
 #include <libopenikev2/diffiehellman.h>
 #include <openssl/dh.h>
+#include "mutexposix.h"
 
 namespace openikev2 {
 
@@ -27,6 +28,17 @@ namespace openikev2 {
             auto_ptr<ByteArray> shared_secret;  /**< Shared secret */
             auto_ptr<ByteArray> public_key;     /**< Public key */
 
+            static MutexPosix mutex_parameters; /**< Mutex to protect the shared group parameters */
+
+            /****************************** METHODS ******************************/
+        protected:
+            /**
+             * Gets the parameters of a group. They are parsed only the first time
+             * @param group_id Group id
+             * @return The group parameters, shared by all the DiffieHellmanOpenSSL objects
+             */
+            static DH* getGroupParameters( Enums::DH_ID group_id );
+
         public:
             /**
              * Creates a DiffieHellmanOpenSSL object, using the indicated group id.
@@ -36,8 +48,18 @@ namespace openikev2 {
 
             virtual ByteArray& getPublicKey() const;
 
+            /**
+             * Generates the shared secret in the crypto worker pool
+             * @param peer_public_key Public key of the peer
+             */
             virtual void generateSharedSecret( const ByteArray& peer_public_key ) ;
 
+            /**
+             * Computes the shared secret in the calling thread
+             * @param peer_public_key Public key of the peer
+             */
+            virtual void computeSharedSecret( const ByteArray& peer_public_key );
+
             virtual ByteArray& getSharedSecret() const;
 
             virtual ~DiffieHellmanOpenSSL();
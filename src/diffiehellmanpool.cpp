@@ -0,0 +1,156 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#include "diffiehellmanpool.h"
+#include "diffiehellmanpoolfiller.h"
+#include "diffiehellmanopenssl.h"
+#include "diffiehellmanellipticcurve.h"
+#include "diffiehellmanmontgomery.h"
+
+#include <libopenikev2/threadcontroller.h>
+#include <libopenikev2/autolock.h>
+#include <libopenikev2/exception.h>
+#include <libopenikev2/utils.h>
+
+namespace openikev2 {
+
+    DiffieHellmanPool::DiffieHellmanPool( uint16_t pool_size, uint16_t num_fillers ) {
+        this->pool_size = pool_size;
+        this->mutex_key_pairs = ThreadController::getMutex();
+        this->refill_requests = 0;
+        this->exiting = false;
+        this->condition_refill.reset( new ConditionPosix() );
+
+        if ( pool_size == 0 )
+            return;
+
+        for ( uint16_t i = 0; i < num_fillers; i++ ) {
+            DiffieHellmanPoolFiller* filler = new DiffieHellmanPoolFiller( *this, i );
+            this->fillers.push_back( filler );
+            filler->start();
+        }
+    }
+
+    DiffieHellmanPool::~DiffieHellmanPool() {
+        // The fillers finish their current key pair and exit
+        {
+            AutoLock auto_lock( *this->condition_refill );
+            this->exiting = true;
+            this->condition_refill->notifyAll();
+        }
+
+        for ( vector<DiffieHellmanPoolFiller*>::iterator it = this->fillers.begin(); it != this->fillers.end(); it++ ) {
+            ( *it )->join();
+            delete ( *it );
+        }
+
+        for ( map<uint16_t, vector<DiffieHellman*> >::iterator it = this->key_pairs.begin(); it != this->key_pairs.end(); it++ )
+            for ( vector<DiffieHellman*>::iterator it_key = it->second.begin(); it_key != it->second.end(); it_key++ )
+                delete ( *it_key );
+    }
+
+    auto_ptr<DiffieHellman> DiffieHellmanPool::createDiffieHellman( Enums::DH_ID group ) {
+        if ( group < 19 )
+            return auto_ptr<DiffieHellman> ( new DiffieHellmanOpenSSL( group ) );
+
+#ifdef HAVE_INT128
+        if ( group == DH_GROUP_CURVE25519 || group == DH_GROUP_CURVE448 )
+            return auto_ptr<DiffieHellman> ( new DiffieHellmanMontgomery( group ) );
+#endif
+
+#ifdef HAVE_OPENSSL_ECDH_H
+        return auto_ptr<DiffieHellman> ( new DiffieHellmanEllipticCurve( group ) );
+#else
+        throw Exception( "Unsupported Diffie-Hellman group: " + intToString( group ) );
+#endif
+    }
+
+    auto_ptr<DiffieHellman> DiffieHellmanPool::getDiffieHellman( Enums::DH_ID group ) {
+        if ( this->pool_size == 0 )
+            return createDiffieHellman( group );
+
+        DiffieHellman* key_pair = NULL;
+        bool pooled_group;
+        {
+            AutoLock auto_lock( *this->mutex_key_pairs );
+
+            map<uint16_t, vector<DiffieHellman*> >::iterator it = this->key_pairs.find( group );
+            pooled_group = ( it != this->key_pairs.end() );
+            if ( pooled_group && !it->second.empty() ) {
+                key_pair = it->second.back();
+                it->second.pop_back();
+            }
+        }
+
+        // The first request of a group makes the fillers keep it filled (once the group is known to be supported)
+        if ( !pooled_group ) {
+            auto_ptr<DiffieHellman> result = createDiffieHellman( group );
+            {
+                AutoLock auto_lock( *this->mutex_key_pairs );
+                this->key_pairs[ group ];
+            }
+            this->requestRefill();
+            return result;
+        }
+
+        this->requestRefill();
+
+        if ( key_pair == NULL )
+            return createDiffieHellman( group );
+
+        return auto_ptr<DiffieHellman> ( key_pair );
+    }
+
+    bool DiffieHellmanPool::getGroupToFill( Enums::DH_ID & group ) {
+        AutoLock auto_lock( *this->mutex_key_pairs );
+
+        for ( map<uint16_t, vector<DiffieHellman*> >::iterator it = this->key_pairs.begin(); it != this->key_pairs.end(); it++ ) {
+            uint16_t& group_pending = this->pending[ it->first ];
+            if ( it->second.size() + group_pending < this->pool_size ) {
+                group_pending++;
+                group = ( Enums::DH_ID ) it->first;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void DiffieHellmanPool::addKeyPair( Enums::DH_ID group, auto_ptr<DiffieHellman> key_pair ) {
+        AutoLock auto_lock( *this->mutex_key_pairs );
+
+        this->pending[ group ]--;
+
+        if ( key_pair.get() != NULL )
+            this->key_pairs[ group ].push_back( key_pair.release() );
+    }
+
+    void DiffieHellmanPool::requestRefill() {
+        AutoLock auto_lock( *this->condition_refill );
+        this->refill_requests++;
+        this->condition_refill->notify();
+    }
+
+    bool DiffieHellmanPool::waitRefill() {
+        AutoLock auto_lock( *this->condition_refill );
+
+        while ( this->refill_requests == 0 && !this->exiting )
+            this->condition_refill->wait();
+
+        if ( this->exiting )
+            return false;
+
+        this->refill_requests--;
+        return true;
+    }
+
+    bool DiffieHellmanPool::isExiting() {
+        AutoLock auto_lock( *this->condition_refill );
+        return this->exiting;
+    }
+}
@@ -0,0 +1,110 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#ifndef DIFFIEHELLMANPOOL_H
+#define DIFFIEHELLMANPOOL_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <libopenikev2/diffiehellman.h>
+#include <libopenikev2/mutex.h>
+#include "conditionposix.h"
+
+#include <map>
+#include <vector>
+
+using namespace std;
+
+namespace openikev2 {
+    class DiffieHellmanPoolFiller;
+
+    /**
+        This class represents a pool of pre-generated Diffie-Hellman key pairs.
+        The key pairs of each group are generated by low priority filler threads, so the IKE_SA executers don't have to
+        perform the key generation while answering a request. Each key pair is handed out only once. When the pool of a group
+        is empty, the key pair is generated synchronously.
+        Only the groups that have been requested at least once are kept filled.
+        When the pool is destroyed, the fillers are signaled to exit and joined, so none of them is stopped while holding a lock.
+        @author Pedro J. Fernandez Ruiz, Alejandro Perez Mendez <pedroj@um.es, alex@um.es>
+    */
+    class DiffieHellmanPool {
+            friend class DiffieHellmanPoolFiller;
+
+            /****************************** ATTRIBUTES ******************************/
+        protected:
+            map<uint16_t, vector<DiffieHellman*> > key_pairs;   /**< Pre-generated key pairs, by group */
+            map<uint16_t, uint16_t> pending;                    /**< Key pairs being generated by the fillers, by group */
+            uint16_t pool_size;                                 /**< Number of key pairs kept for each group */
+            auto_ptr<Mutex> mutex_key_pairs;                    /**< Mutex to protect the key pairs */
+            uint32_t refill_requests;                           /**< Key pairs taken from the pool and not yet noticed by the fillers */
+            bool exiting;                                       /**< Indicates if the fillers must exit */
+            auto_ptr<ConditionPosix> condition_refill;          /**< Condition to protect the refill requests and the exiting flag, and wait for changes on them */
+            vector<DiffieHellmanPoolFiller*> fillers;           /**< Filler threads */
+
+            /****************************** METHODS ******************************/
+        protected:
+            /**
+             * Gets a group whose pool is not full, and reserves room for one key pair. Called by the filler threads
+             * @param group Output: group
+             * @return TRUE if there is a group to be filled. FALSE otherwise
+             */
+            virtual bool getGroupToFill( Enums::DH_ID& group );
+
+            /**
+             * Adds a generated key pair to the pool, releasing the room reserved by getGroupToFill(). Called by the filler threads
+             * @param group Group
+             * @param key_pair Key pair (NULL if the generation failed)
+             */
+            virtual void addKeyPair( Enums::DH_ID group, auto_ptr<DiffieHellman> key_pair );
+
+            /**
+             * Notifies the fillers that a key pair has been taken from the pool
+             */
+            virtual void requestRefill();
+
+            /**
+             * Waits until a key pair is taken from the pool, or the pool is destroyed. Called by the filler threads
+             * @return TRUE if the pool must be refilled. FALSE if the filler must exit
+             */
+            virtual bool waitRefill();
+
+            /**
+             * Indicates if the pool is being destroyed. Called by the filler threads
+             * @return TRUE if the fillers must exit. FALSE otherwise
+             */
+            virtual bool isExiting();
+
+        public:
+            /**
+             * Creates a new DiffieHellmanPool and starts its filler threads
+             * @param pool_size Number of key pairs kept for each group. If 0, the key pairs are always generated synchronously
+             * @param num_fillers Number of filler threads
+             */
+            DiffieHellmanPool( uint16_t pool_size, uint16_t num_fillers );
+
+            /**
+             * Generates a new key pair
+             * @param group Group
+             * @return The new key pair
+             * @throws Exception If the group is not supported
+             */
+            static auto_ptr<DiffieHellman> createDiffieHellman( Enums::DH_ID group );
+
+            /**
+             * Takes a key pair from the pool, or generates it if the pool is empty
+             * @param group Group
+             * @return The key pair, that is not handed out again
+             */
+            virtual auto_ptr<DiffieHellman> getDiffieHellman( Enums::DH_ID group );
+
+            virtual ~DiffieHellmanPool();
+    };
+};
+#endif
@@ -0,0 +1,57 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#include "diffiehellmanpoolfiller.h"
+
+#include <libopenikev2/log.h>
+#include <libopenikev2/utils.h>
+
+#include <sched.h>
+
+namespace openikev2 {
+    DiffieHellmanPoolFiller::DiffieHellmanPoolFiller( DiffieHellmanPool& pool, uint16_t id ) :
+            pool ( pool ) {
+        this->id = id;
+    }
+
+    DiffieHellmanPoolFiller::~DiffieHellmanPoolFiller( ) {}
+
+    void DiffieHellmanPoolFiller::run( ) {
+        Log::writeLockedMessage( "DiffieHellmanPoolFiller[" + intToString ( this->id ) + "]", "Start: Thread ID=[" + intToString( thread_id ) + "]", Log::LOG_THRD, true );
+
+        // The key generation must not delay the threads processing the requests
+        sched_param schedparam;
+        schedparam.sched_priority = 0;
+#ifdef SCHED_IDLE
+        pthread_setschedparam( pthread_self(), SCHED_IDLE, &schedparam );
+#else
+        pthread_setschedparam( pthread_self(), SCHED_OTHER, &schedparam );
+#endif
+
+        // Until the pool is destroyed
+        while ( true ) {
+            Enums::DH_ID group;
+            while ( !this->pool.isExiting() && this->pool.getGroupToFill( group ) ) {
+                try {
+                    this->pool.addKeyPair( group, DiffieHellmanPool::createDiffieHellman( group ) );
+                }
+                catch ( exception & ex ) {
+                    this->pool.addKeyPair( group, auto_ptr<DiffieHellman> ( NULL ) );
+                    Log::writeLockedMessage( "DiffieHellmanPoolFiller[" + intToString ( this->id ) + "]", ex.what() , Log::LOG_ERRO, true );
+                    break;
+                }
+            }
+
+            // Waits until a key pair is taken from the pool, or the pool is destroyed
+            if ( !this->pool.waitRefill() )
+                break;
+        }
+
+        Log::writeLockedMessage( "DiffieHellmanPoolFiller[" + intToString ( this->id ) + "]", "Exit: Thread ID=[" + intToString( thread_id ) + "]", Log::LOG_THRD, true );
+    }
+}
@@ -0,0 +1,45 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#ifndef DIFFIEHELLMANPOOLFILLER_H
+#define DIFFIEHELLMANPOOLFILLER_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "diffiehellmanpool.h"
+#include "threadposix.h"
+
+namespace openikev2 {
+
+    /**
+        This class represents a low priority thread generating the key pairs of a DiffieHellmanPool.
+        @author Pedro J. Fernandez Ruiz, Alejandro Perez Mendez <pedroj@um.es, alex@um.es>
+    */
+    class DiffieHellmanPoolFiller : public ThreadPosix {
+            /****************************** ATTRIBUTES ******************************/
+        protected:
+            DiffieHellmanPool& pool;
+            uint16_t id;
+
+            /****************************** METHODS ******************************/
+        public:
+            /**
+             * Creates a new DiffieHellmanPoolFiller
+             * @param pool Pool to be filled
+             * @param id Filler identifier
+             */
+            DiffieHellmanPoolFiller( DiffieHellmanPool& pool, uint16_t id );
+
+            virtual void run();
+
+            virtual ~DiffieHellmanPoolFiller();
+    };
+};
+#endif
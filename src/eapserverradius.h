@@ -10,9 +10,12 @@
 #define OPENIKEV2EAPSERVERRADIUS_H
 
 #include "radiusmessage.h"
-#include "udpsocket.h"
+#include "radiusclient.h"
+#include "radiusservergroup.h"
 #include "eapserver.h"
 
+#include <libopenikev2/semaphore.h>
+
 
 #include <libopenikev2/payload_eap.h>
 #include <libopenikev2/eappacket.h>
@@ -22,33 +25,67 @@
 namespace openikev2 {
 
     /**
-        This class implements the EapServer abstract class, acting as an EAP authentication (pass-through) between the client and a RADIUS server
+        This class implements the EapServer abstract class, acting as an EAP authentication (pass-through) between the client and a RADIUS server.
+        The RADIUS messages are exchanged through a shared RadiusServerGroup, so the EapServerRadius objects don't own any socket.
         @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
     */
-    class EapServerRadius : public EapServer {
+    class EapServerRadius : public EapServer, public RadiusResponseHandler {
         protected:
-            auto_ptr<RadiusAttribute> server_state;
-            auto_ptr<UdpSocket> socket;
-            auto_ptr<SocketAddress> server_socket_address;
-            auto_ptr<ByteArray> secret;
-            uint8_t seq_number;
+            auto_ptr<ByteArray> server_state;           /**< Value of the State attribute of the last challenge */
+            RadiusServerGroup* server_group;            /**< Servers the requests are sent to */
+            auto_ptr<ByteArray> secret;                 /**< Secret shared with the server that sent the last response */
             auto_ptr<ByteArray> username;
+            auto_ptr<RadiusMessage> radius_request;     /**< Last request sent, returned by the RADIUS client */
+            auto_ptr<RadiusMessage> radius_response;    /**< Response of the last request. NULL if the server did not answer */
+            auto_ptr<Semaphore> response_semaphore;     /**< Semaphore posted when the last request has finished */
 
         protected:
-            virtual void sendRadiusMessage( RadiusMessage& radius_message );
-            virtual auto_ptr<RadiusMessage> receiveRadiusMessage(const ByteArray& request_message_authenticator );
-            virtual void getMsk(RadiusMessage& radius_message, RadiusMessage & access_request_message);
-            virtual auto_ptr<ByteArray> decryptKey(const ByteArray& key_attr, const ByteArray & authenticator);
+            /**
+             * Sends a request to the RADIUS servers
+             * @param radius_message Request to be sent
+             */
+            virtual void sendRadiusMessage( auto_ptr<RadiusMessage> radius_message );
+
+            /**
+             * Waits for the response of the last request sent. The request is stored in radius_request
+             * @return The response, already authenticated
+             * @throws Exception If the server did not answer
+             */
+            virtual auto_ptr<RadiusMessage> receiveRadiusMessage();
+            virtual void getMsk( const RadiusMessage& radius_message, const RadiusMessage & access_request_message );
+
+            /**
+             * Decrypts a MS-MPPE key attribute (RFC 2548 section 2.4.2) with the secret of the server that answered
+             * @param key_attr Attribute value (salt and encrypted key)
+             * @param key_attr_length Attribute value length
+             * @param authenticator Authenticator of the Access-Request (16 bytes)
+             * @param key ByteBuffer where the decrypted key is appended
+             * @throws Exception If the attribute is malformed
+             */
+            virtual void decryptKey( const uint8_t* key_attr, uint16_t key_attr_length, const uint8_t* authenticator, ByteBuffer& key );
 
             EapServerRadius( const EapServerRadius& other );
 
         public:
+            /**
+             * Creates a new EapServerRadius
+             * @param server_address Comma separated list of RADIUS server addresses. Each one can be followed by "*weight"
+             * @param server_port RADIUS server port
+             * @param secret Secret shared with the RADIUS servers
+             */
             EapServerRadius( string server_address, uint16_t server_port, string secret );
+
+            /**
+             * Creates a new EapServerRadius using an existing group of RADIUS servers
+             * @param server_group RADIUS server group. It must live while this object (and its clones) are used
+             */
+            EapServerRadius( RadiusServerGroup& server_group );
             virtual auto_ptr<Payload_EAP> generateInitialEapRequest( const ID& peer_id );
             virtual auto_ptr<Payload_EAP> processEapResponse( const Payload_EAP& eap_response );
             virtual vector<EapPacket::EAP_TYPE> getSupportedMethods( ) const;
             virtual auto_ptr<EapServer> clone() const;
             virtual string toStringTab( uint8_t tabs ) const;
+            virtual void processRadiusResponse( uint32_t transaction_id, auto_ptr<RadiusMessage> request, auto_ptr<RadiusMessage> response, const ByteArray& secret );
             virtual ~EapServerRadius();
 
     };
@@ -16,6 +16,7 @@
 #include "cryptocontrollerimplopenike.h"
 #include "alarmcontrollerimplopenike.h"
 #include "ipaddressopenike.h"
+#include "diffiehellmanmontgomery.h"
 
 #include <stdio.h>
 
@@ -57,6 +58,9 @@ namespace openikev2 {
         ike_sa_controller_impl.reset( new IkeSaControllerImplOpenIKE( 10 ) );
         IkeSaController::setImplementation( ike_sa_controller_impl.get() );
 
+        // The IKE SAs are moved when their local address disappears
+        network_controller_impl->setIkeSaController( ike_sa_controller_impl.get() );
+
         // Flush SPD and SAD
         IpsecController::flushIpsecPolicies();
         IpsecController::flushIpsecSas();
@@ -126,13 +130,29 @@ namespace openikev2 {
         IpsecController::createIpsecPolicy( *ts_i, *ts_r, direction, action, priority, ipsec_protocol, mode, src_tun.get(), dst_tun.get(), autogen, sub );
     }
 
-    auto_ptr<Proposal> Facade::createBasicIkeProposal() {
+    auto_ptr<Proposal> Facade::createBasicIkeProposal( Enums::DH_ID preferred_group, bool offer_montgomery_groups ) {
         auto_ptr<Proposal> ike_proposal( new Proposal( Enums::PROTO_IKE ) );
 
         ike_proposal->addTransform( auto_ptr<Transform> ( new Transform( Enums::ENCR, Enums::ENCR_AES_CBC, 128 ) ) );
         ike_proposal->addTransform( auto_ptr<Transform> ( new Transform( Enums::INTEG, Enums::AUTH_HMAC_SHA1_96 ) ) );
         ike_proposal->addTransform( auto_ptr<Transform> ( new Transform( Enums::PRF, Enums::PRF_HMAC_SHA1 ) ) );
-        ike_proposal->addTransform( auto_ptr<Transform> ( new Transform( Enums::D_H, Enums::DH_GROUP_2 ) ) );
+
+        // The preferred group goes first (it is the one used in the KE payload), the others are accepted as alternatives
+        vector<Enums::DH_ID> groups;
+        groups.push_back( Enums::DH_GROUP_2 );
+#ifdef HAVE_INT128
+        if ( offer_montgomery_groups ) {
+            groups.push_back( ( Enums::DH_ID ) DH_GROUP_CURVE25519 );
+            groups.push_back( ( Enums::DH_ID ) DH_GROUP_CURVE448 );
+        }
+#endif
+
+        ike_proposal->addTransform( auto_ptr<Transform> ( new Transform( Enums::D_H, preferred_group ) ) );
+        for ( vector<Enums::DH_ID>::iterator it = groups.begin(); it != groups.end(); it++ ) {
+            if ( *it != preferred_group )
+                ike_proposal->addTransform( auto_ptr<Transform> ( new Transform( Enums::D_H, *it ) ) );
+        }
+
         return ike_proposal;
     }
 
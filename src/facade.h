@@ -67,9 +67,11 @@ namespace openikev2 {
 
             /**
              * Creates a new basic IKE proposal using AES_128, SHA1 and MODP 1024
+             * @param preferred_group Group proposed first, used in the KE payload
+             * @param offer_montgomery_groups Also offer the X25519 and X448 groups (when supported by the compiler)
              * @return The new IKE proposal
              */
-            static auto_ptr<Proposal> createBasicIkeProposal();
+            static auto_ptr<Proposal> createBasicIkeProposal( Enums::DH_ID preferred_group = Enums::DH_GROUP_2, bool offer_montgomery_groups = false );
 
             /**
              * Creates a new basic IPSEC proposal using AES_128 (when needed), SHA1 and MODP 1024 (when needed)
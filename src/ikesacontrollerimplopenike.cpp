@@ -17,6 +17,7 @@
 #include <libopenikev2/eventbus.h>
 #include <libopenikev2/buseventcore.h>
 #include <libopenikev2/buseventikesa.h>
+#include <libopenikev2/buseventchildsa.h>
 #include <libopenikev2/configuration.h>
 #include <libopenikev2/ipseccontroller.h>
 #include <libopenikev2/boolattribute.h>
@@ -24,6 +25,7 @@
 #include <libopenikev2/networkcontroller.h>
 
 #include "socketaddressposix.h"
+#include "sendupdatesaaddressesreqcommand.h"
 #include "ipaddressopenike.h"
 #include "threadposix.h"
 
@@ -31,11 +33,25 @@
 
 namespace openikev2 {
 
-    IkeSaControllerImplOpenIKE::IkeSaControllerImplOpenIKE( uint16_t num_command_executers  ) {
+    IkeSaControllerImplOpenIKE::IkeSaControllerImplOpenIKE( uint16_t num_command_executers, uint16_t num_shards, uint16_t max_commands_per_slot, uint16_t num_spare_executers ) {
+        assert( num_shards > 0 );
+        assert( max_commands_per_slot > 0 );
+
+        this->max_commands_per_slot = max_commands_per_slot;
+
         // Exit process is not active
         this->exiting = false;
 
-        this->condition_ike_sa = ThreadController::getCondition();
+        this->mutex_ike_sa_count = ThreadController::getMutex();
+
+        this->ike_sa_count = 0;
+
+        // Creates the IKE SA collection shards
+        for ( uint16_t i = 0; i < num_shards; i++ ) {
+            IkeSaShard* shard = new IkeSaShard();
+            shard->mutex = ThreadController::getMutex();
+            this->ike_sa_shards.push_back( shard );
+        }
 
         this->mutex_half_open_counter = ThreadController::getMutex();
 
@@ -45,56 +61,143 @@ namespace openikev2 {
 
         this->current_spi = 1;
 
-        for ( uint16_t i = 0; i < num_command_executers; i++ ) {
-            IkeSaExecuter* ike_sa_executer = new IkeSaExecuter( *this, i );
-            ike_sa_executer->start();
-        }
-        Log::writeLockedMessage( "IkeSaController", "IkeSaExecuters successfully started: [" + intToString( num_command_executers ) + "]", Log::LOG_THRD, true );
+        this->mutex_ike_sa_index = ThreadController::getMutex();
+
+        // Keeps the Child SA SPI index updated
+        EventBus::getInstance().registerBusObserver( *this, BusEvent::IKE_SA_EVENT );
+        EventBus::getInstance().registerBusObserver( *this, BusEvent::CHILD_SA_EVENT );
+
+        assert( num_command_executers > 0 );
+
+        // The first executers are running from the beginning. The spare ones wait until some executer blocks
+        this->max_running_executers = num_command_executers;
+        this->running_executers = num_command_executers;
+        this->condition_running = ThreadController::getCondition();
+
+        // All the executers must exist before any of them tries to steal work
+        for ( uint16_t i = 0; i < num_command_executers + num_spare_executers; i++ )
+            this->ike_sa_executers.push_back( new IkeSaExecuter( *this, i ) );
+
+        for ( uint16_t i = 0; i < num_command_executers + num_spare_executers; i++ )
+            this->ike_sa_executers[ i ]->start();
+        Log::writeLockedMessage( "IkeSaController", "IkeSaExecuters successfully started: [" + intToString( num_command_executers ) + "] Spare=[" + intToString( num_spare_executers ) + "]", Log::LOG_THRD, true );
     }
 
     IkeSaControllerImplOpenIKE::~IkeSaControllerImplOpenIKE() {
+        EventBus::getInstance().removeBusObserver( *this );
+
+        for ( vector<IkeSaShard*>::iterator it = this->ike_sa_shards.begin(); it != this->ike_sa_shards.end(); it++ )
+            delete ( *it );
+    }
+
+    IkeSaShard & IkeSaControllerImplOpenIKE::getShard( uint64_t spi ) {
+        // Mixes the high bits in, since SPIs are usually consecutive values
+        uint64_t hash = spi ^ ( spi >> 32 );
+        return *this->ike_sa_shards[ hash % this->ike_sa_shards.size() ];
+    }
+
+    IkeSaExecuter & IkeSaControllerImplOpenIKE::getHomeExecuter( uint64_t spi ) {
+        // Spare executers are not the home of any IKE SA, they only steal work
+        uint64_t hash = spi ^ ( spi >> 32 );
+        return *this->ike_sa_executers[ hash % this->max_running_executers ];
     }
 
-    IkeSa & IkeSaControllerImplOpenIKE::getScheduledIkeSa( ) {
-        AutoLock auto_lock( *this->condition_ike_sa );
+    void IkeSaControllerImplOpenIKE::acquireExecutionSlot( ) {
+        AutoLock auto_lock( *this->condition_running );
 
-        // waits until there is any IkeSa waiting available
-        while ( this->scheduled_ike_sa_collection.size() == 0 )
-            this->condition_ike_sa->wait();
+        while ( this->running_executers >= this->max_running_executers )
+            this->condition_running->wait();
 
-        // gets the IkeSa
-        IkeSa& ike_sa = *( this->scheduled_ike_sa_collection.front() );
+        this->running_executers++;
+    }
+
+    void IkeSaControllerImplOpenIKE::releaseExecutionSlot( ) {
+        AutoLock auto_lock( *this->condition_running );
+
+        this->running_executers--;
+        this->condition_running->notify();
+    }
 
-        // removes the first IkeSa in the queue
-        scheduled_ike_sa_collection.pop_front();
+    void IkeSaControllerImplOpenIKE::reclaimExecutionSlot( ) {
+        AutoLock auto_lock( *this->condition_running );
 
-        return ike_sa;
+        this->running_executers++;
     }
 
-    void IkeSaControllerImplOpenIKE::scheduleIkeSa( IkeSa & ike_sa ) {
-        // If the IKE SA is not already in the collection
-        if ( !this->scheduled_ike_sa_map[ike_sa.my_spi] )
-            this->scheduled_ike_sa_collection.push_back( &ike_sa );
+    void IkeSaControllerImplOpenIKE::yieldExecutionSlot( ) {
+        AutoLock auto_lock( *this->condition_running );
 
-        this->scheduled_ike_sa_map[ike_sa.my_spi] = true;
+        if ( this->running_executers <= this->max_running_executers )
+            return;
+
+        this->running_executers--;
+        while ( this->running_executers >= this->max_running_executers )
+            this->condition_running->wait();
 
-        this->condition_ike_sa->notify();
+        this->running_executers++;
     }
 
-    void IkeSaControllerImplOpenIKE::addIkeSa( auto_ptr<IkeSa> ike_sa ) {
-        AutoLock auto_lock( *this->condition_ike_sa );
+    IkeSa * IkeSaControllerImplOpenIKE::stealIkeSa( IkeSaExecuter & thief ) {
+        uint16_t num_executers = this->ike_sa_executers.size();
+
+        // Starts with the executer next to the thief, to spread the steals
+        for ( uint16_t i = 1; i < num_executers; i++ ) {
+            IkeSaExecuter* victim = this->ike_sa_executers[ ( thief.id + i ) % num_executers ];
+            IkeSa* ike_sa = victim->stealIkeSa();
+            if ( ike_sa != NULL )
+                return ike_sa;
+        }
+
+        return NULL;
+    }
+
+    void IkeSaControllerImplOpenIKE::scheduleIkeSa( IkeSaShard & shard, IkeSa & ike_sa ) {
+        // If the IKE SA is already in a run queue (or being executed), there is nothing to do
+        bool& scheduled = shard.scheduled_ike_sa_map[ike_sa.my_spi];
+        if ( scheduled )
+            return;
+
+        scheduled = true;
+
+        IkeSaExecuter& home_executer = this->getHomeExecuter( ike_sa.my_spi );
 
+        // If the home executer was waiting for work, it will execute the IKE SA
+        if ( !home_executer.pushIkeSa( ike_sa ) )
+            return;
+
+        // Else, wake up an idle executer (if any) to steal it
+        uint16_t num_executers = this->ike_sa_executers.size();
+        for ( uint16_t i = 1; i < num_executers; i++ ) {
+            IkeSaExecuter* executer = this->ike_sa_executers[ ( home_executer.id + i ) % num_executers ];
+            if ( executer->idle && executer->wakeUp() )
+                return;
+        }
+    }
+
+    void IkeSaControllerImplOpenIKE::addIkeSa( auto_ptr<IkeSa> ike_sa ) {
         uint64_t spi = ike_sa->my_spi;
 
-        Log::writeLockedMessage( "IkeSaController", "New IkeSa added: SPI=" + Printable::toHexString( &spi, 8 ) + " Count=[" + intToString( this->ike_sa_collection.size() ) + "]", Log::LOG_INFO, true );
+        uint32_t count;
+        {
+            AutoLock auto_lock( *this->mutex_ike_sa_count );
+            count = this->ike_sa_count++;
+        }
+
+        Log::writeLockedMessage( "IkeSaController", "New IkeSa added: SPI=" + Printable::toHexString( &spi, 8 ) + " Count=[" + intToString( count ) + "]", Log::LOG_INFO, true );
 
-        if ( ike_sa->hasMoreCommands() )
-            this->scheduleIkeSa( *ike_sa );
+        IkeSaShard& shard = this->getShard( spi );
+        AutoLock auto_lock( *shard.mutex );
 
-        pair<uint64_t, IkeSa*> pair_to_be_included( spi, ike_sa.release() );
+        IkeSa* new_ike_sa = ike_sa.release();
 
-        this->ike_sa_collection.insert( pair_to_be_included );
+        pair<uint64_t, IkeSa*> pair_to_be_included( spi, new_ike_sa );
 
+        shard.ike_sa_collection.insert( pair_to_be_included );
+
+        this->updateIkeSaAddressIndex( *new_ike_sa );
+
+        if ( new_ike_sa->hasMoreCommands() )
+            this->scheduleIkeSa( shard, *new_ike_sa );
     }
 
     void IkeSaControllerImplOpenIKE::requestChildSa( IpAddress& ike_sa_src_addr, IpAddress& ike_sa_dst_addr, auto_ptr<ChildSaRequest> child_sa_request ) {
@@ -318,29 +421,31 @@ void IkeSaControllerImplOpenIKE::requestChildSaMobility( IpAddress& ike_sa_src_a
 
 
     bool IkeSaControllerImplOpenIKE::pushCommandByIkeSaSpi( uint64_t spi, auto_ptr<Command> command, bool priority ) {
-        AutoLock auto_lock( *this->condition_ike_sa );
+        IkeSaShard& shard = this->getShard( spi );
+        AutoLock auto_lock( *shard.mutex );
 
-        map<uint64_t, IkeSa*>::iterator it = this->ike_sa_collection.find( spi );
+        map<uint64_t, IkeSa*>::iterator it = shard.ike_sa_collection.find( spi );
 
         // If spi value is not found
-        if ( it == this->ike_sa_collection.end() )
+        if ( it == shard.ike_sa_collection.end() )
             return false;
 
         // If spi value is found
         it->second->pushCommand( command, priority );
 
-        this->scheduleIkeSa( *it->second );
+        this->scheduleIkeSa( shard, *it->second );
 
         return true;
     }
 
     IkeSa* IkeSaControllerImplOpenIKE::getIkeSaByIkeSaSpi( uint64_t spi ) {
-        AutoLock auto_lock( *this->condition_ike_sa );
+        IkeSaShard& shard = this->getShard( spi );
+        AutoLock auto_lock( *shard.mutex );
 
-        map<uint64_t, IkeSa*>::iterator it = this->ike_sa_collection.find( spi );
+        map<uint64_t, IkeSa*>::iterator it = shard.ike_sa_collection.find( spi );
 
         // If spi value is not found
-        if ( it == this->ike_sa_collection.end() )
+        if ( it == shard.ike_sa_collection.end() )
             return NULL;
 
 
@@ -349,37 +454,52 @@ void IkeSaControllerImplOpenIKE::requestChildSaMobility( IpAddress& ike_sa_src_a
     }
 
     bool IkeSaControllerImplOpenIKE::pushCommandByChildSaSpi( uint32_t spi, auto_ptr<Command> command, bool priority ) {
-        AutoLock auto_lock( *this->condition_ike_sa );
+        uint64_t ike_sa_spi;
+        {
+            AutoLock auto_lock( *this->mutex_ike_sa_index );
 
-        // For each IkeSa
-        for ( map<uint64_t, IkeSa*>::iterator it = this->ike_sa_collection.begin(); it != this->ike_sa_collection.end(); it++ ) {
-            IkeSa * current_ike_sa = it->second;
-            // If spi value is found
-            if ( current_ike_sa->controlsChildSa( spi ) ) {
-                it->second->pushCommand( command, priority );
-                this->scheduleIkeSa( *it->second );
-                return true;
-            }
+            map<uint32_t, uint64_t>::iterator it = this->child_sa_spi_index.find( spi );
+
+            // If spi value is not found
+            if ( it == this->child_sa_spi_index.end() )
+                return false;
+
+            ike_sa_spi = it->second;
         }
 
-        return false;
-    }
+        IkeSaShard& shard = this->getShard( ike_sa_spi );
+        AutoLock auto_lock( *shard.mutex );
 
+        map<uint64_t, IkeSa*>::iterator it = shard.ike_sa_collection.find( ike_sa_spi );
 
+        // If the IkeSa no longer exists or it no longer controls the Child SA
+        if ( it == shard.ike_sa_collection.end() || !it->second->controlsChildSa( spi ) )
+            return false;
 
+        it->second->pushCommand( command, priority );
+        this->scheduleIkeSa( shard, *it->second );
 
+        return true;
+    }
 
     bool IkeSaControllerImplOpenIKE::pushCommandByAddress( const IpAddress & addr, const IpAddress & peer_addr, auto_ptr<Command> command, bool priority ) {
-        AutoLock auto_lock( *this->condition_ike_sa );
+        vector<uint64_t> candidates = this->getIkeSaSpisByAddress( addr, peer_addr );
+
+        // For each IkeSa indexed with these addresses
+        for ( vector<uint64_t>::iterator spi_it = candidates.begin(); spi_it != candidates.end(); spi_it++ ) {
+            IkeSaShard& shard = this->getShard( *spi_it );
+            AutoLock auto_lock( *shard.mutex );
 
-        // For each IkeSa
-        for ( map<uint64_t, IkeSa*>::iterator it = this->ike_sa_collection.begin(); it != this->ike_sa_collection.end(); it++ ) {
-            IkeSa * current_ike_sa = ( *it ).second;
+            map<uint64_t, IkeSa*>::iterator it = shard.ike_sa_collection.find( *spi_it );
+            if ( it == shard.ike_sa_collection.end() )
+                continue;
+
+            IkeSa * current_ike_sa = it->second;
 
             // If Peer address is found
             if ( current_ike_sa->my_addr->getIpAddress() == addr && current_ike_sa->peer_addr->getIpAddress() == peer_addr ) {
                 current_ike_sa->pushCommand( command, priority );
-                this->scheduleIkeSa( *it->second );
+                this->scheduleIkeSa( shard, *current_ike_sa );
                 return true;
             }
         }
@@ -389,11 +509,18 @@ void IkeSaControllerImplOpenIKE::requestChildSaMobility( IpAddress& ike_sa_src_a
     }
 
     IkeSa* IkeSaControllerImplOpenIKE::getIkeSaByAddress( const IpAddress & addr, const IpAddress & peer_addr ) {
-        AutoLock auto_lock( *this->condition_ike_sa );
+        vector<uint64_t> candidates = this->getIkeSaSpisByAddress( addr, peer_addr );
 
-        // For each IkeSa
-        for ( map<uint64_t, IkeSa*>::iterator it = this->ike_sa_collection.begin(); it != this->ike_sa_collection.end(); it++ ) {
-            IkeSa * current_ike_sa = ( *it ).second;
+        // For each IkeSa indexed with these addresses
+        for ( vector<uint64_t>::iterator spi_it = candidates.begin(); spi_it != candidates.end(); spi_it++ ) {
+            IkeSaShard& shard = this->getShard( *spi_it );
+            AutoLock auto_lock( *shard.mutex );
+
+            map<uint64_t, IkeSa*>::iterator it = shard.ike_sa_collection.find( *spi_it );
+            if ( it == shard.ike_sa_collection.end() )
+                continue;
+
+            IkeSa * current_ike_sa = it->second;
 
             // If Peer address is found
             if ( current_ike_sa->my_addr->getIpAddress() == addr && current_ike_sa->peer_addr->getIpAddress() == peer_addr ) {
@@ -405,44 +532,237 @@ void IkeSaControllerImplOpenIKE::requestChildSaMobility( IpAddress& ike_sa_src_a
         return NULL;
     }
 
+    string IkeSaControllerImplOpenIKE::getAddressKey( const IpAddress & addr, const IpAddress & peer_addr ) {
+        return addr.toString() + "|" + peer_addr.toString();
+    }
+
+    vector<uint64_t> IkeSaControllerImplOpenIKE::getIkeSaSpisByAddress( const IpAddress & addr, const IpAddress & peer_addr ) {
+        string key = getAddressKey( addr, peer_addr );
+
+        AutoLock auto_lock( *this->mutex_ike_sa_index );
+
+        vector<uint64_t> result;
+
+        map<string, set<uint64_t> >::iterator it = this->ike_sa_address_index.find( key );
+        if ( it != this->ike_sa_address_index.end() )
+            result.assign( it->second.begin(), it->second.end() );
+
+        return result;
+    }
+
+    uint32_t IkeSaControllerImplOpenIKE::migrateIkeSas( const IpAddress & old_address, const IpAddress & new_address ) {
+        // The keys of the same local address are consecutive, since they start by it
+        string prefix = old_address.toString() + "|";
+        vector<uint64_t> spis;
+        {
+            AutoLock auto_lock( *this->mutex_ike_sa_index );
+            for ( map<string, set<uint64_t> >::iterator it = this->ike_sa_address_index.lower_bound( prefix ); it != this->ike_sa_address_index.end() && it->first.compare( 0, prefix.size(), prefix ) == 0; it++ )
+                spis.insert( spis.end(), it->second.begin(), it->second.end() );
+        }
+
+        uint32_t migrated = 0;
+        for ( vector<uint64_t>::iterator spi_it = spis.begin(); spi_it != spis.end(); spi_it++ ) {
+            IkeSaShard& shard = this->getShard( *spi_it );
+            AutoLock auto_lock( *shard.mutex );
+
+            map<uint64_t, IkeSa*>::iterator it = shard.ike_sa_collection.find( *spi_it );
+            if ( it == shard.ike_sa_collection.end() )
+                continue;
+
+            IkeSa * current_ike_sa = it->second;
+
+            // Only the established IKE SAs that negotiated MOBIKE can move. The rest are left alone
+            if ( current_ike_sa->getState() < IkeSa::STATE_IKE_SA_ESTABLISHED ) {
+                Log::writeLockedMessage( current_ike_sa->getLogId(), "IKE_SA not established. Omitting address update", Log::LOG_WARN, true );
+                continue;
+            }
+
+            BoolAttribute * attribute = current_ike_sa->getIkeSaConfiguration().attributemap->getAttribute<BoolAttribute>( "mobike_enabled" );
+            if ( attribute == NULL || !attribute->value ) {
+                Log::writeLockedMessage( current_ike_sa->getLogId(), "MOBIKE is not enabled for this IKE_SA. Omitting address update", Log::LOG_WARN, true );
+                continue;
+            }
+
+            current_ike_sa->pushCommand( auto_ptr<Command> ( new SendUpdateSaAddressesReqCommand( new_address.clone() ) ), false );
+            this->scheduleIkeSa( shard, *current_ike_sa );
+            migrated++;
+        }
+
+        return migrated;
+    }
+
+    void IkeSaControllerImplOpenIKE::updateIkeSaAddressIndex( IkeSa & ike_sa ) {
+        string key = getAddressKey( ike_sa.my_addr->getIpAddress(), ike_sa.peer_addr->getIpAddress() );
+
+        AutoLock auto_lock( *this->mutex_ike_sa_index );
+
+        map<uint64_t, string>::iterator it = this->ike_sa_address_keys.find( ike_sa.my_spi );
+
+        // If the addresses have not changed, there is nothing to do
+        if ( it != this->ike_sa_address_keys.end() ) {
+            if ( it->second == key )
+                return;
+
+            // Removes the old entry
+            map<string, set<uint64_t> >::iterator old_it = this->ike_sa_address_index.find( it->second );
+            if ( old_it != this->ike_sa_address_index.end() ) {
+                old_it->second.erase( ike_sa.my_spi );
+                if ( old_it->second.empty() )
+                    this->ike_sa_address_index.erase( old_it );
+            }
+        }
+
+        this->ike_sa_address_keys[ ike_sa.my_spi ] = key;
+        this->ike_sa_address_index[ key ].insert( ike_sa.my_spi );
+    }
+
+    void IkeSaControllerImplOpenIKE::removeIkeSaIndexes( uint64_t spi ) {
+        AutoLock auto_lock( *this->mutex_ike_sa_index );
+
+        // Removes the address index entry
+        map<uint64_t, string>::iterator key_it = this->ike_sa_address_keys.find( spi );
+        if ( key_it != this->ike_sa_address_keys.end() ) {
+            map<string, set<uint64_t> >::iterator it = this->ike_sa_address_index.find( key_it->second );
+            if ( it != this->ike_sa_address_index.end() ) {
+                it->second.erase( spi );
+                if ( it->second.empty() )
+                    this->ike_sa_address_index.erase( it );
+            }
+            this->ike_sa_address_keys.erase( key_it );
+        }
+
+        // Removes the Child SA SPI index entries still pointing to this IKE SA
+        map<uint64_t, set<uint32_t> >::iterator child_it = this->ike_sa_child_sa_spis.find( spi );
+        if ( child_it != this->ike_sa_child_sa_spis.end() ) {
+            for ( set<uint32_t>::iterator it = child_it->second.begin(); it != child_it->second.end(); it++ ) {
+                map<uint32_t, uint64_t>::iterator index_it = this->child_sa_spi_index.find( *it );
+                if ( index_it != this->child_sa_spi_index.end() && index_it->second == spi )
+                    this->child_sa_spi_index.erase( index_it );
+            }
+            this->ike_sa_child_sa_spis.erase( child_it );
+        }
+    }
+
+    void IkeSaControllerImplOpenIKE::addChildSaIndex( uint64_t ike_sa_spi, const ChildSa & child_sa ) {
+        AutoLock auto_lock( *this->mutex_ike_sa_index );
+
+        uint32_t spis[ 2 ] = { child_sa.inbound_spi, child_sa.outbound_spi };
+        for ( uint16_t i = 0; i < 2; i++ ) {
+            if ( spis[ i ] == 0 )
+                continue;
+            this->child_sa_spi_index[ spis[ i ] ] = ike_sa_spi;
+            this->ike_sa_child_sa_spis[ ike_sa_spi ].insert( spis[ i ] );
+        }
+    }
+
+    void IkeSaControllerImplOpenIKE::removeChildSaIndex( const ChildSa & child_sa ) {
+        AutoLock auto_lock( *this->mutex_ike_sa_index );
+
+        uint32_t spis[ 2 ] = { child_sa.inbound_spi, child_sa.outbound_spi };
+        for ( uint16_t i = 0; i < 2; i++ ) {
+            map<uint32_t, uint64_t>::iterator it = this->child_sa_spi_index.find( spis[ i ] );
+            if ( it == this->child_sa_spi_index.end() )
+                continue;
+
+            map<uint64_t, set<uint32_t> >::iterator child_it = this->ike_sa_child_sa_spis.find( it->second );
+            if ( child_it != this->ike_sa_child_sa_spis.end() ) {
+                child_it->second.erase( spis[ i ] );
+                if ( child_it->second.empty() )
+                    this->ike_sa_child_sa_spis.erase( child_it );
+            }
+
+            this->child_sa_spi_index.erase( it );
+        }
+    }
+
+    void IkeSaControllerImplOpenIKE::notifyBusEvent( const BusEvent & event ) {
+        // IKE_SA_EVENT
+        if ( event.type == BusEvent::IKE_SA_EVENT ) {
+            BusEventIkeSa & busevent = ( BusEventIkeSa& ) event;
+
+            // The Child SAs are moved to the new IKE SA
+            if ( busevent.ike_sa_event_type == BusEventIkeSa::IKE_SA_REKEYED ) {
+                uint64_t old_spi = busevent.ike_sa.my_spi;
+                uint64_t new_spi = ( ( IkeSa* ) busevent.data ) ->my_spi;
+
+                AutoLock auto_lock( *this->mutex_ike_sa_index );
+
+                map<uint64_t, set<uint32_t> >::iterator child_it = this->ike_sa_child_sa_spis.find( old_spi );
+                if ( child_it == this->ike_sa_child_sa_spis.end() )
+                    return ;
+
+                set<uint32_t>& new_spis = this->ike_sa_child_sa_spis[ new_spi ];
+                for ( set<uint32_t>::iterator it = child_it->second.begin(); it != child_it->second.end(); it++ ) {
+                    this->child_sa_spi_index[ *it ] = new_spi;
+                    new_spis.insert( *it );
+                }
+                this->ike_sa_child_sa_spis.erase( old_spi );
+            }
+        }
+        // CHILD_SA_EVENT
+        else if ( event.type == BusEvent::CHILD_SA_EVENT ) {
+            BusEventChildSa & busevent = ( BusEventChildSa& ) event;
+
+            if ( busevent.child_sa_event_type == BusEventChildSa::CHILD_SA_ESTABLISHED )
+                this->addChildSaIndex( busevent.ike_sa.my_spi, busevent.child_sa );
+            else if ( busevent.child_sa_event_type == BusEventChildSa::CHILD_SA_REKEYED )
+                this->addChildSaIndex( busevent.ike_sa.my_spi, *( ( ChildSa * ) busevent.data ) );
+            else if ( busevent.child_sa_event_type == BusEventChildSa::CHILD_SA_DELETED )
+                this->removeChildSaIndex( busevent.child_sa );
+        }
+    }
+
 
     void IkeSaControllerImplOpenIKE::exit( ) {
-        AutoLock auto_lock( *this->condition_ike_sa );
+        {
+            AutoLock auto_lock( *this->mutex_ike_sa_count );
 
-        this->exiting = true;
+            this->exiting = true;
 
-        // If there isn't any active IKE SA , then the close operation is already done
-        if ( this->exiting && this->ike_sa_collection.empty() ) {
-            EventBus::getInstance().sendBusEvent( auto_ptr<BusEvent> ( new BusEventCore( BusEventCore::ALL_SAS_CLOSED ) ) );
-            return ;
+            // If there isn't any active IKE SA , then the close operation is already done
+            if ( this->ike_sa_count == 0 ) {
+                EventBus::getInstance().sendBusEvent( auto_ptr<BusEvent> ( new BusEventCore( BusEventCore::ALL_SAS_CLOSED ) ) );
+                return ;
+            }
         }
 
         // else, then send close signal to each IKE SA
-        for ( map<uint64_t, IkeSa*>::iterator it = this->ike_sa_collection.begin(); it != this->ike_sa_collection.end(); it++ ) {
-            ( *it ).second->pushCommand( auto_ptr<Command> ( new CloseIkeSaCommand() ), true );
-            this->scheduleIkeSa( *it->second );
+        for ( vector<IkeSaShard*>::iterator shard_it = this->ike_sa_shards.begin(); shard_it != this->ike_sa_shards.end(); shard_it++ ) {
+            IkeSaShard& shard = **shard_it;
+            AutoLock auto_lock( *shard.mutex );
+
+            for ( map<uint64_t, IkeSa*>::iterator it = shard.ike_sa_collection.begin(); it != shard.ike_sa_collection.end(); it++ ) {
+                ( *it ).second->pushCommand( auto_ptr<Command> ( new CloseIkeSaCommand() ), true );
+                this->scheduleIkeSa( shard, *it->second );
+            }
         }
     }
 
-    void IkeSaControllerImplOpenIKE::deleteIkeSaController( IkeSa & ike_sa ) {
-        // Total number of IkeSa
-        uint32_t count = this->ike_sa_collection.size();
+    void IkeSaControllerImplOpenIKE::deleteIkeSaController( IkeSaShard & shard, IkeSa & ike_sa ) {
+        // Total number of IkeSa in the shard
+        uint32_t count = shard.ike_sa_collection.size();
 
         // Finds controller in IKE_SAs collection and deletes it
-        assert ( this->ike_sa_collection.find( ike_sa.my_spi ) != this->ike_sa_collection.end() );
-        assert ( this->scheduled_ike_sa_map.find( ike_sa.my_spi ) != this->scheduled_ike_sa_map.end() );
+        assert ( shard.ike_sa_collection.find( ike_sa.my_spi ) != shard.ike_sa_collection.end() );
+        assert ( shard.scheduled_ike_sa_map.find( ike_sa.my_spi ) != shard.scheduled_ike_sa_map.end() );
 
-        this->ike_sa_collection.erase( ike_sa.my_spi );
-        this->scheduled_ike_sa_map.erase ( ike_sa.my_spi );
+        shard.ike_sa_collection.erase( ike_sa.my_spi );
+        shard.scheduled_ike_sa_map.erase ( ike_sa.my_spi );
 
         // Only must remove one and only one IkeSa from IKE_SA collection
-        assert( count == ike_sa_collection.size() + 1 );
+        assert( count == shard.ike_sa_collection.size() + 1 );
+
+        this->removeIkeSaIndexes( ike_sa.my_spi );
+
+        AutoLock auto_lock( *this->mutex_ike_sa_count );
+
+        this->ike_sa_count--;
 
         // If this was the last remaining controller in the collection and we want to exit, then finish message controller
-        if ( this->exiting && this->ike_sa_collection.empty() )
+        if ( this->exiting && this->ike_sa_count == 0 )
             EventBus::getInstance().sendBusEvent( auto_ptr<BusEvent> ( new BusEventCore( BusEventCore::ALL_SAS_CLOSED ) ) );
 
-        Log::writeLockedMessage( "IkeSaController", "Delete IkeSa: SPI=" + Printable::toHexString( &ike_sa.my_spi, 8 ) + " Count=[" + intToString( this->ike_sa_collection.size() ) + "]", Log::LOG_INFO, true );
+        Log::writeLockedMessage( "IkeSaController", "Delete IkeSa: SPI=" + Printable::toHexString( &ike_sa.my_spi, 8 ) + " Count=[" + intToString( this->ike_sa_count ) + "]", Log::LOG_INFO, true );
     }
 
     bool IkeSaControllerImplOpenIKE::isExiting( ) {
@@ -482,14 +802,15 @@ void IkeSaControllerImplOpenIKE::requestChildSaMobility( IpAddress& ike_sa_src_a
     }
 
     void IkeSaControllerImplOpenIKE::checkIkeSa( IkeSa & ike_sa, bool delete_ike_sa ) {
-        AutoLock auto_lock( *this->condition_ike_sa );
+        IkeSaShard& shard = this->getShard( ike_sa.my_spi );
+        AutoLock auto_lock( *shard.mutex );
 
-        this->scheduled_ike_sa_map[ike_sa.my_spi] = false;
+        shard.scheduled_ike_sa_map[ike_sa.my_spi] = false;
 
         if ( delete_ike_sa ) {
             // Deletes this ike_sa from the IkeSa list
 
-            this->deleteIkeSaController( ike_sa );
+            this->deleteIkeSaController( shard, ike_sa );
 
             // We need to unlock the list after removing because deletion of an IKE_SA could lead use to a deadlock situation
             auto_lock.release();
@@ -499,11 +820,20 @@ void IkeSaControllerImplOpenIKE::requestChildSaMobility( IpAddress& ike_sa_src_a
             return;
         }
 
-        else if ( ike_sa.hasMoreCommands() ) {
-            this->scheduleIkeSa( ike_sa );
+        // The IkeSa addresses may have been changed by the command (i.e. MOBIKE)
+        this->updateIkeSaAddressIndex( ike_sa );
+
+        if ( ike_sa.hasMoreCommands() ) {
+            this->scheduleIkeSa( shard, ike_sa );
         }
     }
 
+    bool IkeSaControllerImplOpenIKE::hasMoreCommands( IkeSa & ike_sa ) {
+        IkeSaShard& shard = this->getShard( ike_sa.my_spi );
+        AutoLock auto_lock( *shard.mutex );
+        return ike_sa.hasMoreCommands();
+    }
+
     uint64_t IkeSaControllerImplOpenIKE::nextSpi() {
         AutoLock auto_lock( *this->mutex_spi );
         return current_spi++;
@@ -11,43 +11,107 @@
 
 #include <libopenikev2/ikesacontroller.h>
 #include <libopenikev2/threadcontroller.h>
+#include <libopenikev2/busobserver.h>
+#include <libopenikev2/childsa.h>
+
+#include <set>
 
 namespace openikev2 {
     class IkeSaExecuter;
 
+    /**
+     This class represents a shard of the IKE_SA collection.
+     Each shard holds the IKE_SAs whose SPI hashes to it and is protected by its own mutex.
+     @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
+    */
+    class IkeSaShard {
+        public:
+            map <uint64_t, IkeSa*> ike_sa_collection;               /**< IKE_SAs stored in this shard */
+            map <uint64_t, bool> scheduled_ike_sa_map;              /**< Map to determine wich IKE SA is already scheduled or running */
+            auto_ptr<Mutex> mutex;                                  /**< Mutex protecting the shard collections */
+    };
+
     /**
      This class implements the abstract class IkeSaControllerImpl
      @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
     */
-    class IkeSaControllerImplOpenIKE : public IkeSaControllerImpl {
+    class IkeSaControllerImplOpenIKE : public IkeSaControllerImpl, public BusObserver {
             friend class IkeSaExecuter;
 
             /****************************** ATTRIBUTES ******************************/
         protected:
-            map <uint64_t, IkeSa*> ike_sa_collection;               /**< Active IKE_SA collection */
-            deque<IkeSa*> scheduled_ike_sa_collection;              /**< IKE SAs waiting for a free IkeSaExecuter */
-            map <uint64_t, bool> scheduled_ike_sa_map;              /**< Map to determine wich IKE SA is already in the waiting queue*/
-            auto_ptr<Condition> condition_ike_sa;                   /**< Condition to synchronize the IkeSaExecuters */
+            vector<IkeSaShard*> ike_sa_shards;                      /**< Active IKE_SA collection, split in shards by SPI */
+            vector<IkeSaExecuter*> ike_sa_executers;                /**< IkeSaExecuters, each one with its own run queue */
+            uint16_t max_running_executers;                         /**< Maximum number of executers running at the same time (the rest are spare) */
+            uint16_t running_executers;                             /**< Number of executers running (not blocked on a CryptoTask) */
+            auto_ptr<Condition> condition_running;                  /**< Condition to protect the running counter and wait for a free slot */
+            uint16_t max_commands_per_slot;                         /**< Maximum number of commands executed on an IkeSa each time it is scheduled */
             bool exiting;                                           /**< Mark if the we want to exit */
+            uint32_t ike_sa_count;                                  /**< Total number of IKE SAs in all the shards */
+            auto_ptr<Mutex> mutex_ike_sa_count;                     /**< Mutex to control IKE SA counter and exiting flag accesses */
             uint32_t half_open_counter;                             /**< Half open IKE SA counter */
             auto_ptr<Mutex> mutex_half_open_counter;                /**< Mutex to control half-open counter accesses */
             auto_ptr<Mutex> mutex_spi;
             uint64_t current_spi;
 
+            map <string, set<uint64_t> > ike_sa_address_index;      /**< IKE SA SPIs indexed by their (local address, peer address) pair */
+            map <uint64_t, string> ike_sa_address_keys;             /**< Address pair key currently indexed for each IKE SA */
+            map <uint32_t, uint64_t> child_sa_spi_index;            /**< IKE SA SPI indexed by inbound/outbound Child SA SPI */
+            map <uint64_t, set<uint32_t> > ike_sa_child_sa_spis;    /**< Child SA SPIs indexed for each IKE SA */
+            auto_ptr<Mutex> mutex_ike_sa_index;                     /**< Mutex to control the address and Child SA SPI indexes */
+
 
             /****************************** METHODS ******************************/
         protected:
             /**
-             * Gets the next IkeSa from the schedule queue
-             * @return An IkeSa schedule for executing
+             * Gets the shard where the IkeSa with the indicated SPI is stored
+             * @param spi IKE SA SPI
+             * @return The shard for this SPI
+             */
+            virtual IkeSaShard& getShard( uint64_t spi );
+
+            /**
+             * Gets the IkeSaExecuter that usually executes the IkeSa with the indicated SPI
+             * @param spi IKE SA SPI
+             * @return The home IkeSaExecuter for this SPI
+             */
+            virtual IkeSaExecuter& getHomeExecuter( uint64_t spi );
+
+            /**
+             * Waits until the number of running executers is below the maximum, and counts the caller as running
              */
-            virtual IkeSa& getScheduledIkeSa(  );
+            virtual void acquireExecutionSlot();
 
             /**
-             * Adds an IkeSa to the schedule queue (if it is not already on it)
-             * This method needs that the caller locks the mutex on the scheduled collection
+             * Stops counting the caller as running (i.e. it is going to block on a CryptoTask), waking up a spare executer
              */
-            virtual void scheduleIkeSa( IkeSa& ike_sa );
+            virtual void releaseExecutionSlot();
+
+            /**
+             * Counts the caller as running again, even if the maximum is exceeded, since it has to finish its current IkeSa
+             */
+            virtual void reclaimExecutionSlot();
+
+            /**
+             * If the maximum number of running executers is exceeded, the caller stops running until there is a free slot
+             */
+            virtual void yieldExecutionSlot();
+
+            /**
+             * Steals an IkeSa from the run queue of any other IkeSaExecuter
+             * @param thief IkeSaExecuter that wants to steal work
+             * @return The stolen IkeSa, or NULL if all the run queues are empty
+             */
+            virtual IkeSa* stealIkeSa( IkeSaExecuter& thief );
+
+            /**
+             * Adds an IkeSa to the run queue of its home IkeSaExecuter (if it is not already on it).
+             * If the home IkeSaExecuter is busy, an idle one is woken up to steal it.
+             * This method needs that the caller locks the mutex of the IkeSa shard
+             * @param shard Shard where the IkeSa is stored
+             * @param ike_sa IkeSa to be scheduled
+             */
+            virtual void scheduleIkeSa( IkeSaShard& shard, IkeSa& ike_sa );
 
             /**
              * Check the state of the IkeSa after command execution.
@@ -59,10 +123,61 @@ namespace openikev2 {
             virtual void checkIkeSa( IkeSa& ike_sa, bool delete_ike_sa );
 
             /**
-            * Removes the IkeSa from the collection and deletes it
+             * Checks if the IkeSa has more commands to be executed, holding the lock of its shard
+             * @param ike_sa IkeSa to be checked
+             * @return TRUE if the IkeSa has more commands. FALSE otherwise
+             */
+            virtual bool hasMoreCommands( IkeSa& ike_sa );
+
+            /**
+            * Removes the IkeSa from the collection.
+            * This method needs that the caller locks the mutex of the IkeSa shard
+            * @param shard Shard where the IkeSa is stored
             * @param ike_sa IkeSa to be deleted
             */
-            virtual void deleteIkeSaController( IkeSa& ike_sa );
+            virtual void deleteIkeSaController( IkeSaShard& shard, IkeSa& ike_sa );
+
+            /**
+             * Gets the key used to index an IKE SA by its addresses
+             * @param addr Local address
+             * @param peer_addr Peer address
+             * @return The address pair key
+             */
+            static string getAddressKey( const IpAddress& addr, const IpAddress& peer_addr );
+
+            /**
+             * Updates the address index entry of the IkeSa if its addresses have changed (i.e. MOBIKE).
+             * The caller must have exclusive access to the IkeSa
+             * @param ike_sa IkeSa to be indexed
+             */
+            virtual void updateIkeSaAddressIndex( IkeSa& ike_sa );
+
+            /**
+             * Removes all the index entries of an IkeSa
+             * @param spi IKE SA SPI
+             */
+            virtual void removeIkeSaIndexes( uint64_t spi );
+
+            /**
+             * Adds the inbound and outbound SPIs of a Child SA to the Child SA SPI index
+             * @param ike_sa_spi SPI of the IKE SA controlling the Child SA
+             * @param child_sa Child SA to be indexed
+             */
+            virtual void addChildSaIndex( uint64_t ike_sa_spi, const ChildSa& child_sa );
+
+            /**
+             * Removes the inbound and outbound SPIs of a Child SA from the Child SA SPI index
+             * @param child_sa Child SA to be removed
+             */
+            virtual void removeChildSaIndex( const ChildSa& child_sa );
+
+            /**
+             * Gets the SPIs of the IKE SAs indexed with the indicated addresses
+             * @param addr Local address
+             * @param peer_addr Peer address
+             * @return The SPI candidates (lower SPI first)
+             */
+            virtual vector<uint64_t> getIkeSaSpisByAddress( const IpAddress& addr, const IpAddress& peer_addr );
 
             virtual bool pushCommandByAddress( const IpAddress& addr, const IpAddress& peer_addr, auto_ptr<Command> command, bool priority );
 
@@ -70,7 +185,14 @@ namespace openikev2 {
 
 
         public:
-            IkeSaControllerImplOpenIKE ( uint16_t num_command_executer );
+            /**
+             * Creates a new IkeSaControllerImplOpenIKE
+             * @param num_command_executer Number of IkeSaExecuter threads
+             * @param num_shards Number of independently locked shards of the IKE SA collection
+             * @param max_commands_per_slot Maximum number of pending commands executed on an IkeSa before it goes back to the run queue
+             * @param num_spare_executers Number of additional IkeSaExecuter threads that run while others are blocked on public key operations
+             */
+            IkeSaControllerImplOpenIKE ( uint16_t num_command_executer, uint16_t num_shards = 64, uint16_t max_commands_per_slot = 8, uint16_t num_spare_executers = 4 );
 
             virtual void incHalfOpenCounter();
 
@@ -92,6 +214,17 @@ namespace openikev2 {
 
             virtual bool pushCommandByChildSaSpi( uint32_t spi, auto_ptr<Command> command, bool priority );
 
+            /**
+             * Requests the IKE SAs using a local address to move to another one (MOBIKE).
+             * Only the established IKE SAs that negotiated MOBIKE are requested to move
+             * @param old_address Local address no longer available
+             * @param new_address New local address
+             * @return Number of IKE SAs requested to move
+             */
+            virtual uint32_t migrateIkeSas( const IpAddress& old_address, const IpAddress& new_address );
+
+            virtual void notifyBusEvent( const BusEvent& event );
+
             virtual void exit();
 
             virtual bool isExiting();
@@ -12,26 +12,122 @@
 #include <libopenikev2/eventbus.h>
 #include <libopenikev2/buseventikesa.h>
 #include <libopenikev2/log.h>
+#include <libopenikev2/autolock.h>
+#include <libopenikev2/threadcontroller.h>
 
 namespace openikev2 {
     IkeSaExecuter::IkeSaExecuter( IkeSaControllerImplOpenIKE& ike_sa_controller, uint16_t id ) :
             ike_sa_controller ( ike_sa_controller ) {
         this->id = id;
+        this->condition_ike_sa = ThreadController::getCondition();
+        this->idle = false;
+        this->reclaimed_slot = false;
     }
 
     IkeSaExecuter::~IkeSaExecuter( ) {}
 
+    IkeSa & IkeSaExecuter::getScheduledIkeSa( ) {
+        while ( true ) {
+            // First, look into the local run queue
+            {
+                AutoLock auto_lock( *this->condition_ike_sa );
+                if ( !this->scheduled_ike_sa_collection.empty() ) {
+                    IkeSa& ike_sa = *( this->scheduled_ike_sa_collection.front() );
+                    this->scheduled_ike_sa_collection.pop_front();
+                    return ike_sa;
+                }
+            }
+
+            // Then, try to steal work from the other executers
+            IkeSa* stolen_ike_sa = ike_sa_controller.stealIkeSa( *this );
+            if ( stolen_ike_sa != NULL )
+                return *stolen_ike_sa;
+
+            // Finally, waits until there is any IkeSa scheduled in this executer or someone wakes it up
+            AutoLock auto_lock( *this->condition_ike_sa );
+            if ( this->scheduled_ike_sa_collection.empty() ) {
+                this->idle = true;
+                this->condition_ike_sa->wait();
+                this->idle = false;
+            }
+        }
+    }
+
+    bool IkeSaExecuter::pushIkeSa( IkeSa & ike_sa ) {
+        AutoLock auto_lock( *this->condition_ike_sa );
+
+        this->scheduled_ike_sa_collection.push_back( &ike_sa );
+
+        if ( this->idle ) {
+            this->condition_ike_sa->notify();
+            return false;
+        }
+
+        return true;
+    }
+
+    IkeSa * IkeSaExecuter::stealIkeSa( ) {
+        AutoLock auto_lock( *this->condition_ike_sa );
+
+        if ( this->scheduled_ike_sa_collection.empty() )
+            return NULL;
+
+        IkeSa* ike_sa = this->scheduled_ike_sa_collection.back();
+        this->scheduled_ike_sa_collection.pop_back();
+
+        return ike_sa;
+    }
+
+    bool IkeSaExecuter::wakeUp( ) {
+        AutoLock auto_lock( *this->condition_ike_sa );
+
+        if ( !this->idle )
+            return false;
+
+        this->condition_ike_sa->notify();
+        return true;
+    }
+
+    void IkeSaExecuter::beginBlocking( ) {
+        ike_sa_controller.releaseExecutionSlot();
+    }
+
+    void IkeSaExecuter::endBlocking( ) {
+        ike_sa_controller.reclaimExecutionSlot();
+        this->reclaimed_slot = true;
+    }
+
     void IkeSaExecuter::run( ) {
+        // The public key operations performed by this thread let a spare executer run meanwhile
+        CryptoWorkerPool::setBlockingHandler( this );
+
+        // Spare executers wait until some other executer blocks
+        if ( this->id >= ike_sa_controller.max_running_executers )
+            ike_sa_controller.acquireExecutionSlot();
+
         // Do forever
         while ( true ) {
             // Get the next waiting IkeSa
-            IkeSa & ike_sa = ike_sa_controller.getScheduledIkeSa();
+            IkeSa & ike_sa = this->getScheduledIkeSa();
             Log::writeLockedMessage( "IkeSaExecuter[" + intToString ( this->id ) + "]", "Assigned to an IKE_SA=" + Printable::toHexString( &ike_sa.my_spi, 8 ), Log::LOG_THRD, true );
 
-            // Execute the next Command on the IkeSa
-            IkeSa::IKE_SA_ACTION action = ike_sa.processCommand();
-            bool exit = ( action == IkeSa::IKE_SA_ACTION_DELETE_IKE_SA ) ? true : false;
+            // Execute the pending Commands on the IkeSa, up to the per slot budget
+            bool exit = false;
+            uint16_t executed_commands = 0;
+            do {
+                IkeSa::IKE_SA_ACTION action = ike_sa.processCommand();
+                exit = ( action == IkeSa::IKE_SA_ACTION_DELETE_IKE_SA ) ? true : false;
+                executed_commands++;
+            } while ( !exit && executed_commands < ike_sa_controller.max_commands_per_slot && ike_sa_controller.hasMoreCommands( ike_sa ) );
+
+            // The IkeSa goes back to the run queue if it still has more commands
             ike_sa_controller.checkIkeSa( ike_sa, exit );
+
+            // After resuming from a blocking operation there may be too many executers running. Otherwise, the slot count didn't change
+            if ( this->reclaimed_slot ) {
+                this->reclaimed_slot = false;
+                ike_sa_controller.yieldExecutionSlot();
+            }
         }
     }
 }
@@ -15,20 +15,57 @@
 
 #include "ikesacontrollerimplopenike.h"
 #include "threadposix.h"
+#include "cryptoworkerpool.h"
 
 namespace openikev2 {
 
     /**
         This class represents an IKE_SA executer.
-        This class executes a Command on a IkeSa
+        This class executes a Command on a IkeSa.
+        Each IkeSaExecuter has its own run queue. When it is empty, the executer steals IKE SAs from the others.
+        While an executer is blocked on a public key operation, a spare executer runs in its place.
         @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
     */
-    class IkeSaExecuter : public ThreadPosix {
+    class IkeSaExecuter : public ThreadPosix, public CryptoBlockingHandler {
+            friend class IkeSaControllerImplOpenIKE;
+
+            /****************************** ATTRIBUTES ******************************/
         protected:
             IkeSaControllerImplOpenIKE& ike_sa_controller;
             uint16_t id;
+            deque<IkeSa*> scheduled_ike_sa_collection;      /**< IKE SAs waiting to be executed by this executer */
+            auto_ptr<Condition> condition_ike_sa;           /**< Condition to protect the run queue and wait for new IKE SAs */
+            volatile bool idle;                             /**< Indicates if the executer is waiting for work */
+            bool reclaimed_slot;                            /**< Indicates if the executer has reclaimed its slot after blocking */
 
             /****************************** METHODS ******************************/
+        protected:
+            /**
+             * Gets the next IkeSa from the local run queue, or steals one from another executer.
+             * If there is no IkeSa available, waits until one is scheduled.
+             * @return An IkeSa scheduled for executing
+             */
+            virtual IkeSa& getScheduledIkeSa();
+
+            /**
+             * Adds an IkeSa to the back of the local run queue, waking up the executer if needed
+             * @param ike_sa IkeSa to be queued
+             * @return TRUE if the executer was busy, FALSE if it was waiting for work
+             */
+            virtual bool pushIkeSa( IkeSa& ike_sa );
+
+            /**
+             * Removes the IkeSa at the back of the local run queue, to be executed by other executer
+             * @return The stolen IkeSa, or NULL if the run queue is empty
+             */
+            virtual IkeSa* stealIkeSa();
+
+            /**
+             * Wakes up the executer if it is waiting for work, so it can steal an IkeSa
+             * @return TRUE if the executer was waiting, FALSE otherwise
+             */
+            virtual bool wakeUp();
+
         public:
             /**
              * Creates a new IkeSaExecuter
@@ -37,6 +74,10 @@ namespace openikev2 {
 
             virtual void run();
 
+            virtual void beginBlocking();
+
+            virtual void endBlocking();
+
             virtual ~IkeSaExecuter();
     };
 };
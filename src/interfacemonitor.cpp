@@ -0,0 +1,124 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#include "interfacemonitor.h"
+#include "networkcontrollerimplopenike.h"
+#include "libnetlink.h"
+#include "utilsimpl.h"
+
+#include <libopenikev2/log.h>
+#include <libopenikev2/networkcontroller.h>
+
+#include <linux/rtnetlink.h>
+#include <linux/if_addr.h>
+#include <net/if.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Time to wait before receiving again after a netlink reception error (in milliseconds) */
+#define INTERFACE_MONITOR_RETRY_DELAY 100
+
+namespace openikev2 {
+    InterfaceMonitor::InterfaceMonitor( NetworkControllerImplOpenIKE& network_controller ) :
+            network_controller ( network_controller ) {
+        this->netlink_fd = netlinkOpen( RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR, NETLINK_ROUTE );
+    }
+
+    InterfaceMonitor::~InterfaceMonitor( ) {
+        close( this->netlink_fd );
+    }
+
+    void InterfaceMonitor::processAddressNotification( const nlmsghdr & n ) {
+        ifaddrmsg * ifa = ( ifaddrmsg* ) NLMSG_DATA( &n );
+
+        if ( ifa->ifa_family != AF_INET
+#ifdef HAVE_IPv6
+                && ifa->ifa_family != AF_INET6
+#endif
+           )
+            return;
+
+        // Skips loopback addresses, like the InterfaceList does
+        if ( ifa->ifa_scope == RT_SCOPE_HOST )
+            return;
+
+        // IPv6 addresses cannot be bound until DAD has finished. A new notification is received then
+        if ( n.nlmsg_type == RTM_NEWADDR && ( ifa->ifa_flags & ( IFA_F_TENTATIVE | IFA_F_DADFAILED ) ) )
+            return;
+
+        // IFA_LOCAL is the local address of point-to-point interfaces (IFA_ADDRESS is the peer one)
+        rtattr * address_attr = NULL;
+        int32_t attr_len = IFA_PAYLOAD( &n );
+        for ( rtattr * rta = IFA_RTA( ifa ); RTA_OK( rta, attr_len ); rta = RTA_NEXT( rta, attr_len ) ) {
+            if ( rta->rta_type == IFA_LOCAL )
+                address_attr = rta;
+            else if ( rta->rta_type == IFA_ADDRESS && address_attr == NULL )
+                address_attr = rta;
+        }
+
+        if ( address_attr == NULL )
+            return;
+
+        char interface_name[ IF_NAMESIZE ];
+        if ( if_indextoname( ifa->ifa_index, interface_name ) == NULL )
+            interface_name[ 0 ] = '\0';
+
+        auto_ptr<IpAddress> address = NetworkController::getIpAddress( UtilsImpl::getInternalFamily( ifa->ifa_family ), auto_ptr<ByteArray> ( new ByteArray( RTA_DATA( address_attr ), RTA_PAYLOAD( address_attr ) ) ) );
+
+        if ( n.nlmsg_type == RTM_NEWADDR )
+            this->network_controller.addInterfaceAddress( *address, interface_name );
+        else
+            this->network_controller.removeInterfaceAddress( *address );
+    }
+
+    void InterfaceMonitor::run( ) {
+        Log::writeLockedMessage( "InterfaceMonitor", "Start: Thread ID=[" + intToString( thread_id ) + "]", Log::LOG_THRD, true );
+
+        struct {
+            nlmsghdr n;
+            char data[ NLMSG_BUF_SIZE ];
+        }
+        msg;
+
+        while ( !this->network_controller.exiting ) {
+            try {
+                errno = 0;
+                int32_t len = netlinkReceiveMsg( this->netlink_fd, msg.n, sizeof( msg ) );
+
+                // Some notifications have been lost, so the interface table must be rebuilt
+                if ( len == 0 && errno == ENOBUFS ) {
+                    Log::writeLockedMessage( "InterfaceMonitor", "Address notifications lost. Resynchronizing interfaces", Log::LOG_WARN, true );
+                    this->network_controller.syncInterfaces();
+                    continue;
+                }
+
+                // Messages not coming from the kernel are ignored
+                if ( len == 0 && errno == 0 )
+                    continue;
+
+                // Other reception errors are retried after a while, so a persistent failure does not spin the thread
+                if ( len == 0 ) {
+                    if ( this->network_controller.exiting )
+                        break;
+                    Log::writeLockedMessage( "InterfaceMonitor", "Error receiving address notifications: " + string( strerror( errno ) ), Log::LOG_ERRO, true );
+                    usleep( INTERFACE_MONITOR_RETRY_DELAY * 1000 );
+                    continue;
+                }
+
+                for ( nlmsghdr * h = &msg.n; NLMSG_OK( h, len ); h = NLMSG_NEXT( h, len ) ) {
+                    if ( h->nlmsg_type == RTM_NEWADDR || h->nlmsg_type == RTM_DELADDR )
+                        this->processAddressNotification( *h );
+                }
+            }
+            catch ( Exception & ex ) {
+                Log::writeLockedMessage( "InterfaceMonitor", ex.what(), Log::LOG_ERRO, true );
+            }
+        }
+    }
+}
@@ -0,0 +1,57 @@
+/***************************************************************************
+ *   Copyright (C) 2005 by                                                 *
+ *   Alejandro Perez Mendez     alex@um.es                                 *
+ *   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+ *                                                                         *
+ *   This software may be modified and distributed under the terms         *
+ *   of the Apache license.  See the LICENSE file for details.             *
+ ***************************************************************************/
+#ifndef INTERFACEMONITOR_H
+#define INTERFACEMONITOR_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "threadposix.h"
+
+/* This header is required to assure it is included before any linux/ include */
+#include <netinet/in.h>
+#include <linux/netlink.h>
+
+namespace openikev2 {
+    class NetworkControllerImplOpenIKE;
+
+    /**
+        This class represents an interface monitor.
+        It listens to the rtnetlink address notifications and keeps the interface table of the network controller updated.
+        @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
+    */
+    class InterfaceMonitor : public ThreadPosix {
+            /****************************** ATTRIBUTES ******************************/
+        protected:
+            NetworkControllerImplOpenIKE& network_controller;
+            int32_t netlink_fd;                 /**< Socket to receive the address notifications */
+
+            /****************************** METHODS ******************************/
+        protected:
+            /**
+             * Processes an address notification (RTM_NEWADDR or RTM_DELADDR)
+             * @param n Notification message
+             */
+            virtual void processAddressNotification( const nlmsghdr& n );
+
+        public:
+            /**
+             * Creates a new InterfaceMonitor. The notifications are received since its creation.
+             * @param network_controller Network controller to be updated
+             * @throws NetlinkException If the notifications cannot be received
+             */
+            InterfaceMonitor( NetworkControllerImplOpenIKE& network_controller );
+
+            virtual void run();
+
+            virtual ~InterfaceMonitor();
+    };
+};
+#endif
@@ -51,12 +51,13 @@ namespace openikev2 {
         }
     }
 
-    Policy * IpsecControllerImplOpenIKE::findIpsecPolicy( const TrafficSelector & ts_i, const TrafficSelector & ts_r, Enums::DIRECTION dir, Enums::IPSEC_MODE mode, Enums::PROTOCOL_ID ipsec_protocol, const IpAddress & tunnel_src, const IpAddress & tunnel_dst ) {
+    auto_ptr<Policy> IpsecControllerImplOpenIKE::findIpsecPolicy( const TrafficSelector & ts_i, const TrafficSelector & ts_r, Enums::DIRECTION dir, Enums::IPSEC_MODE mode, Enums::PROTOCOL_ID ipsec_protocol, const IpAddress & tunnel_src, const IpAddress & tunnel_dst ) {
         AutoLock auto_lock ( *this->mutex_policies );
 
-        // Look in all the policies for a match
-        for ( uint16_t i = 0; i < this->ipsec_policies->size(); i++ ) {
-            Policy *policy = ipsec_policies[ i ];
+        // Look for a match in the policies whose source and destination selectors overlap ts_i and ts_r (in SPD order)
+        vector<Policy*> candidates = this->ipsec_policies.findCandidates( dir, ts_i, ts_r );
+        for ( uint16_t i = 0; i < candidates.size(); i++ ) {
+            Policy *policy = candidates[ i ];
 
             if ( policy->direction != dir )
                 continue;
@@ -106,10 +107,11 @@ namespace openikev2 {
             auto_ptr<TrafficSelector> narrowed_ts_i = TrafficSelector::intersection( ts_i, *policy_ts_i );
             auto_ptr<TrafficSelector> narrowed_ts_r = TrafficSelector::intersection( ts_r, *policy_ts_r );
 
+            // A copy is returned, since the SPD mirror may change once the lock is released
             if ( narrowed_ts_i.get() != NULL && narrowed_ts_r.get() != NULL )
-                return policy;
+                return policy->clone();
         }
-        return NULL;
+        return auto_ptr<Policy> ( NULL );
     }
 
     bool IpsecControllerImplOpenIKE::narrowPayloadTS( const Payload_TSi & received_payload_ts_i, const Payload_TSr & received_payload_ts_r, IkeSa & ike_sa, ChildSa & child_sa ) {
@@ -209,28 +211,28 @@ namespace openikev2 {
 
         for ( int16_t i = 0; i < ts_i_collection.size(); i++ ) {
             for ( int16_t j = 0; j < ts_r_collection.size() ; j++ ) {
-                Policy *inbound_policy = NULL;
-                Policy *outbound_policy = NULL;
+                auto_ptr<Policy> inbound_policy;
+                auto_ptr<Policy> outbound_policy;
                 if ( (child_sa.mode == Enums::TUNNEL_MODE) && mobility) {
                     // Look for a matching inbound policy
                     inbound_policy = findIpsecPolicy( *ts_i_collection[ i ], *ts_r_collection[ j ], Enums::DIR_IN, child_sa.mode, child_sa.ipsec_protocol, is_ha ? ike_sa.care_of_address->getIpAddress():ike_sa.peer_addr->getIpAddress(), is_ha? ike_sa.my_addr->getIpAddress():ike_sa.care_of_address->getIpAddress() );
-                    if ( inbound_policy == NULL )
+                    if ( inbound_policy.get() == NULL )
                         continue;
 
                     // And for a matching outbound policy
                     outbound_policy = findIpsecPolicy( *ts_r_collection[ j ], *ts_i_collection[ i ], Enums::DIR_OUT, child_sa.mode, child_sa.ipsec_protocol, is_ha ? ike_sa.my_addr->getIpAddress():ike_sa.care_of_address->getIpAddress(), is_ha ? ike_sa.care_of_address->getIpAddress():ike_sa.peer_addr->getIpAddress());
-                    if ( outbound_policy == NULL )
+                    if ( outbound_policy.get() == NULL )
                         continue;
                 }
                 else {
                     // Look for a matching inbound policy
                         inbound_policy = findIpsecPolicy( *ts_i_collection[ i ], *ts_r_collection[ j ], Enums::DIR_IN, child_sa.mode, child_sa.ipsec_protocol, ike_sa.peer_addr->getIpAddress(), ike_sa.my_addr->getIpAddress() );
-                        if ( inbound_policy == NULL )
+                        if ( inbound_policy.get() == NULL )
                             continue;
 
                         // And for a matching outbound policy
                         outbound_policy = findIpsecPolicy( *ts_r_collection[ j ], *ts_i_collection[ i ], Enums::DIR_OUT, child_sa.mode, child_sa.ipsec_protocol, ike_sa.my_addr->getIpAddress(), ike_sa.peer_addr->getIpAddress() );
-                        if ( outbound_policy == NULL )
+                        if ( outbound_policy.get() == NULL )
                             continue;
                 }
 
@@ -15,7 +15,7 @@
 
 #include <libopenikev2/ipseccontrollerimpl.h>
 #include "threadposix.h"
-#include "policy.h"
+#include "policyindex.h"
 
 namespace openikev2 {
 
@@ -25,7 +25,7 @@ namespace openikev2 {
     */
     class IpsecControllerImplOpenIKE: public IpsecControllerImpl, public ThreadPosix {
         protected:
-            AutoVector<Policy> ipsec_policies;          /**< Collection of IPsec policies. */
+            PolicyIndex ipsec_policies;                 /**< Collection of IPsec policies, indexed by ID and selectors. */
             auto_ptr<Mutex> mutex_policies;             /**< Mutex to controls policies acceses. */
 
         protected:
@@ -50,9 +50,9 @@ namespace openikev2 {
              * @param tunnel_src Tunnel source address.
              * @param tunnel_dst Tunnel destination address.
              * @param child_sa The Child_SA in order to establish the inbound and outbound selectors after the narrowing process
-             * @return Matching policy. NULL if not founded.
+             * @return Copy of the matching policy. NULL if not founded.
              */
-            virtual Policy* findIpsecPolicy( const TrafficSelector & ts_i, const TrafficSelector & ts_r, Enums::DIRECTION dir, Enums::IPSEC_MODE mode, Enums::PROTOCOL_ID ipsec_protocol, const IpAddress & tunnel_src, const IpAddress & tunnel_dst );
+            virtual auto_ptr<Policy> findIpsecPolicy( const TrafficSelector & ts_i, const TrafficSelector & ts_r, Enums::DIRECTION dir, Enums::IPSEC_MODE mode, Enums::PROTOCOL_ID ipsec_protocol, const IpAddress & tunnel_src, const IpAddress & tunnel_dst );
 
             virtual bool processTrafficSelectorsRoadWarrior( const Payload_TSi & received_payload_ts_i, const Payload_TSr & received_payload_ts_r, IkeSa& ike_sa, ChildSa & child_sa );
             virtual bool processTrafficSelectors( const Payload_TSi & received_payload_ts_i, const Payload_TSr & received_payload_ts_r, IkeSa& ike_sa, ChildSa & child_sa );
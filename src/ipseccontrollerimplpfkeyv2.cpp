@@ -657,7 +657,7 @@ namespace openikev2 {
         }
 
         // Insert first policy received
-        ipsec_policies->push_back( msg2Policy( &retmsg.hdr ).release() );
+        ipsec_policies.addPolicy( msg2Policy( &retmsg.hdr ) );
 
         // Insert the rest of the policies received
         while ( retmsg.hdr.sadb_msg_seq > 0 ) {
@@ -669,15 +669,16 @@ namespace openikev2 {
             }
 
             // Insert first policy received
-            ipsec_policies->push_back( msg2Policy( &retmsg.hdr ).release() );
+            ipsec_policies.addPolicy( msg2Policy( &retmsg.hdr ) );
         }
 
         // Print policies
         if ( show ) {
             Log::acquire();
-            Log::writeMessage( "IPSecController", "PF_KEY: Updating policies: Found Policies=[" + intToString( ipsec_policies->size() ) + "]", Log::LOG_IPSC, true );
-            for ( uint16_t i = 0; i < ipsec_policies->size(); i++ )
-                Log::writeMessage( "IPSecController", ipsec_policies[i]->toStringTab( 1 ), Log::LOG_POLI, false );
+            Log::writeMessage( "IPSecController", "PF_KEY: Updating policies: Found Policies=[" + intToString( ipsec_policies.size() ) + "]", Log::LOG_IPSC, true );
+            vector<Policy*> policies = ipsec_policies.getPolicies();
+            for ( uint16_t i = 0; i < policies.size(); i++ )
+                Log::writeMessage( "IPSecController", policies[i]->toStringTab( 1 ), Log::LOG_POLI, false );
             Log::release();
         }
 
@@ -702,7 +703,8 @@ namespace openikev2 {
         auto_ptr<SocketAddress> dst ( new SocketAddressPosix( *sock_dst ) );
 
         // Get policy by its ID
-        Policy & policy = this->getPolicyById( ( ( sadb_x_policy* ) message_headers[SADB_X_EXT_POLICY] )->sadb_x_policy_id );
+        auto_ptr<Policy> policy_copy = this->getPolicyById( ( ( sadb_x_policy* ) message_headers[SADB_X_EXT_POLICY] )->sadb_x_policy_id );
+        Policy & policy = *policy_copy;
 
         Log::acquire();
         Log::writeMessage( "IPSecController", "PF_KEY: Recv acquire: Policy Id=[" + intToString( policy.id ) + "]", Log::LOG_IPSC, true );
@@ -819,8 +821,9 @@ namespace openikev2 {
         if ( result->ip_protocol != ( ( sadb_address* ) message_headers[SADB_EXT_ADDRESS_DST] )->sadb_address_proto )
             throw PfkeyException( "Error parsing SPD_DUMP. Transport protocol don't match in policy addresses" );
 
-        // Obtains id
+        // Obtains id and priority
         result->id = policy->sadb_x_policy_id;
+        result->priority = policy->sadb_x_policy_priority;
 
         // Obtains prefixes
         result->selector_prefixlen_src = ( ( sadb_address* ) message_headers[SADB_EXT_ADDRESS_SRC] )->sadb_address_prefixlen;
@@ -1080,14 +1083,14 @@ namespace openikev2 {
                 delete[] ext_hdrs[i];
     }
 
-    Policy & IpsecControllerImplPfkeyv2::getPolicyById( uint32_t id ) {
+    auto_ptr<Policy> IpsecControllerImplPfkeyv2::getPolicyById( uint32_t id ) {
         AutoLock auto_lock( *this->mutex_policies );
 
-        for ( uint16_t i = 0; i < ipsec_policies->size(); i++ )
-            if ( ipsec_policies[i]->id == id )
-                return *ipsec_policies[i];
+        Policy* policy = ipsec_policies.getPolicyById( id );
+        if ( policy == NULL )
+            throw PfkeyException( "Policy ID not found in SPD" );
 
-        throw PfkeyException( "Policy ID not found in SPD" );
+        return policy->clone();
     }
 
     void IpsecControllerImplPfkeyv2::createIpsecPolicy( vector<TrafficSelector*> src_sel, vector<TrafficSelector*> dst_sel, Enums::DIRECTION direction, Enums::POLICY_ACTION action, uint32_t priority, Enums::PROTOCOL_ID ipsec_protocol, Enums::IPSEC_MODE mode, const IpAddress * src_tunnel, const IpAddress * dst_tunnel , bool autogen, bool sub) {
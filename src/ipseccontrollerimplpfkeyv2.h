@@ -236,11 +236,11 @@ namespace openikev2 {
             virtual void updatePolicies( bool show );
 
             /**
-             * Gets a IPsec policy by its ID.
+             * Gets a copy of an IPsec policy by its ID, so it can be used after the SPD mirror changes.
              * @param id Policy ID.
              * @return Corresponding policy. Exception if not found
              */
-            virtual Policy& getPolicyById( uint32_t id );
+            virtual auto_ptr<Policy> getPolicyById( uint32_t id );
 
         public:
             /**
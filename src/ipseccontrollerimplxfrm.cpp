@@ -23,24 +23,37 @@
 #include "utilsimpl.h"
 #include "roadwarriorpolicies.h"
 #include "ipaddressopenike.h"
+#include "xfrmeventprocessor.h"
 
 #include <netinet/in.h>
 #include <stdio.h>
+#include <time.h>
+#include <set>
 
 namespace openikev2 {
 
-    IpsecControllerImplXfrm::IpsecControllerImplXfrm() {
+    IpsecControllerImplXfrm::IpsecControllerImplXfrm( uint32_t acquire_hold_time ) {
         this->name = "XFRM";
         netlink_bcast_fd = -1;
         this->sequence_number = 0;
         this->mutex_policies = ThreadController::getMutex();
         this->exiting = false;
-        this->netlink_bcast_fd = netlinkOpen( XFRMGRP_ACQUIRE | XFRMGRP_EXPIRE, NETLINK_XFRM );
+        this->coalesced_acquires = 0;
+        this->acquire_hold_time = acquire_hold_time;
+        this->condition_events = ThreadController::getCondition();
+        this->event_processor = new XfrmEventProcessor( *this );
+        this->netlink_bcast_fd = netlinkOpen( XFRMGRP_ACQUIRE | XFRMGRP_EXPIRE | XFRMGRP_POLICY, NETLINK_XFRM );
         this->updatePolicies( false );
     }
 
     IpsecControllerImplXfrm::~IpsecControllerImplXfrm() {
         close( this->netlink_bcast_fd );
+        delete this->event_processor;
+    }
+
+    void IpsecControllerImplXfrm::start( ) {
+        this->event_processor->start();
+        ThreadPosix::start();
     }
 
     void IpsecControllerImplXfrm::xfrmFlushIpsecPolicies() {
@@ -82,6 +95,15 @@ namespace openikev2 {
     }
 
     void IpsecControllerImplXfrm::xfrmDeleteIpsecSa( const IpAddress & src, const IpAddress & dst, Enums::PROTOCOL_ID protocol, uint32_t spi ) {
+        NetlinkBatch batch;
+        this->xfrmDeleteIpsecSa( batch, src, dst, protocol, spi );
+        this->xfrmSendBatch( batch );
+
+        if ( batch.getError( 0 ) != 0 )
+            throw IpsecException( "Error performing a DELETE IPSEC SA action" );
+    }
+
+    uint16_t IpsecControllerImplXfrm::xfrmDeleteIpsecSa( NetlinkBatch& batch, const IpAddress & src, const IpAddress & dst, Enums::PROTOCOL_ID protocol, uint32_t spi ) {
         struct {
             struct nlmsghdr n;
             struct xfrm_usersa_id id;
@@ -102,15 +124,7 @@ namespace openikev2 {
 
         req.n.nlmsg_len = NLMSG_ALIGN( NLMSG_LENGTH( sizeof( req.id ) ) );
 
-        int32_t fd = netlinkOpen( 0, NETLINK_XFRM );
-        netlinkSendMsg( fd, req.n );
-
-        if ( netlinkReceiveAck( fd ) != 0 ) {
-            close( fd );
-            throw IpsecException( "Error performing a DELETE IPSEC SA action" );
-        }
-
-        close( fd );
+        return batch.addMessage( req.n );
     }
 
     uint32_t IpsecControllerImplXfrm::xfrmGetSpi( const IpAddress & src, const IpAddress & dst, Enums::PROTOCOL_ID protocol, uint32_t reqid, uint32_t min, uint32_t max ) {
@@ -169,6 +183,15 @@ namespace openikev2 {
 
 
     void IpsecControllerImplXfrm::xfrmAddUpdateIpsecSa( uint16_t operation, const IpAddress & src, const IpAddress & dst, Enums::PROTOCOL_ID protocol, Enums::IPSEC_MODE mode, uint32_t spi, string encr_type, ByteArray & encr_key, string integ_type, ByteArray & integ_key, uint32_t limit_soft_time, uint32_t limit_hard_time, uint32_t limit_hard_octets, uint32_t reqid, const TrafficSelector& src_sel, const TrafficSelector& dst_sel ) {
+        NetlinkBatch batch;
+        this->xfrmAddUpdateIpsecSa( batch, operation, src, dst, protocol, mode, spi, encr_type, encr_key, integ_type, integ_key, limit_soft_time, limit_hard_time, limit_hard_octets, reqid, src_sel, dst_sel );
+        this->xfrmSendBatch( batch );
+
+        if ( batch.getError( 0 ) != 0 )
+            throw IpsecException( "Error performing an UPDATE/ADD action" );
+    }
+
+    uint16_t IpsecControllerImplXfrm::xfrmAddUpdateIpsecSa( NetlinkBatch& batch, uint16_t operation, const IpAddress & src, const IpAddress & dst, Enums::PROTOCOL_ID protocol, Enums::IPSEC_MODE mode, uint32_t spi, string encr_type, ByteArray & encr_key, string integ_type, ByteArray & integ_key, uint32_t limit_soft_time, uint32_t limit_hard_time, uint32_t limit_hard_octets, uint32_t reqid, const TrafficSelector& src_sel, const TrafficSelector& dst_sel ) {
         struct {
             struct nlmsghdr n;
             struct xfrm_usersa_info xsinfo;
@@ -246,18 +269,25 @@ namespace openikev2 {
             netlinkAddattr( req.n, sizeof( req.buf ), XFRMA_ALG_AUTH, ByteArray ( &alg, len ) );
         }
 
-        int32_t fd = netlinkOpen( 0, NETLINK_XFRM );
-        netlinkSendMsg( fd, req.n );
+        return batch.addMessage( req.n );
+    }
 
-        if ( int error = netlinkReceiveAck( fd ) != 0 ) {
-            close( fd );
-            throw IpsecException( "Error performing an UPDATE/ADD action" );
-        }
+    void IpsecControllerImplXfrm::xfrmCreateIpsecPolicy( const IpAddress & src_sel, uint8_t src_prefixlen, uint16_t src_port, const IpAddress & dst_sel, uint8_t dst_prefixlen, uint16_t dst_port, uint8_t ip_protocol, Enums::DIRECTION dir, Enums::POLICY_ACTION action ,Enums::PROTOCOL_ID protocol, Enums::IPSEC_MODE mode, uint32_t priority, const IpAddress * tunnel_src, const IpAddress * tunnel_dst, bool autogen, bool sub ) {
+        NetlinkBatch batch;
+        this->xfrmCreateIpsecPolicy( batch, src_sel, src_prefixlen, src_port, dst_sel, dst_prefixlen, dst_port, ip_protocol, dir, action, protocol, mode, priority, tunnel_src, tunnel_dst, sub );
+        this->xfrmSendBatch( batch );
 
-        close( fd );
+        // an already existing policy is not an error
+        if ( batch.getError( 0 ) != 0 && batch.getError( 0 ) != -EEXIST )
+            throw IpsecException( "Error performing an CREATE POLICY action" );
+
+        this->mirrorPolicyReply( batch.getReply( 1 ) );
+
+        if ( autogen )
+            this->xfrmAutogenerateSas( src_sel, src_prefixlen, src_port, dst_sel, dst_prefixlen, dst_port, ip_protocol, dir, protocol, mode, priority, tunnel_src, tunnel_dst );
     }
 
-    void IpsecControllerImplXfrm::xfrmCreateIpsecPolicy( const IpAddress & src_sel, uint8_t src_prefixlen, uint16_t src_port, const IpAddress & dst_sel, uint8_t dst_prefixlen, uint16_t dst_port, uint8_t ip_protocol, Enums::DIRECTION dir, Enums::POLICY_ACTION action ,Enums::PROTOCOL_ID protocol, Enums::IPSEC_MODE mode, uint32_t priority, const IpAddress * tunnel_src, const IpAddress * tunnel_dst, bool autogen, bool sub ) {
+    uint16_t IpsecControllerImplXfrm::xfrmCreateIpsecPolicy( NetlinkBatch& batch, const IpAddress & src_sel, uint8_t src_prefixlen, uint16_t src_port, const IpAddress & dst_sel, uint8_t dst_prefixlen, uint16_t dst_port, uint8_t ip_protocol, Enums::DIRECTION dir, Enums::POLICY_ACTION action ,Enums::PROTOCOL_ID protocol, Enums::IPSEC_MODE mode, uint32_t priority, const IpAddress * tunnel_src, const IpAddress * tunnel_dst, bool sub ) {
         struct {
             struct nlmsghdr n;
             struct xfrm_userpolicy_info pol;
@@ -346,21 +376,33 @@ namespace openikev2 {
             netlinkAddattr( req.n, sizeof( req.buf ), XFRMA_TMPL, temp );
         }
 
-        int32_t fd = netlinkOpen( 0, NETLINK_XFRM );
-        netlinkSendMsg( fd, req.n );
+        uint16_t index = batch.addMessage( req.n );
 
-        int myerror = netlinkReceiveAck( fd );
-        if ( myerror != 0 ) {
-            if (myerror != -17) {
-                close( fd );
-                throw IpsecException( "Error performing an CREATE POLICY action" );
-            }
+        // retrieves the created policy (and its kernel index) to update the SPD mirror
+        struct {
+            struct nlmsghdr n;
+            struct xfrm_userpolicy_id id;
+            char buf[ RTA_BUF_SIZE ];
         }
+        get;
 
-        close( fd );
+        memset( &get, 0, sizeof( get ) );
+
+        get.n.nlmsg_len = NLMSG_ALIGN( NLMSG_LENGTH( sizeof( get.id ) ) );
+        get.n.nlmsg_flags = NLM_F_REQUEST;
+        get.n.nlmsg_type = XFRM_MSG_GETPOLICY;
+        get.id.sel = req.pol.sel;
+        get.id.dir = req.pol.dir;
+
+        netlinkAddattr( get.n, sizeof( get ), XFRMA_POLICY_TYPE, temp2 );
 
+        batch.addMessage( get.n );
 
-        if (autogen && protocol != Enums::PROTO_NONE ){
+        return index;
+    }
+
+    void IpsecControllerImplXfrm::xfrmAutogenerateSas( const IpAddress & src_sel, uint8_t src_prefixlen, uint16_t src_port, const IpAddress & dst_sel, uint8_t dst_prefixlen, uint16_t dst_port, uint8_t ip_protocol, Enums::DIRECTION dir, Enums::PROTOCOL_ID protocol, Enums::IPSEC_MODE mode, uint32_t priority, const IpAddress * tunnel_src, const IpAddress * tunnel_dst ) {
+        if ( protocol != Enums::PROTO_NONE ){
             // Si la politica es modo tunel y tiene las direcciones de tunel asignadas,
             if ((mode == Enums::TUNNEL_MODE && tunnel_src != NULL && tunnel_dst != NULL)){
                 // Estos valores de puerto son un ejemplo porque hay que poner alguno
@@ -377,6 +419,20 @@ namespace openikev2 {
     }
 
     void IpsecControllerImplXfrm::xfrmDeleteIpsecPolicy( const IpAddress & src_sel, uint8_t src_prefixlen, uint16_t src_port, const IpAddress & dst_sel, uint8_t dst_prefixlen, uint16_t dst_port, uint8_t ip_protocol, Enums::DIRECTION dir ) {
+        NetlinkBatch batch;
+        uint16_t index = this->xfrmDeleteIpsecPolicy( batch, src_sel, src_prefixlen, src_port, dst_sel, dst_prefixlen, dst_port, ip_protocol, dir );
+        this->xfrmSendBatch( batch );
+
+        if ( batch.getError( index ) != 0 )
+            throw IpsecException( "Error performing an DELETE POLICY action" );
+
+        // the policy retrieved just before deleting it indicates which one must be removed from the SPD mirror
+        const nlmsghdr* reply = batch.getReply( index - 1 );
+        if ( reply != NULL && reply->nlmsg_type == XFRM_MSG_NEWPOLICY )
+            this->mirrorRemovePolicy( ( ( xfrm_userpolicy_info* ) NLMSG_DATA( reply ) ) ->index );
+    }
+
+    uint16_t IpsecControllerImplXfrm::xfrmDeleteIpsecPolicy( NetlinkBatch& batch, const IpAddress & src_sel, uint8_t src_prefixlen, uint16_t src_port, const IpAddress & dst_sel, uint8_t dst_prefixlen, uint16_t dst_port, uint8_t ip_protocol, Enums::DIRECTION dir ) {
         struct {
             struct nlmsghdr n;
             struct xfrm_userpolicy_id pol;
@@ -416,14 +472,12 @@ namespace openikev2 {
                 break;
         }
 
-        int32_t fd = netlinkOpen( 0, NETLINK_XFRM );
-        netlinkSendMsg( fd, req.n );
+        // retrieves the policy first, to know its kernel index
+        req.n.nlmsg_type = XFRM_MSG_GETPOLICY;
+        batch.addMessage( req.n );
 
-        if ( netlinkReceiveAck( fd ) != 0 ) {
-            close( fd );
-            throw IpsecException( "Error performing an DELETE POLICY action" );
-        }
-        close( fd );
+        req.n.nlmsg_type = XFRM_MSG_DELPOLICY;
+        return batch.addMessage( req.n );
     }
 
     string IpsecControllerImplXfrm::getXfrmEncrAlgo( const Transform* encr_transform ) {
@@ -538,13 +592,9 @@ namespace openikev2 {
     void IpsecControllerImplXfrm::processAcquire( const nlmsghdr & n ) {
         xfrm_user_acquire * acquire = ( xfrm_user_acquire* ) NLMSG_DATA( &n );
 
-        NetworkController::refreshInterfaces();
-
         // BY NOW, ALL THE POLICY SHOULD BE IPv6 or IPv4
         Enums::ADDR_FAMILY family = UtilsImpl::getInternalFamily( acquire->policy.sel.family );
 
-        this->updatePolicies( false );
-
         auto_ptr<IpAddress> src = NetworkController::getIpAddress( family, auto_ptr<ByteArray> ( new ByteArray( &acquire->saddr, sizeof ( acquire->saddr ) ) ) );
         auto_ptr<IpAddress> dst = NetworkController::getIpAddress( family, auto_ptr<ByteArray> ( new ByteArray( &acquire->id.daddr, sizeof ( acquire->id.daddr ) ) ) );
         auto_ptr<IpAddress> src_sel = NetworkController::getIpAddress( family, auto_ptr<ByteArray> ( new ByteArray( &acquire->sel.saddr, sizeof ( acquire->sel.saddr ) ) ) );
@@ -555,8 +605,11 @@ namespace openikev2 {
         uint16_t dst_sel_port = ntohs( acquire->sel.dport );
         uint8_t sel_ip_proto = acquire->sel.proto;
 
-        // Get policy by its ID
-        Policy & policy = this->getIpsecPolicyById( acquire->policy.index );
+        // Get policy by its ID. If the SPD mirror doesn't know it, performs a full resync
+        if ( !this->hasIpsecPolicy( acquire->policy.index ) )
+            this->updatePolicies( false );
+        auto_ptr<Policy> policy_copy = this->getIpsecPolicyById( acquire->policy.index );
+        Policy & policy = *policy_copy;
 
         if (policy.type != Enums::POLICY_MAIN ){
 
@@ -662,6 +715,144 @@ namespace openikev2 {
         IpsecControllerImplOpenIKE::processExpire( *src_addr, *dst_addr, ntohl( expire->state.id.spi ), expire->hard );
     }
 
+    string IpsecControllerImplXfrm::getAcquireKey( const xfrm_address_t & src, const xfrm_address_t & dst, uint32_t policy_id ) {
+        string key( ( const char* ) &src, sizeof( xfrm_address_t ) );
+        key.append( ( const char* ) &dst, sizeof( xfrm_address_t ) );
+        if ( policy_id != 0 )
+            key.append( ( const char* ) &policy_id, sizeof( policy_id ) );
+        return key;
+    }
+
+    uint64_t IpsecControllerImplXfrm::getMonotonicTime( ) {
+        struct timespec now;
+        clock_gettime( CLOCK_MONOTONIC, &now );
+        return now.tv_sec;
+    }
+
+    void IpsecControllerImplXfrm::queueAcquire( const nlmsghdr & n ) {
+        xfrm_user_acquire * acquire = ( xfrm_user_acquire* ) NLMSG_DATA( &n );
+        string key = getAcquireKey( acquire->saddr, acquire->id.daddr, acquire->policy.index );
+        uint64_t now = getMonotonicTime();
+
+        AutoLock auto_lock( *this->condition_events );
+
+        // If there is a negotiation in progress for this acquire, it is discarded
+        map<string, uint64_t>::iterator it = this->inflight_acquires.find( key );
+        if ( it != this->inflight_acquires.end() && it->second > now ) {
+            this->coalesced_acquires++;
+            return;
+        }
+
+        this->inflight_acquires[ key ] = now + this->acquire_hold_time;
+        this->pending_events.push_back( vector<uint8_t>( ( uint8_t* ) &n, ( uint8_t* ) &n + n.nlmsg_len ) );
+        this->condition_events->notify();
+    }
+
+    void IpsecControllerImplXfrm::queueExpire( const nlmsghdr & n ) {
+        AutoLock auto_lock( *this->condition_events );
+        this->pending_events.push_back( vector<uint8_t>( ( uint8_t* ) &n, ( uint8_t* ) &n + n.nlmsg_len ) );
+        this->condition_events->notify();
+    }
+
+    void IpsecControllerImplXfrm::releaseAcquires( const IpAddress & src, const IpAddress & dst ) {
+        xfrm_address_t src_address = this->getXfrmAddress( src );
+        xfrm_address_t dst_address = this->getXfrmAddress( dst );
+        string prefixes[ 2 ] = { getAcquireKey( src_address, dst_address, 0 ), getAcquireKey( dst_address, src_address, 0 ) };
+
+        AutoLock auto_lock( *this->condition_events );
+
+        // The keys of the same address pair are consecutive, since they start by the addresses
+        for ( uint16_t i = 0; i < 2; i++ ) {
+            map<string, uint64_t>::iterator it = this->inflight_acquires.lower_bound( prefixes[ i ] );
+            while ( it != this->inflight_acquires.end() && it->first.compare( 0, prefixes[ i ].size(), prefixes[ i ] ) == 0 )
+                this->inflight_acquires.erase( it++ );
+        }
+    }
+
+    bool IpsecControllerImplXfrm::getPendingEvents( deque<vector<uint8_t> >& events ) {
+        AutoLock auto_lock( *this->condition_events );
+
+        while ( this->pending_events.empty() && !this->exiting )
+            this->condition_events->wait();
+
+        if ( this->exiting )
+            return false;
+
+        events.swap( this->pending_events );
+        return true;
+    }
+
+    void IpsecControllerImplXfrm::processEvents( deque<vector<uint8_t> >& events ) {
+        // Looks for the acquires and the hard expirations of the batch
+        bool has_acquires = false;
+        set<uint32_t> hard_expired_spis;
+        for ( deque<vector<uint8_t> >::iterator it = events.begin(); it != events.end(); it++ ) {
+            nlmsghdr* n = ( nlmsghdr* ) &( *it ) [ 0 ];
+            if ( n->nlmsg_type == XFRM_MSG_ACQUIRE )
+                has_acquires = true;
+            else if ( ( ( xfrm_user_expire* ) NLMSG_DATA( n ) ) ->hard )
+                hard_expired_spis.insert( ( ( xfrm_user_expire* ) NLMSG_DATA( n ) ) ->state.id.spi );
+        }
+
+        // The interfaces are refreshed once for all the acquires
+        if ( has_acquires )
+            NetworkController::refreshInterfaces();
+
+        set<uint32_t> soft_processed_spis, hard_processed_spis;
+        for ( deque<vector<uint8_t> >::iterator it = events.begin(); it != events.end(); it++ ) {
+            nlmsghdr* n = ( nlmsghdr* ) &( *it ) [ 0 ];
+
+            try {
+                if ( n->nlmsg_type == XFRM_MSG_ACQUIRE ) {
+                    processAcquire( *n );
+                    continue;
+                }
+
+                // Skips the repeated expirations, and the soft ones of SAs also expiring hard (a rekey is useless)
+                xfrm_user_expire * expire = ( xfrm_user_expire* ) NLMSG_DATA( n );
+                uint32_t spi = expire->state.id.spi;
+                if ( expire->hard ) {
+                    if ( !hard_processed_spis.insert( spi ).second )
+                        continue;
+                }
+                else if ( hard_expired_spis.count( spi ) || !soft_processed_spis.insert( spi ).second )
+                    continue;
+
+                processExpire( *n );
+            }
+            catch ( Exception & ex ) {
+                Log::writeLockedMessage( "IpsecControllerImplXfrm", ex.what(), Log::LOG_ERRO, true );
+
+                // A failed acquire must not block the following ones
+                if ( n->nlmsg_type == XFRM_MSG_ACQUIRE ) {
+                    xfrm_user_acquire * acquire = ( xfrm_user_acquire* ) NLMSG_DATA( n );
+                    AutoLock auto_lock( *this->condition_events );
+                    this->inflight_acquires.erase( getAcquireKey( acquire->saddr, acquire->id.daddr, acquire->policy.index ) );
+                }
+            }
+        }
+
+        events.clear();
+
+        // Forgets the acquires whose negotiation should have already finished, and reports the discarded ones
+        uint32_t coalesced = 0;
+        {
+            AutoLock auto_lock( *this->condition_events );
+            uint64_t now = getMonotonicTime();
+            for ( map<string, uint64_t>::iterator it = this->inflight_acquires.begin(); it != this->inflight_acquires.end(); )
+                if ( it->second <= now )
+                    this->inflight_acquires.erase( it++ );
+                else
+                    it++;
+
+            coalesced = this->coalesced_acquires;
+            this->coalesced_acquires = 0;
+        }
+
+        if ( coalesced > 0 )
+            Log::writeLockedMessage( "IpsecController", "Discarded " + intToString( coalesced ) + " duplicated acquires", Log::LOG_IPSC, true );
+    }
+
     void IpsecControllerImplXfrm::run( ) {
         Log::writeLockedMessage( "IpsecControllerXfrm", "Start: Thread ID=[" + intToString( thread_id ) + "]", Log::LOG_THRD, true );
 
@@ -674,15 +865,30 @@ namespace openikev2 {
         while ( !exiting ) {
             try {
                 uint16_t len = netlinkReceiveMsg( this->netlink_bcast_fd, msg.n, sizeof( msg ) );
+
+                // Some notifications have been lost, so the SPD mirror must be rebuilt
+                if ( len == 0 && errno == ENOBUFS && !exiting ) {
+                    Log::writeLockedMessage( "IpsecController", "XFRM notifications lost. Resynchronizing SPD", Log::LOG_WARN, true );
+                    this->updatePolicies( false );
+                    continue;
+                }
+
                 if ( len == 0 || len != msg.n.nlmsg_len || exiting )
                     continue;
 
                 switch ( msg.n.nlmsg_type ) {
                     case XFRM_MSG_ACQUIRE:
-                        processAcquire( msg.n );
+                        queueAcquire( msg.n );
                         break;
                     case XFRM_MSG_EXPIRE:
-                        processExpire( msg.n );
+                        queueExpire( msg.n );
+                        break;
+                    case XFRM_MSG_NEWPOLICY:
+                    case XFRM_MSG_UPDPOLICY:
+                    case XFRM_MSG_DELPOLICY:
+                    case XFRM_MSG_POLEXPIRE:
+                    case XFRM_MSG_FLUSHPOLICY:
+                        processPolicyNotification( msg.n );
                         break;
                     default:
                         // ignored
@@ -743,108 +949,221 @@ namespace openikev2 {
                 }
 
                 // Parseamos la politica
-                struct xfrm_userpolicy_info *xpinfo = ( xfrm_userpolicy_info* ) NLMSG_DATA( h );
+                this->ipsec_policies.addPolicy( this->parsePolicy( *h ) );
 
-                auto_ptr<Policy> policy ( new Policy() );
-                policy->id = xpinfo->index;
+                // err = filter(&nladdr, h, arg1);
+                h = NLMSG_NEXT( h, len );
+            }
 
-                switch ( xpinfo->dir ) {
-                    case XFRM_POLICY_IN:
-                        policy->direction = Enums::DIR_IN;
-                        break;
-                    case XFRM_POLICY_OUT:
-                        policy->direction = Enums::DIR_OUT;
-                        break;
-                    case XFRM_POLICY_FWD:
-                        policy->direction = Enums::DIR_FWD;
-                        break;
-                    default:
-                        assert ( "Unknown direction" && 0 );
-                }
+            // Get the next message until NLMSG_DONE received
+            len = netlinkReceiveMsg( fd, res.nlh, sizeof( res ) );
+        }
 
-                Enums::ADDR_FAMILY family = UtilsImpl::getInternalFamily( xpinfo->sel.family );
+        close( fd );
 
-                policy->selector_src = NetworkController::getIpAddress( family, auto_ptr<ByteArray> ( new ByteArray( &xpinfo->sel.saddr, sizeof ( xpinfo->sel.saddr ) ) ) );
-                policy->selector_dst = NetworkController::getIpAddress( family, auto_ptr<ByteArray> ( new ByteArray( &xpinfo->sel.daddr, sizeof ( xpinfo->sel.daddr ) ) ) );
+        // Print policies
+        if ( show ) {
+            Log::acquire();
+            Log::writeMessage( "IpsecController", "Updating policies: Found Policies=[" + intToString( ipsec_policies.size() ) + "]", Log::LOG_IPSC, true );
+            vector<Policy*> policies = this->ipsec_policies.getPolicies();
+            for ( vector<Policy*>::iterator it = policies.begin(); it != policies.end(); it++ )
+                Log::writeMessage( "IpsecController", ( *it ) ->toStringTab( 1 ), Log::LOG_POLI, false );
+            Log::release();
+        }
+    }
 
-                policy->selector_src_port = ntohs( xpinfo->sel.sport );
-                policy->selector_dst_port = ntohs( xpinfo->sel.dport );
-                policy->icmp_type = ntohs( xpinfo->sel.sport );
-                policy->icmp_code = ntohs( xpinfo->sel.dport );
+    auto_ptr<Policy> IpsecControllerImplXfrm::parsePolicy( const nlmsghdr & n ) {
+        const struct xfrm_userpolicy_info *xpinfo = ( xfrm_userpolicy_info* ) NLMSG_DATA( &n );
 
-                policy->selector_prefixlen_src = xpinfo->sel.prefixlen_s;
-                policy->selector_prefixlen_dst = xpinfo->sel.prefixlen_d;
-                policy->ip_protocol = xpinfo->sel.proto;
-                policy->type = Enums::POLICY_MAIN; // Por defecto es Main
+        auto_ptr<Policy> policy ( new Policy() );
+        policy->id = xpinfo->index;
+        policy->priority = xpinfo->priority;
 
-                struct rtattr* tb[ RTA_BUF_SIZE ];
-                memset( tb, 0, sizeof( tb ) );
-                uint16_t ntb = netlinkParseRtattrByIndex( tb, RTA_BUF_SIZE, XFRMP_RTA( xpinfo ), len - NLMSG_LENGTH( sizeof( *xpinfo ) ) );
+        switch ( xpinfo->dir ) {
+            case XFRM_POLICY_IN:
+                policy->direction = Enums::DIR_IN;
+                break;
+            case XFRM_POLICY_OUT:
+                policy->direction = Enums::DIR_OUT;
+                break;
+            case XFRM_POLICY_FWD:
+                policy->direction = Enums::DIR_FWD;
+                break;
+            default:
+                assert ( "Unknown direction" && 0 );
+        }
 
-                // Find template attributes
-                for ( uint16_t i = 0; i < ntb; i++ ) {
-                    if ( tb[ i ] ->rta_type == XFRMA_POLICY_TYPE ){
-                         xfrm_userpolicy_type* policy_type = ( xfrm_userpolicy_type* ) RTA_DATA( tb[ i ] );
+        Enums::ADDR_FAMILY family = UtilsImpl::getInternalFamily( xpinfo->sel.family );
 
-                        if (policy_type->type == XFRM_POLICY_TYPE_MAIN)
-                            policy->type = Enums::POLICY_MAIN;
-                        else if (policy_type->type == XFRM_POLICY_TYPE_SUB)
-                            policy->type = Enums::POLICY_SUB;
-                        else
-                            policy->type = Enums::POLICY_MAIN;
+        policy->selector_src = NetworkController::getIpAddress( family, auto_ptr<ByteArray> ( new ByteArray( &xpinfo->sel.saddr, sizeof ( xpinfo->sel.saddr ) ) ) );
+        policy->selector_dst = NetworkController::getIpAddress( family, auto_ptr<ByteArray> ( new ByteArray( &xpinfo->sel.daddr, sizeof ( xpinfo->sel.daddr ) ) ) );
 
-                    }
+        policy->selector_src_port = ntohs( xpinfo->sel.sport );
+        policy->selector_dst_port = ntohs( xpinfo->sel.dport );
+        policy->icmp_type = ntohs( xpinfo->sel.sport );
+        policy->icmp_code = ntohs( xpinfo->sel.dport );
 
-                    if ( tb[ i ] ->rta_type != XFRMA_TMPL )
-                        continue;
+        policy->selector_prefixlen_src = xpinfo->sel.prefixlen_s;
+        policy->selector_prefixlen_dst = xpinfo->sel.prefixlen_d;
+        policy->ip_protocol = xpinfo->sel.proto;
+        policy->type = Enums::POLICY_MAIN; // Por defecto es Main
 
-                    int len = tb[ i ] ->rta_len;
-                    xfrm_user_tmpl* templates = ( xfrm_user_tmpl* ) RTA_DATA( tb[ i ] );
+        struct rtattr* tb[ RTA_BUF_SIZE ];
+        memset( tb, 0, sizeof( tb ) );
+        uint16_t ntb = netlinkParseRtattrByIndex( tb, RTA_BUF_SIZE, XFRMP_RTA( xpinfo ), n.nlmsg_len - NLMSG_SPACE( sizeof( *xpinfo ) ) );
 
-                    //Gets the number of templates
-                    int ntmpls = len / sizeof( struct xfrm_user_tmpl );
+        // Find template attributes
+        for ( uint16_t i = 0; i < ntb; i++ ) {
+            if ( tb[ i ] ->rta_type == XFRMA_POLICY_TYPE ){
+                 xfrm_userpolicy_type* policy_type = ( xfrm_userpolicy_type* ) RTA_DATA( tb[ i ] );
 
-                    // If there are more than one sa, we only use the first one
-                    if ( ntmpls > 1 )
-                        Log::writeLockedMessage( "IpsecController", "Warning: Policy has more than one request. SA BUNDLES are obsoleted and not supported.", Log::LOG_WARN, true );
+                if (policy_type->type == XFRM_POLICY_TYPE_MAIN)
+                    policy->type = Enums::POLICY_MAIN;
+                else if (policy_type->type == XFRM_POLICY_TYPE_SUB)
+                    policy->type = Enums::POLICY_SUB;
+                else
+                    policy->type = Enums::POLICY_MAIN;
 
-                    struct xfrm_user_tmpl *tmpl = &templates[ 0 ];
+            }
 
-                    auto_ptr<SaRequest> request ( new SaRequest() );
+            if ( tb[ i ] ->rta_type != XFRMA_TMPL )
+                continue;
 
-                    request->mode = ( tmpl->mode == 0 ) ? Enums::TRANSPORT_MODE : Enums::TUNNEL_MODE;
-                    request->request_id = tmpl->reqid;
-                    request->ipsec_protocol = ( tmpl->id.proto == IPPROTO_ESP ) ? Enums::PROTO_ESP : Enums::PROTO_AH;
-                    if ( request->mode == Enums::TUNNEL_MODE ) {
-                        Enums::ADDR_FAMILY family = UtilsImpl::getInternalFamily( tmpl->family );
-                        request->tunnel_src = NetworkController::getIpAddress( family, auto_ptr<ByteArray> ( new ByteArray( & tmpl->saddr, sizeof ( tmpl->saddr ) ) ) );
-                        request->tunnel_dst = NetworkController::getIpAddress( family, auto_ptr<ByteArray> ( new ByteArray( & tmpl->id.daddr, sizeof ( tmpl->id.daddr ) ) ) );
-                    }
+            int len = tb[ i ] ->rta_len;
+            xfrm_user_tmpl* templates = ( xfrm_user_tmpl* ) RTA_DATA( tb[ i ] );
 
-                    request->level = ( request->request_id == 0 ) ? SaRequest::LEVEL_REQUIRE : SaRequest::LEVEL_UNIQUE;
+            //Gets the number of templates
+            int ntmpls = len / sizeof( struct xfrm_user_tmpl );
 
-                    policy->sa_request = request;
-                }
+            // If there are more than one sa, we only use the first one
+            if ( ntmpls > 1 )
+                Log::writeLockedMessage( "IpsecController", "Warning: Policy has more than one request. SA BUNDLES are obsoleted and not supported.", Log::LOG_WARN, true );
 
-                this->ipsec_policies->push_back( policy.release() );
+            struct xfrm_user_tmpl *tmpl = &templates[ 0 ];
 
-                // err = filter(&nladdr, h, arg1);
-                h = NLMSG_NEXT( h, len );
+            auto_ptr<SaRequest> request ( new SaRequest() );
+
+            request->mode = ( tmpl->mode == 0 ) ? Enums::TRANSPORT_MODE : Enums::TUNNEL_MODE;
+            request->request_id = tmpl->reqid;
+            request->ipsec_protocol = ( tmpl->id.proto == IPPROTO_ESP ) ? Enums::PROTO_ESP : Enums::PROTO_AH;
+            if ( request->mode == Enums::TUNNEL_MODE ) {
+                Enums::ADDR_FAMILY family = UtilsImpl::getInternalFamily( tmpl->family );
+                request->tunnel_src = NetworkController::getIpAddress( family, auto_ptr<ByteArray> ( new ByteArray( & tmpl->saddr, sizeof ( tmpl->saddr ) ) ) );
+                request->tunnel_dst = NetworkController::getIpAddress( family, auto_ptr<ByteArray> ( new ByteArray( & tmpl->id.daddr, sizeof ( tmpl->id.daddr ) ) ) );
             }
 
-            // Get the next message until NLMSG_DONE received
-            len = netlinkReceiveMsg( fd, res.nlh, sizeof( res ) );
+            request->level = ( request->request_id == 0 ) ? SaRequest::LEVEL_REQUIRE : SaRequest::LEVEL_UNIQUE;
+
+            policy->sa_request = request;
         }
 
-        close( fd );
+        return policy;
+    }
 
-        // Print policies
-        if ( show ) {
-            Log::acquire();
-            Log::writeMessage( "IpsecController", "Updating policies: Found Policies=[" + intToString( ipsec_policies->size() ) + "]", Log::LOG_IPSC, true );
-            for ( vector<Policy*>::iterator it = this->ipsec_policies->begin(); it != this->ipsec_policies->end(); it++ )
-                Log::writeMessage( "IpsecController", ( *it ) ->toStringTab( 1 ), Log::LOG_POLI, false );
-            Log::release();
+    bool IpsecControllerImplXfrm::hasIpsecPolicy( uint32_t id ) {
+        AutoLock auto_lock( *this->mutex_policies );
+        return this->ipsec_policies.getPolicyById( id ) != NULL;
+    }
+
+    void IpsecControllerImplXfrm::mirrorAddPolicy( auto_ptr<Policy> policy ) {
+        AutoLock auto_lock( *this->mutex_policies );
+
+        // replaces the policy if it is already known (i.e. UPDPOLICY or our own creations notified again)
+        this->ipsec_policies.addPolicy( policy );
+    }
+
+    void IpsecControllerImplXfrm::mirrorRemovePolicy( uint32_t id ) {
+        AutoLock auto_lock( *this->mutex_policies );
+        this->ipsec_policies.removePolicy( id );
+    }
+
+    void IpsecControllerImplXfrm::mirrorRemovePolicy( const xfrm_selector & selector, uint8_t dir ) {
+        Enums::DIRECTION direction;
+        switch ( dir ) {
+            case XFRM_POLICY_IN:
+                direction = Enums::DIR_IN;
+                break;
+            case XFRM_POLICY_OUT:
+                direction = Enums::DIR_OUT;
+                break;
+            case XFRM_POLICY_FWD:
+                direction = Enums::DIR_FWD;
+                break;
+            default:
+                return;
+        }
+
+        Enums::ADDR_FAMILY family = UtilsImpl::getInternalFamily( selector.family );
+        auto_ptr<IpAddress> selector_src = NetworkController::getIpAddress( family, auto_ptr<ByteArray> ( new ByteArray( &selector.saddr, sizeof ( selector.saddr ) ) ) );
+        auto_ptr<IpAddress> selector_dst = NetworkController::getIpAddress( family, auto_ptr<ByteArray> ( new ByteArray( &selector.daddr, sizeof ( selector.daddr ) ) ) );
+
+        AutoLock auto_lock( *this->mutex_policies );
+
+        vector<Policy*> policies = this->ipsec_policies.getPolicies();
+        for ( vector<Policy*>::iterator it = policies.begin(); it != policies.end(); it++ ) {
+            Policy& policy = **it;
+            if ( policy.direction == direction &&
+                    policy.ip_protocol == selector.proto &&
+                    policy.selector_prefixlen_src == selector.prefixlen_s &&
+                    policy.selector_prefixlen_dst == selector.prefixlen_d &&
+                    policy.selector_src_port == ntohs( selector.sport ) &&
+                    policy.selector_dst_port == ntohs( selector.dport ) &&
+                    *policy.selector_src == *selector_src &&
+                    *policy.selector_dst == *selector_dst ) {
+                this->ipsec_policies.removePolicy( policy.id );
+                return;
+            }
+        }
+    }
+
+    void IpsecControllerImplXfrm::mirrorPolicyReply( const nlmsghdr * reply ) {
+        // without the reply, the only way to know the policy is a full resync
+        if ( reply == NULL || reply->nlmsg_type != XFRM_MSG_NEWPOLICY ) {
+            this->updatePolicies( false );
+            return;
+        }
+
+        this->mirrorAddPolicy( this->parsePolicy( *reply ) );
+    }
+
+    void IpsecControllerImplXfrm::processPolicyNotification( const nlmsghdr & n ) {
+        switch ( n.nlmsg_type ) {
+            case XFRM_MSG_NEWPOLICY:
+            case XFRM_MSG_UPDPOLICY:
+                this->mirrorAddPolicy( this->parsePolicy( n ) );
+                break;
+            case XFRM_MSG_DELPOLICY: {
+                    xfrm_userpolicy_id* id = ( xfrm_userpolicy_id* ) NLMSG_DATA( &n );
+
+                    // The kernel attaches the deleted policy, which has the index even if it was deleted by selector
+                    struct rtattr* tb[ RTA_BUF_SIZE ];
+                    memset( tb, 0, sizeof( tb ) );
+                    uint16_t ntb = netlinkParseRtattrByIndex( tb, RTA_BUF_SIZE, ( rtattr* ) ( ( ( uint8_t* ) id ) + NLMSG_ALIGN( sizeof( *id ) ) ), n.nlmsg_len - NLMSG_SPACE( sizeof( *id ) ) );
+
+                    for ( uint16_t i = 0; i < ntb; i++ ) {
+                        if ( tb[ i ] ->rta_type == XFRMA_POLICY ) {
+                            this->mirrorRemovePolicy( ( ( xfrm_userpolicy_info* ) RTA_DATA( tb[ i ] ) ) ->index );
+                            return;
+                        }
+                    }
+
+                    if ( id->index != 0 )
+                        this->mirrorRemovePolicy( id->index );
+                    else
+                        this->mirrorRemovePolicy( id->sel, id->dir );
+                }
+                break;
+            case XFRM_MSG_POLEXPIRE: {
+                    xfrm_user_polexpire* expire = ( xfrm_user_polexpire* ) NLMSG_DATA( &n );
+                    if ( expire->hard )
+                        this->mirrorRemovePolicy( expire->pol.index );
+                }
+                break;
+            case XFRM_MSG_FLUSHPOLICY: {
+                    AutoLock auto_lock( *this->mutex_policies );
+                    this->ipsec_policies.clear();
+                }
+                break;
         }
     }
 
@@ -854,24 +1173,46 @@ namespace openikev2 {
         return this->xfrmGetSpi( src, dst, protocol, 0, 1, 0xFFFFFFFF );
     }
 
+    void IpsecControllerImplXfrm::xfrmSendBatch( NetlinkBatch & batch ) {
+        int32_t fd = netlinkOpen( 0, NETLINK_XFRM );
+
+        try {
+            batch.send( fd );
+        }
+        catch ( NetlinkException & ex ) {
+            close( fd );
+            throw;
+        }
+
+        close( fd );
+    }
+
     void IpsecControllerImplXfrm::createIpsecSa( const IpAddress & src, const IpAddress & dst, const ChildSa& childsa ) {
         // child_sa must have at least one traffic selector in each direction
         assert ( !childsa.my_traffic_selector->getTrafficSelectors().empty() );
         assert ( !childsa.peer_traffic_selector->getTrafficSelectors().empty() );
 
-        Log::writeLockedMessage( "IpsecController", "IPsec tunnel creation (outbound)", Log::LOG_INFO, true );
+        // The negotiation has finished, so new acquires between these addresses must be processed
+        this->releaseAcquires( src, dst );
+
+        string encr_algo = getXfrmEncrAlgo( childsa.getProposal().getFirstTransformByType( Enums::ENCR ) );
+        string integ_algo = getXfrmIntegAlgo( childsa.getProposal().getFirstTransformByType( Enums::INTEG ) );
 
-        // creates the outbound IPsec SA
-        this->xfrmAddUpdateIpsecSa(
+        Log::writeLockedMessage( "IpsecController", "IPsec tunnel creation (outbound) and update (inbound)", Log::LOG_INFO, true );
+
+        // creates the outbound IPsec SA and updates the inbound one in the same kernel round trip
+        NetlinkBatch batch;
+        uint16_t outbound = this->xfrmAddUpdateIpsecSa(
+            batch,
             (XFRM_MSG_NEWSA),
             src,
             dst,
             childsa.ipsec_protocol,
             childsa.mode,
             childsa.outbound_spi,
-            getXfrmEncrAlgo( childsa.getProposal().getFirstTransformByType( Enums::ENCR ) ),
+            encr_algo,
             ( childsa.child_sa_initiator ) ? *childsa.keyring->sk_ei : *childsa.keyring->sk_er,
-            getXfrmIntegAlgo( childsa.getProposal().getFirstTransformByType( Enums::INTEG ) ),
+            integ_algo,
             ( childsa.child_sa_initiator ) ? *childsa.keyring->sk_ai : *childsa.keyring->sk_ar,
             childsa.getChildSaConfiguration().lifetime_soft,
             childsa.getChildSaConfiguration().lifetime_hard,
@@ -881,21 +1222,17 @@ namespace openikev2 {
             *childsa.peer_traffic_selector->getTrafficSelectors().front()
         );
 
-        // Creates the inbound IPsec SA
-        Log::writeLockedMessage( "IpsecController", "IPsec tunnel update (inbound)", Log::LOG_INFO, true );
-
-
-    try {
-        this->xfrmAddUpdateIpsecSa(
+        uint16_t inbound = this->xfrmAddUpdateIpsecSa(
+            batch,
             (XFRM_MSG_UPDSA),
             dst,
             src,
             childsa.ipsec_protocol,
             childsa.mode,
             childsa.inbound_spi,
-            getXfrmEncrAlgo( childsa.getProposal().getFirstTransformByType( Enums::ENCR ) ),
+            encr_algo,
             ( childsa.child_sa_initiator ) ? *childsa.keyring->sk_er : *childsa.keyring->sk_ei,
-            getXfrmIntegAlgo( childsa.getProposal().getFirstTransformByType( Enums::INTEG ) ),
+            integ_algo,
             ( childsa.child_sa_initiator ) ? *childsa.keyring->sk_ar : *childsa.keyring->sk_ai,
             childsa.getChildSaConfiguration().lifetime_soft,
             childsa.getChildSaConfiguration().lifetime_hard,
@@ -904,30 +1241,42 @@ namespace openikev2 {
             *childsa.peer_traffic_selector->getTrafficSelectors().front(),
             *childsa.my_traffic_selector->getTrafficSelectors().front()
         );
-    }catch(IpsecException & ex) {
 
+        this->xfrmSendBatch( batch );
 
-        try {
-            Log::writeLockedMessage( "IpsecController", "IPsec tunnel update fails, deleting it (inbound)", Log::LOG_WARN, true );
-            this->xfrmDeleteIpsecSa( dst, src, childsa.ipsec_protocol, childsa.inbound_spi );
-
+        // The inbound update was already applied in the same round trip: it is undone so a failed outbound SA leaves
+        // nothing installed, as if the inbound update had never been sent
+        if ( batch.getError( outbound ) != 0 ) {
+            if ( batch.getError( inbound ) == 0 ) {
+                try {
+                    this->xfrmDeleteIpsecSa( dst, src, childsa.ipsec_protocol, childsa.inbound_spi );
                 }
-        catch(IpsecException & ex2){
-            Log::writeLockedMessage( "IpsecController", "Impossible deleting tunnel", Log::LOG_WARN, true );
+                catch ( IpsecException & ) {
+                    Log::writeLockedMessage( "IpsecController", "Impossible deleting tunnel", Log::LOG_WARN, true );
+                }
+            }
+            throw IpsecException( "Error performing an UPDATE/ADD action" );
         }
 
-        Log::writeLockedMessage( "IpsecController", "IPsec tunnel update fails, creating it (inbound)", Log::LOG_WARN, true );
+        if ( batch.getError( inbound ) == 0 )
+            return;
+
+        // The larval inbound SA could not be updated: deletes it and creates it again (also in one round trip)
+        Log::writeLockedMessage( "IpsecController", "IPsec tunnel update fails, deleting and creating it (inbound)", Log::LOG_WARN, true );
 
-        this->xfrmAddUpdateIpsecSa(
+        NetlinkBatch retry_batch;
+        uint16_t deletion = this->xfrmDeleteIpsecSa( retry_batch, dst, src, childsa.ipsec_protocol, childsa.inbound_spi );
+        uint16_t creation = this->xfrmAddUpdateIpsecSa(
+            retry_batch,
             (XFRM_MSG_NEWSA),
             dst,
             src,
             childsa.ipsec_protocol,
             childsa.mode,
             childsa.inbound_spi,
-            getXfrmEncrAlgo( childsa.getProposal().getFirstTransformByType( Enums::ENCR ) ),
+            encr_algo,
             ( childsa.child_sa_initiator ) ? *childsa.keyring->sk_er : *childsa.keyring->sk_ei,
-            getXfrmIntegAlgo( childsa.getProposal().getFirstTransformByType( Enums::INTEG ) ),
+            integ_algo,
             ( childsa.child_sa_initiator ) ? *childsa.keyring->sk_ar : *childsa.keyring->sk_ai,
             childsa.getChildSaConfiguration().lifetime_soft,
             childsa.getChildSaConfiguration().lifetime_hard,
@@ -936,8 +1285,14 @@ namespace openikev2 {
             *childsa.peer_traffic_selector->getTrafficSelectors().front(),
             *childsa.my_traffic_selector->getTrafficSelectors().front()
         );
-    }
 
+        this->xfrmSendBatch( retry_batch );
+
+        if ( retry_batch.getError( deletion ) != 0 )
+            Log::writeLockedMessage( "IpsecController", "Impossible deleting tunnel", Log::LOG_WARN, true );
+
+        if ( retry_batch.getError( creation ) != 0 )
+            throw IpsecException( "Error performing an UPDATE/ADD action" );
     }
 
     uint32_t IpsecControllerImplXfrm::deleteIpsecSa( const IpAddress & src, const IpAddress & dst, Enums::PROTOCOL_ID protocol, uint32_t spi ) {
@@ -951,14 +1306,14 @@ namespace openikev2 {
         return spi;
     }
 
-    Policy & IpsecControllerImplXfrm::getIpsecPolicyById( uint32_t id ) {
+    auto_ptr<Policy> IpsecControllerImplXfrm::getIpsecPolicyById( uint32_t id ) {
         AutoLock auto_lock( *this->mutex_policies );
 
-        for ( uint16_t i = 0; i < this->ipsec_policies->size(); i++ )
-            if ( this->ipsec_policies[ i ] ->id == id )
-                return *ipsec_policies[ i ];
+        Policy* policy = this->ipsec_policies.getPolicyById( id );
+        if ( policy == NULL )
+            throw IpsecException( "Policy ID not found in SPD" );
 
-        throw IpsecException( "Policy ID not found in SPD" );
+        return policy->clone();
     }
 
 
@@ -977,8 +1332,31 @@ namespace openikev2 {
         }
 
 
-        this->xfrmCreateIpsecPolicy( *src_selector, src_prefix, src_port, *dst_selector, dst_prefix, dst_port, ip_protocol, direction, action, ipsec_protocol, mode, priority, src_tunnel, dst_tunnel, autogen, sub );
-        this->updatePolicies( false );
+        // All the directions are created in the same kernel round trip
+        if ( direction == Enums::DIR_ALL ) {
+            Enums::DIRECTION directions[] = { Enums::DIR_IN, Enums::DIR_OUT, Enums::DIR_FWD };
+
+            uint16_t indexes[ 3 ];
+            NetlinkBatch batch;
+            for ( uint16_t i = 0; i < 3; i++ )
+                indexes[ i ] = this->xfrmCreateIpsecPolicy( batch, *src_selector, src_prefix, src_port, *dst_selector, dst_prefix, dst_port, ip_protocol, directions[ i ], action, ipsec_protocol, mode, priority, src_tunnel, dst_tunnel, sub );
+            this->xfrmSendBatch( batch );
+
+            for ( uint16_t i = 0; i < 3; i++ ) {
+                if ( batch.getError( indexes[ i ] ) != 0 && batch.getError( indexes[ i ] ) != -EEXIST )
+                    throw IpsecException( "Error performing an CREATE POLICY action: Direction=[" + Enums::DIRECTION_STR( directions[ i ] ) + "]" );
+
+                this->mirrorPolicyReply( batch.getReply( indexes[ i ] + 1 ) );
+            }
+
+            if ( autogen ) {
+                for ( uint16_t i = 0; i < 3; i++ )
+                    this->xfrmAutogenerateSas( *src_selector, src_prefix, src_port, *dst_selector, dst_prefix, dst_port, ip_protocol, directions[ i ], ipsec_protocol, mode, priority, src_tunnel, dst_tunnel );
+            }
+        }
+        else {
+            this->xfrmCreateIpsecPolicy( *src_selector, src_prefix, src_port, *dst_selector, dst_prefix, dst_port, ip_protocol, direction, action, ipsec_protocol, mode, priority, src_tunnel, dst_tunnel, autogen, sub );
+        }
     }
 
     void IpsecControllerImplXfrm::deleteIpsecPolicy( vector<TrafficSelector*> src_sel, vector<TrafficSelector*> dst_sel, Enums::DIRECTION direction ) {
@@ -991,7 +1369,6 @@ namespace openikev2 {
         uint8_t ip_protocol = src_sel.front() ->ip_protocol_id;
 
         this->xfrmDeleteIpsecPolicy( *src_selector, src_prefix, src_port, *dst_selector, dst_prefix, dst_port, ip_protocol, direction );
-        this->updatePolicies( false );
     }
 
     void IpsecControllerImplXfrm::flushIpsecPolicies() {
@@ -1098,7 +1475,9 @@ namespace openikev2 {
     }
 
     void IpsecControllerImplXfrm::exit() {
+        AutoLock auto_lock( *this->condition_events );
         this->exiting = true;
+        this->condition_events->notify();
     }
 
     void IpsecControllerImplXfrm::printPolicies() {
@@ -14,28 +14,43 @@
 #endif
 
 #include <libopenikev2/autovector.h>
+#include <libopenikev2/condition.h>
 
 #include "ipseccontrollerimplopenike.h"
 #include "policy.h"
 #include "libnetlink.h"
 
+#include <map>
+#include <deque>
+#include <vector>
+
 /* This header is required to assure it is included before any linux/ include */
 #include <netinet/in.h>
 #include <linux/xfrm.h>
 
 namespace openikev2 {
+    class XfrmEventProcessor;
 
     /**
         This class represents an IPSEC_Controller concrete implementation using a netlink socket (XFRM)
+        Acquire and expire events are queued and processed by a XfrmEventProcessor, so the netlink socket is always drained.
+        Duplicated acquires for a negotiation in progress are discarded.
         @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
     */
     class IpsecControllerImplXfrm : public IpsecControllerImplOpenIKE {
+            friend class XfrmEventProcessor;
 
             /****************************** ATTRIBUTES ******************************/
         protected:
             int32_t netlink_bcast_fd;           /**< Socket to receive broadcast messages */
             uint32_t sequence_number;           /**< Message sequence number. */
             bool exiting;                       /**< Indicates if controller must exit */
+            XfrmEventProcessor* event_processor;            /**< Thread processing the queued events */
+            deque<vector<uint8_t> > pending_events;         /**< Queued acquire and expire messages */
+            map<string, uint64_t> inflight_acquires;        /**< Deadline of each acquire in negotiation, by acquire key */
+            uint32_t coalesced_acquires;                    /**< Number of duplicated acquires discarded since the last report */
+            uint32_t acquire_hold_time;                     /**< Time (in seconds) an acquire is considered in negotiation */
+            auto_ptr<Condition> condition_events;           /**< Condition to protect the queued events and the acquires in negotiation */
 
             /****************************** METHODS ******************************/
         protected:
@@ -68,6 +83,20 @@ namespace openikev2 {
              */
             virtual void xfrmCreateIpsecPolicy( const IpAddress& src_sel, uint8_t src_prefixlen, uint16_t src_port, const IpAddress& dst_sel, uint8_t dst_prefixlen, uint16_t dst_port, uint8_t ip_protocol, Enums::DIRECTION dir, Enums::POLICY_ACTION action, Enums::PROTOCOL_ID protocol, Enums::IPSEC_MODE mode, uint32_t priority, const IpAddress * tunnel_src, const IpAddress * tunnel_dst, bool autogen = false, bool sub = false );
 
+            /**
+             * Adds a new IPSEC policy creation request to a batch (see xfrmCreateIpsecPolicy()).
+             * It is followed by a request retrieving the created policy, to update the SPD mirror
+             * @param batch Batch where the request is added
+             * @return Index of the creation request in the batch
+             */
+            virtual uint16_t xfrmCreateIpsecPolicy( NetlinkBatch& batch, const IpAddress& src_sel, uint8_t src_prefixlen, uint16_t src_port, const IpAddress& dst_sel, uint8_t dst_prefixlen, uint16_t dst_port, uint8_t ip_protocol, Enums::DIRECTION dir, Enums::POLICY_ACTION action, Enums::PROTOCOL_ID protocol, Enums::IPSEC_MODE mode, uint32_t priority, const IpAddress * tunnel_src, const IpAddress * tunnel_dst, bool sub );
+
+            /**
+             * Requests the creation of the SAs associated with an autogen policy, once the policy has been created
+             * (see xfrmCreateIpsecPolicy() for the parameters)
+             */
+            virtual void xfrmAutogenerateSas( const IpAddress& src_sel, uint8_t src_prefixlen, uint16_t src_port, const IpAddress& dst_sel, uint8_t dst_prefixlen, uint16_t dst_port, uint8_t ip_protocol, Enums::DIRECTION dir, Enums::PROTOCOL_ID protocol, Enums::IPSEC_MODE mode, uint32_t priority, const IpAddress * tunnel_src, const IpAddress * tunnel_dst );
+
             /**
              * Deletes a IPSEC policy
              * @param src_sel IP address of the source selector
@@ -81,6 +110,14 @@ namespace openikev2 {
              */
             virtual void xfrmDeleteIpsecPolicy( const IpAddress & src_sel, uint8_t src_prefixlen, uint16_t src_port, const IpAddress & dst_sel, uint8_t dst_prefixlen, uint16_t dst_port, uint8_t ip_protocol, Enums::DIRECTION dir );
 
+            /**
+             * Adds an IPSEC policy deletion request to a batch (see xfrmDeleteIpsecPolicy()).
+             * It is preceded by a request retrieving the policy, so its index is known
+             * @param batch Batch where the request is added
+             * @return Index of the deletion request in the batch
+             */
+            virtual uint16_t xfrmDeleteIpsecPolicy( NetlinkBatch& batch, const IpAddress & src_sel, uint8_t src_prefixlen, uint16_t src_port, const IpAddress & dst_sel, uint8_t dst_prefixlen, uint16_t dst_port, uint8_t ip_protocol, Enums::DIRECTION dir );
+
             /**
              * Delete an existing SA from SADB
              * @param src Source IP address of the SA
@@ -90,6 +127,13 @@ namespace openikev2 {
              */
             virtual void xfrmDeleteIpsecSa( const IpAddress & src, const IpAddress & dst, Enums::PROTOCOL_ID protocol, uint32_t spi );
 
+            /**
+             * Adds an SA deletion request to a batch (see xfrmDeleteIpsecSa())
+             * @param batch Batch where the request is added
+             * @return Index of the request in the batch
+             */
+            virtual uint16_t xfrmDeleteIpsecSa( NetlinkBatch& batch, const IpAddress & src, const IpAddress & dst, Enums::PROTOCOL_ID protocol, uint32_t spi );
+
             /**
              * Gets a new SPI needed in a SA creation
              * @param src Source IP address of the desired SA
@@ -128,6 +172,21 @@ namespace openikev2 {
                                                 string encr_type, ByteArray & encr_key, string integ_type, ByteArray & integ_key,
                                                 uint32_t limit_soft_time, uint32_t limit_hard_time, uint32_t limit_hard_octets, uint32_t reqid, const TrafficSelector& src_sel, const TrafficSelector& dst_sel );
 
+            /**
+             * Adds a new/update SA request to a batch (see xfrmAddUpdateIpsecSa())
+             * @param batch Batch where the request is added
+             * @return Index of the request in the batch
+             */
+            virtual uint16_t xfrmAddUpdateIpsecSa ( NetlinkBatch& batch, uint16_t operation, const IpAddress & src, const IpAddress & dst, Enums::PROTOCOL_ID protocol, Enums::IPSEC_MODE mode, uint32_t spi,
+                                                    string encr_type, ByteArray & encr_key, string integ_type, ByteArray & integ_key,
+                                                    uint32_t limit_soft_time, uint32_t limit_hard_time, uint32_t limit_hard_octets, uint32_t reqid, const TrafficSelector& src_sel, const TrafficSelector& dst_sel );
+
+            /**
+             * Sends a batch of XFRM requests in a single kernel round trip, and collects the results
+             * @param batch Batch to be sent
+             */
+            virtual void xfrmSendBatch( NetlinkBatch& batch );
+
             /**
              * Translate encryption algorithms from IKE world to XFRM world
              * @param encr_transform Encription transfrom
@@ -187,18 +246,112 @@ namespace openikev2 {
             virtual void processExpire( const nlmsghdr & n );
 
             /**
-             * Gets a IPsec policy by its ID.
+             * Gets the key identifying an acquire: source address, destination address and policy ID
+             * @param src Source address of the acquire
+             * @param dst Destination address of the acquire
+             * @param policy_id Policy ID (not included if 0)
+             * @return The acquire key
+             */
+            static string getAcquireKey( const xfrm_address_t& src, const xfrm_address_t& dst, uint32_t policy_id );
+
+            /**
+             * Gets the current monotonic time
+             * @return Time in seconds
+             */
+            static uint64_t getMonotonicTime();
+
+            /**
+             * Queues an acquire message, unless there is already a negotiation in progress for it
+             * @param n XFRM acquire message
+             */
+            virtual void queueAcquire( const nlmsghdr & n );
+
+            /**
+             * Queues an expire message
+             * @param n XFRM expire message
+             */
+            virtual void queueExpire( const nlmsghdr & n );
+
+            /**
+             * Forgets the acquires in negotiation between two addresses (in both directions), so new acquires are processed
+             * @param src Source address
+             * @param dst Destination address
+             */
+            virtual void releaseAcquires( const IpAddress& src, const IpAddress& dst );
+
+            /**
+             * Gets all the queued events, waiting until there is one. Used by the XfrmEventProcessor.
+             * @param events Collection where the events are moved
+             * @return FALSE if the controller is exiting. TRUE otherwise
+             */
+            virtual bool getPendingEvents( deque<vector<uint8_t> >& events );
+
+            /**
+             * Processes a batch of queued events. The interfaces are refreshed once for all the acquires,
+             * and duplicated expires are skipped. Used by the XfrmEventProcessor.
+             * @param events Events to be processed (the collection is emptied)
+             */
+            virtual void processEvents( deque<vector<uint8_t> >& events );
+
+            /**
+             * Gets a copy of an IPsec policy by its ID, so it can be used after the SPD mirror changes.
              * @param id Policy ID.
              * @return Corresponding policy. Exception if not found
              */
-            virtual Policy& getIpsecPolicyById( uint32_t id );
+            virtual auto_ptr<Policy> getIpsecPolicyById( uint32_t id );
 
             /**
-             * Updates the list of policies. It must by performed after create or delete policies.
+             * Updates the list of policies with a full SPD dump. The list is kept updated incrementally,
+             * so this is only needed when the XFRM notifications have been lost.
              * @param show Indicate if all the policies detected must be printed
              */
             virtual void updatePolicies( bool show );
 
+            /**
+             * Creates a Policy from a XFRM policy message
+             * @param n Message containing a xfrm_userpolicy_info and its attributes
+             * @return The new Policy
+             */
+            virtual auto_ptr<Policy> parsePolicy( const nlmsghdr& n );
+
+            /**
+             * Checks if a policy is in the SPD mirror
+             * @param id Policy ID
+             * @return TRUE if the policy is known. FALSE otherwise
+             */
+            virtual bool hasIpsecPolicy( uint32_t id );
+
+            /**
+             * Adds (or replaces) a policy in the SPD mirror
+             * @param policy Policy to be added
+             */
+            virtual void mirrorAddPolicy( auto_ptr<Policy> policy );
+
+            /**
+             * Removes a policy from the SPD mirror
+             * @param id Policy ID
+             */
+            virtual void mirrorRemovePolicy( uint32_t id );
+
+            /**
+             * Removes from the SPD mirror the policy with a selector and direction
+             * @param selector XFRM selector
+             * @param dir XFRM policy direction
+             */
+            virtual void mirrorRemovePolicy( const xfrm_selector& selector, uint8_t dir );
+
+            /**
+             * Adds to the SPD mirror the policy received as reply of a GET request. If there is no reply, a full resync is performed
+             * @param reply Reply message (can be NULL)
+             */
+            virtual void mirrorPolicyReply( const nlmsghdr* reply );
+
+            /**
+             * Updates the SPD mirror with a policy change notified by the kernel (XFRMNLGRP_POLICY)
+             * @param n XFRM notification
+             */
+            virtual void processPolicyNotification( const nlmsghdr & n );
+
             virtual xfrm_selector getXfrmSelector( const TrafficSelector& ts_i, const TrafficSelector& ts_r );
             virtual xfrm_address_t getXfrmAddress( const IpAddress& address );
             virtual uint16_t getXfrmSrcPort( const TrafficSelector& ts_i, const TrafficSelector& ts_r );
@@ -207,8 +360,11 @@ namespace openikev2 {
         public:
             /**
              * Creates a new IpsecControllerImplXfrm
+             * @param acquire_hold_time Time (in seconds) while duplicated acquires are discarded, if no SA is created
              */
-            IpsecControllerImplXfrm();
+            IpsecControllerImplXfrm( uint32_t acquire_hold_time = 30 );
+
+            virtual void start();
 
             virtual void run();
 
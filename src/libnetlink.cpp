@@ -11,6 +11,7 @@
 #include <libopenikev2/utils.h>
 
 namespace openikev2 {
+    static uint32_t sequence_number = 0;
 
     int32_t netlinkOpen( uint32_t groups, uint32_t protocol ) {
         int32_t fd = -1;
@@ -52,12 +53,10 @@ namespace openikev2 {
     }
 
     void netlinkSendMsg( int32_t fd, struct nlmsghdr & hdr ) {
-        static uint32_t sequence_number;
-
         size_t len;
         ssize_t r;
 
-        hdr.nlmsg_seq = ++sequence_number;
+        hdr.nlmsg_seq = __sync_add_and_fetch( &sequence_number, 1 );
 
         len = hdr.nlmsg_len;
         do {
@@ -113,6 +112,103 @@ namespace openikev2 {
 
 
 
+    NetlinkBatch::NetlinkBatch() {}
+
+    uint16_t NetlinkBatch::addMessage( const nlmsghdr & hdr ) {
+        uint32_t offset = this->buffer.size();
+        this->buffer.resize( offset + NLMSG_ALIGN( hdr.nlmsg_len ), 0 );
+        memcpy( &this->buffer[ offset ], &hdr, hdr.nlmsg_len );
+
+        nlmsghdr* copy = ( nlmsghdr* ) &this->buffer[ offset ];
+        copy->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+
+        this->offsets.push_back( offset );
+        this->errors.push_back( 0 );
+        this->acknowledged.push_back( false );
+        this->replies.push_back( vector<uint8_t>() );
+
+        return this->offsets.size() - 1;
+    }
+
+    void NetlinkBatch::send( int32_t fd ) {
+        if ( this->offsets.empty() )
+            return;
+
+        // reserves a block of consecutive sequence numbers atomically, so messages sent by other threads can't take
+        // numbers in the middle of it and the ACKs can be matched by substraction
+        uint32_t first_sequence_number = __sync_fetch_and_add( &sequence_number, this->offsets.size() ) + 1;
+        for ( uint16_t i = 0; i < this->offsets.size(); i++ )
+            ( ( nlmsghdr* ) &this->buffer[ this->offsets[ i ] ] ) ->nlmsg_seq = first_sequence_number + i;
+
+        struct sockaddr_nl kernel;
+        memset( &kernel, 0, sizeof( kernel ) );
+        kernel.nl_family = AF_NETLINK;
+
+        struct iovec iov;
+        iov.iov_base = &this->buffer[ 0 ];
+        iov.iov_len = this->buffer.size();
+
+        struct msghdr msg;
+        memset( &msg, 0, sizeof( msg ) );
+        msg.msg_name = &kernel;
+        msg.msg_namelen = sizeof( kernel );
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        ssize_t r;
+        do {
+            r = sendmsg( fd, &msg, 0 );
+        } while ( r < 0 && errno == EINTR );
+
+        if ( r < 0 )
+            throw NetlinkException( "netlink sendmsg() of batch failed. Do you set up XFRM_USER in your kernel? Try \"modprobe xfrm_user\"" );
+        else if ( ( size_t ) r != this->buffer.size() )
+            throw NetlinkException( "netlink sendmsg() of batch truncated" );
+
+        // gathers the ACKs, in any order
+        vector<uint8_t> response( NLMSG_BUF_SIZE * 4 );
+        uint16_t pending = this->offsets.size();
+        while ( pending > 0 ) {
+            ssize_t len = recv( fd, &response[ 0 ], response.size(), 0 );
+            if ( len < 0 ) {
+                if ( errno == EINTR )
+                    continue;
+                throw NetlinkException( "netlink recv() of batch ACKs failed" );
+            }
+
+            for ( nlmsghdr* h = ( nlmsghdr* ) &response[ 0 ]; NLMSG_OK( h, ( uint32_t ) len ); h = NLMSG_NEXT( h, len ) ) {
+                uint32_t index = h->nlmsg_seq - first_sequence_number;
+                if ( index >= this->offsets.size() || this->acknowledged[ index ] )
+                    continue;
+
+                // stores the reply, the ACK follows it
+                if ( h->nlmsg_type != NLMSG_ERROR ) {
+                    if ( this->replies[ index ].empty() )
+                        this->replies[ index ].assign( ( uint8_t* ) h, ( uint8_t* ) h + h->nlmsg_len );
+                    continue;
+                }
+
+                this->errors[ index ] = ( ( nlmsgerr* ) NLMSG_DATA( h ) ) ->error;
+                this->acknowledged[ index ] = true;
+                pending--;
+            }
+        }
+    }
+
+    int32_t NetlinkBatch::getError( uint16_t index ) const {
+        return this->errors.at( index );
+    }
+
+    const nlmsghdr * NetlinkBatch::getReply( uint16_t index ) const {
+        if ( this->replies.at( index ).empty() )
+            return NULL;
+        return ( const nlmsghdr* ) &this->replies[ index ][ 0 ];
+    }
+
+    uint16_t NetlinkBatch::size() const {
+        return this->offsets.size();
+    }
+
     uint16_t netlinkParseRtattrByIndex( struct rtattr * tb[], uint16_t max, struct rtattr * rta, uint16_t len ) {
         uint16_t i = 0;
         while ( RTA_OK( rta, len ) ) {
@@ -25,6 +25,7 @@
 #include <sys/types.h>
 #include <sys/queue.h>
 #include <unistd.h>
+#include <vector>
 
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
@@ -44,6 +45,61 @@ namespace openikev2 {
             NetlinkException( string m ) : Exception( "Netlink: " + m ) {}
     };
 
+    /**
+        This class represents a set of netlink requests sent with a single sendmsg().
+        Every request is acknowledged by the kernel, and the ACKs (and the replies to GET requests) are matched with the requests by sequence number
+        @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
+    */
+    class NetlinkBatch {
+            /****************************** ATTRIBUTES ******************************/
+        protected:
+            vector<uint8_t> buffer;                 /**< Packed requests */
+            vector<uint32_t> offsets;               /**< Offset of each request in the buffer */
+            vector<int32_t> errors;                 /**< Error code of each request (0 = success) */
+            vector<bool> acknowledged;              /**< Indicates if each request has been acknowledged */
+            vector< vector<uint8_t> > replies;      /**< First reply message received for each request (empty if none) */
+
+            /****************************** METHODS ******************************/
+        public:
+            /**
+             * Creates a new empty NetlinkBatch
+             */
+            NetlinkBatch();
+
+            /**
+             * Appends a copy of a request to the batch. NLM_F_ACK is always requested
+             * @param hdr Request (header and payload)
+             * @return Index of the request in the batch
+             */
+            uint16_t addMessage( const nlmsghdr& hdr );
+
+            /**
+             * Sends all the requests in a single sendmsg() and waits for all the ACKs
+             * @param fd Netlink socket
+             */
+            void send( int32_t fd );
+
+            /**
+             * Gets the result of a request. Only valid after send()
+             * @param index Index of the request
+             * @return 0 on success, negative errno otherwise
+             */
+            int32_t getError( uint16_t index ) const;
+
+            /**
+             * Gets the reply received for a request (i.e. the response to a GET request). Only valid after send()
+             * @param index Index of the request
+             * @return The reply message, or NULL if no reply was received
+             */
+            const nlmsghdr* getReply( uint16_t index ) const;
+
+            /**
+             * Gets the number of requests in the batch
+             * @return Number of requests
+             */
+            uint16_t size() const;
+    };
+
     // NETLINK aux functions
     int32_t netlinkOpen( uint32_t groups, uint32_t protocol );
     void netlinkAddattr( nlmsghdr &n, uint16_t maxlen, uint16_t type, const ByteArray& data );
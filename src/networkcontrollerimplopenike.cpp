@@ -9,6 +9,7 @@
 #include "networkcontrollerimplopenike.h"
 
 #include <libopenikev2/log.h>
+#include <libopenikev2/threadcontroller.h>
 #include <libopenikev2/utils.h>
 #include <libopenikev2/configuration.h>
 #include <libopenikev2/cryptocontroller.h>
@@ -30,6 +31,9 @@
 
 #include "interfacelist.h"
 #include "socketaddressposix.h"
+#include "networkreceiver.h"
+#include "interfacemonitor.h"
+#include "ikesacontrollerimplopenike.h"
 
 #ifdef EAP_SERVER_ENABLED
 #include "radvd_wrapper.h"
@@ -39,6 +43,8 @@
 #include <ifaddrs.h>
 #include <net/if.h>
 
+#define RECEIVE_BATCH_SIZE 32
+
 extern "C" {
 #include <linux/if_tun.h>
 #include <stdio.h>
@@ -48,27 +54,136 @@ extern "C" {
 
 namespace openikev2 {
 
-    NetworkControllerImplOpenIKE::NetworkControllerImplOpenIKE()
+    NetworkControllerImplOpenIKE::NetworkControllerImplOpenIKE( UdpSocket::RECEIVE_BACKEND receive_backend, uint16_t num_receivers )
     : NetworkControllerImpl() {
+        assert( num_receivers > 0 );
+
+#ifndef SO_REUSEPORT
+        // The receiver sockets cannot share the addresses, so there is only the main one
+        num_receivers = 1;
+#endif
 
-        // Creates the socket using the correct port
-        this->udp_socket.reset( new UdpSocket() );
+        // Creates the socket using the correct port. With several receivers, each one has its own socket
+        bool reuse_port = ( num_receivers > 1 );
+        this->udp_socket.reset( new UdpSocket( receive_backend, reuse_port ) );
+
+        for ( uint16_t i = 1; i < num_receivers; i++ ) {
+            UdpSocket* receiver_socket = new UdpSocket( receive_backend, reuse_port );
+            this->receiver_sockets.push_back( receiver_socket );
+            this->receivers.push_back( new NetworkReceiver( *this, *receiver_socket, i ) );
+        }
 
         // initializes the exiting variable
         this->exiting = false;
 
-        this->refreshInterfaces();
+        this->mutex_interfaces = ThreadController::getMutex();
+        this->mutex_addresses = ThreadController::getMutex();
+        this->ike_sa_controller = NULL;
+
+        // The monitor is created before reading the interfaces, so no change is lost
+        try {
+            this->interface_monitor = new InterfaceMonitor( *this );
+        }
+        catch ( NetlinkException& ex ) {
+            Log::writeLockedMessage( "NetworkController", "Interface changes will not be notified: " + string( ex.what() ), Log::LOG_WARN, true );
+            this->interface_monitor = NULL;
+        }
+
+        this->syncInterfaces();
 
     }
 
     void NetworkControllerImplOpenIKE::refreshInterfaces(){
+        // The interface table is kept updated by the address notifications
+        if ( this->interface_monitor != NULL )
+            return;
+
+        this->syncInterfaces();
+    }
+
+    void NetworkControllerImplOpenIKE::syncInterfaces(){
         InterfaceList interface_list;
 
-        // For each address
+        map<string, bool> current_addresses;
         for ( uint16_t i = 0; i < interface_list.addresses->size(); i++ ) {
+            current_addresses[ interface_list.addresses[ i ] ->toString() ] = true;
+            this->addInterfaceAddress( *interface_list.addresses[ i ], interface_list.interface_names[ i ] );
+        }
+
+        // Gets the addresses that have disappeared
+        vector<string> removed_addresses;
+        {
+            AutoLock auto_lock( *this->mutex_interfaces );
+            for ( map<string, string>::iterator it = this->interface_addresses.begin(); it != this->interface_addresses.end(); it++ )
+                if ( current_addresses.find( it->first ) == current_addresses.end() )
+                    removed_addresses.push_back( it->first );
+        }
+
+        for ( vector<string>::iterator it = removed_addresses.begin(); it != removed_addresses.end(); it++ )
+            this->removeInterfaceAddress( IpAddressOpenIKE( *it ) );
+    }
+
+    void NetworkControllerImplOpenIKE::addInterfaceAddress( const IpAddress& address, string interface_name ){
+        AutoLock auto_lock( *this->mutex_interfaces );
+
+        // Already listening from this address
+        if ( this->interface_addresses.find( address.toString() ) != this->interface_addresses.end() )
+            return;
+
+        try {
+            this->bindAll( SocketAddressPosix( address.clone(), 500 ), interface_name );
+            this->interface_addresses[ address.toString() ] = interface_name;
+            Log::writeLockedMessage( "NetworkController", "Listening from interface: Name=[" + interface_name + "] Address=[" + address.toString() + "]", Log::LOG_INFO, true );
+        }
+        catch ( BindingException& ex ) {
+            Log::writeLockedMessage( "NetworkController", ex.what(), Log::LOG_ERRO, true );
+        }
+    }
+
+    void NetworkControllerImplOpenIKE::removeInterfaceAddress( const IpAddress& address ){
+        auto_ptr<IpAddress> new_address;
+        {
+            AutoLock auto_lock( *this->mutex_interfaces );
+
+            map<string, string>::iterator it = this->interface_addresses.find( address.toString() );
+            if ( it == this->interface_addresses.end() )
+                return;
+
+            Log::writeLockedMessage( "NetworkController", "Address removed from interface: Name=[" + it->second + "] Address=[" + address.toString() + "]", Log::LOG_INFO, true );
+            this->interface_addresses.erase( it );
+            this->removeSrcAddress( address );
+
+            // Looks for another global address of the same family, where the IKE SAs can be moved
+            for ( it = this->interface_addresses.begin(); it != this->interface_addresses.end(); it++ ) {
+                auto_ptr<IpAddress> candidate( new IpAddressOpenIKE( it->first ) );
+                auto_ptr<ByteArray> bytes = candidate->getBytes();
+                uint8_t* raw = ( uint8_t* ) bytes->getRawPointer();
+                bool link_local = ( candidate->getFamily() == Enums::ADDR_IPV6 && raw[ 0 ] == 0xfe && ( raw[ 1 ] & 0xc0 ) == 0x80 );
+                if ( candidate->getFamily() == address.getFamily() && !link_local ) {
+                    new_address = candidate;
+                    break;
+                }
+            }
+        }
+
+        if ( new_address.get() != NULL && this->ike_sa_controller != NULL ) {
+            uint32_t migrated = this->ike_sa_controller->migrateIkeSas( address, *new_address );
+            if ( migrated > 0 )
+                Log::writeLockedMessage( "NetworkController", "Moving " + intToString( migrated ) + " IKE SAs to Address=[" + new_address->toString() + "]", Log::LOG_INFO, true );
+        }
+    }
+
+    void NetworkControllerImplOpenIKE::setIkeSaController( IkeSaControllerImplOpenIKE* ike_sa_controller ){
+        this->ike_sa_controller = ike_sa_controller;
+    }
+
+    void NetworkControllerImplOpenIKE::bindAll( const SocketAddress& src_address, string interface_name ) {
+        // The main socket is used to send, so it must be bound
+        this->udp_socket->bind( src_address, interface_name );
+
+        for ( vector<UdpSocket*>::iterator it = this->receiver_sockets.begin(); it != this->receiver_sockets.end(); it++ ) {
             try {
-                this->udp_socket->bind( SocketAddressPosix( interface_list.addresses[i]->clone(), 500 ), interface_list.interface_names[i] );
-                Log::writeLockedMessage( "NetworkController", "Listening from interface: Name=[" + interface_list.interface_names[ i ] + "] Address=[" + interface_list.addresses[i]->toString() + "]", Log::LOG_INFO, true );
+                ( *it )->bind( src_address, interface_name );
             }
             catch ( BindingException& ex ) {
                 Log::writeLockedMessage( "NetworkController", ex.what(), Log::LOG_ERRO, true );
@@ -403,6 +518,18 @@ void NetworkControllerImplOpenIKE::deleteAddress( const IpAddress& addr, uint8_t
 }
 
 NetworkControllerImplOpenIKE::~NetworkControllerImplOpenIKE() {
+    if ( this->interface_monitor != NULL )
+        delete this->interface_monitor;
+
+    for ( vector<NetworkReceiver*>::iterator it = this->receivers.begin(); it != this->receivers.end(); it++ )
+        delete ( *it );
+
+    for ( map<string, AddressPool*>::iterator it = this->address_pools.begin(); it != this->address_pools.end(); it++ )
+        delete it->second;
+
+    for ( vector<UdpSocket*>::iterator it = this->receiver_sockets.begin(); it != this->receiver_sockets.end(); it++ )
+        delete ( *it );
+
 #ifdef EAP_SERVER_ENABLED
     if ( radvd != NULL )
         delete radvd;
@@ -410,7 +537,37 @@ NetworkControllerImplOpenIKE::~NetworkControllerImplOpenIKE() {
 }
 
 void NetworkControllerImplOpenIKE::releaseAddress( IpAddress & addr ) {
-    this->used_addresses[ addr.getBytes() ->toString()] = false;
+    AutoLock auto_lock( *this->mutex_addresses );
+
+    for ( map<string, AddressPool*>::iterator it = this->address_pools.begin(); it != this->address_pools.end(); it++ )
+        if ( it->second->releaseAddress( addr ) )
+            return;
+
+    this->used_addresses.erase( addr.getBytes() ->toString() );
+}
+
+AddressPool& NetworkControllerImplOpenIKE::getAddressPool( IkeSa& ike_sa, NetworkPrefix& prefix ) {
+    string key = prefix.getNetworkAddress().toString() + "/" + intToString( prefix.getPrefixLen() );
+
+    map<string, AddressPool*>::iterator it = this->address_pools.find( key );
+    if ( it != this->address_pools.end() )
+        return *it->second;
+
+    StringAttribute* lease_file = ike_sa.getIkeSaConfiguration().attributemap->getAttribute<StringAttribute>( "address_lease_file" );
+    AddressPool* pool = new AddressPool( prefix, ( lease_file != NULL ) ? lease_file->value : "" );
+    this->address_pools[ key ] = pool;
+
+    Log::writeLockedMessage( "NetworkController", "New address pool: Prefix=[" + key + "] Size=[" + intToString( pool->getFreeCount() ) + "]", Log::LOG_INFO, true );
+
+    return *pool;
+}
+
+string NetworkControllerImplOpenIKE::getAddressOwner( IkeSa& ike_sa ) {
+    BoolAttribute* sticky_address = ike_sa.getIkeSaConfiguration().attributemap->getAttribute<BoolAttribute>( "sticky_address" );
+    if ( sticky_address == NULL || !sticky_address->value || ike_sa.peer_id.get() == NULL )
+        return "";
+
+    return AddressPool::getOwner( *ike_sa.peer_id );
 }
 
 auto_ptr<IpAddress> NetworkControllerImplOpenIKE::generateIpv4AddressDhcp( IkeSa& ike_sa, ConfigurationAttribute & attribute, auto_ptr<ByteArray> *netmask ) {
@@ -444,52 +601,19 @@ auto_ptr<IpAddress> NetworkControllerImplOpenIKE::generateIpv4AddressFixed( IkeS
 
     assert( fixed_prefix->getNetworkAddress().getFamily() == Enums::ADDR_IPV4 );
 
-        // get the network address data
-    auto_ptr<ByteArray> fixed_prefix_data = fixed_prefix->getNetworkAddress().getBytes();
-
         // Generates the mask based on the prefixlen
-    auto_ptr<ByteArray> mask = fixed_prefix->getMask();
-
-    *netmask = mask->clone();
+    *netmask = fixed_prefix->getMask();
 
-        // Generates a random address with the correct prefix
-    auto_ptr<Random> random = CryptoController::getRandom();
+        // Takes a free address from the pool (network & broadcast addresses are never assigned)
+    AutoLock auto_lock( *this->mutex_addresses );
 
-    auto_ptr<ByteArray> generated_address_data = random->getRandomBytes( fixed_prefix_data->size() );
-
-    for ( uint16_t i = 0; i < fixed_prefix_data->size();i++ )
-        ( *generated_address_data )[ i ] = (( *fixed_prefix_data )[ i ] & ( *mask )[ i ] ) |
-    (( *generated_address_data )[ i ] & ~( *mask )[ i ] );
-
-    auto_ptr<ByteArray> alternative_address_data = generated_address_data->clone();
-
-        // So, the generated address is
-
-    uint8_t last_byte = ( *generated_address_data )[ 3 ];
-
-    auto_ptr<IpAddress> address( new IpAddressOpenIKE( Enums::ADDR_IPV4, generated_address_data ) );
-
-        // Avoid network & broadcast addresses when using IPv4 (if mask != 32)
-    if ( fixed_prefix->getPrefixLen() != 32 ) {
-        if ( *address == fixed_prefix->getNetworkAddress() ) {
-           ( *alternative_address_data )[ 3 ] = last_byte + 1 ;
-           auto_ptr<IpAddress> address2( new IpAddressOpenIKE( Enums::ADDR_IPV4, alternative_address_data ) );
-           return address2;
-       }
-       else if ( *address == *fixed_prefix->getBroadCastAddress() ) {
-           ( *alternative_address_data )[ 3 ] = last_byte - 1 ;
-           auto_ptr<IpAddress> address3( new IpAddressOpenIKE( Enums::ADDR_IPV4, alternative_address_data ) );
-           return address3;
-       }
-   }
-
-   bool rv = this->registerAddress( *address );
-   if ( !rv ) {
-    Log::writeLockedMessage( "NetworkController", "Randomly chosen IPv4 address is already in use. Please, try again", Log::LOG_ERRO, true );
-    return auto_ptr<IpAddress> ( NULL );
-}
+    auto_ptr<IpAddress> address = this->getAddressPool( ike_sa, *fixed_prefix ).allocateAddress( this->getAddressOwner( ike_sa ) );
+    if ( address.get() == NULL ) {
+        Log::writeLockedMessage( "NetworkController", "The IPv4 address pool is exhausted", Log::LOG_ERRO, true );
+        return auto_ptr<IpAddress> ( NULL );
+    }
 
-return address;
+    return address;
 }
 
 auto_ptr<IpAddress> NetworkControllerImplOpenIKE::generateIpv6AddressFixed( IkeSa& ike_sa, ConfigurationAttribute& attribute, auto_ptr<ByteArray> *netmask ) {
@@ -510,50 +634,46 @@ auto_ptr<IpAddress> NetworkControllerImplOpenIKE::generateIpv6AddressFixed( IkeS
 
     *netmask = mask->clone();
 
-        // Generates a random address with the correct prefix
-    auto_ptr<Random> random = CryptoController::getRandom();
-
-    auto_ptr<ByteArray> generated_address_data = random->getRandomBytes( fixed_prefix_data->size() );
+    AutoLock auto_lock( *this->mutex_addresses );
 
-    for ( uint16_t i = 0; i < fixed_prefix_data->size();i++ )
-        ( *generated_address_data )[ i ] = (( *fixed_prefix_data )[ i ] & ( *mask )[ i ] ) |
-    (( *generated_address_data )[ i ] & ~( *mask )[ i ] );
+    AddressPool& pool = this->getAddressPool( ike_sa, *fixed_prefix );
+    string owner = this->getAddressOwner( ike_sa );
 
         // If a suffix is requested
     if ( attribute.value->size() > 0 ) {
         uint16_t requested_suffix_len = ( *attribute.value )[ 16 ];
 
-        auto_ptr<ByteArray> final_address_data = generated_address_data->clone();
+        auto_ptr<ByteArray> final_address_data = fixed_prefix_data->clone();
 
         auto_ptr<ByteArray> mask = NetworkPrefix::getMask( 128 - requested_suffix_len, 16 );
 
             //Construct the final address
 
         for ( uint16_t i = 0; i < 16; i++ )
-            ( *final_address_data )[ i ] = (( *generated_address_data )[ i ] & ( *mask )[i] ) |
+            ( *final_address_data )[ i ] = (( *fixed_prefix_data )[ i ] & ( *mask )[i] ) |
         (( *attribute.value )[ i ] & ~( *mask )[i] );
 
 
             // Construct the address
         auto_ptr<IpAddress> address( new IpAddressOpenIKE( Enums::ADDR_IPV6, final_address_data->clone() ) );
-        NetworkPrefix temp_prefix( address, fixed_prefix->getPrefixLen() );
+        NetworkPrefix temp_prefix( address->clone(), fixed_prefix->getPrefixLen() );
 
-            // if the suggested suffix doesn't vilate the current prefix, go with it
-        if ( temp_prefix.getNetworkAddress() == fixed_prefix->getNetworkAddress() ) {
-            generated_address_data = final_address_data;
+            // if the suggested suffix doesn't vilate the current prefix and it is free, go with it
+        if ( !( temp_prefix.getNetworkAddress() == fixed_prefix->getNetworkAddress() ) ) {
+            Log::writeLockedMessage( "NetworkController", "Warning: Peer requests an address with an invalid prefix. Omiting proposed suffix", Log::LOG_WARN, true );
+        }
+        else if ( pool.contains( *address ) ? pool.allocateAddress( *address, owner ) : this->registerAddress( *address ) ) {
+            return address;
         }
         else {
-            Log::writeLockedMessage( "NetworkController", "Warning: Peer requests an address with an invalid prefix. Omiting proposed suffix", Log::LOG_WARN, true );
+            Log::writeLockedMessage( "NetworkController", "Warning: Peer requests an address already in use. Omiting proposed suffix", Log::LOG_WARN, true );
         }
     }
 
-        // So, the generated address is
-    auto_ptr<IpAddress> address( new IpAddressOpenIKE( Enums::ADDR_IPV6, generated_address_data ) );
-
-    bool rv = this->registerAddress( *address );
-
-    if ( !rv ) {
-        Log::writeLockedMessage( "NetworkController", "Randomly chosen IPv6 address is already in use. Please, try again", Log::LOG_ERRO, true );
+        // Takes a free address from the pool
+    auto_ptr<IpAddress> address = pool.allocateAddress( owner );
+    if ( address.get() == NULL ) {
+        Log::writeLockedMessage( "NetworkController", "The IPv6 address pool is exhausted", Log::LOG_ERRO, true );
         return auto_ptr<IpAddress> ( NULL );
     }
 
@@ -1066,25 +1186,93 @@ IkeSa::NEGOTIATION_ACTION NetworkControllerImplOpenIKE::processConfigurationResp
 
 
     void NetworkControllerImplOpenIKE::addSrcAddress( auto_ptr< IpAddress > new_src_address ) {
-        this->udp_socket->bind( SocketAddressPosix( new_src_address, 500 ) );
+        SocketAddressPosix src_address( new_src_address, 500 );
+
+        this->udp_socket->bind( src_address );
+
+        // A receiver socket failing to bind only loses its share of the traffic, the main socket receives the rest
+        for ( vector<UdpSocket*>::iterator it = this->receiver_sockets.begin(); it != this->receiver_sockets.end(); it++ ) {
+            try {
+                ( *it )->bind( src_address );
+            }
+            catch ( BindingException& ex ) {
+                Log::writeLockedMessage( "NetworkController", ex.what(), Log::LOG_ERRO, true );
+            }
+        }
     }
 
     void NetworkControllerImplOpenIKE::removeSrcAddress( const IpAddress& src_address ) {
-        this->udp_socket->unbind( SocketAddressPosix( src_address.clone(), 500 ) );
+        SocketAddressPosix socket_address( src_address.clone(), 500 );
+
+        this->udp_socket->unbind( socket_address );
+
+        for ( vector<UdpSocket*>::iterator it = this->receiver_sockets.begin(); it != this->receiver_sockets.end(); it++ ) {
+            try {
+                ( *it )->unbind( socket_address );
+            }
+            catch ( exception & ex ) {
+                Log::writeLockedMessage( "NetworkController", ex.what(), Log::LOG_ERRO, true );
+            }
+        }
+    }
+
+    void NetworkControllerImplOpenIKE::start( ) {
+        // Starts the additional receivers
+        for ( vector<NetworkReceiver*>::iterator it = this->receivers.begin(); it != this->receivers.end(); it++ )
+            ( *it )->start();
+
+        if ( this->interface_monitor != NULL )
+            this->interface_monitor->start();
+
+        ThreadPosix::start();
     }
 
     void NetworkControllerImplOpenIKE::run( ) {
         auto_ptr<GeneralConfiguration> general_conf = Configuration::getInstance().getGeneralConfiguration();
         Log::writeLockedMessage( "NetworkController", "Start: Thread ID=[" + intToString( thread_id ) +
          "] Cookie Threshold=[" + intToString( general_conf->cookie_threshold ) +
-         " half-opened IKE SAs] Max. Cookie Time=[" + intToString( general_conf->cookie_lifetime ) + " seconds]", Log::LOG_THRD, true );
+         " half-opened IKE SAs] Max. Cookie Time=[" + intToString( general_conf->cookie_lifetime ) + " seconds] Receivers=[" + intToString( this->receivers.size() + 1 ) + "]", Log::LOG_THRD, true );
+
+        this->receiveLoop( *this->udp_socket );
+    }
+
+    void NetworkControllerImplOpenIKE::receiveLoop( UdpSocket& socket ) {
+        // Reception buffers, reused for every batch
+        DatagramBatch batch( RECEIVE_BATCH_SIZE );
 
         // Do forever (until a thread cancel received)
         while ( !exiting ) {
             try {
-                // Waits for receive a message
-                auto_ptr<Message> received_message = this->receive();
+                // Waits for receive a batch of datagrams
+                if ( !socket.receiveBatch( batch ) )
+                    continue;
+
+                // Responses generated while processing the batch (i.e. INVALID_IKE_SPI)
+                AutoVector<Message> responses;
+
+                for ( uint16_t i = 0; i < batch.count; i++ ) {
+                    try {
+                        auto_ptr<ByteArray> message_data = batch.getData( i );
+                        ByteBuffer byte_buffer( *message_data );
+                        auto_ptr<Message> received_message ( new Message( batch.getSrcAddress( i ), batch.getDstAddress(), byte_buffer ) );
+
+                        this->processMessage( received_message, responses );
+                    }
+                    catch ( Exception & ex ) {
+                        Log::writeLockedMessage( "NetworkController", ex.what() , Log::LOG_ERRO, true );
+                    }
+                }
+
+                // Sends all the responses at once
+                this->sendMessages( responses );
+            }
+            catch ( Exception & ex ) {
+                Log::writeLockedMessage( "NetworkController", ex.what() , Log::LOG_ERRO, true );
+            }
+        }
+    }
 
+    void NetworkControllerImplOpenIKE::processMessage( auto_ptr<Message> received_message, AutoVector<Message>& responses ) {
     	        //For mobility protection
 
 		auto_ptr<GeneralConfiguration> general_conf = Configuration::getInstance().getGeneralConfiguration();
@@ -1124,7 +1312,7 @@ IkeSa::NEGOTIATION_ACTION NetworkControllerImplOpenIKE::processConfigurationResp
 			// if the threadcontroller is exiting, then omit new IKE_SA creation
 			if ( exiting ) {
 				Log::writeLockedMessage( "NetworkController", "Cannot create any IKE_SA because we are exiting.", Log::LOG_ERRO, true );
-				continue;
+				return;
 			}
 
 			// Increments the next SPI value to be used
@@ -1262,20 +1450,57 @@ IkeSa::NEGOTIATION_ACTION NetworkControllerImplOpenIKE::processConfigurationResp
 		                    	Log::writeLockedMessage( "NetworkController", "Debug 12", Log::LOG_WARN, true );
                     Log::writeLockedMessage( "NetworkController", "Message to an unknown IKE SA with SPI=" + Printable::toHexString( &our_spi, 8 ) + " Source Addr=[" + src_addr->toString() + "]", Log::LOG_WARN, true );
                     if ( received_message->message_type == Message::REQUEST )
-                        this->send_INVALID_IKE_SPI( *received_message );
+                        responses->push_back( this->createInvalidIkeSpiResponse( *received_message ).release() );
                 }
 		                    	Log::writeLockedMessage( "NetworkController", "Debug 13", Log::LOG_WARN, true );
+    }
+
+    void NetworkControllerImplOpenIKE::sendMessages( AutoVector<Message>& messages ) {
+        // Groups the messages by source address, so each group needs a single system call
+        while ( !messages->empty() ) {
+            auto_ptr<SocketAddress> src_addr = messages->front()->getSrcAddress().clone();
+
+            vector<ByteArray*> data;
+            vector<const SocketAddress*> dst_addrs;
+            vector<Message*> remaining;
+
+            for ( vector<Message*>::iterator it = messages->begin(); it != messages->end(); it++ ) {
+                if ( ( *it )->getSrcAddress() == *src_addr ) {
+                    data.push_back( ( *it )->getBinaryRepresentation( NULL ).release() );
+                    dst_addrs.push_back( &( *it )->getDstAddress() );
+                }
+                else {
+                    remaining.push_back( *it );
+                }
+            }
 
+            try {
+                this->udp_socket->sendBatch( *src_addr, dst_addrs, data );
             }
             catch ( Exception & ex ) {
                 Log::writeLockedMessage( "NetworkController", ex.what() , Log::LOG_ERRO, true );
             }
+
+            // Deletes the sent messages and keeps the others
+            for ( vector<ByteArray*>::iterator it = data.begin(); it != data.end(); it++ )
+                delete ( *it );
+
+            for ( vector<Message*>::iterator it = messages->begin(); it != messages->end(); it++ ) {
+                if ( ( *it )->getSrcAddress() == *src_addr )
+                    delete ( *it );
+            }
+            messages->swap( remaining );
         }
     }
 
     void NetworkControllerImplOpenIKE::send_INVALID_IKE_SPI( Message& received_message ) {
+        auto_ptr<Message> message = this->createInvalidIkeSpiResponse( received_message );
+        this->sendMessage( *message, NULL );
+    }
+
+    auto_ptr<Message> NetworkControllerImplOpenIKE::createInvalidIkeSpiResponse( Message& received_message ) {
             // Creates a new Message (we are responders)
-        Message message( received_message.getDstAddress().clone(),
+        auto_ptr<Message> message ( new Message( received_message.getDstAddress().clone(),
            received_message.getSrcAddress().clone(),
            received_message.spi_i,
            received_message.spi_r,
@@ -1286,20 +1511,20 @@ IkeSa::NEGOTIATION_ACTION NetworkControllerImplOpenIKE::processConfigurationResp
                              !received_message.is_initiator,
                              false,                                                       // cannot use major version
                              received_message.message_id
-                             );
+                             ) );
 
         uint64_t our_spi = received_message.is_initiator ? received_message.spi_r : received_message.spi_i;
 
         auto_ptr<Payload> notify( new Payload_NOTIFY( Payload_NOTIFY::INVALID_IKE_SPI, Enums::PROTO_NONE ) );
 
-        message.addPayload( notify, false );
-
-        this->sendMessage( message, NULL );
+        message->addPayload( notify, false );
 
         Log::acquire();
         Log::writeMessage( "NetworkController", "Send: INVALID_IKE_SPI=" + Printable::toHexString( &our_spi, 8 ), Log::LOG_MESG, true );
-        Log::writeMessage( "NetworkController", message.toStringTab( 1 ), Log::LOG_MESG, false );
+        Log::writeMessage( "NetworkController", message->toStringTab( 1 ), Log::LOG_MESG, false );
         Log::release();
+
+        return message;
     }
 
 
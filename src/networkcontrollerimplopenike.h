@@ -12,8 +12,11 @@
 
 #include <libopenikev2/networkcontrollerimpl.h>
 #include <libopenikev2/payload_conf.h>
+#include <libopenikev2/autovector.h>
+#include <libopenikev2/mutex.h>
 #include "udpsocket.h"
 #include "threadposix.h"
+#include "addresspool.h"
 
 #include <map>
 
@@ -21,17 +24,30 @@
 
 namespace openikev2 {
     class RadvdWrapper;
+    class NetworkReceiver;
+    class InterfaceMonitor;
+    class IkeSaControllerImplOpenIKE;
     /**
         This class represents the NetworkController concrete implementation used in the openikev2 program.
         @author Pedro J. Fernandez Ruiz, Alejandro Perez Mendez <pedroj@um.es, alex@um.es>
     */
     class NetworkControllerImplOpenIKE : public NetworkControllerImpl, public ThreadPosix {
             friend class AddressConfiguration;
+            friend class NetworkReceiver;
+            friend class InterfaceMonitor;
 
             /****************************** ATTRIBUTES ******************************/
         protected:
-            map <string, bool> used_addresses;          /**< Map of used addresses */
+            map <string, bool> used_addresses;          /**< Map of used addresses outside the address pools */
+            map <string, AddressPool*> address_pools;   /**< Address pools, by network prefix */
+            auto_ptr<Mutex> mutex_addresses;            /**< Mutex to control the address pools */
             auto_ptr<UdpSocket> udp_socket;             /**< UDP Socket to perform networking operations */
+            vector<UdpSocket*> receiver_sockets;        /**< Additional SO_REUSEPORT sockets, one per NetworkReceiver */
+            vector<NetworkReceiver*> receivers;         /**< Additional receiver threads */
+            map<string, string> interface_addresses;    /**< Interface name of each bound address, by address */
+            auto_ptr<Mutex> mutex_interfaces;           /**< Mutex to control the interface table */
+            InterfaceMonitor* interface_monitor;        /**< Thread updating the interface table (NULL if rtnetlink is not available) */
+            IkeSaControllerImplOpenIKE* ike_sa_controller; /**< IKE SA controller notified of the removed addresses (MOBIKE). Can be NULL */
             bool exiting;                               /**< Indicates if we want to exit */
 #ifdef EAP_SERVER_ENABLED
             RadvdWrapper *radvd;
@@ -57,8 +73,44 @@ namespace openikev2 {
              */
             virtual void createAddress( const IpAddress& addr, uint8_t prefixlen, string ifname );
 
+            /**
+             * Does nothing if the InterfaceMonitor keeps the interface table updated. Otherwise, it is rebuilt.
+             */
             virtual void refreshInterfaces();
 
+            /**
+             * Rebuilds the interface table from the current system interfaces, binding and unbinding the changed addresses
+             */
+            virtual void syncInterfaces();
+
+            /**
+             * Adds an address to the interface table, binding it in all the sockets
+             * @param address New interface address
+             * @param interface_name Interface name
+             */
+            virtual void addInterfaceAddress( const IpAddress& address, string interface_name );
+
+            /**
+             * Removes an address from the interface table, unbinding it from all the sockets.
+             * The IKE SAs using it are moved to another address of the same family (MOBIKE), if any.
+             * @param address Removed interface address
+             */
+            virtual void removeInterfaceAddress( const IpAddress& address );
+
+            /**
+             * Binds a new source address in all the sockets
+             * @param src_address New source socket address to bind
+             * @param interface_name Interface name (needed for LINK LOCAL addresses)
+             * @throws BindingException Cannot bind the indicated address/port
+             */
+            virtual void bindAll( const SocketAddress& src_address, string interface_name );
+
+            /**
+             * Receives and processes messages from a socket until the controller exits
+             * @param socket Socket to receive from
+             */
+            virtual void receiveLoop( UdpSocket& socket );
+
 	    virtual IpAddress * getCurrentCoA();
 
 	    virtual IpAddress * getHoAbyCoA(const IpAddress& current_coa);
@@ -81,6 +133,21 @@ namespace openikev2 {
 
             virtual void deleteRoute( const IpAddress& addr_dst, uint8_t prefixlen, const IpAddress& gateway, int metric, string ifname );
 
+            /**
+             * Gets the address pool of a network prefix, creating it the first time. The caller must lock the addresses mutex
+             * @param ike_sa IKE_SA whose configuration indicates the lease file
+             * @param prefix Network prefix
+             * @return The address pool
+             */
+            virtual AddressPool& getAddressPool( IkeSa& ike_sa, NetworkPrefix& prefix );
+
+            /**
+             * Gets the owner name used to bind the peer to its address, if the configuration requests it
+             * @param ike_sa IKE_SA
+             * @return The owner name, or an empty string if the addresses are not sticky
+             */
+            virtual string getAddressOwner( IkeSa& ike_sa );
+
             /**
              * Gets an IPv6 address from an address pool based on the fixed parameters
              * @param IkeSa IKE_SA
@@ -131,7 +198,7 @@ namespace openikev2 {
             virtual auto_ptr<IpAddress> generateIpv4Address( IkeSa& ike_sa, ConfigurationAttribute& attribute, auto_ptr<ByteArray> *netmask );
 
             /**
-             * Register an address as used in the pool
+             * Register an address outside the address pools as used. The caller must lock the addresses mutex
              * @param addr Address to be registered as used
              * @return TRUE if address is not already registered. FALSE otherwise
              */
@@ -155,8 +222,33 @@ namespace openikev2 {
              */
             virtual void send_INVALID_IKE_SPI( Message& received_message );
 
+            /**
+             * Creates a response exchange with a NOTIFY payload indicating a INVALID_IKE_SPI condition
+             * @param received_message The received request
+             * @return The response message, ready to be sent
+             */
+            virtual auto_ptr<Message> createInvalidIkeSpiResponse( Message& received_message );
+
+            /**
+             * Processes a received message, dispatching it to the properly IkeSa
+             * @param received_message The received message
+             * @param responses Collection where the responses to be sent by the network controller are stored
+             */
+            virtual void processMessage( auto_ptr<Message> received_message, AutoVector<Message>& responses );
+
+            /**
+             * Sends several unencrypted messages, using a single system call per source address
+             * @param messages Messages to be sent. The collection is emptied.
+             */
+            virtual void sendMessages( AutoVector<Message>& messages );
+
         public:
-            NetworkControllerImplOpenIKE();
+            /**
+             * Creates a new NetworkControllerImplOpenIKE
+             * @param receive_backend Backend used by the UdpSocket to wait for incoming IKE messages
+             * @param num_receivers Number of receiver threads, each one with its own SO_REUSEPORT socket
+             */
+            NetworkControllerImplOpenIKE( UdpSocket::RECEIVE_BACKEND receive_backend = UdpSocket::RECEIVE_EPOLL, uint16_t num_receivers = 4 );
 
             virtual auto_ptr<IpAddress> getIpAddress( string address );
 
@@ -176,6 +268,8 @@ namespace openikev2 {
 
             virtual void run();
 
+            virtual void start();
+
             virtual void sendMessage( Message &message, Cipher* cipher );
 
             virtual void addSrcAddress( auto_ptr<IpAddress> new_src_address );
@@ -188,6 +282,12 @@ namespace openikev2 {
 
             virtual void startRadvd();
 
+            /**
+             * Sets the IKE SA controller notified when a local address disappears
+             * @param ike_sa_controller IKE SA controller
+             */
+            virtual void setIkeSaController( IkeSaControllerImplOpenIKE* ike_sa_controller );
+
             virtual ~NetworkControllerImplOpenIKE();
     };
 }
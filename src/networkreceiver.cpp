@@ -0,0 +1,26 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#include "networkreceiver.h"
+
+#include <libopenikev2/log.h>
+
+namespace openikev2 {
+    NetworkReceiver::NetworkReceiver( NetworkControllerImplOpenIKE& network_controller, UdpSocket& udp_socket, uint16_t id ) :
+            network_controller ( network_controller ), udp_socket ( udp_socket ) {
+        this->id = id;
+    }
+
+    NetworkReceiver::~NetworkReceiver( ) {}
+
+    void NetworkReceiver::run( ) {
+        Log::writeLockedMessage( "NetworkReceiver[" + intToString ( this->id ) + "]", "Start: Thread ID=[" + intToString( thread_id ) + "]", Log::LOG_THRD, true );
+
+        this->network_controller.receiveLoop( this->udp_socket );
+    }
+}
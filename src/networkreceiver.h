@@ -0,0 +1,47 @@
+/***************************************************************************
+ *   Copyright (C) 2005 by                                                 *
+ *   Alejandro Perez Mendez     alex@um.es                                 *
+ *   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+ *                                                                         *
+ *   This software may be modified and distributed under the terms         *
+ *   of the Apache license.  See the LICENSE file for details.             *
+ ***************************************************************************/
+#ifndef NETWORKRECEIVER_H
+#define NETWORKRECEIVER_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "networkcontrollerimplopenike.h"
+#include "threadposix.h"
+
+namespace openikev2 {
+
+    /**
+        This class represents an additional IKE message receiver.
+        It receives, parses and dispatches the messages arriving to its own SO_REUSEPORT socket
+        @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
+    */
+    class NetworkReceiver : public ThreadPosix {
+        protected:
+            NetworkControllerImplOpenIKE& network_controller;
+            UdpSocket& udp_socket;
+            uint16_t id;
+
+            /****************************** METHODS ******************************/
+        public:
+            /**
+             * Creates a new NetworkReceiver
+             * @param network_controller Network controller used to process the received messages
+             * @param udp_socket Socket where the messages are received
+             * @param id Receiver identifier
+             */
+            NetworkReceiver( NetworkControllerImplOpenIKE& network_controller, UdpSocket& udp_socket, uint16_t id );
+
+            virtual void run();
+
+            virtual ~NetworkReceiver();
+    };
+};
+#endif
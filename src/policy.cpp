@@ -10,7 +10,31 @@
 
 namespace openikev2 {
 
-    Policy::Policy( ) {}
+    Policy::Policy( ) {
+        this->priority = 0;
+    }
+
+    Policy::Policy( const Policy & other ) {
+        this->selector_src = other.selector_src->clone();
+        this->selector_dst = other.selector_dst->clone();
+        this->selector_src_port = other.selector_src_port;
+        this->selector_dst_port = other.selector_dst_port;
+        this->icmp_type = other.icmp_type;
+        this->icmp_code = other.icmp_code;
+        this->selector_prefixlen_src = other.selector_prefixlen_src;
+        this->selector_prefixlen_dst = other.selector_prefixlen_dst;
+        this->id = other.id;
+        this->priority = other.priority;
+        this->type = other.type;
+        this->direction = other.direction;
+        this->ip_protocol = other.ip_protocol;
+        if ( other.sa_request.get() )
+            this->sa_request.reset( new SaRequest( *other.sa_request ) );
+    }
+
+    auto_ptr<Policy> Policy::clone( ) const {
+        return auto_ptr<Policy> ( new Policy( *this ) );
+    }
 
     Policy::~Policy() { }
 
@@ -21,6 +45,8 @@ namespace openikev2 {
 
         oss << Printable::generateTabs( tabs + 1 ) << "id=" << ( int ) this->id << "\n";
 
+        oss << Printable::generateTabs( tabs + 1 ) << "priority=" << this->priority << "\n";
+
         oss << Printable::generateTabs( tabs + 1 ) << "type=" << Enums::POLICY_TYPE_STR(this->type) << "\n";
 
         oss << Printable::generateTabs( tabs + 1 ) << "direction=" << Enums::DIRECTION_STR( this->direction ) << "\n";
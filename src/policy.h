@@ -33,6 +33,7 @@ namespace openikev2 {
             uint8_t selector_prefixlen_src;     /**< Selector source prefix length */
             uint8_t selector_prefixlen_dst;     /**< Selector destination prefix length */
             uint32_t id;                        /**< Policy ID */
+            uint32_t priority;                  /**< Policy priority. Policies with lower values are checked first */
             Enums::POLICY_TYPE type;            /**< Policy Type (MAIN or SUB) */
             Enums::DIRECTION direction;         /**< Policy direction */
             uint8_t ip_protocol;                /**< IP protocol to protect (TCP, UDP..). See IP protocol ids.*/
@@ -45,6 +46,18 @@ namespace openikev2 {
              */
             Policy();
 
+            /**
+             * Creates a new Policy clonning another one.
+             * @param other Other Policy to be cloned.
+             */
+            Policy( const Policy & other );
+
+            /**
+             * Clones this Policy
+             * @return A new Policy with the same attributes
+             */
+            virtual auto_ptr<Policy> clone() const;
+
             /**
              * Compares this Policy with another one.
              * @param other Other policy.
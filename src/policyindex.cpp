@@ -0,0 +1,256 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#include "policyindex.h"
+
+#include "utilsimpl.h"
+
+namespace openikev2 {
+
+    PolicyIndex::TrieNode::TrieNode() {
+        this->children[ 0 ] = NULL;
+        this->children[ 1 ] = NULL;
+        this->dst_root = NULL;
+    }
+
+    PolicyIndex::TrieNode::~TrieNode() {
+        delete this->children[ 0 ];
+        delete this->children[ 1 ];
+        delete this->dst_root;
+    }
+
+    PolicyIndex::PolicyIndex() {
+        this->next_sequence = 0;
+    }
+
+    PolicyIndex::~PolicyIndex() {
+        this->clear();
+    }
+
+    uint32_t PolicyIndex::getBucketKey( Enums::DIRECTION direction, Enums::ADDR_FAMILY family, uint8_t ip_protocol ) {
+        return ( ( uint32_t ) direction << 16 ) | ( ( uint32_t ) family << 8 ) | ip_protocol;
+    }
+
+    bool PolicyIndex::isSamePolicy( const Policy & policy, const Policy & other ) {
+        if ( policy.id != other.id || policy.priority != other.priority || !policy.equals( other ) )
+            return false;
+
+        // Policy::equals() doesn't compare the ports (or ICMP type and code, which share their fields)
+        return policy.selector_src_port == other.selector_src_port && policy.selector_dst_port == other.selector_dst_port;
+    }
+
+    PolicyIndex::TrieNode * PolicyIndex::getNode( TrieNode * root, const ByteArray & address, uint8_t prefixlen, bool create ) {
+        const uint8_t* bytes = ( const uint8_t* ) address.getRawPointer();
+        TrieNode* node = root;
+        for ( uint16_t i = 0; i < prefixlen && node != NULL; i++ ) {
+            uint8_t bit = ( bytes[ i / 8 ] >> ( 7 - i % 8 ) ) & 1;
+            if ( node->children[ bit ] == NULL && create )
+                node->children[ bit ] = new TrieNode();
+            node = node->children[ bit ];
+        }
+        return node;
+    }
+
+    void PolicyIndex::collectSubtree( const TrieNode * node, map<PolicyPosition, Policy*>& result ) {
+        if ( node == NULL )
+            return;
+
+        result.insert( node->policies.begin(), node->policies.end() );
+        collectSubtree( node->children[ 0 ], result );
+        collectSubtree( node->children[ 1 ], result );
+    }
+
+    void PolicyIndex::collectOverlapping( const TrieNode * root, const ByteArray & address, uint8_t prefixlen, map<PolicyPosition, Policy*>& result ) {
+        // A policy prefix overlaps the address prefix if it contains it (ancestors) or it is contained in it (subtree)
+        const uint8_t* bytes = ( const uint8_t* ) address.getRawPointer();
+        const TrieNode* node = root;
+        for ( uint16_t i = 0; i < prefixlen && node != NULL; i++ ) {
+            result.insert( node->policies.begin(), node->policies.end() );
+            uint8_t bit = ( bytes[ i / 8 ] >> ( 7 - i % 8 ) ) & 1;
+            node = node->children[ bit ];
+        }
+        collectSubtree( node, result );
+    }
+
+    void PolicyIndex::collectSubtree( const TrieNode * node, const ByteArray & dst_address, uint8_t dst_prefixlen, map<PolicyPosition, Policy*>& result ) {
+        if ( node == NULL )
+            return;
+
+        if ( node->dst_root != NULL )
+            collectOverlapping( node->dst_root, dst_address, dst_prefixlen, result );
+        collectSubtree( node->children[ 0 ], dst_address, dst_prefixlen, result );
+        collectSubtree( node->children[ 1 ], dst_address, dst_prefixlen, result );
+    }
+
+    void PolicyIndex::collectOverlapping( const TrieNode * root, const ByteArray & src_address, uint8_t src_prefixlen, const ByteArray & dst_address, uint8_t dst_prefixlen, map<PolicyPosition, Policy*>& result ) {
+        // Only the destination tries of the source prefixes overlapping the source address prefix are searched
+        const uint8_t* bytes = ( const uint8_t* ) src_address.getRawPointer();
+        const TrieNode* node = root;
+        for ( uint16_t i = 0; i < src_prefixlen && node != NULL; i++ ) {
+            if ( node->dst_root != NULL )
+                collectOverlapping( node->dst_root, dst_address, dst_prefixlen, result );
+            uint8_t bit = ( bytes[ i / 8 ] >> ( 7 - i % 8 ) ) & 1;
+            node = node->children[ bit ];
+        }
+        collectSubtree( node, dst_address, dst_prefixlen, result );
+    }
+
+    void PolicyIndex::indexPolicy( Policy & policy, const PolicyPosition & position ) {
+        uint32_t key = getBucketKey( policy.direction, policy.selector_src->getFamily(), policy.ip_protocol );
+
+        map<uint32_t, TrieNode*>::iterator it = this->tries.find( key );
+        if ( it == this->tries.end() )
+            it = this->tries.insert( pair<uint32_t, TrieNode*>( key, new TrieNode() ) ).first;
+
+        auto_ptr<ByteArray> src_address = policy.selector_src->getBytes();
+        TrieNode* src_node = getNode( it->second, *src_address, policy.selector_prefixlen_src, true );
+        if ( src_node->dst_root == NULL )
+            src_node->dst_root = new TrieNode();
+
+        auto_ptr<ByteArray> dst_address = policy.selector_dst->getBytes();
+        getNode( src_node->dst_root, *dst_address, policy.selector_prefixlen_dst, true ) ->policies[ position ] = &policy;
+    }
+
+    void PolicyIndex::unindexPolicy( Policy & policy, const PolicyPosition & position ) {
+        uint32_t key = getBucketKey( policy.direction, policy.selector_src->getFamily(), policy.ip_protocol );
+
+        map<uint32_t, TrieNode*>::iterator it = this->tries.find( key );
+        if ( it == this->tries.end() )
+            return;
+
+        // Empty nodes are kept, they will be reused by the next policies with the same prefix
+        auto_ptr<ByteArray> src_address = policy.selector_src->getBytes();
+        TrieNode* src_node = getNode( it->second, *src_address, policy.selector_prefixlen_src, false );
+        if ( src_node == NULL || src_node->dst_root == NULL )
+            return;
+
+        auto_ptr<ByteArray> dst_address = policy.selector_dst->getBytes();
+        TrieNode* dst_node = getNode( src_node->dst_root, *dst_address, policy.selector_prefixlen_dst, false );
+        if ( dst_node != NULL )
+            dst_node->policies.erase( position );
+    }
+
+    void PolicyIndex::addPolicy( auto_ptr<Policy> policy ) {
+        // Like the kernel, new policies go after the existing ones with the same priority
+        PolicyPosition position( policy->priority, this->next_sequence );
+
+        map<uint32_t, PolicyPosition>::iterator it = this->position_by_id.find( policy->id );
+        if ( it != this->position_by_id.end() ) {
+            Policy* old_policy = this->policies_by_position[ it->second ];
+
+            // The same policy is usually notified more than once (i.e. the creation reply and its multicast echo)
+            if ( isSamePolicy( *old_policy, *policy ) )
+                return;
+
+            // An updated policy keeps its position, unless its priority has changed
+            if ( old_policy->priority == policy->priority )
+                position = it->second;
+
+            this->unindexPolicy( *old_policy, it->second );
+            this->policies_by_position.erase( it->second );
+            delete old_policy;
+        }
+
+        if ( position.second == this->next_sequence )
+            this->next_sequence++;
+
+        this->position_by_id[ policy->id ] = position;
+        this->indexPolicy( *policy, position );
+        this->policies_by_position[ position ] = policy.release();
+    }
+
+    bool PolicyIndex::removePolicy( uint32_t id ) {
+        map<uint32_t, PolicyPosition>::iterator it = this->position_by_id.find( id );
+        if ( it == this->position_by_id.end() )
+            return false;
+
+        PolicyPosition position = it->second;
+        Policy* policy = this->policies_by_position[ position ];
+
+        this->unindexPolicy( *policy, position );
+        this->policies_by_position.erase( position );
+        this->position_by_id.erase( it );
+        delete policy;
+
+        return true;
+    }
+
+    void PolicyIndex::clear() {
+        for ( map<PolicyPosition, Policy*>::iterator it = this->policies_by_position.begin(); it != this->policies_by_position.end(); it++ )
+            delete it->second;
+
+        for ( map<uint32_t, TrieNode*>::iterator it = this->tries.begin(); it != this->tries.end(); it++ )
+            delete it->second;
+
+        this->policies_by_position.clear();
+        this->position_by_id.clear();
+        this->tries.clear();
+    }
+
+    Policy * PolicyIndex::getPolicyById( uint32_t id ) const {
+        map<uint32_t, PolicyPosition>::const_iterator it = this->position_by_id.find( id );
+        if ( it == this->position_by_id.end() )
+            return NULL;
+
+        return this->policies_by_position.find( it->second ) ->second;
+    }
+
+    vector<Policy*> PolicyIndex::getPolicies() const {
+        vector<Policy*> result;
+        for ( map<PolicyPosition, Policy*>::const_iterator it = this->policies_by_position.begin(); it != this->policies_by_position.end(); it++ )
+            result.push_back( it->second );
+        return result;
+    }
+
+    vector<Policy*> PolicyIndex::findCandidates( Enums::DIRECTION direction, const TrafficSelector & ts_src, const TrafficSelector & ts_dst ) const {
+        vector<Policy*> result;
+
+        if ( ts_src.ts_type != TrafficSelector::TS_IPV4_ADDR_RANGE && ts_src.ts_type != TrafficSelector::TS_IPV6_ADDR_RANGE )
+            return result;
+
+        if ( ts_dst.ts_type != ts_src.ts_type )
+            return result;
+
+        Enums::ADDR_FAMILY family = ( ts_src.ts_type == TrafficSelector::TS_IPV4_ADDR_RANGE ) ? Enums::ADDR_IPV4 : Enums::ADDR_IPV6;
+
+        // Smallest prefixes containing the selector ranges
+        uint16_t src_prefixlen, dst_prefixlen;
+        auto_ptr<IpAddress> src_prefix = UtilsImpl::trafficSelectorToIpAddress( ts_src, &src_prefixlen );
+        auto_ptr<IpAddress> dst_prefix = UtilsImpl::trafficSelectorToIpAddress( ts_dst, &dst_prefixlen );
+        auto_ptr<ByteArray> src_address = src_prefix->getBytes();
+        auto_ptr<ByteArray> dst_address = dst_prefix->getBytes();
+
+        // Policies for any protocol always apply. Selectors for any protocol apply to all the policies
+        map<PolicyPosition, Policy*> candidates;
+        map<uint32_t, TrieNode*>::const_iterator first, last;
+        if ( ts_src.ip_protocol_id == 0 ) {
+            first = this->tries.lower_bound( getBucketKey( direction, family, 0 ) );
+            last = this->tries.upper_bound( getBucketKey( direction, family, 0xFF ) );
+            for ( map<uint32_t, TrieNode*>::const_iterator it = first; it != last; it++ )
+                collectOverlapping( it->second, *src_address, src_prefixlen, *dst_address, dst_prefixlen, candidates );
+        }
+        else {
+            map<uint32_t, TrieNode*>::const_iterator it = this->tries.find( getBucketKey( direction, family, 0 ) );
+            if ( it != this->tries.end() )
+                collectOverlapping( it->second, *src_address, src_prefixlen, *dst_address, dst_prefixlen, candidates );
+
+            it = this->tries.find( getBucketKey( direction, family, ts_src.ip_protocol_id ) );
+            if ( it != this->tries.end() )
+                collectOverlapping( it->second, *src_address, src_prefixlen, *dst_address, dst_prefixlen, candidates );
+        }
+
+        for ( map<PolicyPosition, Policy*>::iterator it = candidates.begin(); it != candidates.end(); it++ )
+            result.push_back( it->second );
+
+        return result;
+    }
+
+    uint32_t PolicyIndex::size() const {
+        return this->policies_by_position.size();
+    }
+}
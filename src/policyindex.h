@@ -0,0 +1,192 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#ifndef POLICYINDEX_H
+#define POLICYINDEX_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "policy.h"
+
+#include <map>
+#include <vector>
+
+using namespace std;
+
+namespace openikev2 {
+
+    /**
+        This class represents an indexed collection of IPsec policies (the SPD mirror).
+        Policies are indexed by ID, and by selectors in a two-level binary prefix trie for each (direction, family, IP protocol) bucket:
+        each node of the source selector trie has its own destination selector trie, whose nodes hold the policies.
+        The collection owns the policies, and keeps them in the kernel SPD order: by priority, and then in insertion order.
+        @author Pedro J. Fernandez Ruiz, Alejandro Perez Mendez <pedroj@um.es, alex@um.es>
+    */
+    class PolicyIndex {
+            /****************************** STRUCTS ******************************/
+        protected:
+            /**
+             * Position of a policy in the SPD: its priority and its insertion sequence number
+             */
+            typedef pair<uint32_t, uint64_t> PolicyPosition;
+
+            /**
+             * Node of a selector prefix trie
+             */
+            struct TrieNode {
+                TrieNode* children[ 2 ];                    /**< Children nodes (bit 0 and bit 1) */
+                TrieNode* dst_root;                         /**< Destination selector trie of the policies with exactly this source prefix (source tries only) */
+                map<PolicyPosition, Policy*> policies;      /**< Policies with exactly this destination prefix, by SPD position (destination tries only) */
+
+                TrieNode();
+                ~TrieNode();
+            };
+
+            /****************************** ATTRIBUTES ******************************/
+        protected:
+            map<uint32_t, PolicyPosition> position_by_id;       /**< SPD position of each policy, by policy ID */
+            map<PolicyPosition, Policy*> policies_by_position;  /**< Policies in SPD order */
+            map<uint32_t, TrieNode*> tries;                     /**< Source selector tries, by bucket key */
+            uint64_t next_sequence;                             /**< Sequence number for the next inserted policy */
+
+            /****************************** METHODS ******************************/
+        protected:
+            /**
+             * Gets the bucket key for a direction, address family and IP protocol
+             * @return Bucket key
+             */
+            static uint32_t getBucketKey( Enums::DIRECTION direction, Enums::ADDR_FAMILY family, uint8_t ip_protocol );
+
+            /**
+             * Checks if two policies have the same ID and the same attributes
+             * @param policy Policy
+             * @param other Other policy
+             * @return TRUE if the policies are identical. FALSE otherwise
+             */
+            static bool isSamePolicy( const Policy& policy, const Policy& other );
+
+            /**
+             * Gets the trie node for an address prefix
+             * @param root Trie root
+             * @param address Address bytes
+             * @param prefixlen Prefix length
+             * @param create Create the missing nodes
+             * @return The node, or NULL if it doesn't exist and create is FALSE
+             */
+            static TrieNode* getNode( TrieNode* root, const ByteArray& address, uint8_t prefixlen, bool create );
+
+            /**
+             * Adds all the policies of a destination trie subtree to a collection
+             * @param node Subtree root
+             * @param result Collection where the policies are added
+             */
+            static void collectSubtree( const TrieNode* node, map<PolicyPosition, Policy*>& result );
+
+            /**
+             * Adds the policies of a destination trie overlapping an address prefix to a collection
+             * @param root Trie root
+             * @param address Address bytes
+             * @param prefixlen Prefix length
+             * @param result Collection where the policies are added
+             */
+            static void collectOverlapping( const TrieNode* root, const ByteArray& address, uint8_t prefixlen, map<PolicyPosition, Policy*>& result );
+
+            /**
+             * Adds the policies of a source trie subtree overlapping a destination prefix to a collection
+             * @param node Subtree root
+             * @param dst_address Destination address bytes
+             * @param dst_prefixlen Destination prefix length
+             * @param result Collection where the policies are added
+             */
+            static void collectSubtree( const TrieNode* node, const ByteArray& dst_address, uint8_t dst_prefixlen, map<PolicyPosition, Policy*>& result );
+
+            /**
+             * Adds the policies of a source trie overlapping both a source and a destination prefix to a collection
+             * @param root Source trie root
+             * @param src_address Source address bytes
+             * @param src_prefixlen Source prefix length
+             * @param dst_address Destination address bytes
+             * @param dst_prefixlen Destination prefix length
+             * @param result Collection where the policies are added
+             */
+            static void collectOverlapping( const TrieNode* root, const ByteArray& src_address, uint8_t src_prefixlen, const ByteArray& dst_address, uint8_t dst_prefixlen, map<PolicyPosition, Policy*>& result );
+
+            /**
+             * Inserts a policy in its trie
+             * @param policy Policy
+             * @param position SPD position of the policy
+             */
+            virtual void indexPolicy( Policy& policy, const PolicyPosition& position );
+
+            /**
+             * Removes a policy from its trie
+             * @param policy Policy
+             * @param position SPD position of the policy
+             */
+            virtual void unindexPolicy( Policy& policy, const PolicyPosition& position );
+
+        public:
+            /**
+             * Creates a new empty PolicyIndex
+             */
+            PolicyIndex();
+
+            /**
+             * Adds a policy at its priority position. If there is an identical policy with the same ID, nothing is done.
+             * If there is a different one, it is replaced, keeping its position if the priority has not changed
+             * @param policy Policy to be added
+             */
+            virtual void addPolicy( auto_ptr<Policy> policy );
+
+            /**
+             * Removes (and deletes) a policy
+             * @param id Policy ID
+             * @return TRUE if the policy was found. FALSE otherwise
+             */
+            virtual bool removePolicy( uint32_t id );
+
+            /**
+             * Removes (and deletes) all the policies
+             */
+            virtual void clear();
+
+            /**
+             * Gets a policy by its ID
+             * @param id Policy ID
+             * @return The policy, or NULL if not found
+             */
+            virtual Policy* getPolicyById( uint32_t id ) const;
+
+            /**
+             * Gets all the policies, in SPD order
+             * @return Policy collection
+             */
+            virtual vector<Policy*> getPolicies() const;
+
+            /**
+             * Gets the policies whose source and destination selectors may intersect with two traffic selectors, in SPD order.
+             * The caller must check the rest of the policy attributes.
+             * @param direction Policy direction
+             * @param ts_src Traffic selector to be compared with the policy source selectors
+             * @param ts_dst Traffic selector to be compared with the policy destination selectors
+             * @return Candidate policies
+             */
+            virtual vector<Policy*> findCandidates( Enums::DIRECTION direction, const TrafficSelector& ts_src, const TrafficSelector& ts_dst ) const;
+
+            /**
+             * Gets the number of policies
+             * @return Number of policies
+             */
+            virtual uint32_t size() const;
+
+            virtual ~PolicyIndex();
+    };
+};
+#endif
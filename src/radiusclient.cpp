@@ -0,0 +1,300 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#include "radiusclient.h"
+#include "radiusreceiver.h"
+#include "socketaddressposix.h"
+#include "ipaddressopenike.h"
+
+#include <libopenikev2/threadcontroller.h>
+#include <libopenikev2/autolock.h>
+#include <libopenikev2/log.h>
+
+#include <time.h>
+#include <unistd.h>
+#include <string.h>
+
+/* Time between two checks of the retransmission deadlines (in milliseconds) */
+#define RADIUS_RETRANSMISSION_TICK 100
+
+/* Maximum number of responses received with a single system call */
+#define RADIUS_RECEIVE_BATCH 16
+
+namespace openikev2 {
+    RadiusClient* RadiusClient::instance = NULL;
+    MutexPosix RadiusClient::mutex_instance;
+
+    RadiusResponseHandler::~RadiusResponseHandler() {}
+
+    __thread RadiusResponseHandler* RadiusDispatchTracker::dispatched_handler = NULL;
+
+    RadiusDispatchTracker::RadiusDispatchTracker() {
+        this->condition_dispatching.reset( new ConditionPosix() );
+    }
+
+    RadiusDispatchTracker::~RadiusDispatchTracker() {}
+
+    void RadiusDispatchTracker::startDispatch( RadiusResponseHandler & handler ) {
+        AutoLock auto_lock( *this->condition_dispatching );
+        this->dispatching_handlers[ &handler ]++;
+    }
+
+    void RadiusDispatchTracker::dispatch( RadiusResponseHandler & handler, uint32_t transaction_id, auto_ptr<RadiusMessage> request, auto_ptr<RadiusMessage> response, const ByteArray & secret ) {
+        // A handler can notify another one (e.g. a RadiusServerGroup), so the previous value is restored afterwards
+        RadiusResponseHandler* previous_handler = dispatched_handler;
+        dispatched_handler = &handler;
+
+        try {
+            handler.processRadiusResponse( transaction_id, request, response, secret );
+        }
+        catch ( exception & ex ) {
+            Log::writeLockedMessage( "RadiusClient", ex.what(), Log::LOG_ERRO, true );
+        }
+
+        dispatched_handler = previous_handler;
+
+        AutoLock auto_lock( *this->condition_dispatching );
+        map<RadiusResponseHandler*, uint16_t>::iterator it = this->dispatching_handlers.find( &handler );
+        if ( --it->second == 0 )
+            this->dispatching_handlers.erase( it );
+
+        // wakes up waitDispatches()
+        this->condition_dispatching->notifyAll();
+    }
+
+    void RadiusDispatchTracker::waitDispatches( RadiusResponseHandler & handler ) {
+        AutoLock auto_lock( *this->condition_dispatching );
+
+        // waits for the threads notifying it, except the current one if it is being cancelled from its own notification
+        uint16_t own_dispatches = ( dispatched_handler == &handler ) ? 1 : 0;
+        map<RadiusResponseHandler*, uint16_t>::iterator it;
+        while ( ( it = this->dispatching_handlers.find( &handler ) ) != this->dispatching_handlers.end() && it->second > own_dispatches )
+            this->condition_dispatching->wait();
+    }
+
+    RadiusClient::RadiusClient( uint16_t num_sockets, uint32_t retransmission_time, uint16_t max_retransmissions ) {
+        assert( num_sockets > 0 );
+
+        this->retransmission_time = retransmission_time;
+        this->max_retransmissions = max_retransmissions;
+        this->next_socket = 0;
+        this->mutex_pending_requests = ThreadController::getMutex();
+
+        // Each socket is bound to a different ephemeral port
+        for ( uint16_t i = 0; i < num_sockets; i++ ) {
+            UdpSocket* socket = new UdpSocket();
+            socket->bind( SocketAddressPosix ( auto_ptr<IpAddress> ( new IpAddressOpenIKE( Enums::ADDR_IPV4 ) ), 0 ) );
+            this->sockets.push_back( socket );
+            this->receivers.push_back( new RadiusReceiver( *this, i ) );
+        }
+
+        this->pending_requests.resize( num_sockets );
+        this->next_identifiers.resize( num_sockets, 0 );
+    }
+
+    RadiusClient::~RadiusClient() {
+        for ( vector<RadiusReceiver*>::iterator it = this->receivers.begin(); it != this->receivers.end(); it++ )
+            delete ( *it );
+
+        for ( vector<UdpSocket*>::iterator it = this->sockets.begin(); it != this->sockets.end(); it++ )
+            delete ( *it );
+
+        for ( uint16_t i = 0; i < this->pending_requests.size(); i++ )
+            for ( map<uint8_t, PendingRequest*>::iterator it = this->pending_requests[ i ].begin(); it != this->pending_requests[ i ].end(); it++ )
+                delete it->second;
+    }
+
+    RadiusClient& RadiusClient::getInstance( ) {
+        AutoLock auto_lock( mutex_instance );
+
+        if ( instance == NULL ) {
+            instance = new RadiusClient();
+            instance->start();
+        }
+
+        return *instance;
+    }
+
+    uint64_t RadiusClient::getMonotonicTime( ) {
+        struct timespec now;
+        clock_gettime( CLOCK_MONOTONIC, &now );
+        return ( uint64_t ) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    }
+
+    uint32_t RadiusClient::sendRequest( auto_ptr<RadiusMessage> request, const SocketAddress & server, const ByteArray & secret, RadiusResponseHandler & handler ) {
+        AutoLock auto_lock( *this->mutex_pending_requests );
+
+        // Looks for a free identifier, starting by the next socket (round robin)
+        uint16_t socket_index = this->next_socket;
+        uint16_t tried_sockets = 0;
+        while ( this->pending_requests[ socket_index ].size() == 256 ) {
+            if ( ++tried_sockets == this->sockets.size() )
+                throw Exception( "RADIUS: No free identifiers" );
+            socket_index = ( socket_index + 1 ) % this->sockets.size();
+        }
+        this->next_socket = ( socket_index + 1 ) % this->sockets.size();
+
+        uint8_t identifier = this->next_identifiers[ socket_index ];
+        while ( this->pending_requests[ socket_index ].count( identifier ) )
+            identifier++;
+        this->next_identifiers[ socket_index ] = identifier + 1;
+
+        // Sets the identifier and the Message-Authenticator (added, or recomputed if the request was already sent to another server)
+        request->setIdentifier( identifier );
+        request->sign( secret );
+        auto_ptr<ByteArray> packet( new ByteArray( request->getRawPointer(), request->size() ) );
+
+        // Sends the message
+        this->sockets[ socket_index ]->send( SocketAddressPosix ( auto_ptr<IpAddress> ( new IpAddressOpenIKE( Enums::ADDR_IPV4 ) ), 0 ), server, *packet );
+
+        PendingRequest* pending_request = new PendingRequest();
+        pending_request->handler = &handler;
+        pending_request->request = request;
+        pending_request->packet = packet;
+        pending_request->server = server.clone();
+        pending_request->secret = secret.clone();
+        pending_request->retransmission_time = this->retransmission_time;
+        pending_request->next_retransmission = getMonotonicTime() + this->retransmission_time;
+        pending_request->retransmissions = 0;
+        this->pending_requests[ socket_index ][ identifier ] = pending_request;
+
+        return ( socket_index << 8 ) | identifier;
+    }
+
+    void RadiusClient::cancelRequests( RadiusResponseHandler & handler ) {
+        {
+            AutoLock auto_lock( *this->mutex_pending_requests );
+
+            for ( uint16_t i = 0; i < this->pending_requests.size(); i++ ) {
+                for ( map<uint8_t, PendingRequest*>::iterator it = this->pending_requests[ i ].begin(); it != this->pending_requests[ i ].end(); ) {
+                    if ( it->second->handler == &handler ) {
+                        delete it->second;
+                        this->pending_requests[ i ].erase( it++ );
+                    }
+                    else
+                        it++;
+                }
+            }
+        }
+
+        // The responses already taken from the pending requests are being notified without holding the lock
+        this->dispatch_tracker.waitDispatches( handler );
+    }
+
+    void RadiusClient::receiveLoop( uint16_t socket_index ) {
+        UdpSocket& socket = *this->sockets[ socket_index ];
+        DatagramBatch batch( RADIUS_RECEIVE_BATCH );
+
+        while ( true ) {
+            try {
+                socket.receiveBatch( batch );
+            }
+            catch ( exception & ex ) {
+                Log::writeLockedMessage( "RadiusClient", ex.what(), Log::LOG_ERRO, true );
+                continue;
+            }
+
+            for ( uint16_t i = 0; i < batch.count; i++ ) {
+                try {
+                    // The response is parsed directly from the reception buffer
+                    uint32_t size;
+                    const uint8_t* data = batch.getRawData( i, size );
+                    auto_ptr<RadiusMessage> response = RadiusMessage::parse( data, size );
+                    auto_ptr<SocketAddress> src = batch.getSrcAddress( i );
+
+                    auto_ptr<PendingRequest> pending_request;
+                    {
+                        AutoLock auto_lock( *this->mutex_pending_requests );
+
+                        map<uint8_t, PendingRequest*>::iterator it = this->pending_requests[ socket_index ].find( response->getIdentifier() );
+                        if ( it == this->pending_requests[ socket_index ].end() || !( *it->second->server == *src ) ) {
+                            Log::writeLockedMessage( "RadiusClient", "Received RADIUS response without associated request", Log::LOG_WARN, true );
+                            continue;
+                        }
+
+                        // Invalid responses are discarded, but the request keeps waiting for the right one
+                        if ( !response->verify( it->second->request->getAuthenticator(), *it->second->secret ) ) {
+                            Log::writeLockedMessage( "RadiusClient", "Received invalid Message-Authenticator", Log::LOG_ERRO, true );
+                            continue;
+                        }
+
+                        pending_request.reset( it->second );
+                        this->pending_requests[ socket_index ].erase( it );
+                        this->dispatch_tracker.startDispatch( *pending_request->handler );
+                    }
+
+                    uint8_t identifier = response->getIdentifier();
+                    this->dispatch_tracker.dispatch( *pending_request->handler, ( socket_index << 8 ) | identifier, pending_request->request, response, *pending_request->secret );
+                }
+                catch ( exception & ex ) {
+                    Log::writeLockedMessage( "RadiusClient", ex.what(), Log::LOG_ERRO, true );
+                }
+            }
+        }
+    }
+
+    void RadiusClient::start() {
+        for ( vector<RadiusReceiver*>::iterator it = this->receivers.begin(); it != this->receivers.end(); it++ )
+            ( *it )->start();
+
+        ThreadPosix::start();
+    }
+
+    void RadiusClient::run( ) {
+        Log::writeLockedMessage( "RadiusClient", "Start: Thread ID=[" + intToString( thread_id ) + "] Sockets=[" + intToString( this->sockets.size() ) + "]", Log::LOG_THRD, true );
+
+        while ( true ) {
+            usleep( RADIUS_RETRANSMISSION_TICK * 1000 );
+
+            vector<uint32_t> expired_ids;
+            vector<PendingRequest*> expired_requests;
+            {
+                AutoLock auto_lock( *this->mutex_pending_requests );
+                uint64_t now = getMonotonicTime();
+
+                for ( uint16_t i = 0; i < this->pending_requests.size(); i++ ) {
+                    for ( map<uint8_t, PendingRequest*>::iterator it = this->pending_requests[ i ].begin(); it != this->pending_requests[ i ].end(); ) {
+                        PendingRequest* pending_request = it->second;
+
+                        if ( pending_request->next_retransmission > now ) {
+                            it++;
+                            continue;
+                        }
+
+                        // The server has not answered
+                        if ( pending_request->retransmissions == this->max_retransmissions ) {
+                            expired_ids.push_back( ( i << 8 ) | it->first );
+                            expired_requests.push_back( pending_request );
+                            this->pending_requests[ i ].erase( it++ );
+                            this->dispatch_tracker.startDispatch( *pending_request->handler );
+                            continue;
+                        }
+
+                        try {
+                            this->sockets[ i ]->send( SocketAddressPosix ( auto_ptr<IpAddress> ( new IpAddressOpenIKE( Enums::ADDR_IPV4 ) ), 0 ), *pending_request->server, *pending_request->packet );
+                        }
+                        catch ( exception & ex ) {
+                            Log::writeLockedMessage( "RadiusClient", ex.what(), Log::LOG_ERRO, true );
+                        }
+
+                        pending_request->retransmissions++;
+                        pending_request->retransmission_time *= 2;
+                        pending_request->next_retransmission = now + pending_request->retransmission_time;
+                        it++;
+                    }
+                }
+            }
+
+            // Notifies the expired requests without holding the lock
+            for ( uint16_t i = 0; i < expired_requests.size(); i++ ) {
+                auto_ptr<PendingRequest> pending_request( expired_requests[ i ] );
+                this->dispatch_tracker.dispatch( *pending_request->handler, expired_ids[ i ], pending_request->request, auto_ptr<RadiusMessage> ( NULL ), *pending_request->secret );
+            }
+        }
+    }
+}
@@ -0,0 +1,196 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#ifndef RADIUSCLIENT_H
+#define RADIUSCLIENT_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <libopenikev2/mutex.h>
+#include <libopenikev2/bytearray.h>
+#include <libopenikev2/socketaddress.h>
+#include "threadposix.h"
+#include "mutexposix.h"
+#include "conditionposix.h"
+#include "radiusmessage.h"
+#include "udpsocket.h"
+
+#include <map>
+#include <vector>
+
+using namespace std;
+
+namespace openikev2 {
+    class RadiusReceiver;
+
+    /**
+        This abstract class represents objects that want to receive the responses of the RADIUS requests sent by a RadiusClient.
+        @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
+    */
+    class RadiusResponseHandler {
+        public:
+            /**
+             * This method is called by the RadiusClient threads when a valid response is received, or when the server
+             * has not answered after all the retransmissions. It must not block.
+             * @param transaction_id Transaction ID returned by RadiusClient::sendRequest()
+             * @param request Request sent
+             * @param response Received response (already authenticated). NULL if the server did not answer
+             * @param secret Secret shared with the server the request was sent to (needed to decrypt the key attributes)
+             */
+            virtual void processRadiusResponse( uint32_t transaction_id, auto_ptr<RadiusMessage> request, auto_ptr<RadiusMessage> response, const ByteArray& secret ) = 0;
+
+            virtual ~RadiusResponseHandler();
+    };
+
+    /**
+        This class keeps track of the RadiusResponseHandlers being notified, so the response handlers can be cancelled while
+        the responses are notified without holding any lock.
+        @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
+    */
+    class RadiusDispatchTracker {
+            /****************************** ATTRIBUTES ******************************/
+        protected:
+            map<RadiusResponseHandler*, uint16_t> dispatching_handlers;     /**< Handlers being notified, and the number of threads notifying each one */
+            auto_ptr<ConditionPosix> condition_dispatching;                 /**< Condition to protect the dispatching handlers, and wait for changes on them */
+            static __thread RadiusResponseHandler* dispatched_handler;      /**< Handler being notified by the current thread */
+
+            /****************************** METHODS ******************************/
+        public:
+            /**
+             * Creates a new RadiusDispatchTracker
+             */
+            RadiusDispatchTracker();
+
+            /**
+             * Registers a notification to a handler. It must be called while holding the lock the handler is cancelled with,
+             * before releasing it
+             * @param handler Response handler
+             */
+            virtual void startDispatch( RadiusResponseHandler& handler );
+
+            /**
+             * Notifies a response to a handler registered with startDispatch(), and unregisters the notification
+             * @param handler Response handler
+             * @param transaction_id Transaction ID
+             * @param request Request sent
+             * @param response Received response. NULL if the server did not answer
+             * @param secret Secret shared with the server
+             */
+            virtual void dispatch( RadiusResponseHandler& handler, uint32_t transaction_id, auto_ptr<RadiusMessage> request, auto_ptr<RadiusMessage> response, const ByteArray& secret );
+
+            /**
+             * Waits until the notifications to a handler finish, except the one being performed by the current thread
+             * (if the handler is cancelled from its own notification)
+             * @param handler Response handler
+             */
+            virtual void waitDispatches( RadiusResponseHandler& handler );
+
+            virtual ~RadiusDispatchTracker();
+    };
+
+    /**
+        This class represents an asynchronous RADIUS client.
+        Requests are sent through several sockets (source ports), each one with its own identifier space, so more than 256 requests
+        can be in flight. Requests are retransmitted with exponential backoff until a response arrives or the retransmissions are exhausted.
+        Each socket has a RadiusReceiver thread, and the client thread performs the retransmissions.
+        A daemon-wide instance is shared by all the RADIUS users (see getInstance()).
+        @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
+    */
+    class RadiusClient : public ThreadPosix {
+            friend class RadiusReceiver;
+
+            /****************************** STRUCTS ******************************/
+        protected:
+            /**
+             * Request waiting for its response
+             */
+            struct PendingRequest {
+                RadiusResponseHandler* handler;         /**< Handler of the response */
+                auto_ptr<RadiusMessage> request;        /**< Request sent */
+                auto_ptr<ByteArray> packet;             /**< Binary representation of the request (retransmitted as is) */
+                auto_ptr<SocketAddress> server;         /**< Server address */
+                auto_ptr<ByteArray> secret;             /**< Secret shared with the server */
+                uint64_t next_retransmission;           /**< Monotonic time (in milliseconds) of the next retransmission */
+                uint32_t retransmission_time;           /**< Current retransmission interval (in milliseconds) */
+                uint16_t retransmissions;               /**< Number of retransmissions performed */
+            };
+
+            /****************************** ATTRIBUTES ******************************/
+        protected:
+            vector<UdpSocket*> sockets;                                 /**< Sockets, each one bound to a different source port */
+            vector<RadiusReceiver*> receivers;                          /**< Receiver threads, one per socket */
+            vector<map<uint8_t, PendingRequest*> > pending_requests;    /**< Pending requests of each socket, by identifier */
+            vector<uint8_t> next_identifiers;                           /**< Next identifier to try in each socket */
+            uint16_t next_socket;                                       /**< Next socket to try */
+            uint32_t retransmission_time;                               /**< Initial retransmission interval (in milliseconds) */
+            uint16_t max_retransmissions;                               /**< Maximum number of retransmissions */
+            auto_ptr<Mutex> mutex_pending_requests;                     /**< Mutex to protect the pending requests */
+            RadiusDispatchTracker dispatch_tracker;                     /**< Handlers being notified without holding the mutex */
+
+            static RadiusClient* instance;                              /**< Daemon-wide instance, created by getInstance() */
+            static MutexPosix mutex_instance;                           /**< Mutex to protect the instance creation */
+
+            /****************************** METHODS ******************************/
+        protected:
+            /**
+             * Gets the current monotonic time
+             * @return Time in milliseconds
+             */
+            static uint64_t getMonotonicTime();
+
+            /**
+             * Receives and dispatches the responses of a socket. Used by the RadiusReceivers.
+             * @param socket_index Socket index
+             */
+            virtual void receiveLoop( uint16_t socket_index );
+
+        public:
+            /**
+             * Gets the shared RadiusClient, creating and starting it the first time
+             * @return The shared RadiusClient
+             */
+            static RadiusClient& getInstance();
+
+            /**
+             * Creates a new RadiusClient
+             * @param num_sockets Number of sockets (up to 256 requests in flight per socket)
+             * @param retransmission_time Initial retransmission interval (in milliseconds). It is doubled on each retransmission
+             * @param max_retransmissions Number of retransmissions before giving up
+             */
+            RadiusClient( uint16_t num_sockets = 4, uint32_t retransmission_time = 1000, uint16_t max_retransmissions = 3 );
+
+            /**
+             * Sends a request to a RADIUS server. Its identifier is assigned, and a Message-Authenticator attribute is added
+             * (or reset, if the request is being sent again).
+             * This method does not wait for the response, which is notified to the handler.
+             * @param request Request to be sent
+             * @param server Server address
+             * @param secret Secret shared with the server
+             * @param handler Handler of the response
+             * @return Transaction ID, to match the response
+             * @throws Exception If there are no free identifiers
+             */
+            virtual uint32_t sendRequest( auto_ptr<RadiusMessage> request, const SocketAddress& server, const ByteArray& secret, RadiusResponseHandler& handler );
+
+            /**
+             * Cancels all the pending requests of a handler. Their responses are not notified, and the responses being
+             * notified to the handler are waited for, so it can be deleted when this method returns.
+             * @param handler Response handler
+             */
+            virtual void cancelRequests( RadiusResponseHandler& handler );
+
+            virtual void start();
+
+            virtual void run();
+
+            virtual ~RadiusClient();
+    };
+}
+#endif
@@ -9,105 +9,260 @@
 #include "radiusmessage.h"
 #include <libopenikev2/utils.h>
 #include <libopenikev2/exception.h>
+#include <openssl/hmac.h>
+#include <openssl/evp.h>
 #include <assert.h>
+#include <string.h>
+
+/* Size of the fixed RADIUS header */
+#define RADIUS_HEADER_SIZE 20
+
+/* Maximum size of an attribute value */
+#define RADIUS_MAX_ATTRIBUTE_SIZE 253
 
 namespace openikev2 {
 
     RadiusMessage::RadiusMessage() {
+        this->length = 0;
+        this->attribute_count = 0;
+        this->message_authenticator = -1;
     }
 
-    RadiusMessage::RadiusMessage( RADIUS_MESSAGE_CODE code, uint8_t identifier, auto_ptr<ByteArray> authenticator ) {
-        assert( authenticator->size() == 16 );
-
-        this->code = code;
-        this->identifier = identifier;
-        this->authenticator = authenticator;
+    RadiusMessage::RadiusMessage( RADIUS_MESSAGE_CODE code, uint8_t identifier, const ByteArray& authenticator ) {
+        assert( authenticator.size() == 16 );
+
+        this->buffer[ 0 ] = code;
+        this->buffer[ 1 ] = identifier;
+        memcpy( &this->buffer[ 4 ], authenticator.getRawPointer(), 16 );
+        this->length = RADIUS_HEADER_SIZE;
+        this->buffer[ 2 ] = this->length >> 8;
+        this->buffer[ 3 ] = this->length & 0xFF;
+        this->attribute_count = 0;
+        this->message_authenticator = -1;
     }
 
-
     RadiusMessage::~RadiusMessage() {
     }
 
-    auto_ptr< RadiusMessage > RadiusMessage::parse( ByteBuffer & byte_buffer ) {
-        auto_ptr<RadiusMessage> result( new RadiusMessage() );
-
-        // Pointer to the beginning of the transform
-        uint8_t * message_begin = byte_buffer.getReadPosition();
+    auto_ptr< RadiusMessage > RadiusMessage::parse( const uint8_t* data, uint32_t size ) {
+        if ( size < RADIUS_HEADER_SIZE )
+            throw ParsingException( "Invalid RADIUS message size: " + intToString( size ) );
 
-        result->code = ( RADIUS_MESSAGE_CODE ) byte_buffer.readInt8();
-        result->identifier = byte_buffer.readInt8();
-        uint16_t length = byte_buffer.readInt16();
+        uint16_t length = ( data[ 2 ] << 8 ) | data[ 3 ];
 
-        // Size must be at least size of fixed header
-        if ( length < 20 ||  length > 4096 )
+        // Size must be at least size of fixed header, and the data must contain the whole message
+        if ( length < RADIUS_HEADER_SIZE || length > RADIUS_MAX_MESSAGE_SIZE || length > size )
             throw ParsingException( "Invalid RADIUS message size: " + intToString( length ) );
 
-        result->authenticator = byte_buffer.readByteArray( 16 );
-
-        while ( byte_buffer.getReadPosition() < message_begin + length ) {
-            // parse the transform attribute
-            auto_ptr<RadiusAttribute> attribute = RadiusAttribute::parse( byte_buffer );
-
-            // adds the attribute to the collection
-            result->addAttribute( attribute );
+        auto_ptr<RadiusMessage> result( new RadiusMessage() );
+        memcpy( result->buffer, data, length );
+        result->length = length;
+
+        // Indexes the attributes over the message buffer
+        uint16_t offset = RADIUS_HEADER_SIZE;
+        while ( offset < length ) {
+            if ( offset + 2 > length )
+                throw ParsingException( "Invalid RADIUS attribute header" );
+
+            uint8_t type = result->buffer[ offset ];
+            uint8_t attribute_length = result->buffer[ offset + 1 ];
+            if ( attribute_length < 2 || offset + attribute_length > length )
+                throw ParsingException( "Invalid RADIUS attribute length: " + intToString( attribute_length ) );
+
+            result->indexAttribute( type, offset + 2, attribute_length - 2 );
+            offset += attribute_length;
         }
 
         return result;
+    }
+
+    void RadiusMessage::indexAttribute( uint8_t type, uint16_t offset, uint8_t length ) {
+        if ( this->attribute_count == RADIUS_MAX_ATTRIBUTES )
+            throw ParsingException( "Too many RADIUS attributes" );
+
+        if ( type == RadiusAttribute::RADIUS_ATTR_MESSAGE_AUTHENTICATOR && length == 16 && this->message_authenticator == -1 )
+            this->message_authenticator = this->attribute_count;
 
+        AttributeEntry& entry = this->attribute_table[ this->attribute_count++ ];
+        entry.type = type;
+        entry.offset = offset;
+        entry.length = length;
     }
 
-    void RadiusMessage::addAttribute( auto_ptr< RadiusAttribute > attribute ) {
-        this->attributes->push_back( attribute.release() );
+    RadiusMessage::RADIUS_MESSAGE_CODE RadiusMessage::getCode( ) const {
+        return ( RADIUS_MESSAGE_CODE ) this->buffer[ 0 ];
     }
 
-    void RadiusMessage::getBinaryRepresentation( ByteBuffer & byte_buffer ) const {
-        byte_buffer.writeInt8( this->code );
-        byte_buffer.writeInt8( this->identifier );
+    uint8_t RadiusMessage::getIdentifier( ) const {
+        return this->buffer[ 1 ];
+    }
+
+    void RadiusMessage::setIdentifier( uint8_t identifier ) {
+        this->buffer[ 1 ] = identifier;
+    }
+
+    const uint8_t * RadiusMessage::getAuthenticator( ) const {
+        return &this->buffer[ 4 ];
+    }
 
-        // writes a dummy lengh
-        uint8_t* length_field_position = byte_buffer.getWritePosition();
-        byte_buffer.writeInt16( 0 );
+    void RadiusMessage::addAttribute( RadiusAttribute::RADIUS_ATTRIBUTE_TYPE type, const uint8_t * value, uint16_t length ) {
+        if ( length > RADIUS_MAX_ATTRIBUTE_SIZE )
+            throw Exception( "RADIUS attribute too long: " + intToString( length ) );
+        if ( this->length + length + 2 > RADIUS_MAX_MESSAGE_SIZE )
+            throw Exception( "RADIUS message too long" );
+
+        this->indexAttribute( type, this->length + 2, length );
+
+        this->buffer[ this->length ] = type;
+        this->buffer[ this->length + 1 ] = length + 2;
+        memcpy( &this->buffer[ this->length + 2 ], value, length );
+        this->length += length + 2;
+
+        this->buffer[ 2 ] = this->length >> 8;
+        this->buffer[ 3 ] = this->length & 0xFF;
+    }
+
+    void RadiusMessage::addAttribute( RadiusAttribute::RADIUS_ATTRIBUTE_TYPE type, const ByteArray & value ) {
+        this->addAttribute( type, value.getRawPointer(), value.size() );
+    }
 
-        byte_buffer.writeByteArray( *this->authenticator );
+    void RadiusMessage::addAttribute( RadiusAttribute::RADIUS_ATTRIBUTE_TYPE type, const string & value ) {
+        this->addAttribute( type, ( const uint8_t* ) value.data(), value.size() );
+    }
 
-        for ( vector<RadiusAttribute*>::const_iterator it = this->attributes->begin(); it != this->attributes->end(); it++ ) {
-            ( *it ) ->getBinaryRepresentation( byte_buffer );
+    void RadiusMessage::addFragmentedAttribute( RadiusAttribute::RADIUS_ATTRIBUTE_TYPE type, const uint8_t * value, uint32_t length ) {
+        do {
+            uint16_t fragment_length = ( length > RADIUS_MAX_ATTRIBUTE_SIZE ) ? RADIUS_MAX_ATTRIBUTE_SIZE : length;
+            this->addAttribute( type, value, fragment_length );
+            value += fragment_length;
+            length -= fragment_length;
         }
+        while ( length > 0 );
+    }
+
+    uint16_t RadiusMessage::getAttributeCount( ) const {
+        return this->attribute_count;
+    }
+
+    int32_t RadiusMessage::findAttribute( RadiusAttribute::RADIUS_ATTRIBUTE_TYPE type, uint16_t first ) const {
+        for ( uint16_t i = first; i < this->attribute_count; i++ )
+            if ( this->attribute_table[ i ].type == type )
+                return i;
+        return -1;
+    }
 
-        // pointer to the current position
-        uint8_t* current_position = byte_buffer.getWritePosition();
+    const uint8_t * RadiusMessage::getAttributeValue( uint16_t index, uint16_t & length ) const {
+        assert( index < this->attribute_count );
+        length = this->attribute_table[ index ].length;
+        return &this->buffer[ this->attribute_table[ index ].offset ];
+    }
 
-        // writes the real length value
-        byte_buffer.setWritePosition( length_field_position );
-        byte_buffer.writeInt16( current_position - length_field_position + 2 );
-        byte_buffer.setWritePosition( current_position );
+    const uint8_t * RadiusMessage::getAttribute( RadiusAttribute::RADIUS_ATTRIBUTE_TYPE type, uint16_t & length ) const {
+        int32_t index = this->findAttribute( type );
+        if ( index == -1 )
+            return NULL;
+        return this->getAttributeValue( index, length );
     }
 
+    uint16_t RadiusMessage::getFragmentedAttribute( RadiusAttribute::RADIUS_ATTRIBUTE_TYPE type, ByteBuffer & byte_buffer ) const {
+        uint16_t count = 0;
+        for ( int32_t index = this->findAttribute( type ); index != -1; index = this->findAttribute( type, index + 1 ) ) {
+            uint16_t length;
+            const uint8_t* value = this->getAttributeValue( index, length );
+            byte_buffer.writeBuffer( value, length );
+            count++;
+        }
+        return count;
+    }
 
-    RadiusAttribute * RadiusMessage::getAttribute( RadiusAttribute::RADIUS_ATTRIBUTE_TYPE type ) {
-        for ( vector<RadiusAttribute*>::const_iterator it = this->attributes->begin(); it != this->attributes->end(); it++ ) {
-            RadiusAttribute* current = ( *it );
-            if (current->getType() == type)
-                return current;
+    const uint8_t * RadiusMessage::getVendorAttribute( uint32_t vendor_id, uint8_t vendor_type, uint16_t & length ) const {
+        for ( int32_t index = this->findAttribute( RadiusAttribute::RADIUS_ATTR_VENDOR_SPECIFIC ); index != -1; index = this->findAttribute( RadiusAttribute::RADIUS_ATTR_VENDOR_SPECIFIC, index + 1 ) ) {
+            uint16_t attribute_length;
+            const uint8_t* value = this->getAttributeValue( index, attribute_length );
+            if ( attribute_length < 4 )
+                continue;
+
+            // if vendor ID doesn't match, continue
+            uint32_t current_vendor_id = ( value[ 0 ] << 24 ) | ( value[ 1 ] << 16 ) | ( value[ 2 ] << 8 ) | value[ 3 ];
+            if ( current_vendor_id != vendor_id )
+                continue;
+
+            // Read all the subattributes in the attribute
+            uint16_t offset = 4;
+            while ( offset + 2 <= attribute_length ) {
+                uint8_t current_vendor_type = value[ offset ];
+                uint8_t vendor_length = value[ offset + 1 ];
+                if ( vendor_length < 2 || offset + vendor_length > attribute_length )
+                    break;
+
+                if ( current_vendor_type == vendor_type ) {
+                    length = vendor_length - 2;
+                    return &value[ offset + 2 ];
+                }
+
+                offset += vendor_length;
+            }
         }
         return NULL;
     }
 
-    vector<RadiusAttribute*> RadiusMessage::getAttributes( RadiusAttribute::RADIUS_ATTRIBUTE_TYPE type ) {
-	vector<RadiusAttribute*> result;
-        for ( vector<RadiusAttribute*>::const_iterator it = this->attributes->begin(); it != this->attributes->end(); it++ ) {
-            RadiusAttribute* current = ( *it );
-            if (current->getType() == type)
-                result.push_back(current);
+    void RadiusMessage::computeMessageAuthenticator( const ByteArray & secret, uint8_t * hmac ) const {
+        assert( this->message_authenticator != -1 );
+        const AttributeEntry& entry = this->attribute_table[ this->message_authenticator ];
+
+        // The message is authenticated with the Message-Authenticator value set to zero, without copying it
+        HMAC_CTX context;
+        HMAC_CTX_init( &context );
+        HMAC_Init_ex( &context, secret.getRawPointer(), secret.size(), EVP_md5(), NULL );
+        HMAC_Update( &context, this->buffer, entry.offset );
+
+        uint8_t zero[ 16 ];
+        memset( zero, 0, 16 );
+        HMAC_Update( &context, zero, 16 );
+
+        HMAC_Update( &context, &this->buffer[ entry.offset + 16 ], this->length - entry.offset - 16 );
+
+        unsigned int hmac_length = 16;
+        HMAC_Final( &context, hmac, &hmac_length );
+        HMAC_CTX_cleanup( &context );
+    }
+
+    void RadiusMessage::sign( const ByteArray & secret ) {
+        if ( this->message_authenticator == -1 ) {
+            uint8_t zero[ 16 ];
+            memset( zero, 0, 16 );
+            this->addAttribute( RadiusAttribute::RADIUS_ATTR_MESSAGE_AUTHENTICATOR, zero, 16 );
         }
-        return result;
+
+        this->computeMessageAuthenticator( secret, &this->buffer[ this->attribute_table[ this->message_authenticator ].offset ] );
     }
-}
 
+    bool RadiusMessage::verify( const uint8_t * request_authenticator, const ByteArray & secret ) {
+        if ( this->message_authenticator == -1 )
+            return false;
 
+        // The HMAC of a response is computed with the authenticator of the request
+        uint8_t response_authenticator[ 16 ];
+        memcpy( response_authenticator, &this->buffer[ 4 ], 16 );
+        memcpy( &this->buffer[ 4 ], request_authenticator, 16 );
 
+        uint8_t hmac[ 16 ];
+        this->computeMessageAuthenticator( secret, hmac );
 
+        memcpy( &this->buffer[ 4 ], response_authenticator, 16 );
 
+        return memcmp( hmac, &this->buffer[ this->attribute_table[ this->message_authenticator ].offset ], 16 ) == 0;
+    }
 
+    const uint8_t * RadiusMessage::getRawPointer( ) const {
+        return this->buffer;
+    }
 
+    uint16_t RadiusMessage::size( ) const {
+        return this->length;
+    }
 
+    void RadiusMessage::getBinaryRepresentation( ByteBuffer & byte_buffer ) const {
+        byte_buffer.writeBuffer( this->buffer, this->length );
+    }
+}
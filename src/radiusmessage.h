@@ -10,12 +10,23 @@
 #define OPENIKEV2RADIUSMESSAGE_H
 
 #include <libopenikev2/radiusattribute.h>
-#include <libopenikev2/autovector.h>
+#include <libopenikev2/bytearray.h>
+#include <libopenikev2/bytebuffer.h>
+
+#include <string>
+
+/* Maximum size of a RADIUS message (RFC 2865) */
+#define RADIUS_MAX_MESSAGE_SIZE 4096
+
+/* Maximum number of attributes indexed in a RADIUS message */
+#define RADIUS_MAX_ATTRIBUTES 256
 
 namespace openikev2 {
 
     /**
-        This class represents a RADIUS message
+        This class represents a RADIUS message.
+        The message is kept in its wire format in a single buffer, and the attributes are accessed through a table of offsets
+        into that buffer. Parsing, attribute lookups and serialization don't allocate any memory.
         @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
     */
     class RadiusMessage {
@@ -32,21 +43,177 @@ namespace openikev2 {
                 RADIUS_CODE_RESERVED = 255
             };
 
-        public:
-            RADIUS_MESSAGE_CODE code;
-            uint8_t identifier;
-            auto_ptr<ByteArray> authenticator;
-            AutoVector<RadiusAttribute> attributes;
+        protected:
+            /**
+             * Position of an attribute in the message buffer
+             */
+            struct AttributeEntry {
+                uint8_t type;                   /**< Attribute type */
+                uint8_t length;                 /**< Value length */
+                uint16_t offset;                /**< Value offset in the buffer */
+            };
+
+        protected:
+            uint8_t buffer[ RADIUS_MAX_MESSAGE_SIZE ];              /**< Wire format of the message */
+            uint16_t length;                                        /**< Message length */
+            AttributeEntry attribute_table[ RADIUS_MAX_ATTRIBUTES ];/**< Attribute table */
+            uint16_t attribute_count;                               /**< Number of attributes */
+            int32_t message_authenticator;                          /**< Index of the Message-Authenticator attribute (-1 if not present) */
+
             RadiusMessage();
 
+            /**
+             * Adds an attribute to the attribute table
+             * @param type Attribute type
+             * @param offset Value offset in the buffer
+             * @param length Value length
+             * @throws ParsingException If there are too many attributes
+             */
+            void indexAttribute( uint8_t type, uint16_t offset, uint8_t length );
+
+            /**
+             * Computes the HMAC-MD5 of the message, with the Message-Authenticator value set to zero
+             * @param secret Secret shared with the peer
+             * @param hmac Output buffer of 16 bytes
+             */
+            void computeMessageAuthenticator( const ByteArray& secret, uint8_t* hmac ) const;
+
         public:
-            RadiusMessage(RADIUS_MESSAGE_CODE code, uint8_t identifier, auto_ptr<ByteArray> authenticator);
-            static auto_ptr<RadiusMessage> parse( ByteBuffer& byte_buffer );
+            /**
+             * Creates a new RadiusMessage without attributes
+             * @param code Message code
+             * @param identifier Message identifier
+             * @param authenticator Request authenticator (16 bytes)
+             */
+            RadiusMessage( RADIUS_MESSAGE_CODE code, uint8_t identifier, const ByteArray& authenticator );
+
+            /**
+             * Creates a RadiusMessage from its binary representation. The data is copied into the message buffer and indexed in place
+             * @param data Binary representation
+             * @param size Data size
+             * @return The new RadiusMessage
+             * @throws ParsingException If the data is not a valid RADIUS message
+             */
+            static auto_ptr<RadiusMessage> parse( const uint8_t* data, uint32_t size );
+
+            RADIUS_MESSAGE_CODE getCode() const;
+
+            uint8_t getIdentifier() const;
+
+            void setIdentifier( uint8_t identifier );
+
+            /**
+             * Gets the authenticator of the message
+             * @return Pointer to the 16 bytes of the authenticator
+             */
+            const uint8_t* getAuthenticator() const;
+
+            /**
+             * Adds an attribute to the end of the message
+             * @param type Attribute type
+             * @param value Attribute value
+             * @param length Value length (up to 253 bytes)
+             * @throws Exception If the message is full
+             */
+            virtual void addAttribute( RadiusAttribute::RADIUS_ATTRIBUTE_TYPE type, const uint8_t* value, uint16_t length );
+
+            /**
+             * Adds an attribute to the end of the message
+             * @param type Attribute type
+             * @param value Attribute value (up to 253 bytes)
+             * @throws Exception If the message is full
+             */
+            virtual void addAttribute( RadiusAttribute::RADIUS_ATTRIBUTE_TYPE type, const ByteArray& value );
+
+            /**
+             * Adds an attribute to the end of the message
+             * @param type Attribute type
+             * @param value Attribute value (up to 253 bytes)
+             * @throws Exception If the message is full
+             */
+            virtual void addAttribute( RadiusAttribute::RADIUS_ATTRIBUTE_TYPE type, const string& value );
+
+            /**
+             * Adds a value split into as many consecutive attributes as needed (i.e. EAP-Message)
+             * @param type Attribute type
+             * @param value Value
+             * @param length Value length
+             * @throws Exception If the message is full
+             */
+            virtual void addFragmentedAttribute( RadiusAttribute::RADIUS_ATTRIBUTE_TYPE type, const uint8_t* value, uint32_t length );
+
+            /**
+             * Gets the number of attributes of the message
+             * @return The number of attributes
+             */
+            uint16_t getAttributeCount() const;
+
+            /**
+             * Looks for an attribute
+             * @param type Attribute type
+             * @param first Index where the search starts
+             * @return The index of the first attribute of this type from first, or -1 if not found
+             */
+            int32_t findAttribute( RadiusAttribute::RADIUS_ATTRIBUTE_TYPE type, uint16_t first = 0 ) const;
 
-            virtual void addAttribute(auto_ptr<RadiusAttribute> attribute);
+            /**
+             * Gets the value of an attribute, without copying it
+             * @param index Attribute index
+             * @param length Output: value length
+             * @return Pointer to the value, valid while the message exists
+             */
+            const uint8_t* getAttributeValue( uint16_t index, uint16_t& length ) const;
+
+            /**
+             * Gets the value of the first attribute of a type, without copying it
+             * @param type Attribute type
+             * @param length Output: value length
+             * @return Pointer to the value, or NULL if the attribute is not present
+             */
+            const uint8_t* getAttribute( RadiusAttribute::RADIUS_ATTRIBUTE_TYPE type, uint16_t& length ) const;
 
-            virtual RadiusAttribute* getAttribute(RadiusAttribute::RADIUS_ATTRIBUTE_TYPE type);
-            virtual vector<RadiusAttribute*> getAttributes(RadiusAttribute::RADIUS_ATTRIBUTE_TYPE type);
+            /**
+             * Writes the concatenation of the values of all the attributes of a type (i.e. EAP-Message)
+             * @param type Attribute type
+             * @param byte_buffer ByteBuffer where the values are appended
+             * @return Number of attributes found
+             */
+            uint16_t getFragmentedAttribute( RadiusAttribute::RADIUS_ATTRIBUTE_TYPE type, ByteBuffer& byte_buffer ) const;
+
+            /**
+             * Gets the value of a vendor specific sub-attribute (RFC 2865 section 5.26), without copying it
+             * @param vendor_id Vendor ID
+             * @param vendor_type Vendor type
+             * @param length Output: value length
+             * @return Pointer to the value, or NULL if the sub-attribute is not present
+             */
+            const uint8_t* getVendorAttribute( uint32_t vendor_id, uint8_t vendor_type, uint16_t& length ) const;
+
+            /**
+             * Adds a Message-Authenticator attribute (if not present yet) and computes its value, in the same buffer
+             * @param secret Secret shared with the server
+             */
+            virtual void sign( const ByteArray& secret );
+
+            /**
+             * Checks the Message-Authenticator of a response. The buffer is restored after the check
+             * @param request_authenticator Authenticator of the request (16 bytes)
+             * @param secret Secret shared with the server
+             * @return TRUE if the response has a valid Message-Authenticator. FALSE otherwise
+             */
+            virtual bool verify( const uint8_t* request_authenticator, const ByteArray& secret );
+
+            /**
+             * Gets the binary representation of the message
+             * @return Pointer to the message buffer, valid while the message exists
+             */
+            const uint8_t* getRawPointer() const;
+
+            /**
+             * Gets the size of the binary representation of the message
+             * @return The message length
+             */
+            uint16_t size() const;
 
             /**
             * Appends the binary representation at the end of byte_buffer
@@ -0,0 +1,27 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#include "radiusreceiver.h"
+#include "radiusclient.h"
+
+#include <libopenikev2/log.h>
+
+namespace openikev2 {
+    RadiusReceiver::RadiusReceiver( RadiusClient& radius_client, uint16_t socket_index ) :
+            radius_client ( radius_client ) {
+        this->socket_index = socket_index;
+    }
+
+    RadiusReceiver::~RadiusReceiver( ) {}
+
+    void RadiusReceiver::run( ) {
+        Log::writeLockedMessage( "RadiusReceiver[" + intToString ( this->socket_index ) + "]", "Start: Thread ID=[" + intToString( thread_id ) + "]", Log::LOG_THRD, true );
+
+        this->radius_client.receiveLoop( this->socket_index );
+    }
+}
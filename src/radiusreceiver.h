@@ -0,0 +1,46 @@
+/***************************************************************************
+ *   Copyright (C) 2005 by                                                 *
+ *   Alejandro Perez Mendez     alex@um.es                                 *
+ *   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+ *                                                                         *
+ *   This software may be modified and distributed under the terms         *
+ *   of the Apache license.  See the LICENSE file for details.             *
+ ***************************************************************************/
+#ifndef RADIUSRECEIVER_H
+#define RADIUSRECEIVER_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "threadposix.h"
+
+namespace openikev2 {
+    class RadiusClient;
+
+    /**
+        This class represents a RADIUS receiver.
+        It receives the responses arriving at one of the sockets of a RadiusClient.
+        @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
+    */
+    class RadiusReceiver : public ThreadPosix {
+            /****************************** ATTRIBUTES ******************************/
+        protected:
+            RadiusClient& radius_client;
+            uint16_t socket_index;
+
+            /****************************** METHODS ******************************/
+        public:
+            /**
+             * Creates a new RadiusReceiver
+             * @param radius_client RADIUS client owning the socket
+             * @param socket_index Socket index in the RADIUS client
+             */
+            RadiusReceiver( RadiusClient& radius_client, uint16_t socket_index );
+
+            virtual void run();
+
+            virtual ~RadiusReceiver();
+    };
+};
+#endif
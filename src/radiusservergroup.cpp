@@ -0,0 +1,359 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#include "radiusservergroup.h"
+#include "randomopenssl.h"
+#include "socketaddressposix.h"
+#include "ipaddressopenike.h"
+
+#include <libopenikev2/threadcontroller.h>
+#include <libopenikev2/autolock.h>
+#include <libopenikev2/exception.h>
+#include <libopenikev2/log.h>
+
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+/* Time between two checks of the probe deadlines (in milliseconds) */
+#define RADIUS_PROBE_TICK 1000
+
+/* Time an EAP conversation is bound to its server after the last Access-Challenge (in milliseconds) */
+#define RADIUS_STICKY_STATE_LIFETIME 60000
+
+namespace openikev2 {
+    uint32_t RadiusServerGroup::next_transaction_id = 0;
+    map<string, RadiusServerGroup*> RadiusServerGroup::groups;
+    MutexPosix RadiusServerGroup::mutex_groups;
+
+    RadiusServerGroup::RadiusServerGroup( BALANCING_POLICY balancing_policy, uint32_t min_probe_interval, uint32_t max_probe_interval ) {
+        assert( min_probe_interval > 0 && min_probe_interval <= max_probe_interval );
+
+        this->balancing_policy = balancing_policy;
+        this->min_probe_interval = min_probe_interval;
+        this->max_probe_interval = max_probe_interval;
+        this->mutex_servers = ThreadController::getMutex();
+    }
+
+    RadiusServerGroup::~RadiusServerGroup() {
+        RadiusClient::getInstance().cancelRequests( *this );
+
+        for ( vector<RadiusServer*>::iterator it = this->servers.begin(); it != this->servers.end(); it++ )
+            delete ( *it );
+    }
+
+    RadiusServerGroup& RadiusServerGroup::getGroup( string server_addresses, uint16_t server_port, string secret ) {
+        string key = server_addresses + "|" + intToString( server_port ) + "|" + secret;
+
+        AutoLock auto_lock( mutex_groups );
+
+        map<string, RadiusServerGroup*>::iterator it = groups.find( key );
+        if ( it != groups.end() )
+            return *it->second;
+
+        auto_ptr<RadiusServerGroup> group( new RadiusServerGroup() );
+        ByteArray secret_bytes( secret.data(), secret.size() );
+
+        // Each address of the list can be followed by "*weight"
+        string::size_type begin = 0;
+        while ( begin <= server_addresses.size() ) {
+            string::size_type end = server_addresses.find( ',', begin );
+            if ( end == string::npos )
+                end = server_addresses.size();
+
+            string server = server_addresses.substr( begin, end - begin );
+            begin = end + 1;
+
+            string::size_type first = server.find_first_not_of( " \t" );
+            if ( first == string::npos )
+                continue;
+            server = server.substr( first, server.find_last_not_of( " \t" ) - first + 1 );
+
+            uint16_t weight = 1;
+            string::size_type weight_position = server.find( '*' );
+            if ( weight_position != string::npos ) {
+                weight = atoi( server.substr( weight_position + 1 ).c_str() );
+                server = server.substr( 0, weight_position );
+                if ( weight == 0 )
+                    throw Exception( "RADIUS: Invalid server weight" );
+            }
+
+            group->addServer( SocketAddressPosix( auto_ptr<IpAddress> ( new IpAddressOpenIKE( server ) ), server_port ), secret_bytes, weight );
+        }
+
+        group->start();
+        RadiusServerGroup* result = group.release();
+        groups[ key ] = result;
+
+        return *result;
+    }
+
+    uint64_t RadiusServerGroup::getMonotonicTime( ) {
+        struct timespec now;
+        clock_gettime( CLOCK_MONOTONIC, &now );
+        return ( uint64_t ) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    }
+
+    string RadiusServerGroup::getStateKey( RadiusMessage & message ) {
+        uint16_t length;
+        const uint8_t* value = message.getAttribute( RadiusAttribute::RADIUS_ATTR_STATE, length );
+        if ( value == NULL )
+            return "";
+
+        return string( ( const char* ) value, length );
+    }
+
+    void RadiusServerGroup::addServer( const SocketAddress & address, const ByteArray & secret, uint16_t weight ) {
+        assert( weight > 0 );
+
+        RadiusServer* server = new RadiusServer();
+        server->address = address.clone();
+        server->secret = secret.clone();
+        server->weight = weight;
+        server->current_weight = 0;
+        server->outstanding = 0;
+        server->srtt = 0;
+        server->alive = true;
+        server->probing = false;
+        server->probe_interval = this->min_probe_interval;
+        server->next_probe = 0;
+
+        AutoLock auto_lock( *this->mutex_servers );
+        this->servers.push_back( server );
+    }
+
+    int32_t RadiusServerGroup::selectServer( RadiusMessage & request, int32_t excluded_server ) {
+        uint64_t now = getMonotonicTime();
+
+        // Requests of an EAP conversation go to the server that issued the State
+        string state_key = getStateKey( request );
+        if ( !state_key.empty() ) {
+            map<string, StickyState>::iterator it = this->sticky_states.find( state_key );
+            if ( it != this->sticky_states.end() && it->second.expiration > now && it->second.server_index != excluded_server )
+                return it->second.server_index;
+        }
+
+        // If all the servers are down, they are tried anyway
+        bool any_alive = false;
+        for ( uint16_t i = 0; i < this->servers.size(); i++ )
+            if ( this->servers[ i ]->alive && i != excluded_server )
+                any_alive = true;
+
+        int32_t selected = -1;
+        int32_t total_weight = 0;
+        for ( uint16_t i = 0; i < this->servers.size(); i++ ) {
+            RadiusServer& server = *this->servers[ i ];
+            if ( i == excluded_server || ( any_alive && !server.alive ) )
+                continue;
+
+            if ( this->balancing_policy == BALANCE_WEIGHTED_ROUND_ROBIN ) {
+                server.current_weight += server.weight;
+                total_weight += server.weight;
+                if ( selected == -1 || server.current_weight > this->servers[ selected ]->current_weight )
+                    selected = i;
+            }
+            else {
+                // Estimated completion time: (outstanding + 1) * srtt / weight. Unmeasured servers are tried first
+                if ( selected == -1 ) {
+                    selected = i;
+                    continue;
+                }
+                RadiusServer& best = *this->servers[ selected ];
+                uint64_t cost = ( uint64_t ) ( server.outstanding + 1 ) * ( server.srtt ? server.srtt : 1 ) * best.weight;
+                uint64_t best_cost = ( uint64_t ) ( best.outstanding + 1 ) * ( best.srtt ? best.srtt : 1 ) * server.weight;
+                if ( cost < best_cost )
+                    selected = i;
+            }
+        }
+
+        if ( selected != -1 && this->balancing_policy == BALANCE_WEIGHTED_ROUND_ROBIN )
+            this->servers[ selected ]->current_weight -= total_weight;
+
+        return selected;
+    }
+
+    void RadiusServerGroup::sendToServer( auto_ptr<RadiusMessage> request, uint16_t server_index, Transaction transaction ) {
+        RadiusServer& server = *this->servers[ server_index ];
+
+        // The responses cannot be processed before the transaction is registered, since the lock is held while sending
+        uint32_t client_transaction_id = RadiusClient::getInstance().sendRequest( request, *server.address, *server.secret, *this );
+
+        transaction.server_index = server_index;
+        transaction.send_time = getMonotonicTime();
+        this->transactions[ client_transaction_id ] = transaction;
+        server.outstanding++;
+    }
+
+    uint32_t RadiusServerGroup::sendRequest( auto_ptr<RadiusMessage> request, RadiusResponseHandler & handler ) {
+        AutoLock auto_lock( *this->mutex_servers );
+
+        int32_t server_index = this->selectServer( *request, -1 );
+        if ( server_index == -1 )
+            throw Exception( "RADIUS: No servers configured" );
+
+        Transaction transaction;
+        transaction.handler = &handler;
+        transaction.transaction_id = __sync_fetch_and_add( &next_transaction_id, 1 );
+        transaction.attempts = 1;
+        transaction.probe = false;
+
+        this->sendToServer( request, server_index, transaction );
+
+        return transaction.transaction_id;
+    }
+
+    void RadiusServerGroup::cancelRequests( RadiusResponseHandler & handler ) {
+        {
+            AutoLock auto_lock( *this->mutex_servers );
+
+            // The requests are kept in flight to update the server state, but their responses are discarded
+            for ( map<uint32_t, Transaction>::iterator it = this->transactions.begin(); it != this->transactions.end(); it++ )
+                if ( it->second.handler == &handler )
+                    it->second.handler = NULL;
+        }
+
+        // The responses already taken from the transactions are being notified without holding the lock
+        this->dispatch_tracker.waitDispatches( handler );
+    }
+
+    void RadiusServerGroup::markServerDown( uint16_t server_index ) {
+        RadiusServer& server = *this->servers[ server_index ];
+        if ( !server.alive )
+            return;
+
+        server.alive = false;
+        server.probe_interval = this->min_probe_interval;
+        server.next_probe = getMonotonicTime() + server.probe_interval;
+
+        Log::writeLockedMessage( "RadiusServerGroup", "RADIUS server down: Address=[" + server.address->toString() + "]", Log::LOG_WARN, true );
+    }
+
+    void RadiusServerGroup::processRadiusResponse( uint32_t transaction_id, auto_ptr<RadiusMessage> request, auto_ptr<RadiusMessage> response, const ByteArray& secret ) {
+        Transaction transaction;
+        {
+            AutoLock auto_lock( *this->mutex_servers );
+
+            map<uint32_t, Transaction>::iterator it = this->transactions.find( transaction_id );
+            if ( it == this->transactions.end() )
+                return;
+            transaction = it->second;
+            this->transactions.erase( it );
+
+            RadiusServer& server = *this->servers[ transaction.server_index ];
+            server.outstanding--;
+
+            if ( transaction.probe ) {
+                server.probing = false;
+
+                if ( response.get() != NULL ) {
+                    server.alive = true;
+                    server.srtt = 0;
+                    server.probe_interval = this->min_probe_interval;
+                    Log::writeLockedMessage( "RadiusServerGroup", "RADIUS server up: Address=[" + server.address->toString() + "]", Log::LOG_INFO, true );
+                }
+                else {
+                    server.probe_interval = ( server.probe_interval * 2 < this->max_probe_interval ) ? server.probe_interval * 2 : this->max_probe_interval;
+                    server.next_probe = getMonotonicTime() + server.probe_interval;
+                }
+                return;
+            }
+
+            if ( response.get() != NULL ) {
+                // Updates the smoothed RTT (RFC 6298 alpha = 1/8)
+                uint64_t now = getMonotonicTime();
+                uint32_t rtt = ( now > transaction.send_time ) ? now - transaction.send_time : 1;
+                server.srtt = ( server.srtt == 0 ) ? rtt : ( 7 * server.srtt + rtt ) / 8;
+                server.alive = true;
+
+                // Binds the EAP conversation to this server until it finishes
+                if ( response->getCode() == RadiusMessage::RADIUS_CODE_ACCESS_CHALLENGE ) {
+                    string state_key = getStateKey( *response );
+                    if ( !state_key.empty() ) {
+                        StickyState& sticky_state = this->sticky_states[ state_key ];
+                        sticky_state.server_index = transaction.server_index;
+                        sticky_state.expiration = now + RADIUS_STICKY_STATE_LIFETIME;
+                    }
+                }
+                else if ( request.get() != NULL ) {
+                    this->sticky_states.erase( getStateKey( *request ) );
+                }
+            }
+            else {
+                this->markServerDown( transaction.server_index );
+
+                // Requests that don't belong to an EAP conversation are sent to another server
+                if ( transaction.handler != NULL && request.get() != NULL && getStateKey( *request ).empty() && transaction.attempts < this->servers.size() ) {
+                    int32_t server_index = this->selectServer( *request, transaction.server_index );
+                    if ( server_index != -1 && this->servers[ server_index ]->alive ) {
+                        try {
+                            transaction.attempts++;
+                            this->sendToServer( request, server_index, transaction );
+                            return;
+                        }
+                        catch ( exception & ex ) {
+                            Log::writeLockedMessage( "RadiusServerGroup", ex.what(), Log::LOG_ERRO, true );
+                        }
+                    }
+                }
+            }
+
+            if ( transaction.handler == NULL )
+                return;
+            this->dispatch_tracker.startDispatch( *transaction.handler );
+        }
+
+        this->dispatch_tracker.dispatch( *transaction.handler, transaction.transaction_id, request, response, secret );
+    }
+
+    void RadiusServerGroup::sendProbes( ) {
+        AutoLock auto_lock( *this->mutex_servers );
+        uint64_t now = getMonotonicTime();
+        RandomOpenSSL random;
+
+        for ( uint16_t i = 0; i < this->servers.size(); i++ ) {
+            RadiusServer& server = *this->servers[ i ];
+            if ( server.alive || server.probing || server.next_probe > now )
+                continue;
+
+            // The Message-Authenticator required by RFC 5997 is added by the RADIUS client
+            auto_ptr<RadiusMessage> probe( new RadiusMessage( RadiusMessage::RADIUS_CODE_STATUS_SERVER, 0, *random.getRandomBytes( 16 ) ) );
+
+            Transaction transaction;
+            transaction.handler = NULL;
+            transaction.transaction_id = 0;
+            transaction.attempts = 1;
+            transaction.probe = true;
+
+            try {
+                this->sendToServer( probe, i, transaction );
+                server.probing = true;
+            }
+            catch ( exception & ex ) {
+                Log::writeLockedMessage( "RadiusServerGroup", ex.what(), Log::LOG_ERRO, true );
+                server.next_probe = now + server.probe_interval;
+            }
+        }
+
+        // Forgets the conversations that have been abandoned
+        for ( map<string, StickyState>::iterator it = this->sticky_states.begin(); it != this->sticky_states.end(); ) {
+            if ( it->second.expiration <= now )
+                this->sticky_states.erase( it++ );
+            else
+                it++;
+        }
+    }
+
+    void RadiusServerGroup::run( ) {
+        Log::writeLockedMessage( "RadiusServerGroup", "Start: Thread ID=[" + intToString( thread_id ) + "] Servers=[" + intToString( this->servers.size() ) + "]", Log::LOG_THRD, true );
+
+        while ( true ) {
+            usleep( RADIUS_PROBE_TICK * 1000 );
+            this->sendProbes();
+        }
+    }
+}
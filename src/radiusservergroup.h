@@ -0,0 +1,197 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#ifndef RADIUSSERVERGROUP_H
+#define RADIUSSERVERGROUP_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <libopenikev2/mutex.h>
+#include <libopenikev2/bytearray.h>
+#include <libopenikev2/socketaddress.h>
+#include "threadposix.h"
+#include "mutexposix.h"
+#include "radiusmessage.h"
+#include "radiusclient.h"
+
+#include <map>
+#include <vector>
+
+using namespace std;
+
+namespace openikev2 {
+
+    /**
+        This class represents a group of RADIUS servers providing the same service.
+        Each request is sent to one of the servers, selected with the configured balancing policy. Requests of an EAP
+        conversation (carrying a State attribute) are always sent to the server that issued the State.
+        A server that does not answer is marked down and stops receiving requests. The group thread probes the down servers
+        with Status-Server requests (RFC 5997), with exponential backoff, and marks them up again when they answer.
+        A request that times out is sent again to another server, unless it belongs to an ongoing EAP conversation.
+        The requests are sent through the shared RadiusClient; the group acts as the response handler and notifies the original one.
+        @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
+    */
+    class RadiusServerGroup : public ThreadPosix, public RadiusResponseHandler {
+            /****************************** ENUMS ******************************/
+        public:
+            /** Server selection policies */
+            enum BALANCING_POLICY {
+                BALANCE_WEIGHTED_ROUND_ROBIN,   /**< Smooth weighted round robin */
+                BALANCE_LEAST_OUTSTANDING       /**< Lowest (outstanding requests + 1) * smoothed RTT / weight */
+            };
+
+            /****************************** STRUCTS ******************************/
+        protected:
+            /**
+             * Server of the group
+             */
+            struct RadiusServer {
+                auto_ptr<SocketAddress> address;        /**< Server address */
+                auto_ptr<ByteArray> secret;             /**< Secret shared with the server */
+                uint16_t weight;                        /**< Server weight */
+                int32_t current_weight;                 /**< Current weight (weighted round robin) */
+                uint32_t outstanding;                   /**< Requests waiting for a response */
+                uint32_t srtt;                          /**< Smoothed round trip time (in milliseconds). 0 if unknown */
+                bool alive;                             /**< Indicates if the server is up */
+                bool probing;                           /**< Indicates if a Status-Server request is in flight */
+                uint32_t probe_interval;                /**< Current interval between probes (in milliseconds) */
+                uint64_t next_probe;                    /**< Monotonic time (in milliseconds) of the next probe */
+            };
+
+            /**
+             * Request sent through the RadiusClient
+             */
+            struct Transaction {
+                RadiusResponseHandler* handler;         /**< Original handler. NULL for probes and cancelled requests */
+                uint32_t transaction_id;                /**< Transaction ID returned to the original handler */
+                uint16_t server_index;                  /**< Server the request was sent to */
+                uint16_t attempts;                      /**< Number of servers tried */
+                bool probe;                             /**< Indicates if the request is a Status-Server probe */
+                uint64_t send_time;                     /**< Monotonic time (in milliseconds) of the sending */
+            };
+
+            /**
+             * Server that issued the State of an EAP conversation
+             */
+            struct StickyState {
+                uint16_t server_index;                  /**< Server index */
+                uint64_t expiration;                    /**< Monotonic time (in milliseconds) when the entry is forgotten */
+            };
+
+            /****************************** ATTRIBUTES ******************************/
+        protected:
+            vector<RadiusServer*> servers;                      /**< Servers of the group */
+            map<uint32_t, Transaction> transactions;            /**< Requests waiting for a response, by RadiusClient transaction ID */
+            map<string, StickyState> sticky_states;             /**< Server of each EAP conversation, by State value */
+            BALANCING_POLICY balancing_policy;                  /**< Server selection policy */
+            uint32_t min_probe_interval;                        /**< Initial interval between probes to a down server (in milliseconds) */
+            uint32_t max_probe_interval;                        /**< Maximum interval between probes to a down server (in milliseconds) */
+            auto_ptr<Mutex> mutex_servers;                      /**< Mutex to protect the servers and the transactions */
+            RadiusDispatchTracker dispatch_tracker;             /**< Original handlers being notified without holding the mutex */
+
+            static uint32_t next_transaction_id;                /**< Next transaction ID returned to the handlers (unique among all the groups) */
+            static map<string, RadiusServerGroup*> groups;      /**< Groups created by getGroup(), by servers, port and secret */
+            static MutexPosix mutex_groups;                     /**< Mutex to protect the groups */
+
+            /****************************** METHODS ******************************/
+        protected:
+            /**
+             * Gets the current monotonic time
+             * @return Time in milliseconds
+             */
+            static uint64_t getMonotonicTime();
+
+            /**
+             * Gets the value of the State attribute of a message
+             * @param message RADIUS message
+             * @return The State value, or an empty string if the message has no State
+             */
+            static string getStateKey( RadiusMessage& message );
+
+            /**
+             * Selects the server for a request. If all the servers are down, all of them are candidates.
+             * The caller must lock the servers mutex
+             * @param request Request to be sent
+             * @param excluded_server Server that must not be selected (-1 for none)
+             * @return The server index, or -1 if there is no candidate
+             */
+            virtual int32_t selectServer( RadiusMessage& request, int32_t excluded_server );
+
+            /**
+             * Sends a request to a server and registers the transaction. The caller must lock the servers mutex
+             * @param request Request to be sent
+             * @param server_index Server index
+             * @param transaction Transaction data (the server index and the send time are filled)
+             */
+            virtual void sendToServer( auto_ptr<RadiusMessage> request, uint16_t server_index, Transaction transaction );
+
+            /**
+             * Marks a server down and schedules its first probe. The caller must lock the servers mutex
+             * @param server_index Server index
+             */
+            virtual void markServerDown( uint16_t server_index );
+
+            /**
+             * Sends the Status-Server requests to the down servers whose probe time has arrived
+             */
+            virtual void sendProbes();
+
+        public:
+            /**
+             * Gets the group for a server configuration, creating and starting it the first time.
+             * Groups are shared by all the users of the same configuration.
+             * @param server_addresses Comma separated list of server addresses. Each one can be followed by "*weight"
+             * @param server_port Server port
+             * @param secret Secret shared with the servers
+             * @return The server group
+             */
+            static RadiusServerGroup& getGroup( string server_addresses, uint16_t server_port, string secret );
+
+            /**
+             * Creates a new empty RadiusServerGroup
+             * @param balancing_policy Server selection policy
+             * @param min_probe_interval Initial interval between probes to a down server (in milliseconds). It is doubled after each failed probe
+             * @param max_probe_interval Maximum interval between probes to a down server (in milliseconds)
+             */
+            RadiusServerGroup( BALANCING_POLICY balancing_policy = BALANCE_LEAST_OUTSTANDING, uint32_t min_probe_interval = 5000, uint32_t max_probe_interval = 120000 );
+
+            /**
+             * Adds a server to the group. Servers must be added before the group is used
+             * @param address Server address
+             * @param secret Secret shared with the server
+             * @param weight Server weight
+             */
+            virtual void addServer( const SocketAddress& address, const ByteArray& secret, uint16_t weight = 1 );
+
+            /**
+             * Sends a request to one of the servers. The identifier and the Message-Authenticator are set by the RadiusClient.
+             * This method does not wait for the response, which is notified to the handler.
+             * @param request Request to be sent
+             * @param handler Handler of the response
+             * @return Transaction ID, to match the response
+             * @throws Exception If the group has no servers or the request cannot be sent
+             */
+            virtual uint32_t sendRequest( auto_ptr<RadiusMessage> request, RadiusResponseHandler& handler );
+
+            /**
+             * Cancels all the pending requests of a handler. Their responses are not notified, and the responses being
+             * notified to the handler are waited for, so it can be deleted when this method returns.
+             * @param handler Response handler
+             */
+            virtual void cancelRequests( RadiusResponseHandler& handler );
+
+            virtual void processRadiusResponse( uint32_t transaction_id, auto_ptr<RadiusMessage> request, auto_ptr<RadiusMessage> response, const ByteArray& secret );
+
+            virtual void run();
+
+            virtual ~RadiusServerGroup();
+    };
+}
+#endif
@@ -8,6 +8,9 @@
 ***************************************************************************/
 #include "semaphoreposix.h"
 
+#include <errno.h>
+#include <time.h>
+
 namespace openikev2 {
     SemaphorePosix::SemaphorePosix( uint32_t initial_value ) {
         sem_init ( &this->semaphore, 0, initial_value );
@@ -21,6 +24,24 @@ namespace openikev2 {
         sem_post( &this->semaphore );
     }
 
+    bool SemaphorePosix::timedWait( uint32_t msec ) {
+        struct timespec deadline;
+        clock_gettime( CLOCK_REALTIME, &deadline );
+        deadline.tv_sec += msec / 1000;
+        deadline.tv_nsec += ( msec % 1000 ) * 1000000L;
+        if ( deadline.tv_nsec >= 1000000000L ) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        int result;
+        do {
+            result = sem_timedwait( &this->semaphore, &deadline );
+        } while ( result != 0 && errno == EINTR );
+
+        return result == 0;
+    }
+
     SemaphorePosix::~SemaphorePosix() {
         sem_destroy( &this->semaphore );
     }
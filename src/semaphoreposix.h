@@ -40,6 +40,13 @@ namespace openikev2 {
 
             virtual void post();
 
+            /**
+             * Waits on the semaphore, but no longer than the indicated time
+             * @param msec Maximum time to wait (in milliseconds)
+             * @return TRUE if the semaphore has been decremented. FALSE if the time has expired
+             */
+            virtual bool timedWait( uint32_t msec );
+
             virtual ~SemaphorePosix();
     };
 }
@@ -13,6 +13,7 @@
 #include <libopenikev2/log.h>
 #include <libopenikev2/buseventikesa.h>
 #include <libopenikev2/eventbus.h>
+#include <libopenikev2/boolattribute.h>
 
 namespace openikev2 {
 
@@ -35,6 +36,12 @@ namespace openikev2 {
             return IkeSa::IKE_SA_ACTION_CONTINUE;
         }
 
+        BoolAttribute * attribute = ike_sa.getIkeSaConfiguration().attributemap->getAttribute<BoolAttribute>( "mobike_enabled" );
+        if ( attribute == NULL || !attribute->value ) {
+            Log::writeLockedMessage( ike_sa.getLogId(), "MOBIKE is not enabled for this IKE_SA. Omitting address update", Log::LOG_WARN, true );
+            return IkeSa::IKE_SA_ACTION_CONTINUE;
+        }
+
         auto_ptr<IpAddress> old_src_address = ike_sa.my_addr->getIpAddress().clone();
 
         // Update the IPsec SAs
@@ -45,6 +45,10 @@ namespace openikev2 {
         pthread_cancel( this->pthreadid );
     }
 
+    void ThreadPosix::join() {
+        pthread_join( this->pthreadid, NULL );
+    }
+
     void * ThreadPosix::real_run( void * param ) {
         ThreadPosix * thread = ( ThreadPosix* ) param;
         thread->run();
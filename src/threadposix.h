@@ -56,6 +56,11 @@ namespace openikev2 {
 
             virtual void cancel();
 
+            /**
+             * Waits until the thread finishes
+             */
+            virtual void join();
+
             virtual ~ThreadPosix();
     };
 };
@@ -19,21 +19,90 @@
 #include <string.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
 #include <unistd.h>
 
+#define EPOLL_MAX_EVENTS 64
+
 namespace openikev2 {
 
-    UdpSocket::UdpSocket( ) {
+    DatagramBatch::DatagramBatch( uint16_t capacity ) {
+        assert( capacity > 0 );
+        this->capacity = capacity;
+        this->count = 0;
+        this->buffers = new uint8_t[ capacity * MAX_MESSAGE_SIZE ];
+        this->headers = new mmsghdr[ capacity ];
+        this->iovecs = new iovec[ capacity ];
+        this->src_addresses = new sockaddr_storage[ capacity ];
+    }
+
+    DatagramBatch::~DatagramBatch() {
+        delete[] this->buffers;
+        delete[] this->headers;
+        delete[] this->iovecs;
+        delete[] this->src_addresses;
+    }
+
+    void DatagramBatch::prepare( ) {
+        // the kernel overwrites the lengths on each reception
+        for ( uint16_t i = 0; i < this->capacity; i++ ) {
+            this->iovecs[ i ].iov_base = &this->buffers[ i * MAX_MESSAGE_SIZE ];
+            this->iovecs[ i ].iov_len = MAX_MESSAGE_SIZE;
+
+            memset( &this->headers[ i ], 0, sizeof( mmsghdr ) );
+            this->headers[ i ].msg_hdr.msg_name = &this->src_addresses[ i ];
+            this->headers[ i ].msg_hdr.msg_namelen = sizeof( sockaddr_storage );
+            this->headers[ i ].msg_hdr.msg_iov = &this->iovecs[ i ];
+            this->headers[ i ].msg_hdr.msg_iovlen = 1;
+        }
+    }
+
+    auto_ptr<ByteArray> DatagramBatch::getData( uint16_t index ) const {
+        assert( index < this->count );
+        return auto_ptr<ByteArray> ( new ByteArray( &this->buffers[ index * MAX_MESSAGE_SIZE ], this->headers[ index ].msg_len ) );
+    }
+
+    const uint8_t* DatagramBatch::getRawData( uint16_t index, uint32_t& size ) const {
+        assert( index < this->count );
+        size = this->headers[ index ].msg_len;
+        return &this->buffers[ index * MAX_MESSAGE_SIZE ];
+    }
+
+    auto_ptr<SocketAddress> DatagramBatch::getSrcAddress( uint16_t index ) const {
+        assert( index < this->count );
+        return auto_ptr<SocketAddress> ( new SocketAddressPosix( ( sockaddr& ) this->src_addresses[ index ] ) );
+    }
+
+    auto_ptr<SocketAddress> DatagramBatch::getDstAddress( ) const {
+        return this->dst_address->clone();
+    }
+
+    UdpSocket::UdpSocket( RECEIVE_BACKEND receive_backend, bool reuse_port ) {
         // creates the socket set
         FD_ZERO( &this->socket_set );
 
         // creates the mutexes
         this->mutex_read = ThreadController::getMutex();
         this->mutex_write = ThreadController::getMutex();
+        this->mutex_ready = ThreadController::getMutex();
+
+        this->receive_backend = receive_backend;
+        this->reuse_port = reuse_port;
+        this->epoll_fd = -1;
+
+        if ( this->receive_backend == RECEIVE_EPOLL ) {
+            this->epoll_fd = epoll_create( EPOLL_MAX_EVENTS );
+            if ( this->epoll_fd < 0 )
+                throw NetworkException( "Cannot create epoll descriptor: " + string( strerror( errno ) ) );
+        }
     }
 
     auto_ptr< ByteArray > UdpSocket::receive( auto_ptr< SocketAddress > & src_addr, auto_ptr< SocketAddress > & dst_addr ) {
+        if ( this->receive_backend == RECEIVE_EPOLL )
+            return this->receiveEpoll( src_addr, dst_addr, -1 );
+
         // Creates remote address and sets its size
 #ifdef HAVE_IPv6
         sockaddr_in6 addr;
@@ -91,6 +160,9 @@ namespace openikev2 {
     }
 
     auto_ptr< ByteArray > UdpSocket::receive( auto_ptr< SocketAddress > & src_addr, auto_ptr< SocketAddress > & dst_addr, uint32_t milliseconds ) {
+        if ( this->receive_backend == RECEIVE_EPOLL )
+            return this->receiveEpoll( src_addr, dst_addr, milliseconds );
+
         // Creates remote address and sets its size
 #ifdef HAVE_IPv6
         sockaddr_in6 addr;
@@ -143,6 +215,248 @@ namespace openikev2 {
 
         // if the timeout expired, throw Exception
         //throw TimeoutException( "No data in the socket after wait " + intToString( milliseconds ) + " milliseconds." );
+        return auto_ptr<ByteArray> ( NULL );
+    }
+
+    int UdpSocket::waitReadySocket( int32_t milliseconds ) {
+        while ( true ) {
+            // gets a socket that may have pending data
+            {
+                AutoLock auto_lock( *this->mutex_ready );
+                if ( !this->ready_sockets.empty() ) {
+                    int sock_fd = this->ready_sockets.front();
+                    this->ready_sockets.pop_front();
+                    return sock_fd;
+                }
+            }
+
+            // if there is none, waits for new readiness events (we may need a timeout in order to check the exiting flag)
+            epoll_event events[ EPOLL_MAX_EVENTS ];
+            int rv = epoll_wait( this->epoll_fd, events, EPOLL_MAX_EVENTS, ( milliseconds < 0 ) ? 500 : milliseconds );
+
+            if ( rv < 0 ) {
+                if ( errno == EINTR )
+                    continue;
+                throw ReceivingException( strerror ( errno ) );
+            }
+
+            // if the timeout expired
+            if ( rv == 0 ) {
+                if ( milliseconds < 0 )
+                    continue;
+                return -1;
+            }
+
+            AutoLock auto_lock( *this->mutex_ready );
+            for ( int i = 0; i < rv; i++ )
+                this->ready_sockets.push_back( events[ i ].data.fd );
+        }
+    }
+
+    auto_ptr< ByteArray > UdpSocket::receiveEpoll( auto_ptr< SocketAddress > & src_addr, auto_ptr< SocketAddress > & dst_addr, int32_t milliseconds ) {
+        // Creates remote address
+#ifdef HAVE_IPv6
+        sockaddr_in6 addr;
+#else
+        sockaddr_in addr;
+#endif
+
+        while ( true ) {
+            int sock_fd = this->waitReadySocket( milliseconds );
+
+            // if the timeout expired
+            if ( sock_fd < 0 )
+                return auto_ptr<ByteArray> ( NULL );
+
+            // reads the data from the socket (non blocking)
+            auto_ptr<ByteArray> received_data ( new ByteArray( MAX_MESSAGE_SIZE ) );
+            socklen_t addr_length = sizeof( addr );
+            int total = recvfrom ( sock_fd, received_data->getRawPointer(), MAX_MESSAGE_SIZE, 0, ( sockaddr* ) & addr, &addr_length );
+
+            if ( total < 0 ) {
+                // the socket has been drained (or unbound), so wait for the next edge
+                if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EBADF )
+                    continue;
+                throw ReceivingException( strerror ( errno ) );
+            }
+
+            // updates the received data length
+            received_data->setSize( total );
+
+            AutoLock auto_lock( *this->mutex_ready );
+
+            SocketAddressPosix* sock_address = this->getSocketAddress( sock_fd );
+            if ( sock_address == NULL )
+                continue;
+
+            // the socket may have more datagrams queued (edge-triggered)
+            this->ready_sockets.push_back( sock_fd );
+
+            // sets source and destination addresses
+            src_addr.reset( new SocketAddressPosix( ( sockaddr& ) addr ) );
+            dst_addr = sock_address->clone();
+            return received_data;
+        }
+    }
+
+    bool UdpSocket::receiveBatch( DatagramBatch & batch, int32_t milliseconds ) {
+        batch.count = 0;
+
+        while ( true ) {
+            int sock_fd = -1;
+
+            if ( this->receive_backend == RECEIVE_EPOLL ) {
+                sock_fd = this->waitReadySocket( milliseconds );
+            }
+            else {
+                AutoLock auto_lock( *this->mutex_read );
+
+                // set the maximum time to wait for data (we may need to do this in order to update the FD set)
+                struct timeval tv;
+                tv.tv_sec = ( milliseconds < 0 ) ? 0 : milliseconds / 1000;
+                tv.tv_usec = ( milliseconds < 0 ) ? 500000 : ( milliseconds * 1000 ) % 1000000;
+
+                fd_set temp_set = this->socket_set;
+                int16_t rv = select ( FD_SETSIZE, &temp_set, NULL, NULL, &tv );
+
+                if ( rv < 0 )
+                    throw ReceivingException( strerror ( errno ) );
+
+                for ( uint16_t i = 0; i < this->socket_collection.size() && sock_fd < 0; i++ ) {
+                    if ( FD_ISSET( this->socket_collection[ i ].socket, &temp_set ) )
+                        sock_fd = this->socket_collection[ i ].socket;
+                }
+
+                if ( sock_fd < 0 && milliseconds < 0 )
+                    continue;
+            }
+
+            // if the timeout expired
+            if ( sock_fd < 0 )
+                return false;
+
+            // reads as many datagrams as possible in one system call
+            batch.prepare();
+            int total = recvmmsg( sock_fd, batch.headers, batch.capacity, MSG_DONTWAIT, NULL );
+
+            if ( total < 0 ) {
+                // the socket has been drained (or unbound), so wait for the next edge
+                if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EBADF )
+                    continue;
+                throw ReceivingException( strerror ( errno ) );
+            }
+
+            AutoLock auto_lock( *this->mutex_ready );
+
+            SocketAddressPosix* sock_address = this->getSocketAddress( sock_fd );
+            if ( sock_address == NULL )
+                continue;
+
+            // if the batch is full, the socket may have more datagrams queued (edge-triggered)
+            if ( this->receive_backend == RECEIVE_EPOLL && total == batch.capacity )
+                this->ready_sockets.push_back( sock_fd );
+
+            batch.count = total;
+            batch.dst_address = sock_address->clone();
+            return true;
+        }
+    }
+
+    void UdpSocket::sendBatch( const SocketAddress & src_addr, const vector<const SocketAddress*> & dst_addrs, const vector<ByteArray*> & data ) {
+        assert( dst_addrs.size() == data.size() );
+
+        if ( data.empty() )
+            return;
+
+        // prepares the message headers
+        uint16_t num_messages = data.size();
+        vector<mmsghdr> headers( num_messages );
+        vector<iovec> iovecs( num_messages );
+
+        for ( uint16_t i = 0; i < num_messages; i++ ) {
+            SocketAddressPosix temp_dst( *dst_addrs[ i ] );
+
+            iovecs[ i ].iov_base = data[ i ]->getRawPointer();
+            iovecs[ i ].iov_len = data[ i ]->size();
+
+            memset( &headers[ i ], 0, sizeof( mmsghdr ) );
+            headers[ i ].msg_hdr.msg_name = temp_dst.getSockAddr().release();
+            headers[ i ].msg_hdr.msg_namelen = temp_dst.getSockAddrSize();
+            headers[ i ].msg_hdr.msg_iov = &iovecs[ i ];
+            headers[ i ].msg_hdr.msg_iovlen = 1;
+        }
+
+        string error;
+        {
+            AutoLock auto_lock( *this->mutex_write );
+
+            // look for the specified source address
+            int sock_fd = -1;
+            for ( uint16_t i = 0; i < this->socket_collection.size(); i++ ) {
+                if ( src_addr == *this->socket_collection[ i ].sock_address ) {
+                    sock_fd = this->socket_collection[ i ].socket;
+                    break;
+                }
+            }
+
+            if ( sock_fd < 0 ) {
+                error = "Cannot find a suittable socket to write";
+            }
+            else {
+                // sends all the datagrams, with as few system calls as possible
+                uint16_t sent = 0;
+                while ( sent < num_messages ) {
+                    int total = sendmmsg( sock_fd, &headers[ sent ], num_messages - sent, 0 );
+                    if ( total < 0 ) {
+                        if ( errno == EINTR )
+                            continue;
+                        error = strerror( errno );
+                        break;
+                    }
+                    sent += total;
+                }
+            }
+        }
+
+        for ( uint16_t i = 0; i < num_messages; i++ )
+            delete ( sockaddr* ) headers[ i ].msg_hdr.msg_name;
+
+        // if an error occurred, throw Exception
+        if ( !error.empty() )
+            throw SendingException( error );
+    }
+
+    SocketAddressPosix * UdpSocket::getSocketAddress( int sock_fd ) {
+        for ( vector<SocketData>::iterator it = this->socket_collection.begin(); it != this->socket_collection.end(); it++ ) {
+            if ( it->socket == sock_fd )
+                return it->sock_address;
+        }
+        return NULL;
+    }
+
+    void UdpSocket::addSocket( int sock_fd, auto_ptr<SocketAddressPosix> sock_address ) {
+        AutoLock auto_lock( *this->mutex_ready );
+
+        if ( this->receive_backend == RECEIVE_EPOLL ) {
+            // edge-triggered sockets must be non blocking
+            fcntl( sock_fd, F_SETFL, fcntl( sock_fd, F_GETFL, 0 ) | O_NONBLOCK );
+
+            epoll_event event;
+            memset( &event, 0, sizeof( event ) );
+            event.events = EPOLLIN | EPOLLET;
+            event.data.fd = sock_fd;
+            if ( epoll_ctl( this->epoll_fd, EPOLL_CTL_ADD, sock_fd, &event ) < 0 ) {
+                close( sock_fd );
+                throw BindingException( "Cannot add socket to epoll with address=" + sock_address->toString() + " reason=" + strerror( errno ) );
+            }
+        }
+
+        // adds the socket to the collection
+        SocketData socket_data = {sock_address.release(), sock_fd};
+        this->socket_collection.push_back( socket_data );
+
+        // includes the socket in the socket set
+        FD_SET( sock_fd, &this->socket_set );
     }
 
     void UdpSocket::send( const SocketAddress & src_addr, const SocketAddress & dst_addr, const ByteArray & data ) {
@@ -172,6 +486,12 @@ namespace openikev2 {
         AutoLock auto_lock_read( *this->mutex_read );
         AutoLock auto_lock_write( *this->mutex_write );
 
+        // with SO_REUSEPORT, binding twice would succeed, so checks it explicitly
+        for ( uint16_t i = 0; i < this->socket_collection.size(); i++ ) {
+            if ( src_address == *this->socket_collection[ i ].sock_address )
+                throw BindingException( "Address already bound: " + this->socket_collection[ i ].sock_address->toString() );
+        }
+
         // creates the socket (depends on the family
         int sock_fd;
 
@@ -188,6 +508,20 @@ namespace openikev2 {
         if ( sock_fd <= 0 )
             throw BindingException( "Error creating DGRAM socket." );
 
+        // allows other UdpSockets to bind the same address (the kernel balances the flows between them)
+        if ( this->reuse_port ) {
+#ifdef SO_REUSEPORT
+            int enable = 1;
+            if ( setsockopt( sock_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof( enable ) ) < 0 ) {
+                close( sock_fd );
+                throw BindingException( string( "Cannot enable SO_REUSEPORT: " ) + strerror( errno ) );
+            }
+#else
+            close( sock_fd );
+            throw BindingException( "SO_REUSEPORT is not supported" );
+#endif
+        }
+
         // Creates a new IP address
         auto_ptr<SocketAddressPosix> cloned_address ( new SocketAddressPosix ( src_address ) );
 
@@ -195,18 +529,19 @@ namespace openikev2 {
         if ( ::bind ( sock_fd, cloned_address->getSockAddr().get(), cloned_address->getSockAddrSize() ) < 0 )
             throw BindingException( "Binding error with address=" + cloned_address->toString() + " reason=" + strerror( errno ) );
 
-        // adds the socket to the collection
-        SocketData socket_data = {cloned_address.release(), sock_fd};
-        this->socket_collection.push_back( socket_data );
-
-        // includes the socket in the socket set
-        FD_SET( sock_fd, &this->socket_set );
+        this->addSocket( sock_fd, cloned_address );
     }
 
     void UdpSocket::bind( const SocketAddress & src_address, string interface_name ) {
         AutoLock auto_lock_read( *this->mutex_read );
         AutoLock auto_lock_write( *this->mutex_write );
 
+        // with SO_REUSEPORT, binding twice would succeed, so checks it explicitly
+        for ( uint16_t i = 0; i < this->socket_collection.size(); i++ ) {
+            if ( src_address == *this->socket_collection[ i ].sock_address )
+                throw BindingException( "Address already bound: " + this->socket_collection[ i ].sock_address->toString() );
+        }
+
         // creates the socket (depends on the family
         int sock_fd;
 
@@ -223,6 +558,20 @@ namespace openikev2 {
         if ( sock_fd <= 0 )
             throw BindingException( "Error creating DGRAM socket." );
 
+        // allows other UdpSockets to bind the same address (the kernel balances the flows between them)
+        if ( this->reuse_port ) {
+#ifdef SO_REUSEPORT
+            int enable = 1;
+            if ( setsockopt( sock_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof( enable ) ) < 0 ) {
+                close( sock_fd );
+                throw BindingException( string( "Cannot enable SO_REUSEPORT: " ) + strerror( errno ) );
+            }
+#else
+            close( sock_fd );
+            throw BindingException( "SO_REUSEPORT is not supported" );
+#endif
+        }
+
         // Creates a new IP address
         auto_ptr<SocketAddressPosix> cloned_address ( new SocketAddressPosix ( src_address ) );
         auto_ptr<sockaddr> sockaddress = cloned_address->getSockAddr();
@@ -241,22 +590,33 @@ namespace openikev2 {
         if ( ::bind ( sock_fd, sockaddress.get(), cloned_address->getSockAddrSize() ) < 0 )
             throw BindingException( "Binding error with address=" + cloned_address->toString() + " reason=" + strerror( errno ) );
 
-        // adds the socket to the collection
-        SocketData socket_data = {cloned_address.release(), sock_fd};
-        this->socket_collection.push_back( socket_data );
+        this->addSocket( sock_fd, cloned_address );
+    }
 
-        // includes the socket in the socket set
-        FD_SET( sock_fd, &this->socket_set );
+    bool UdpSocket::isBound( const SocketAddress & src_address ) {
+        AutoLock auto_lock_write( *this->mutex_write );
+
+        for ( uint16_t i = 0; i < this->socket_collection.size(); i++ ) {
+            if ( src_address == *this->socket_collection[ i ].sock_address )
+                return true;
+        }
+        return false;
     }
 
     void UdpSocket::unbind( const SocketAddress & src_address ) {
         AutoLock auto_lock_read( *this->mutex_read );
         AutoLock auto_lock_write( *this->mutex_write );
+        AutoLock auto_lock_ready( *this->mutex_ready );
 
         for ( vector<SocketData>::iterator it = this->socket_collection.begin(); it != this->socket_collection.end(); it++ ) {
             if ( *it->sock_address == src_address ) {
                 delete it->sock_address;
                 FD_CLR( it->socket, &this->socket_set );
+                if ( this->receive_backend == RECEIVE_EPOLL ) {
+                    epoll_ctl( this->epoll_fd, EPOLL_CTL_DEL, it->socket, NULL );
+                    for ( deque<int>::iterator ready_it = this->ready_sockets.begin(); ready_it != this->ready_sockets.end(); )
+                        ready_it = ( *ready_it == it->socket ) ? this->ready_sockets.erase( ready_it ) : ready_it + 1;
+                }
                 close( it->socket );
                 this->socket_collection.erase( it );
                 return;
@@ -270,6 +630,9 @@ namespace openikev2 {
             FD_CLR( it->socket, &this->socket_set );
             close( it->socket );
         }
+
+        if ( this->epoll_fd >= 0 )
+            close( this->epoll_fd );
     }
 }
 
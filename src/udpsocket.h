@@ -20,15 +20,100 @@
 #include "socketaddressposix.h"
 
 #include <vector>
+#include <deque>
+#include <sys/socket.h>
 
 using namespace std;
 
 namespace openikev2 {
+    /**
+        This class represents a reusable set of preallocated buffers to receive several datagrams with a single system call
+        @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
+    */
+    class DatagramBatch {
+            friend class UdpSocket;
+
+            /****************************** ATTRIBUTES ******************************/
+        protected:
+            uint8_t* buffers;                       /**< capacity * MAX_MESSAGE_SIZE bytes of reception buffers */
+            mmsghdr* headers;                       /**< Message headers used by recvmmsg */
+            iovec* iovecs;                          /**< One iovec per buffer */
+            sockaddr_storage* src_addresses;        /**< Source addresses of the received datagrams */
+            auto_ptr<SocketAddress> dst_address;    /**< Local address where the datagrams were received */
+
+        public:
+            uint16_t capacity;                      /**< Maximum number of datagrams in the batch */
+            uint16_t count;                         /**< Number of datagrams received in the last call */
+
+            /****************************** METHODS ******************************/
+        private:
+            /**
+             * The batch owns its buffers, so it cannot be copied (not implemented)
+             */
+            DatagramBatch( const DatagramBatch& other );
+
+            /**
+             * The batch owns its buffers, so it cannot be assigned (not implemented)
+             */
+            DatagramBatch& operator=( const DatagramBatch& other );
+
+        protected:
+            /**
+             * Resets the message headers before a new reception
+             */
+            void prepare();
+
+        public:
+            /**
+             * Creates a new DatagramBatch
+             * @param capacity Maximum number of datagrams received at once
+             */
+            DatagramBatch( uint16_t capacity );
+
+            /**
+             * Gets the data of a received datagram
+             * @param index Datagram index (lower than count)
+             * @return A copy of the datagram data
+             */
+            auto_ptr<ByteArray> getData( uint16_t index ) const;
+
+            /**
+             * Gets the data of a received datagram without copying it. It is valid until the next reception on this batch
+             * @param index Datagram index (lower than count)
+             * @param size Output: datagram size
+             * @return Pointer to the datagram data
+             */
+            const uint8_t* getRawData( uint16_t index, uint32_t& size ) const;
+
+            /**
+             * Gets the source address of a received datagram
+             * @param index Datagram index (lower than count)
+             * @return The source socket address
+             */
+            auto_ptr<SocketAddress> getSrcAddress( uint16_t index ) const;
+
+            /**
+             * Gets the local address where all the datagrams of the batch were received
+             * @return The destination socket address
+             */
+            auto_ptr<SocketAddress> getDstAddress() const;
+
+            ~DatagramBatch();
+    };
+
     /**
         This class represents an UDP socket. It is needed to bind with some IP address and port before using it
         @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
     */
     class UdpSocket {
+            /****************************** ENUMS ******************************/
+        public:
+            /** Backends used to wait for incoming data */
+            enum RECEIVE_BACKEND {
+                RECEIVE_SELECT,         /**< select() over all the sockets, serialized with the read mutex */
+                RECEIVE_EPOLL,          /**< Edge-triggered epoll, without sleeps nor global read mutex */
+            };
+
             /****************************** STRUCTS ******************************/
         protected:
             /**< This class represents each individual socket data */
@@ -43,14 +128,54 @@ namespace openikev2 {
             fd_set socket_set;                      /**< Struct for realice "select" operations. */
             auto_ptr<Mutex> mutex_read;             /**< Mutex to avoid simultaneous readings */
             auto_ptr<Mutex> mutex_write;            /**< Mutex to avoid simultaneous writings */
+            RECEIVE_BACKEND receive_backend;        /**< Backend used to wait for incoming data */
+            int epoll_fd;                           /**< Epoll file descriptor (RECEIVE_EPOLL backend) */
+            deque<int> ready_sockets;               /**< Sockets that may have pending datagrams (RECEIVE_EPOLL backend) */
+            auto_ptr<Mutex> mutex_ready;            /**< Mutex to protect the ready sockets and the socket collection (RECEIVE_EPOLL backend) */
+            bool reuse_port;                        /**< Indicates if the sockets are bound with SO_REUSEPORT */
 
             /****************************** METHODS ******************************/
+        protected:
+            /**
+             * Adds a bound socket to the socket collection and to the receive backend
+             * @param sock_fd Socket file descriptor
+             * @param sock_address Bound socket address
+             */
+            virtual void addSocket( int sock_fd, auto_ptr<SocketAddressPosix> sock_address );
+
+            /**
+             * Gets the bound address of a socket. The caller must lock the ready mutex
+             * @param sock_fd Socket file descriptor
+             * @return The socket address, or NULL if the socket is no longer bound
+             */
+            virtual SocketAddressPosix* getSocketAddress( int sock_fd );
+
+            /**
+             * Gets a socket that may have pending data, waiting for readiness events if needed (RECEIVE_EPOLL backend)
+             * @param milliseconds Maximum time to wait, or a negative value to wait until some socket is ready
+             * @return The socket file descriptor, or -1 if the timeout expired
+             * @throws ReceivingException An error avoids the reception of data
+             */
+            virtual int waitReadySocket( int32_t milliseconds );
+
+            /**
+             * Receives data from the network using the epoll backend
+             * @param src_addr Source socket address of the message (output)
+             * @param dst_addr Destination socket address of the message (output)
+             * @param milliseconds Maximum time to wait, or a negative value to wait until some data is received
+             * @return The received data, or NULL if the timeout expired
+             * @throws ReceivingException An error avoids the reception of data
+             */
+            virtual auto_ptr<ByteArray> receiveEpoll( auto_ptr<SocketAddress> &src_addr, auto_ptr<SocketAddress> &dst_addr, int32_t milliseconds );
+
         public:
 
             /**
              * Creates and UDP socket (without any binding)
+             * @param receive_backend Backend used to wait for incoming data
+             * @param reuse_port Bind the sockets with SO_REUSEPORT, so several UdpSockets can share the same addresses
              */
-            UdpSocket();
+            UdpSocket( RECEIVE_BACKEND receive_backend = RECEIVE_SELECT, bool reuse_port = false );
 
             /**
              * Receives data from the network
@@ -65,9 +190,8 @@ namespace openikev2 {
              * Receives data from the network
              * @param src_addr Source socket ddress of the message (output)
              * @param dst_addr Destination socket address of the message (output)
-             * @return The received data
+             * @return The received data, or NULL if the specified timeout has expired without reciving any data
              * @throws ReceivingException An error avoids the reception of data
-             * @throws TimeoutException The specified timeout has expired without reciving any data
              */
             virtual auto_ptr<ByteArray> receive( auto_ptr<SocketAddress> &src_addr, auto_ptr<SocketAddress> &dst_addr, uint32_t milliseconds );
 
@@ -80,6 +204,24 @@ namespace openikev2 {
              */
             virtual void send( const SocketAddress & src_addr, const SocketAddress & dst_addr, const ByteArray& data );
 
+            /**
+             * Receives several datagrams from the same socket using a single system call
+             * @param batch Batch where the datagrams are stored. Its buffers are reused on each call
+             * @param milliseconds Maximum time to wait, or a negative value to wait until some data is received
+             * @return TRUE if any datagram has been received, FALSE if the timeout expired
+             * @throws ReceivingException An error avoids the reception of data
+             */
+            virtual bool receiveBatch( DatagramBatch& batch, int32_t milliseconds = -1 );
+
+            /**
+             * Sends several datagrams from the same source address using as few system calls as possible
+             * @param src_addr Source socket address of the datagrams
+             * @param dst_addrs Destination socket address of each datagram
+             * @param data Data of each datagram
+             * @throws SendingException An error avoids the sending of the data
+             */
+            virtual void sendBatch( const SocketAddress & src_addr, const vector<const SocketAddress*>& dst_addrs, const vector<ByteArray*>& data );
+
             /**
              * Adds a new socket address binding
              * @param src_addr New source socket address to bind.
@@ -95,6 +237,13 @@ namespace openikev2 {
              */
             virtual void bind( const SocketAddress& src_address, string interface_name );
 
+            /**
+             * Checks if a socket address is already bound
+             * @param src_address Socket address
+             * @return TRUE if the address is bound. FALSE otherwise
+             */
+            virtual bool isBound( const SocketAddress& src_address );
+
             /**
             * Removes a socket address binding
             * @param src_addr Source socket address to unbind
@@ -0,0 +1,29 @@
+/***************************************************************************
+*   Copyright (C) 2005 by                                                 *
+*   Alejandro Perez Mendez     alex@um.es                                 *
+*   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+*                                                                         *
+*   This software may be modified and distributed under the terms         *
+*   of the Apache license.  See the LICENSE file for details.             *
+***************************************************************************/
+#include "xfrmeventprocessor.h"
+#include "ipseccontrollerimplxfrm.h"
+
+#include <libopenikev2/log.h>
+
+namespace openikev2 {
+    XfrmEventProcessor::XfrmEventProcessor( IpsecControllerImplXfrm& ipsec_controller ) :
+            ipsec_controller ( ipsec_controller ) {}
+
+    XfrmEventProcessor::~XfrmEventProcessor( ) {}
+
+    void XfrmEventProcessor::run( ) {
+        Log::writeLockedMessage( "XfrmEventProcessor", "Start: Thread ID=[" + intToString( thread_id ) + "]", Log::LOG_THRD, true );
+
+        deque<vector<uint8_t> > events;
+
+        // Process the queued events until the controller exits
+        while ( this->ipsec_controller.getPendingEvents( events ) )
+            this->ipsec_controller.processEvents( events );
+    }
+}
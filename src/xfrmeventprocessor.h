@@ -0,0 +1,44 @@
+/***************************************************************************
+ *   Copyright (C) 2005 by                                                 *
+ *   Alejandro Perez Mendez     alex@um.es                                 *
+ *   Pedro J. Fernandez Ruiz    pedroj@um.es                               *
+ *                                                                         *
+ *   This software may be modified and distributed under the terms         *
+ *   of the Apache license.  See the LICENSE file for details.             *
+ ***************************************************************************/
+#ifndef XFRMEVENTPROCESSOR_H
+#define XFRMEVENTPROCESSOR_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "threadposix.h"
+
+namespace openikev2 {
+    class IpsecControllerImplXfrm;
+
+    /**
+        This class represents a XFRM event processor.
+        It processes the acquire and expire events queued by the XFRM controller, so the netlink socket is always drained.
+        @author Alejandro Perez Mendez, Pedro J. Fernandez Ruiz <alex@um.es, pedroj@um.es>
+    */
+    class XfrmEventProcessor : public ThreadPosix {
+            /****************************** ATTRIBUTES ******************************/
+        protected:
+            IpsecControllerImplXfrm& ipsec_controller;
+
+            /****************************** METHODS ******************************/
+        public:
+            /**
+             * Creates a new XfrmEventProcessor
+             * @param ipsec_controller XFRM controller where the events are queued
+             */
+            XfrmEventProcessor( IpsecControllerImplXfrm& ipsec_controller );
+
+            virtual void run();
+
+            virtual ~XfrmEventProcessor();
+    };
+};
+#endif